@@ -78,7 +78,7 @@ struct evil_tag_count_t
 {
     unsigned char tag;
     unsigned char flag;
-    unsigned short count;
+    uint32_t count;
 };
 
 struct evil_object_t;
@@ -125,6 +125,61 @@ evil_resolve_object_handle(struct evil_object_handle_t *handle);
 void
 evil_retarget_object_handle(struct evil_object_handle_t *handle, struct evil_object_t *object);
 
+/*
+ * Evaluation on a budget. evil_eval_with_fuel evaluates the object like
+ * evil_eval but gives up once the code it runs has made the given number of
+ * procedure calls and loop iterations, returning EVIL_RUN_SUSPENDED and
+ * keeping the evaluation's state in the environment, and evil_resume
+ * carries on with more fuel. The result is stored once either returns
+ * EVIL_RUN_DONE. The environment can't evaluate anything else while it has
+ * an evaluation suspended; destroying it drops the evaluation.
+ */
+enum evil_run_status_t
+{
+    EVIL_RUN_DONE,
+    EVIL_RUN_SUSPENDED
+};
+
+enum evil_run_status_t
+evil_eval_with_fuel(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, struct evil_object_t *object, int64_t fuel, struct evil_object_t *result);
+
+enum evil_run_status_t
+evil_resume(struct evil_environment_t *environment, int64_t fuel, struct evil_object_t *result);
+
+/*
+ * Garbage collection pauses. Once the heap runs low the collector marks it
+ * a slice at a time between allocations, each slice taking no more than the
+ * pause budget, in microseconds, and clears up after the marking the same
+ * way. Only the roots are scanned again in one go, at the end of the
+ * marking. A budget of 0 leaves the heap to be collected all at once when it
+ * runs out of room.
+ */
+#ifndef EVIL_GC_PAUSE_BUDGET
+#   define EVIL_GC_PAUSE_BUDGET 1000
+#endif
+
+void
+evil_set_gc_pause_budget(struct evil_environment_t *environment, uint64_t microseconds);
+
+/*
+ * Parallel marking. Collections of the whole heap that happen all at once
+ * are marked by helper threads as well as the thread collecting. Heaps of
+ * at least EVIL_PARALLEL_MARK_MIN_HEAP_SIZE bytes get EVIL_GC_MARK_THREADS
+ * helpers, smaller ones none; evil_set_gc_mark_threads sets the number for
+ * any heap, 0 marking on the collecting thread alone. The helpers are
+ * started by the first collection that uses them.
+ */
+#ifndef EVIL_GC_MARK_THREADS
+#   define EVIL_GC_MARK_THREADS 3
+#endif
+
+#ifndef EVIL_PARALLEL_MARK_MIN_HEAP_SIZE
+#   define EVIL_PARALLEL_MARK_MIN_HEAP_SIZE (32 * 1024 * 1024)
+#endif
+
+void
+evil_set_gc_mark_threads(struct evil_environment_t *environment, size_t count);
+
 /*
  * These functions provide the initial core functions used by evil scheme's 
  * runtime.
@@ -151,6 +206,14 @@ evil_lambda(struct evil_environment_t *environment, struct evil_object_handle_t
 struct evil_object_t
 evil_disassemble(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *object);
 
+/*
+ * The eval builtin, which unlike evil_eval takes the expression itself and
+ * leaves calls to the VM that called it, like apply; see vm_request_call.
+ * They can only be called by the VM.
+ */
+struct evil_object_t
+evil_eval_builtin(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *object);
+
 struct evil_object_t
 evil_apply(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *object);
 
@@ -172,4 +235,28 @@ evil_vector_set(struct evil_environment_t *environment, struct evil_object_handl
 struct evil_object_t
 evil_vector_fill(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *object);
 
+struct evil_object_t
+evil_vm_profile(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *object);
+
+struct evil_object_t
+evil_sampler_start(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *object);
+
+struct evil_object_t
+evil_sampler_stop(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *object);
+
+struct evil_object_t
+evil_spawn(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *object);
+
+struct evil_object_t
+evil_yield(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *object);
+
+struct evil_object_t
+evil_join(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *object);
+
+struct evil_object_t
+evil_future(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *object);
+
+struct evil_object_t
+evil_touch(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *object);
+
 #endif
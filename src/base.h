@@ -50,11 +50,24 @@
 #   define inline __inline__
 #endif
 
+/*
+ * Thread local storage. Everything else the library keeps lives in an
+ * environment, so environments can run on different threads at once.
+ */
+#if defined(_MSC_VER)
+#   define EVIL_THREAD_LOCAL __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#   define EVIL_THREAD_LOCAL _Thread_local
+#else
+#   define EVIL_THREAD_LOCAL __thread
+#endif
+
 /*
  * Formatting strings for systems that don't have inttypes.h
  */
 #ifdef _MSC_VER
 #   define PRId64 "I64d"
+#   define PRIu64 "I64u"
 #   define PRIx64 "I64x"
 #else
 #   include <inttypes.h>
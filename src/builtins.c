@@ -59,6 +59,18 @@ evil_define(struct evil_environment_t *environment, struct evil_object_handle_t
          */
         location = bind(environment, environment->lexical_environment, *place);
         *location = *value;
+        gc_write_barrier(environment->heap, location);
+
+        /*
+         * Procedures remember the first name they were defined under, for
+         * the profilers' sake.
+         */
+        if (value->tag_count.tag == TAG_REFERENCE
+                && value->value.ref->tag_count.tag == TAG_PROCEDURE
+                && VECTOR_BASE(value->value.ref)[FIELD_NAME].tag_count.tag != TAG_SYMBOL)
+        {
+            VECTOR_BASE(value->value.ref)[FIELD_NAME] = *place;
+        }
     }
     else
     {
@@ -74,7 +86,7 @@ evil_define(struct evil_environment_t *environment, struct evil_object_handle_t
         BREAK();
     }
 
-    return *value;
+    return make_unspecified();
 }
 
 struct evil_object_t
@@ -86,8 +98,6 @@ evil_vector(struct evil_environment_t *environment, struct evil_object_handle_t
 
     UNUSED(lexical_environment);
 
-    assert(num_args < 65536);
-
     vector = gc_alloc_vector(environment->heap, num_args);
     vector_base = VECTOR_BASE(vector);
 
@@ -125,7 +135,7 @@ evil_vector_length(struct evil_environment_t *environment, struct evil_object_ha
     UNUSED(lexical_environment);
     UNUSED(num_args);
 
-    vector = deref(args + 0);
+    vector = value_deref(args + 0);
 
     assert(num_args == 1);
     assert(vector->tag_count.tag == TAG_VECTOR);
@@ -151,13 +161,17 @@ evil_vector_ref(struct evil_environment_t *environment, struct evil_object_handl
 
     assert(num_args == 2);
 
-    vector = deref(args + 0);
-    element = deref(args + 1);
+    /*
+     * The vector may be an element of another vector, as in
+     * (vector-ref (vector-ref v i) j), which is an inner reference to a
+     * reference. Loop traces call this for operands they don't inline.
+     */
+    vector = value_deref(args + 0);
+    element = value_deref(args + 1);
 
     assert(vector->tag_count.tag == TAG_VECTOR);
 
     index = evil_coerce_fixnum(element);
-    assert(index < 65536);
     assert(index < vector->tag_count.count);
 
     return make_inner_reference(VECTOR_BASE(vector), index);
@@ -171,21 +185,22 @@ evil_vector_set(struct evil_environment_t *environment, struct evil_object_handl
     struct evil_object_t value;
     int64_t index;
 
-    UNUSED(environment);
     UNUSED(lexical_environment);
     UNUSED(num_args);
 
     assert(num_args == 3);
 
-    vector = deref(args + 0);
-    element = deref(args + 1);
+    vector = value_deref(args + 0);
+    element = value_deref(args + 1);
     value = args[2];
 
+    assert(vector->tag_count.tag == TAG_VECTOR);
+
     index = evil_coerce_fixnum(element);
-    assert(index < 65536);
     assert(index < vector->tag_count.count);
 
     VECTOR_BASE(vector)[index] = value;
+    gc_write_barrier(environment->heap, &VECTOR_BASE(vector)[index]);
 
     return value;
 }
@@ -199,7 +214,6 @@ evil_vector_fill(struct evil_environment_t *environment, struct evil_object_hand
     int count;
     int i;
 
-    UNUSED(environment);
     UNUSED(lexical_environment);
     UNUSED(num_args);
 
@@ -215,6 +229,7 @@ evil_vector_fill(struct evil_environment_t *environment, struct evil_object_hand
     for (i = 0; i < count; ++i)
     {
         vector_base[i] = fill;
+        gc_write_barrier(environment->heap, vector_base + i);
     }
 
     return make_ref(vector);
@@ -234,7 +249,6 @@ evil_make_vector(struct evil_environment_t *environment, struct evil_object_hand
     assert(num_args == 1 || num_args == 2);
 
     size = deref(args + 0);
-    fill = deref(args + 1);
 
     assert(size->tag_count.tag == TAG_FIXNUM);
     fixnum_size = (size_t)evil_coerce_fixnum(size);
@@ -242,7 +256,12 @@ evil_make_vector(struct evil_environment_t *environment, struct evil_object_hand
     vector = gc_alloc_vector(environment->heap, fixnum_size);
     vector_fill_args[0] = make_ref(vector);
 
-    vector_fill_args[1] = (num_args == 2) ? *fill : make_fixnum_object(0);
+    /*
+     * The fill value may have been moved by the allocation.
+     */
+    fill = (num_args == 2) ? deref(args + 1) : NULL;
+
+    vector_fill_args[1] = (fill != NULL) ? *fill : make_fixnum_object(0);
 
     return evil_vector_fill(environment, lexical_environment, 2, vector_fill_args);
 }
@@ -251,16 +270,12 @@ struct evil_object_t
 evil_apply(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *args)
 {
     struct evil_object_t *fn;
-    struct evil_object_t *fn_args;
-    unsigned char fn_tag;
-    int num_args_for_fn;
+
+    UNUSED(lexical_environment);
 
     fn = deref(args + 0);
-    fn_tag = fn->tag_count.tag;
-    fn_args = args + 1;
-    num_args_for_fn = num_args - 1;
 
-    if (fn_tag == TAG_SYMBOL)
+    if (fn->tag_count.tag == TAG_SYMBOL)
     {
         struct evil_object_t *bound_location;
 
@@ -268,21 +283,16 @@ evil_apply(struct evil_environment_t *environment, struct evil_object_handle_t *
         assert(bound_location != NULL);
 
         fn = deref(bound_location);
-        fn_tag = fn->tag_count.tag;
     }
 
+    /*
+     * The call is made by the VM running apply, in its place.
+     */
     switch (fn->tag_count.tag)
     {
         case TAG_SPECIAL_FUNCTION:
-            {
-                evil_special_function_t special_fn;
-
-                special_fn = fn->value.special_function_value;
-                return special_fn(environment, lexical_environment, num_args_for_fn, fn_args);
-            }
         case TAG_PROCEDURE:
-            return vm_run(environment, lexical_environment, fn, num_args_for_fn, fn_args);
-            break;
+            return vm_request_call(environment, fn, num_args - 1, args + 1);
         default:
             BREAK();
             break;
@@ -294,14 +304,54 @@ evil_apply(struct evil_environment_t *environment, struct evil_object_handle_t *
 /*
  * eval
  */
-struct evil_object_t
-evil_eval(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *args)
+static struct evil_object_t
+eval_wrapper_procedure(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, struct evil_object_t *object)
 {
-    struct evil_object_t *object;
+    /*
+     * Let's try something new and exciting here. Instead of calling
+     * apply(...), which is dead easy, let's try turning our expression into
+     * ((lambda () expr)) -- ie: (+ 1 1) becomes ((lambda () (+ 1 1)). If we
+     * don't do this then we need to have separate implementations, both VM
+     * and interpreted, for every bit of functionality supported by the
+     * runtime. And that's just not lazy!
+     */
+    struct evil_object_t *wrapper_args;
+    struct evil_object_t *wrapper_body;
+    struct evil_object_handle_t *wrapper_args_handle;
+    struct evil_object_handle_t *object_handle;
+    struct evil_object_t result;
+
+    object_handle = evil_create_object_handle(environment, object);
+    wrapper_args = gc_alloc(environment->heap, TAG_PAIR, 0);
+    wrapper_args_handle = evil_create_object_handle(environment, wrapper_args);
+
+    wrapper_body = gc_alloc(environment->heap, TAG_PAIR, 0);
+
+    wrapper_args = evil_resolve_object_handle(wrapper_args_handle);
+    object = evil_resolve_object_handle(object_handle);
+    evil_destroy_object_handle(environment, object_handle);
+
+    *RAW_CAR(wrapper_args) = make_empty_ref();
+    *RAW_CDR(wrapper_args) = make_ref(wrapper_body);
+    *RAW_CAR(wrapper_body) = make_ref(object);
+    *RAW_CDR(wrapper_body) = make_empty_ref();
+
+    result = evil_lambda(environment, lexical_environment, 1, wrapper_args);
+    evil_destroy_object_handle(environment, wrapper_args_handle);
+
+    return result;
+}
 
-    assert(num_args == 1);
+/*
+ * Compound expressions are compiled into a procedure that the VM running
+ * eval is asked to call.
+ */
+static struct evil_object_t
+eval_expression(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, struct evil_object_t *expression)
+{
+    struct evil_object_t *object;
 
-    object = deref(CAR(args));
+    object = deref(expression);
     switch (object->tag_count.tag)
     {
         case TAG_BOOLEAN:
@@ -313,7 +363,7 @@ evil_eval(struct evil_environment_t *environment, struct evil_object_handle_t *l
         case TAG_SPECIAL_FUNCTION:
         case TAG_PROCEDURE:
         case TAG_STRING:
-            return *args;
+            return make_ref(object);
         case TAG_SYMBOL:
             {
                 struct evil_object_t *bound_location;
@@ -324,34 +374,10 @@ evil_eval(struct evil_environment_t *environment, struct evil_object_handle_t *l
             }
         case TAG_PAIR:
             {
-                /*
-                 * Let's try something new and exciting here. Instead of
-                 * calling apply(...), which is dead easy, let's try turning
-                 * our expression into ((lambda () expr)) -- ie: (+ 1 1)
-                 * becomes ((lambda () (+ 1 1)). If we don't do this then
-                 * we need to have separate implementations, both VM and
-                 * interpreted, for every bit of functionality supported
-                 * by the runtime. And that's just not lazy!
-                 */
-                struct evil_object_t *wrapper_args;
-                struct evil_object_t *wrapper_body;
-                struct evil_object_handle_t *wrapper_args_handle;
                 struct evil_object_t fn;
 
-                wrapper_args = gc_alloc(environment->heap, TAG_PAIR, 0);
-                wrapper_args_handle = evil_create_object_handle(environment, wrapper_args);
-
-                wrapper_body = gc_alloc(environment->heap, TAG_PAIR, 0);
-
-                wrapper_args = evil_resolve_object_handle(wrapper_args_handle);
-
-                *RAW_CAR(wrapper_args) = make_empty_ref();
-                *RAW_CDR(wrapper_args) = make_ref(wrapper_body);
-                *RAW_CAR(wrapper_body) = make_ref(object);
-                *RAW_CDR(wrapper_body) = make_empty_ref();
-
-                fn = evil_lambda(environment, lexical_environment, 1, wrapper_args);
-                return vm_run(environment, lexical_environment, &fn, 0, empty_pair);
+                fn = eval_wrapper_procedure(environment, lexical_environment, object);
+                return vm_request_call(environment, deref(&fn), 0, expression);
             }
             break;
         default:
@@ -362,6 +388,51 @@ evil_eval(struct evil_environment_t *environment, struct evil_object_handle_t *l
     return make_empty_ref();
 }
 
+struct evil_object_t
+evil_eval(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *args)
+{
+    struct evil_object_t result;
+
+    assert(num_args == 1);
+
+    result = eval_expression(environment, lexical_environment, CAR(args));
+
+    return vm_finish_call_request(environment, lexical_environment, result);
+}
+
+struct evil_object_t
+evil_eval_builtin(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *args)
+{
+    assert(num_args == 1);
+
+    return eval_expression(environment, lexical_environment, args);
+}
+
+enum evil_run_status_t
+evil_eval_with_fuel(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, struct evil_object_t *args, int64_t fuel, struct evil_object_t *result)
+{
+    struct evil_object_t fn;
+
+    /*
+     * Only pairs run any code.
+     */
+    if (deref(CAR(args))->tag_count.tag != TAG_PAIR)
+    {
+        *result = evil_eval(environment, lexical_environment, 1, args);
+        return EVIL_RUN_DONE;
+    }
+
+    fn = eval_wrapper_procedure(environment, lexical_environment, deref(CAR(args)));
+
+    return vm_run_with_fuel(environment, lexical_environment, &fn, 0, empty_pair, fuel, result);
+}
+
+enum evil_run_status_t
+evil_resume(struct evil_environment_t *environment, int64_t fuel, struct evil_object_t *result)
+{
+    return vm_resume(environment, fuel, result);
+}
+
 /*
  * print
  */
@@ -66,7 +66,7 @@ get_bound_location(struct evil_environment_t *environment, uint64_t symbol_hash,
 }
 
 static void
-append_symbol_table_fragment(struct evil_object_t *symbol_table_fragment, struct evil_object_t *new_fragment)
+append_symbol_table_fragment(struct evil_environment_t *environment, struct evil_object_t *symbol_table_fragment, struct evil_object_t *new_fragment)
 {
     for (;;)
     {
@@ -77,6 +77,7 @@ append_symbol_table_fragment(struct evil_object_t *symbol_table_fragment, struct
         if (next_symbol_table_fragment == empty_pair)
         {
             VECTOR_BASE(symbol_table_fragment)[FIELD_SYMBOL_TABLE_FRAGMENT_NEXT_FRAGMENT] = make_ref(new_fragment);
+            gc_write_barrier(environment->heap, &VECTOR_BASE(symbol_table_fragment)[FIELD_SYMBOL_TABLE_FRAGMENT_NEXT_FRAGMENT]);
 
             return;
         }
@@ -125,6 +126,7 @@ bind(struct evil_environment_t *environment, struct evil_object_t lexical_enviro
             if (symbol_ptr->value.symbol_hash == INVALID_HASH)
             {
                 *symbol_ptr = symbol;
+                ++environment->binding_epoch;
 
                 /*
                  * TODO: Return an inner reference.
@@ -153,10 +155,11 @@ bind(struct evil_environment_t *environment, struct evil_object_t lexical_enviro
     if (symbol_table_fragment == empty_pair)
     {
         VECTOR_BASE(lexical_environment_ptr)[FIELD_LEX_ENV_SYMBOL_TABLE_FRAGMENT] = make_ref(new_fragment);
+        gc_write_barrier(environment->heap, &VECTOR_BASE(lexical_environment_ptr)[FIELD_LEX_ENV_SYMBOL_TABLE_FRAGMENT]);
     }
     else
     {
-        append_symbol_table_fragment(symbol_table_fragment, new_fragment);
+        append_symbol_table_fragment(environment, symbol_table_fragment, new_fragment);
     }
 
     VECTOR_BASE(new_fragment)[FIELD_SYMBOL_TABLE_FRAGMENT_NEXT_FRAGMENT] = make_empty_ref();
@@ -174,6 +177,7 @@ bind(struct evil_environment_t *environment, struct evil_object_t lexical_enviro
 
     SYMBOL_AT(new_fragment, 0) = symbol;
     OBJECT_AT(new_fragment, 0) = make_ref(empty_pair);
+    ++environment->binding_epoch;
 
     /*
      * TODO: Return an inner reference.
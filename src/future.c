@@ -0,0 +1,547 @@
+/***********************************************************************
+ * evilscheme, Copyright (c) 2012-2015, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE.TXT for details.
+ ***********************************************************************/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base.h"
+#include "evil_scheme.h"
+#include "future.h"
+#include "object.h"
+#include "runtime.h"
+#include "serialize.h"
+#include "vm.h"
+
+#if ENABLE_FUTURES
+#   if defined(_MSC_VER)
+#       define WIN32_LEAN_AND_MEAN
+#       pragma warning(push, 0)
+#       include <Windows.h>
+#       pragma warning(pop)
+#   else
+#       include <pthread.h>
+#   endif
+#endif
+
+#if ENABLE_FUTURES && defined(_MSC_VER)
+    typedef CRITICAL_SECTION future_mutex_t;
+    typedef CONDITION_VARIABLE future_condition_t;
+    typedef HANDLE future_thread_t;
+#elif ENABLE_FUTURES
+    typedef pthread_mutex_t future_mutex_t;
+    typedef pthread_cond_t future_condition_t;
+    typedef pthread_t future_thread_t;
+#endif
+
+struct future_t
+{
+    /*
+     * The next future in the pool's queue.
+     */
+    struct future_t *next;
+
+    unsigned char *thunk;
+    size_t thunk_size;
+    unsigned char *result;
+    size_t result_size;
+
+    /*
+     * Set, under the pool's lock, once the result has been written.
+     */
+    int done;
+};
+
+struct future_worker_t
+{
+    struct future_pool_t *pool;
+    struct evil_environment_t *environment;
+    void *stack;
+    void *heap;
+#if ENABLE_FUTURES
+    future_thread_t thread;
+#endif
+};
+
+struct future_pool_t
+{
+#if ENABLE_FUTURES
+    /*
+     * The lock covers the queue, the done flags of the futures and
+     * shutting_down. Everything else is only used by the environment that
+     * owns the pool.
+     */
+    future_mutex_t lock;
+    future_condition_t work_available;
+    future_condition_t work_done;
+    int shutting_down;
+#endif
+    struct future_t *queue_head;
+    struct future_t *queue_tail;
+
+    struct future_worker_t workers[FUTURE_NUM_WORKERS];
+    int num_workers;
+
+    /*
+     * Every future that hasn't been touched yet, indexed by id.
+     */
+    struct future_t **futures;
+    size_t num_futures;
+    size_t capacity;
+};
+
+static void
+future_worker_create(struct future_worker_t *worker, struct future_pool_t *pool)
+{
+    size_t stack_size;
+
+    stack_size = FUTURE_WORKER_STACK_SLOTS * sizeof(struct evil_object_t);
+
+    worker->pool = pool;
+    worker->stack = evil_aligned_alloc(sizeof(void *), stack_size);
+    worker->heap = evil_aligned_alloc(4096, FUTURE_WORKER_HEAP_SIZE);
+    assert(worker->stack != NULL && worker->heap != NULL);
+
+    worker->environment = evil_environment_create(worker->stack, stack_size, worker->heap, FUTURE_WORKER_HEAP_SIZE);
+}
+
+static void
+future_worker_destroy(struct future_worker_t *worker)
+{
+    evil_environment_destroy(worker->environment);
+    evil_aligned_free(worker->stack);
+    evil_aligned_free(worker->heap);
+}
+
+/*
+ * Copies the thunk into the worker's environment, calls it and copies the
+ * result out.
+ */
+static void
+future_run(struct future_worker_t *worker, struct future_t *future)
+{
+    struct evil_environment_t *environment;
+    struct evil_object_handle_t *lexical_environment;
+    struct evil_object_t thunk;
+    struct evil_object_t result;
+
+    environment = worker->environment;
+    lexical_environment = evil_create_object_handle_from_value(environment, environment->lexical_environment);
+
+    thunk = deserialize_value(environment, future->thunk, future->thunk_size);
+    result = vm_run(environment, lexical_environment, deref(&thunk), 0, empty_pair);
+    future->result = serialize_value(environment, &result, &future->result_size);
+
+    evil_destroy_object_handle(environment, lexical_environment);
+
+    free(future->thunk);
+    future->thunk = NULL;
+}
+
+#if ENABLE_FUTURES
+
+#if defined(_MSC_VER)
+    static void
+    future_mutex_create(future_mutex_t *mutex)
+    {
+        InitializeCriticalSection(mutex);
+    }
+
+    static void
+    future_mutex_destroy(future_mutex_t *mutex)
+    {
+        DeleteCriticalSection(mutex);
+    }
+
+    static void
+    future_lock(future_mutex_t *mutex)
+    {
+        EnterCriticalSection(mutex);
+    }
+
+    static void
+    future_unlock(future_mutex_t *mutex)
+    {
+        LeaveCriticalSection(mutex);
+    }
+
+    static void
+    future_condition_create(future_condition_t *condition)
+    {
+        InitializeConditionVariable(condition);
+    }
+
+    static void
+    future_condition_destroy(future_condition_t *condition)
+    {
+        UNUSED(condition);
+    }
+
+    static void
+    future_wait(future_condition_t *condition, future_mutex_t *mutex)
+    {
+        SleepConditionVariableCS(condition, mutex, INFINITE);
+    }
+
+    static void
+    future_signal(future_condition_t *condition)
+    {
+        WakeConditionVariable(condition);
+    }
+
+    static void
+    future_broadcast(future_condition_t *condition)
+    {
+        WakeAllConditionVariable(condition);
+    }
+#else
+    static void
+    future_mutex_create(future_mutex_t *mutex)
+    {
+        pthread_mutex_init(mutex, NULL);
+    }
+
+    static void
+    future_mutex_destroy(future_mutex_t *mutex)
+    {
+        pthread_mutex_destroy(mutex);
+    }
+
+    static void
+    future_lock(future_mutex_t *mutex)
+    {
+        pthread_mutex_lock(mutex);
+    }
+
+    static void
+    future_unlock(future_mutex_t *mutex)
+    {
+        pthread_mutex_unlock(mutex);
+    }
+
+    static void
+    future_condition_create(future_condition_t *condition)
+    {
+        pthread_cond_init(condition, NULL);
+    }
+
+    static void
+    future_condition_destroy(future_condition_t *condition)
+    {
+        pthread_cond_destroy(condition);
+    }
+
+    static void
+    future_wait(future_condition_t *condition, future_mutex_t *mutex)
+    {
+        pthread_cond_wait(condition, mutex);
+    }
+
+    static void
+    future_signal(future_condition_t *condition)
+    {
+        pthread_cond_signal(condition);
+    }
+
+    static void
+    future_broadcast(future_condition_t *condition)
+    {
+        pthread_cond_broadcast(condition);
+    }
+#endif
+
+static void
+future_worker_main(struct future_worker_t *worker)
+{
+    struct future_pool_t *pool;
+
+    pool = worker->pool;
+
+    /*
+     * The worker's environment is created on its own thread so that the
+     * pool's first future doesn't wait for all of them to be set up.
+     */
+    future_worker_create(worker, pool);
+    future_lock(&pool->lock);
+
+    for (;;)
+    {
+        struct future_t *future;
+
+        while (pool->queue_head == NULL && !pool->shutting_down)
+            future_wait(&pool->work_available, &pool->lock);
+
+        if (pool->shutting_down)
+            break;
+
+        future = pool->queue_head;
+        pool->queue_head = future->next;
+
+        if (pool->queue_head == NULL)
+            pool->queue_tail = NULL;
+
+        future_unlock(&pool->lock);
+        future_run(worker, future);
+        future_lock(&pool->lock);
+
+        future->done = 1;
+        future_broadcast(&pool->work_done);
+    }
+
+    future_unlock(&pool->lock);
+    future_worker_destroy(worker);
+}
+
+#if defined(_MSC_VER)
+    static DWORD WINAPI
+    future_thread_main(LPVOID context)
+    {
+        future_worker_main(context);
+
+        return 0;
+    }
+
+    static int
+    future_start_thread(struct future_worker_t *worker)
+    {
+        worker->thread = CreateThread(NULL, 0, future_thread_main, worker, 0, NULL);
+
+        return worker->thread != NULL;
+    }
+
+    static void
+    future_join_thread(struct future_worker_t *worker)
+    {
+        WaitForSingleObject(worker->thread, INFINITE);
+        CloseHandle(worker->thread);
+    }
+#else
+    static void *
+    future_thread_main(void *context)
+    {
+        future_worker_main(context);
+
+        return NULL;
+    }
+
+    static int
+    future_start_thread(struct future_worker_t *worker)
+    {
+        return pthread_create(&worker->thread, NULL, future_thread_main, worker) == 0;
+    }
+
+    static void
+    future_join_thread(struct future_worker_t *worker)
+    {
+        pthread_join(worker->thread, NULL);
+    }
+#endif
+
+static struct future_pool_t *
+future_pool_create(void)
+{
+    struct future_pool_t *pool;
+
+    pool = calloc(1, sizeof(struct future_pool_t));
+    assert(pool != NULL);
+
+    future_mutex_create(&pool->lock);
+    future_condition_create(&pool->work_available);
+    future_condition_create(&pool->work_done);
+
+    for (pool->num_workers = 0; pool->num_workers < FUTURE_NUM_WORKERS; ++pool->num_workers)
+    {
+        pool->workers[pool->num_workers].pool = pool;
+
+        if (!future_start_thread(&pool->workers[pool->num_workers]))
+            break;
+    }
+
+    assert(pool->num_workers > 0);
+
+    return pool;
+}
+
+static void
+future_submit(struct future_pool_t *pool, struct future_t *future)
+{
+    future_lock(&pool->lock);
+
+    if (pool->queue_tail != NULL)
+        pool->queue_tail->next = future;
+    else
+        pool->queue_head = future;
+
+    pool->queue_tail = future;
+    future_signal(&pool->work_available);
+    future_unlock(&pool->lock);
+}
+
+static void
+future_wait_until_done(struct future_pool_t *pool, struct future_t *future)
+{
+    future_lock(&pool->lock);
+
+    while (!future->done)
+        future_wait(&pool->work_done, &pool->lock);
+
+    future_unlock(&pool->lock);
+}
+
+void
+future_pool_destroy(struct future_pool_t *pool)
+{
+    size_t i;
+    int ii;
+
+    if (pool == NULL)
+        return;
+
+    future_lock(&pool->lock);
+    pool->shutting_down = 1;
+    future_broadcast(&pool->work_available);
+    future_unlock(&pool->lock);
+
+    for (ii = 0; ii < pool->num_workers; ++ii)
+        future_join_thread(&pool->workers[ii]);
+
+    future_condition_destroy(&pool->work_done);
+    future_condition_destroy(&pool->work_available);
+    future_mutex_destroy(&pool->lock);
+
+    for (i = 0; i < pool->num_futures; ++i)
+    {
+        free(pool->futures[i]->thunk);
+        free(pool->futures[i]->result);
+        free(pool->futures[i]);
+    }
+
+    free(pool->futures);
+    free(pool);
+}
+
+#else
+
+static struct future_pool_t *
+future_pool_create(void)
+{
+    struct future_pool_t *pool;
+
+    pool = calloc(1, sizeof(struct future_pool_t));
+    assert(pool != NULL);
+
+    future_worker_create(&pool->workers[0], pool);
+    pool->num_workers = 1;
+
+    return pool;
+}
+
+static void
+future_submit(struct future_pool_t *pool, struct future_t *future)
+{
+    future_run(&pool->workers[0], future);
+    future->done = 1;
+}
+
+static void
+future_wait_until_done(struct future_pool_t *pool, struct future_t *future)
+{
+    UNUSED(pool);
+    assert(future->done);
+}
+
+void
+future_pool_destroy(struct future_pool_t *pool)
+{
+    size_t i;
+
+    if (pool == NULL)
+        return;
+
+    future_worker_destroy(&pool->workers[0]);
+
+    for (i = 0; i < pool->num_futures; ++i)
+    {
+        free(pool->futures[i]->result);
+        free(pool->futures[i]);
+    }
+
+    free(pool->futures);
+    free(pool);
+}
+
+#endif
+
+struct evil_object_t
+evil_future(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *args)
+{
+    struct future_pool_t *pool;
+    struct future_t *future;
+    struct evil_object_t *procedure;
+    size_t id;
+
+    UNUSED(lexical_environment);
+    UNUSED(num_args);
+
+    /*
+     * (future thunk) hands a copy of thunk to the worker pool and returns
+     * the future's id.
+     */
+    procedure = deref(&args[0]);
+    assert(procedure->tag_count.tag == TAG_PROCEDURE);
+    assert(vm_procedure_header(procedure).num_args == 0);
+
+    if (environment->futures == NULL)
+        environment->futures = future_pool_create();
+
+    pool = environment->futures;
+
+    if (pool->num_futures == pool->capacity)
+    {
+        pool->capacity = (pool->capacity == 0) ? 16 : pool->capacity * 2;
+        pool->futures = realloc(pool->futures, pool->capacity * sizeof(struct future_t *));
+        assert(pool->futures != NULL);
+    }
+
+    future = calloc(1, sizeof(struct future_t));
+    assert(future != NULL);
+    future->thunk = serialize_value(environment, &args[0], &future->thunk_size);
+
+    id = pool->num_futures++;
+    pool->futures[id] = future;
+    future_submit(pool, future);
+
+    return make_fixnum_object((int64_t)id);
+}
+
+struct evil_object_t
+evil_touch(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *args)
+{
+    struct future_pool_t *pool;
+    struct future_t *future;
+    struct evil_object_t *id;
+
+    UNUSED(lexical_environment);
+    UNUSED(num_args);
+
+    /*
+     * (touch id) returns the result of the future, waiting for it if it
+     * hasn't finished yet. This blocks the whole environment, including any
+     * other fibers. The result is kept with the future, so every touch gets
+     * a fresh copy of it.
+     */
+    pool = environment->futures;
+    id = value_deref(&args[0]);
+    assert(id->tag_count.tag == TAG_FIXNUM);
+    assert(pool != NULL && id->value.fixnum_value >= 0 && (size_t)id->value.fixnum_value < pool->num_futures);
+
+    future = pool->futures[id->value.fixnum_value];
+    assert(future != NULL);
+
+    future_wait_until_done(pool, future);
+
+    return deserialize_value(environment, future->result, future->result_size);
+}
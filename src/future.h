@@ -0,0 +1,69 @@
+/***********************************************************************
+ * evilscheme, Copyright (c) 2012-2015, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE.TXT for details.
+ ***********************************************************************/
+
+#ifndef EVIL_FUTURE_H
+#define EVIL_FUTURE_H
+
+#include "object.h"
+
+/*
+ * Futures. (future thunk) copies the procedure, which takes no arguments,
+ * along with everything it refers to into one of a pool of worker
+ * environments and returns the future's id; the worker calls it on a
+ * thread of its own. (touch id) waits for the call to finish and returns a
+ * copy of its result. A future can be touched any number of times, each
+ * touch returning a copy of its own.
+ *
+ * The copies are made with serialize_value, so workers share nothing with
+ * the environment that made the future and the environments never need to
+ * lock each other out while they run. It also means thunks are meant to be
+ * pure: whatever they do to globals or to the data they were handed
+ * happens to the worker's copies. Output printed by a thunk goes through
+ * evil_printf on the worker's thread.
+ *
+ * Each environment has a pool of its own, whose threads are started when it
+ * makes its first future and stopped when it is destroyed. Workers keep
+ * their environments between futures, so globals copied in for one future
+ * stay bound until another copies in new values. Futures that haven't
+ * started when the pool is destroyed are dropped.
+ *
+ * Without thread support the future is run in the worker environment
+ * straight away, on the calling thread.
+ */
+#ifndef ENABLE_FUTURES
+#   if defined(_MSC_VER) || defined(__unix__) || defined(__APPLE__)
+#       define ENABLE_FUTURES 1
+#   else
+#       define ENABLE_FUTURES 0
+#   endif
+#endif
+
+#ifndef FUTURE_NUM_WORKERS
+#   define FUTURE_NUM_WORKERS 4
+#endif
+
+/*
+ * The size of the first stack segment and of the heap of each worker's
+ * environment.
+ */
+#ifndef FUTURE_WORKER_STACK_SLOTS
+#   define FUTURE_WORKER_STACK_SLOTS 1024
+#endif
+
+#ifndef FUTURE_WORKER_HEAP_SIZE
+#   define FUTURE_WORKER_HEAP_SIZE (4 * 1024 * 1024)
+#endif
+
+struct future_pool_t;
+
+/*
+ * Stops the workers, waiting for the futures they are running, and frees
+ * their environments, the futures and their results.
+ */
+void
+future_pool_destroy(struct future_pool_t *pool);
+
+#endif
@@ -9,6 +9,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(_MSC_VER)
+#   define WIN32_LEAN_AND_MEAN
+#   pragma warning(push, 0)
+#   include <Windows.h>
+#   pragma warning(pop)
+#else
+#   include <time.h>
+#endif
+
 #include "base.h"
 #include "dlist.h"
 #include "environment.h"
@@ -17,6 +26,11 @@
 #include "slist.h"
 #include "vm.h"
 
+#if ENABLE_PARALLEL_MARKING && !defined(_MSC_VER)
+#   include <pthread.h>
+#   include <sched.h>
+#endif
+
 #define EVIL_DEFAULT_ALIGN 8
 #define EVIL_DEFAULT_ALIGN_MASK (EVIL_DEFAULT_ALIGN - 1)
 
@@ -24,10 +38,96 @@
 #define EVIL_PAGE_SIZE 4096
 #endif
 
-#define FLAG_MARKED 1
-#define FLAG_UNMARKED 0
 #define INITIAL_COST 0
 
+/*
+ * Marks are kept in a bitmap beside the heap, a bit for every
+ * EVIL_DEFAULT_ALIGN bytes, rather than in the objects, so a bucket's marks
+ * are cleared in one go instead of by tracing the live objects again, and
+ * the mutator can't copy them around with the slots it moves. The elements
+ * of vectors have bits of their own, see is_live_object.
+ */
+#define EVIL_MARK_BYTES_PER_BUCKET (EVIL_PAGE_SIZE / EVIL_DEFAULT_ALIGN / 8)
+
+#ifndef EVIL_INITIAL_GREY_OBJECTS
+#define EVIL_INITIAL_GREY_OBJECTS 1024
+#endif
+
+/*
+ * Incremental marking looks at the clock after tracing this many objects.
+ */
+#define EVIL_GREY_OBJECTS_PER_CLOCK_CHECK 64
+
+#if ENABLE_PARALLEL_MARKING && defined(_MSC_VER)
+    typedef CRITICAL_SECTION mark_mutex_t;
+    typedef CONDITION_VARIABLE mark_condition_t;
+    typedef HANDLE mark_thread_t;
+#elif ENABLE_PARALLEL_MARKING
+    typedef pthread_mutex_t mark_mutex_t;
+    typedef pthread_cond_t mark_condition_t;
+    typedef pthread_t mark_thread_t;
+#endif
+
+#if ENABLE_PARALLEL_MARKING
+/*
+ * Parallel markers keep their grey objects on work-stealing deques, after
+ * Chase and Lev's "Dynamic Circular Work-Stealing Deque". The owner pushes
+ * and pops at the bottom without locking; the others steal from the top,
+ * racing the owner for the last object with a compare and swap. A full
+ * deque moves to an array twice the size, and the old one is kept until
+ * the marking is done as thieves may still be reading from it.
+ */
+struct mark_array_t
+{
+    struct evil_object_t *volatile *slots;
+    intptr_t mask;
+    struct mark_array_t *previous;
+};
+
+struct mark_deque_t
+{
+    volatile intptr_t top;
+    volatile intptr_t bottom;
+    struct mark_array_t *volatile array;
+};
+
+struct marker_t
+{
+    struct heap_t *heap;
+    struct mark_deque_t deque;
+    size_t index;
+
+    /*
+     * The last marking the helper took part in, see marker_main.
+     */
+    size_t cycle;
+    mark_thread_t thread;
+};
+
+/*
+ * The marker of the thread running, while it marks in parallel.
+ */
+static EVIL_THREAD_LOCAL struct marker_t *current_marker;
+#endif
+
+/*
+ * The forwarding table holds an entry per object moved by a collection, so
+ * its size bounds how much work one compaction does.
+ */
+#ifndef EVIL_FORWARDING_ENTRIES_PER_BUCKET
+#define EVIL_FORWARDING_ENTRIES_PER_BUCKET 8
+#endif
+
+/*
+ * The nursery is limited to half of the heap on small heaps.
+ */
+#ifndef EVIL_NURSERY_BUCKETS
+#define EVIL_NURSERY_BUCKETS 64
+#endif
+
+#define EVIL_CARD_SIZE (8 * EVIL_DEFAULT_ALIGN)
+#define EVIL_CARDS_PER_BUCKET (EVIL_PAGE_SIZE / EVIL_CARD_SIZE)
+
 struct evil_object_handle_t
 {
     struct dlist_t link;
@@ -40,6 +140,49 @@ struct heap_bucket_t
     char *base;
     char *ptr;
     char *top;
+
+    /*
+     * Both are only meaningful during a collection. Pinned buckets hold
+     * objects that are referenced from places the collector can't update,
+     * see pin_procedure, and evacuated buckets have had their live objects
+     * moved out.
+     */
+    unsigned char pinned;
+    unsigned char evacuated;
+
+    /*
+     * Buckets are young from when they are acquired until the end of the
+     * next collection.
+     */
+    unsigned char young;
+
+    /*
+     * Set while the bucket is on the free list.
+     */
+    unsigned char free;
+
+    /*
+     * Set on the buckets that survive the marking of an incremental
+     * collection until the collection has cleared their dead objects and
+     * their marks, see sweep_buckets.
+     */
+    unsigned char unswept;
+
+    /*
+     * Objects too large for a bucket are given a run of contiguous buckets,
+     * see acquire_run. Every bucket of the run refers to the first one,
+     * which holds the object and the length of the run; the rest are left
+     * empty. Large objects are never evacuated.
+     */
+    struct heap_bucket_t *run;
+    size_t run_length;
+};
+
+struct forwarding_entry_t
+{
+    char *from;
+    char *to;
+    size_t size;
 };
 
 struct bucket_cost_t
@@ -48,6 +191,13 @@ struct bucket_cost_t
     size_t cost;
 };
 
+enum gc_phase_t
+{
+    GC_PHASE_IDLE,
+    GC_PHASE_MARKING,
+    GC_PHASE_SWEEPING
+};
+
 struct heap_t
 {
     struct evil_environment_t *environment;
@@ -55,12 +205,72 @@ struct heap_t
     size_t size;
 
     unsigned char *card_base;
+    size_t num_cards;
     size_t num_buckets;
     struct heap_bucket_t *bucket_base;
     struct heap_bucket_t *current_bucket;
     struct heap_bucket_t *free_list;
     struct bucket_cost_t *bucket_costs;
 
+    /*
+     * The empty bucket the first objects are evacuated into. It is kept off
+     * the free list so that a compaction is possible once the heap is full.
+     */
+    struct heap_bucket_t *reserve;
+    struct forwarding_entry_t *forwarding;
+    size_t num_forwarding;
+    size_t max_forwarding;
+    int evacuation_inhibited;
+
+    /*
+     * Nursery collections stop marking at old objects, and mark what the
+     * slots on dirty cards refer to instead.
+     */
+    size_t num_young;
+    size_t nursery_size;
+    int collecting_nursery;
+    int full_collection_pending;
+
+    /*
+     * Objects that have been marked but whose slots have yet to be traced,
+     * the grey ones, are kept on a stack rather than recursed into.
+     */
+    unsigned char *mark_bits;
+    struct evil_object_t **grey;
+    size_t num_grey;
+    size_t max_grey;
+
+    /*
+     * Incremental collections run a slice at a time, each taking no more
+     * than the pause budget, in microseconds, see step_incremental_collection.
+     */
+    enum gc_phase_t phase;
+    size_t sweep_cursor;
+    uint64_t pause_budget;
+    size_t num_free;
+    int incremental_stalled;
+
+#if ENABLE_PARALLEL_MARKING
+    /*
+     * The helpers that mark collections of the whole heap along with the
+     * collecting thread, whose marker is the first. They wait on mark_start
+     * for the cycle to change and count themselves off in num_markers_done;
+     * the lock covers those and shutting_down. A marker that runs out of
+     * objects to trace or steal counts itself idle, and the marking is done
+     * once they all are.
+     */
+    size_t mark_threads;
+    struct marker_t *markers;
+    size_t num_markers;
+    mark_mutex_t mark_lock;
+    mark_condition_t mark_start;
+    mark_condition_t mark_done;
+    size_t mark_cycle;
+    size_t num_markers_done;
+    int markers_shutting_down;
+    volatile size_t num_idle_markers;
+#endif
+
     struct dlist_t active_object_handles;
     struct dlist_t free_object_handles;
 };
@@ -79,9 +289,137 @@ acquire_bucket(struct heap_t *heap)
     heap->free_list = (struct heap_bucket_t *)new_bucket->link.next;
     heap->current_bucket = new_bucket;
 
+    new_bucket->free = 0;
+    new_bucket->young = 1;
+    ++heap->num_young;
+    --heap->num_free;
+
     return new_bucket;
 }
 
+/*
+ * Takes the highest run of free buckets long enough to hold a large object
+ * off the free list.
+ */
+static struct heap_bucket_t *
+acquire_run(struct heap_t *heap, size_t run_length)
+{
+    size_t i;
+    size_t k;
+    size_t num_free;
+    struct heap_bucket_t *run;
+
+    num_free = 0;
+
+    for (i = heap->num_buckets; i > 0 && num_free < run_length; )
+    {
+        --i;
+        num_free = heap->bucket_base[i].free ? num_free + 1 : 0;
+    }
+
+    if (num_free < run_length)
+    {
+        return NULL;
+    }
+
+    run = heap->bucket_base + i;
+
+    for (k = 0; k < run_length; ++k)
+    {
+        run[k].free = 0;
+        run[k].young = 1;
+        run[k].run = run;
+    }
+
+    run->run_length = run_length;
+    run->top = run->base + run_length * EVIL_PAGE_SIZE;
+    heap->num_young += run_length;
+    heap->num_free -= run_length;
+
+    /*
+     * The run's buckets can be anywhere in the free list, which is rebuilt
+     * from what is left.
+     */
+    heap->free_list = NULL;
+
+    for (i = heap->num_buckets; i-- > 0; )
+    {
+        if (heap->bucket_base[i].free)
+        {
+            heap->bucket_base[i].link.next = &heap->free_list->link;
+            heap->free_list = heap->bucket_base + i;
+        }
+    }
+
+    return run;
+}
+
+static void
+collect_heap(struct heap_t *heap, int compact);
+
+static void
+trace_slot(struct heap_t *heap, struct evil_object_t *slot);
+
+static void
+consider_incremental_collection(struct heap_t *heap);
+
+static void
+step_incremental_collection(struct heap_t *heap);
+
+static void
+finish_marking(struct heap_t *heap);
+
+#if ENABLE_PARALLEL_MARKING
+static void
+stop_markers(struct heap_t *heap);
+#endif
+
+static void *
+perform_large_alloc(struct heap_t *heap, size_t size)
+{
+    struct heap_bucket_t *run;
+    size_t run_length;
+    int i;
+
+    run_length = (size + EVIL_PAGE_SIZE - 1) / EVIL_PAGE_SIZE;
+
+    if (heap->phase != GC_PHASE_IDLE)
+    {
+        step_incremental_collection(heap);
+    }
+#if ENABLE_GENERATIONAL_GC
+    else if (heap->num_young >= heap->nursery_size)
+    {
+        gc_collect_nursery(heap);
+    }
+#endif
+
+    for (i = 0; i < 3; ++i)
+    {
+        run = acquire_run(heap, run_length);
+
+        if (run != NULL)
+        {
+            run->ptr = run->base + size;
+            memset(run->base, 0, size);
+            return run->base;
+        }
+
+        if (i < 2)
+        {
+            collect_heap(heap, i);
+        }
+    }
+
+    /*
+     * The free buckets are too fragmented to make a run of, or there aren't
+     * enough of them.
+     */
+    BREAK();
+
+    return NULL;
+}
+
 static void *
 perform_alloc(struct heap_t *heap, size_t size)
 {
@@ -94,12 +432,13 @@ perform_alloc(struct heap_t *heap, size_t size)
         char *mem;
 
         bucket = heap->current_bucket;
-
-        /*
-         * TODO: We need to support large (>4kb) allocations sometime.
-         */
-        assert(size < EVIL_PAGE_SIZE);
         rounded_size = (ptrdiff_t)((size + EVIL_DEFAULT_ALIGN_MASK) & (~EVIL_DEFAULT_ALIGN_MASK));
+
+        if (rounded_size > EVIL_PAGE_SIZE)
+        {
+            return perform_large_alloc(heap, (size_t)rounded_size);
+        }
+
         mem = bucket->ptr;
 
         if (bucket->top - mem >= rounded_size)
@@ -109,12 +448,37 @@ perform_alloc(struct heap_t *heap, size_t size)
             return mem;
         }
 
+        /*
+         * Incremental collections take a slice at a time out of filling the
+         * buckets, and replace the current one once they finish marking.
+         */
+        if (heap->phase != GC_PHASE_IDLE)
+        {
+            step_incremental_collection(heap);
+
+            if (heap->current_bucket != bucket)
+            {
+                continue;
+            }
+        }
+#if ENABLE_GENERATIONAL_GC
+        else if (heap->num_young >= heap->nursery_size)
+        {
+            gc_collect_nursery(heap);
+            continue;
+        }
+#endif
+
         bucket = acquire_bucket(heap);
 
         if (bucket == NULL)
         {
             gc_collect(heap);
         }
+        else
+        {
+            consider_incremental_collection(heap);
+        }
     }
 
     /*
@@ -141,7 +505,12 @@ create_buckets(struct heap_t *heap)
 
     buckets = heap->bucket_base;
     heap_base = heap->base;
-    for (i = 0, num_buckets = heap->num_buckets; i < num_buckets; ++i)
+    num_buckets = heap->num_buckets;
+
+    /*
+     * The free list starts with the lowest bucket, see reclaim_empty_buckets.
+     */
+    for (i = num_buckets; i-- > 0; )
     {
         char *bucket_base;
 
@@ -149,11 +518,22 @@ create_buckets(struct heap_t *heap)
         buckets[i].base = bucket_base;
         buckets[i].ptr = bucket_base;
         buckets[i].top = bucket_base + EVIL_PAGE_SIZE;
+        buckets[i].free = 1;
 
         buckets[i].link.next = &heap->free_list->link;
         heap->free_list = &buckets[i];
     }
 
+    heap->num_free = num_buckets;
+
+    if (num_buckets > 1)
+    {
+        heap->reserve = heap->free_list;
+        heap->free_list = (struct heap_bucket_t *)heap->reserve->link.next;
+        heap->reserve->free = 0;
+        --heap->num_free;
+    }
+
     current_bucket = acquire_bucket(heap);
     assert(current_bucket != NULL);
 }
@@ -174,11 +554,19 @@ gc_create(void *heap_mem, size_t heap_size)
     heap->base = heap_mem;
     heap->size = heap_size;
 
-    num_cards = heap_size / (8 * EVIL_DEFAULT_ALIGN);
+    num_cards = heap_size / EVIL_CARD_SIZE;
     heap->card_base = evil_aligned_alloc(sizeof(void *), num_cards);
+    memset(heap->card_base, 0, num_cards);
+    heap->num_cards = num_cards;
 
     assert(heap_size % EVIL_PAGE_SIZE == 0);
     num_buckets = heap_size / EVIL_PAGE_SIZE;
+    heap->nursery_size = (num_buckets / 2 < EVIL_NURSERY_BUCKETS) ? num_buckets / 2 : EVIL_NURSERY_BUCKETS;
+
+    if (heap->nursery_size == 0)
+    {
+        heap->nursery_size = 1;
+    }
     bucket_alloc_size = num_buckets * sizeof(struct heap_bucket_t);
 
     bucket_base = evil_aligned_alloc(sizeof(void *), bucket_alloc_size);
@@ -189,6 +577,18 @@ gc_create(void *heap_mem, size_t heap_size)
     bucket_cost_size = sizeof(struct bucket_cost_t) * num_buckets;
     heap->bucket_costs = evil_aligned_alloc(sizeof(void *), bucket_cost_size);
 
+    heap->max_forwarding = num_buckets * EVIL_FORWARDING_ENTRIES_PER_BUCKET;
+    heap->forwarding = evil_aligned_alloc(sizeof(void *), heap->max_forwarding * sizeof(struct forwarding_entry_t));
+
+    heap->mark_bits = evil_aligned_alloc(sizeof(void *), num_buckets * EVIL_MARK_BYTES_PER_BUCKET);
+    memset(heap->mark_bits, 0, num_buckets * EVIL_MARK_BYTES_PER_BUCKET);
+    heap->max_grey = EVIL_INITIAL_GREY_OBJECTS;
+    heap->grey = evil_aligned_alloc(sizeof(void *), heap->max_grey * sizeof(struct evil_object_t *));
+    heap->pause_budget = EVIL_GC_PAUSE_BUDGET;
+#if ENABLE_PARALLEL_MARKING
+    heap->mark_threads = heap_size >= EVIL_PARALLEL_MARK_MIN_HEAP_SIZE ? EVIL_GC_MARK_THREADS : 0;
+#endif
+
     dlist_initialize(&heap->active_object_handles);
     dlist_initialize(&heap->free_object_handles);
 
@@ -223,6 +623,13 @@ gc_destroy(struct heap_t *heap)
         evil_aligned_free(handle);
     }
 
+#if ENABLE_PARALLEL_MARKING
+    stop_markers(heap);
+#endif
+
+    evil_aligned_free(heap->grey);
+    evil_aligned_free(heap->mark_bits);
+    evil_aligned_free(heap->forwarding);
     evil_aligned_free(heap->bucket_costs);
     evil_aligned_free(heap->bucket_base);
     evil_aligned_free(heap->card_base);
@@ -235,6 +642,54 @@ gc_set_environment(struct heap_t *heap, struct evil_environment_t *env)
     heap->environment = env;
 }
 
+void
+gc_write_barrier(struct heap_t *heap, struct evil_object_t *slot)
+{
+#if ENABLE_GENERATIONAL_GC
+    size_t offset;
+#endif
+
+    /*
+     * The object holding the slot may already have been traced by the
+     * incremental marking, which has to be told what is stored in it.
+     */
+    if (heap->phase == GC_PHASE_MARKING)
+    {
+        trace_slot(heap, slot);
+    }
+
+#if ENABLE_GENERATIONAL_GC
+    offset = (size_t)slot - (size_t)heap->base;
+
+    if (offset < heap->size)
+    {
+        heap->card_base[offset / EVIL_CARD_SIZE] = 1;
+    }
+#endif
+}
+
+void
+gc_inhibit_evacuation(struct heap_t *heap)
+{
+    /*
+     * Incremental marking relies on the stores being reported, so it is
+     * finished before code that doesn't report them runs.
+     */
+    if (heap->phase == GC_PHASE_MARKING)
+    {
+        finish_marking(heap);
+    }
+
+    ++heap->evacuation_inhibited;
+}
+
+void
+gc_allow_evacuation(struct heap_t *heap)
+{
+    assert(heap->evacuation_inhibited > 0);
+    --heap->evacuation_inhibited;
+}
+
 struct evil_object_t *
 gc_alloc(struct heap_t *heap, enum evil_tag_t type, size_t extra_bytes)
 {
@@ -265,8 +720,15 @@ gc_alloc(struct heap_t *heap, enum evil_tag_t type, size_t extra_bytes)
 
     if (type == TAG_STRING)
     {
-        assert(extra_bytes < 65536);
-        object->tag_count.count = (unsigned short)extra_bytes;
+        if ((uint64_t)extra_bytes > UINT32_MAX)
+        {
+            /*
+             * The string's length is kept in the header's count.
+             */
+            BREAK();
+        }
+
+        object->tag_count.count = (uint32_t)extra_bytes;
     }
     else
     {
@@ -288,11 +750,26 @@ gc_alloc_vector(struct heap_t *heap, size_t count)
     size_t total_alloc_size;
     struct evil_object_t *object;
 
+    if ((uint64_t)count > UINT32_MAX)
+    {
+        /*
+         * The vector's length is kept in the header's count.
+         */
+        BREAK();
+    }
+
     total_alloc_size = (count * sizeof(struct evil_object_t)) + offsetof(struct evil_object_t, value);
     object = perform_alloc(heap, total_alloc_size);
 
     object->tag_count.tag = TAG_VECTOR;
-    object->tag_count.count = (unsigned short)count;
+    object->tag_count.count = (uint32_t)count;
+
+    /*
+     * The elements are cleared as callers commonly allocate something else
+     * before filling them in, which may end up in a collection that scans
+     * the half built vector.
+     */
+    memset(VECTOR_BASE(object), 0, count * sizeof(struct evil_object_t));
 
     return object;
 }
@@ -384,71 +861,490 @@ evil_retarget_object_handle(struct evil_object_handle_t *handle, struct evil_obj
     handle->object = object;
 }
 
-static void
-mark_object(struct heap_t *heap, struct evil_object_t *object, unsigned char flag)
+static struct heap_bucket_t *
+find_bucket(struct heap_t *heap, void *ptr)
 {
-    char *object_address;
-    size_t object_offset;
-    size_t bucket_index;
-    struct bucket_cost_t *costs;
-
-    object_address = (char *)object;
-    object_offset = (size_t)object_address - (size_t)heap->base;
-
-    object->tag_count.flag = flag;
-
-    /*
-     * TODO: Specialize marking/unmarking code.
-     */
-    if (flag == FLAG_UNMARKED)
-    {
-        return;
-    }
+    size_t offset;
 
     /*
-     * This check uses the overflow of unsigned arithmetic to check if an 
-     * object resides in the heap. If the offset is creater than the heap size,
-     * it is out of heap bounds and thus the bucket costs should not be 
-     * updated.
+     * This check uses the overflow of unsigned arithmetic to check if a
+     * pointer is into the heap: pointers below its base wrap around to
+     * offsets past its end.
      */
+    offset = (size_t)ptr - (size_t)heap->base;
 
-    if (object_offset > heap->size)
+    if (offset >= heap->size)
     {
-        return;
+        return NULL;
     }
 
-    costs = heap->bucket_costs;
-    bucket_index = object_offset / EVIL_PAGE_SIZE;
+    return heap->bucket_base + offset / EVIL_PAGE_SIZE;
+}
 
-    /*
-     * The reasoning behind the costs is described below in 
-     * initialize_bucket_costs
-     */
-    assert(costs[bucket_index].bucket == (heap->bucket_base + bucket_index));
-    ++costs[bucket_index].cost;
+#if ENABLE_PARALLEL_MARKING
+/*
+ * The atomic operations parallel marking needs. MSVC gives volatile loads
+ * and stores acquire and release semantics, so only the read-modify-write
+ * operations and the fence need intrinsics.
+ */
+static inline intptr_t
+load_index(volatile intptr_t *index)
+{
+#if defined(_MSC_VER)
+    return *index;
+#else
+    return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline void
+store_index(volatile intptr_t *index, intptr_t value)
+{
+#if defined(_MSC_VER)
+    *index = value;
+#else
+    __atomic_store_n(index, value, __ATOMIC_RELEASE);
+#endif
 }
 
 static inline int
-scan_object(struct heap_t *heap, struct evil_object_t *object, unsigned char flag)
+swap_index(volatile intptr_t *index, intptr_t expected, intptr_t desired)
 {
-    unsigned char tag;
+#if defined(_MSC_VER)
+    return InterlockedCompareExchangePointer((PVOID volatile *)index, (PVOID)desired, (PVOID)expected) == (PVOID)expected;
+#else
+    return __atomic_compare_exchange_n(index, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+#endif
+}
 
-    if (object == NULL)
-    {
-        return 0;
-    }
+static inline void *
+load_pointer(void *volatile *pointer)
+{
+#if defined(_MSC_VER)
+    return *pointer;
+#else
+    return __atomic_load_n(pointer, __ATOMIC_ACQUIRE);
+#endif
+}
 
-    if (object->tag_count.flag == flag)
-    {
-        return 0;
-    }
+static inline void
+store_pointer(void *volatile *pointer, void *value)
+{
+#if defined(_MSC_VER)
+    *pointer = value;
+#else
+    __atomic_store_n(pointer, value, __ATOMIC_RELEASE);
+#endif
+}
 
-    mark_object(heap, object, flag);
+static inline void
+full_fence(void)
+{
+#if defined(_MSC_VER)
+    MemoryBarrier();
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
 
-    tag = object->tag_count.tag;
+static inline unsigned char
+fetch_or_byte(volatile unsigned char *byte, unsigned char bits)
+{
+#if defined(_MSC_VER)
+    return (unsigned char)InterlockedOr8((volatile char *)byte, (char)bits);
+#else
+    return __atomic_fetch_or(byte, bits, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline size_t
+add_size(volatile size_t *size, size_t value)
+{
+#if defined(_MSC_VER)
+    return InterlockedExchangeAddSizeT(size, value) + value;
+#else
+    return __atomic_add_fetch(size, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline size_t
+load_size(volatile size_t *size)
+{
+#if defined(_MSC_VER)
+    return *size;
+#else
+    return __atomic_load_n(size, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static struct mark_array_t *
+create_mark_array(intptr_t size)
+{
+    struct mark_array_t *array;
+
+    assert((size & (size - 1)) == 0);
+
+    array = evil_aligned_alloc(sizeof(void *), sizeof(struct mark_array_t));
+    array->slots = evil_aligned_alloc(sizeof(void *), (size_t)size * sizeof(struct evil_object_t *));
+    array->mask = size - 1;
+    array->previous = NULL;
+
+    return array;
+}
+
+static void
+destroy_mark_arrays(struct mark_array_t *array)
+{
+    while (array != NULL)
+    {
+        struct mark_array_t *previous;
+
+        previous = array->previous;
+        evil_aligned_free((void *)array->slots);
+        evil_aligned_free(array);
+        array = previous;
+    }
+}
+
+static struct evil_object_t *
+load_slot(struct mark_array_t *array, intptr_t index)
+{
+    return load_pointer((void *volatile *)&array->slots[index & array->mask]);
+}
+
+static void
+push_marker_object(struct mark_deque_t *deque, struct evil_object_t *object)
+{
+    intptr_t bottom;
+    intptr_t top;
+    struct mark_array_t *array;
+
+    bottom = deque->bottom;
+    top = load_index(&deque->top);
+    array = deque->array;
+
+    if (bottom - top > array->mask)
+    {
+        struct mark_array_t *grown;
+        intptr_t i;
+
+        grown = create_mark_array(2 * (array->mask + 1));
+
+        for (i = top; i < bottom; ++i)
+        {
+            store_pointer((void *volatile *)&grown->slots[i & grown->mask], load_slot(array, i));
+        }
+
+        grown->previous = array;
+        store_pointer((void *volatile *)&deque->array, grown);
+        array = grown;
+    }
+
+    store_pointer((void *volatile *)&array->slots[bottom & array->mask], object);
+    store_index(&deque->bottom, bottom + 1);
+}
+
+static struct evil_object_t *
+pop_marker_object(struct mark_deque_t *deque)
+{
+    intptr_t bottom;
+    intptr_t top;
+    struct mark_array_t *array;
+    struct evil_object_t *object;
+
+    bottom = deque->bottom - 1;
+    array = deque->array;
+    store_index(&deque->bottom, bottom);
+    full_fence();
+    top = load_index(&deque->top);
+
+    if (top > bottom)
+    {
+        store_index(&deque->bottom, bottom + 1);
+        return NULL;
+    }
+
+    object = load_slot(array, bottom);
+
+    /*
+     * The last object may be being stolen at the same time.
+     */
+    if (top == bottom)
+    {
+        if (!swap_index(&deque->top, top, top + 1))
+        {
+            object = NULL;
+        }
+
+        store_index(&deque->bottom, bottom + 1);
+    }
+
+    return object;
+}
+
+/*
+ * Returns NULL if the deque is empty or another thief got there first.
+ */
+static struct evil_object_t *
+steal_marker_object(struct mark_deque_t *deque)
+{
+    intptr_t bottom;
+    intptr_t top;
+    struct mark_array_t *array;
+    struct evil_object_t *object;
+
+    top = load_index(&deque->top);
+    full_fence();
+    bottom = load_index(&deque->bottom);
+
+    if (top >= bottom)
+    {
+        return NULL;
+    }
+
+    array = load_pointer((void *volatile *)&deque->array);
+    object = load_slot(array, top);
+
+    return swap_index(&deque->top, top, top + 1) ? object : NULL;
+}
+#endif
+
+static int
+is_marked(struct heap_t *heap, void *ptr)
+{
+    size_t index;
+
+    index = (size_t)((char *)ptr - heap->base) / EVIL_DEFAULT_ALIGN;
+
+    return (heap->mark_bits[index / 8] >> (index % 8)) & 1;
+}
+
+static void
+set_mark(struct heap_t *heap, void *ptr, int marked)
+{
+    size_t index;
+    unsigned char bit;
+
+    index = (size_t)((char *)ptr - heap->base) / EVIL_DEFAULT_ALIGN;
+    bit = (unsigned char)(1 << (index % 8));
+
+    if (marked)
+    {
+        heap->mark_bits[index / 8] |= bit;
+    }
+    else
+    {
+        heap->mark_bits[index / 8] &= (unsigned char)~bit;
+    }
+}
+
+static void
+clear_bucket_marks(struct heap_t *heap, struct heap_bucket_t *bucket)
+{
+    size_t index;
+
+    index = (size_t)(bucket - heap->bucket_base);
+    memset(heap->mark_bits + index * EVIL_MARK_BYTES_PER_BUCKET, 0, EVIL_MARK_BYTES_PER_BUCKET);
+}
+
+static void
+pin_object(struct heap_t *heap, struct evil_object_t *object)
+{
+    struct heap_bucket_t *bucket;
+
+    bucket = find_bucket(heap, object);
+
+    if (bucket != NULL)
+    {
+#if ENABLE_PARALLEL_MARKING
+        if (current_marker != NULL)
+        {
+            fetch_or_byte(&bucket->pinned, 1);
+            return;
+        }
+#endif
+        bucket->pinned = 1;
+    }
+}
+
+/*
+ * Running procedures are referred to by the VM's locals and activation
+ * records, and compiled traces embed the addresses of procedures, of their
+ * byte code and of their lexical environments, so none of them can move.
+ */
+static void
+pin_procedure(struct heap_t *heap, struct evil_object_t *procedure)
+{
+    struct evil_object_t *procedure_base;
+
+    procedure_base = VECTOR_BASE(procedure);
+    pin_object(heap, procedure);
+
+    if (procedure_base[FIELD_CODE].tag_count.tag == TAG_REFERENCE)
+    {
+        pin_object(heap, procedure_base[FIELD_CODE].value.ref);
+    }
+
+    if (procedure_base[FIELD_LEXICAL_ENVIRONMENT].tag_count.tag == TAG_REFERENCE)
+    {
+        pin_object(heap, procedure_base[FIELD_LEXICAL_ENVIRONMENT].value.ref);
+    }
+}
+
+static void
+push_grey_object(struct heap_t *heap, struct evil_object_t *object)
+{
+    if (heap->num_grey == heap->max_grey)
+    {
+        struct evil_object_t **grey;
+
+        grey = evil_aligned_alloc(sizeof(void *), 2 * heap->max_grey * sizeof(struct evil_object_t *));
+        memcpy(grey, heap->grey, heap->num_grey * sizeof(struct evil_object_t *));
+        evil_aligned_free(heap->grey);
+
+        heap->grey = grey;
+        heap->max_grey *= 2;
+    }
+
+    heap->grey[heap->num_grey++] = object;
+}
+
+static void
+trace_object(struct heap_t *heap, struct evil_object_t *object);
+
+#if ENABLE_PARALLEL_MARKING
+/*
+ * Parallel markers can find an object at the same time, so the mark is set
+ * atomically and only the marker that set it traces the object.
+ */
+static void
+shade_object_in_parallel(struct heap_t *heap, struct heap_bucket_t *bucket, struct evil_object_t *object)
+{
+    size_t index;
+    size_t bucket_index;
+    unsigned char bit;
+
+    index = (size_t)((char *)object - heap->base) / EVIL_DEFAULT_ALIGN;
+    bit = (unsigned char)(1 << (index % 8));
+
+    if (fetch_or_byte(heap->mark_bits + index / 8, bit) & bit)
+    {
+        return;
+    }
+
+    bucket_index = (size_t)(bucket - heap->bucket_base);
+    add_size(&heap->bucket_costs[bucket_index].cost, 1);
+    push_marker_object(&current_marker->deque, object);
+}
+#endif
+
+/*
+ * Marks an object and leaves it to be traced. Objects outside of the heap,
+ * like the slots of the environment and the stack, have no marks and are
+ * traced on the spot whenever they are found, as they may be gone by the
+ * time the grey objects are. The stack slots that refer to others are the
+ * saved frame pointers, which only refer further up the stack.
+ */
+static void
+shade_object(struct heap_t *heap, struct evil_object_t *object)
+{
+    struct heap_bucket_t *bucket;
+    size_t bucket_index;
+
+    if (object == NULL || object == empty_pair)
+    {
+        return;
+    }
+
+    bucket = find_bucket(heap, object);
+
+    if (bucket != NULL)
+    {
+        if (heap->collecting_nursery && !bucket->young)
+        {
+            return;
+        }
+
+#if ENABLE_PARALLEL_MARKING
+        if (current_marker != NULL)
+        {
+            shade_object_in_parallel(heap, bucket, object);
+            return;
+        }
+#endif
+
+        if (is_marked(heap, object))
+        {
+            return;
+        }
+
+        set_mark(heap, object, 1);
+
+        /*
+         * The reasoning behind the costs is described below in
+         * initialize_bucket_costs
+         */
+        bucket_index = (size_t)(bucket - heap->bucket_base);
+        assert(heap->bucket_costs[bucket_index].bucket == bucket);
+        ++heap->bucket_costs[bucket_index].cost;
+
+        push_grey_object(heap, object);
+    }
+    else
+    {
+        trace_object(heap, object);
+    }
+}
+
+/*
+ * Shades what a slot refers to.
+ */
+static void
+trace_slot(struct heap_t *heap, struct evil_object_t *slot)
+{
+    struct evil_object_t *parent;
+
+    switch (slot->tag_count.tag)
+    {
+        case TAG_REFERENCE:
+            shade_object(heap, slot->value.ref);
+            break;
+
+        case TAG_INNER_REFERENCE:
+            parent = slot->value.ref;
+
+            /*
+             * vector-ref's results point at the vector's first element
+             * rather than at the vector, and refer to the element deref
+             * finds. Any other parent is live as a whole; return addresses
+             * are inner references into a procedure whose count is a
+             * bytecode offset rather than an element index.
+             */
+            if (parent != NULL && is_value_tag(parent->tag_count.tag))
+            {
+                shade_object(heap, parent + slot->tag_count.count);
+            }
+            else
+            {
+                shade_object(heap, parent);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void
+trace_object(struct heap_t *heap, struct evil_object_t *object)
+{
+    unsigned char tag;
+
+    tag = object->tag_count.tag;
 
     switch (tag)
     {
+        case TAG_INVALID:
         case TAG_BOOLEAN:
         case TAG_SYMBOL:
         case TAG_CHAR:
@@ -456,174 +1352,1758 @@ scan_object(struct heap_t *heap, struct evil_object_t *object, unsigned char fla
         case TAG_FLONUM:
         case TAG_EXTERNAL_FUNCTION:
         case TAG_STRING:
-            return 0;
+            break;
 
         case TAG_VECTOR:
         case TAG_PAIR:
         case TAG_PROCEDURE:
         case TAG_SPECIAL_FUNCTION:
             {
-                unsigned short elements;
-                unsigned short i;
+                uint32_t elements;
+                uint32_t i;
                 struct evil_object_t *base;
 
-                elements = object->tag_count.count;
-                base = VECTOR_BASE(object);
+                elements = object->tag_count.count;
+                base = VECTOR_BASE(object);
+
+                if (tag == TAG_PROCEDURE || tag == TAG_SPECIAL_FUNCTION)
+                {
+                    pin_procedure(heap, object);
+                }
+
+                for (i = 0; i < elements; ++i)
+                {
+                    trace_slot(heap, base + i);
+                }
+            }
+            break;
+
+        case TAG_ENVIRONMENT:
+            /*
+             * TODO: Post-symbol-table-fragment refactoring, this will need
+             * attention.
+             */
+            break;
+
+        case TAG_REFERENCE:
+        case TAG_INNER_REFERENCE:
+            trace_slot(heap, object);
+            break;
+
+        default:
+            /*
+             * Unhandled object type?
+             */
+            BREAK();
+            break;
+    }
+}
+
+static void
+trace_grey_objects(struct heap_t *heap)
+{
+    while (heap->num_grey > 0)
+    {
+        trace_object(heap, heap->grey[--heap->num_grey]);
+    }
+}
+
+static void
+mark_evaluation_stack(struct heap_t *heap, struct evil_object_t *stack_ptr, struct evil_object_t *stack_top)
+{
+    struct evil_object_t *i;
+
+    for (i = stack_ptr + 1; i < stack_top; ++i)
+    {
+        trace_slot(heap, i);
+    }
+}
+
+static void
+mark_object_handles(struct heap_t *heap)
+{
+    struct dlist_t *i;
+
+    for (i = heap->active_object_handles.next; i != &heap->active_object_handles; i = i->next)
+    {
+        struct evil_object_handle_t *handle;
+
+        handle = (struct evil_object_handle_t *)i;
+        shade_object(heap, handle->object);
+    }
+}
+
+static void
+mark_stack_segments(struct heap_t *heap, struct vm_stack_segment_t *segment, struct evil_object_t *stack_ptr)
+{
+    mark_evaluation_stack(heap, stack_ptr, segment->top);
+
+    /*
+     * The live part of each earlier segment is everything above the slot
+     * the next segment returns through.
+     */
+    for (; segment->previous != NULL; segment = segment->previous)
+    {
+        mark_evaluation_stack(heap, segment->return_slot, segment->previous->top);
+    }
+}
+
+static void
+mark_fibers(struct heap_t *heap, struct vm_scheduler_t *scheduler)
+{
+    size_t i;
+
+    /*
+     * The running fiber's stack is the environment's; the others are marked
+     * from the stack pointers they were switched out with.
+     */
+    for (i = 0; i < scheduler->num_fibers; ++i)
+    {
+        struct vm_fiber_t *fiber;
+
+        fiber = scheduler->fibers[i];
+
+        if (fiber == NULL || fiber == scheduler->current)
+            continue;
+
+        if (fiber->state == VM_FIBER_DONE)
+        {
+            trace_slot(heap, &fiber->result);
+        }
+        else
+        {
+            mark_stack_segments(heap, fiber->stack_segment, fiber->sp);
+            trace_slot(heap, &fiber->procedure);
+        }
+    }
+}
+
+/*
+ * The roots are split up so that parallel markers can each start from
+ * their own part of them, see mark_in_parallel.
+ */
+enum root_partition_t
+{
+    ROOT_PARTITION_STACKS,
+    ROOT_PARTITION_HANDLES,
+    ROOT_PARTITION_GLOBALS,
+    NUM_ROOT_PARTITIONS
+};
+
+static void
+mark_root_partition(struct heap_t *heap, struct evil_environment_t *environment, enum root_partition_t partition)
+{
+    struct vm_activation_t *activation;
+
+    switch (partition)
+    {
+        case ROOT_PARTITION_STACKS:
+            mark_stack_segments(heap, environment->stack_segment, environment->stack_ptr);
+            mark_fibers(heap, environment->scheduler);
+
+            /*
+             * Frames only refer to the procedures of their callers, so
+             * nothing on the stack need refer to the one each invocation is
+             * running. Being marked, they are also pinned and don't need
+             * forwarding.
+             */
+            for (activation = environment->activation; activation != NULL; activation = activation->previous)
+            {
+                if (activation->procedure != NULL)
+                    shade_object(heap, activation->procedure);
+            }
+
+            /*
+             * A suspended invocation's frames are on the stack marked above,
+             * but the procedure it was running need not be.
+             */
+            if (environment->suspension != NULL)
+                trace_slot(heap, &environment->suspension->procedure);
+            break;
+
+        case ROOT_PARTITION_HANDLES:
+            mark_object_handles(heap);
+            break;
+
+        case ROOT_PARTITION_GLOBALS:
+            trace_slot(heap, &environment->lexical_environment);
+            break;
+
+        default:
+            BREAK();
+            break;
+    }
+}
+
+/*
+ * Shades everything the roots refer to, leaving it to be traced by
+ * trace_grey_objects.
+ */
+static void
+mark_roots(struct heap_t *heap, struct evil_environment_t *environment)
+{
+    int partition;
+
+    for (partition = 0; partition < NUM_ROOT_PARTITIONS; ++partition)
+    {
+        mark_root_partition(heap, environment, (enum root_partition_t)partition);
+    }
+}
+
+#if ENABLE_PARALLEL_MARKING
+
+#if defined(_MSC_VER)
+    static void
+    mark_mutex_create(mark_mutex_t *mutex)
+    {
+        InitializeCriticalSection(mutex);
+    }
+
+    static void
+    mark_mutex_destroy(mark_mutex_t *mutex)
+    {
+        DeleteCriticalSection(mutex);
+    }
+
+    static void
+    mark_lock(mark_mutex_t *mutex)
+    {
+        EnterCriticalSection(mutex);
+    }
+
+    static void
+    mark_unlock(mark_mutex_t *mutex)
+    {
+        LeaveCriticalSection(mutex);
+    }
+
+    static void
+    mark_condition_create(mark_condition_t *condition)
+    {
+        InitializeConditionVariable(condition);
+    }
+
+    static void
+    mark_condition_destroy(mark_condition_t *condition)
+    {
+        UNUSED(condition);
+    }
+
+    static void
+    mark_wait(mark_condition_t *condition, mark_mutex_t *mutex)
+    {
+        SleepConditionVariableCS(condition, mutex, INFINITE);
+    }
+
+    static void
+    mark_signal(mark_condition_t *condition)
+    {
+        WakeConditionVariable(condition);
+    }
+
+    static void
+    mark_broadcast(mark_condition_t *condition)
+    {
+        WakeAllConditionVariable(condition);
+    }
+
+    static void
+    mark_yield(void)
+    {
+        SwitchToThread();
+    }
+#else
+    static void
+    mark_mutex_create(mark_mutex_t *mutex)
+    {
+        pthread_mutex_init(mutex, NULL);
+    }
+
+    static void
+    mark_mutex_destroy(mark_mutex_t *mutex)
+    {
+        pthread_mutex_destroy(mutex);
+    }
+
+    static void
+    mark_lock(mark_mutex_t *mutex)
+    {
+        pthread_mutex_lock(mutex);
+    }
+
+    static void
+    mark_unlock(mark_mutex_t *mutex)
+    {
+        pthread_mutex_unlock(mutex);
+    }
+
+    static void
+    mark_condition_create(mark_condition_t *condition)
+    {
+        pthread_cond_init(condition, NULL);
+    }
+
+    static void
+    mark_condition_destroy(mark_condition_t *condition)
+    {
+        pthread_cond_destroy(condition);
+    }
+
+    static void
+    mark_wait(mark_condition_t *condition, mark_mutex_t *mutex)
+    {
+        pthread_cond_wait(condition, mutex);
+    }
+
+    static void
+    mark_signal(mark_condition_t *condition)
+    {
+        pthread_cond_signal(condition);
+    }
+
+    static void
+    mark_broadcast(mark_condition_t *condition)
+    {
+        pthread_cond_broadcast(condition);
+    }
+
+    static void
+    mark_yield(void)
+    {
+        sched_yield();
+    }
+#endif
+
+/*
+ * Steals from the other markers in turn, starting with the next one along
+ * so that thieves spread out over the deques.
+ */
+static struct evil_object_t *
+steal_grey_object(struct marker_t *marker)
+{
+    struct heap_t *heap;
+    size_t i;
+
+    heap = marker->heap;
+
+    for (i = 1; i < heap->num_markers; ++i)
+    {
+        struct evil_object_t *object;
+
+        object = steal_marker_object(&heap->markers[(marker->index + i) % heap->num_markers].deque);
+
+        if (object != NULL)
+        {
+            return object;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Idles a marker that has run out of objects to trace and to steal until
+ * another marker has some to steal again, returning 1, or all of them have
+ * run out, returning 0. Markers only push objects onto their own deques,
+ * and only go idle once their deques are empty, so once all of them are
+ * idle there is nothing left to trace.
+ */
+static int
+wait_for_grey_objects(struct marker_t *marker)
+{
+    struct heap_t *heap;
+    size_t i;
+
+    heap = marker->heap;
+    add_size(&heap->num_idle_markers, 1);
+
+    for (;;)
+    {
+        if (load_size(&heap->num_idle_markers) == heap->num_markers)
+        {
+            return 0;
+        }
+
+        for (i = 0; i < heap->num_markers; ++i)
+        {
+            struct mark_deque_t *deque;
+
+            deque = &heap->markers[i].deque;
+
+            if (load_index(&deque->top) < load_index(&deque->bottom))
+            {
+                add_size(&heap->num_idle_markers, (size_t)-1);
+                return 1;
+            }
+        }
+
+        mark_yield();
+    }
+}
+
+/*
+ * Each marker starts from its share of the root partitions and traces what
+ * it shades, stealing once it runs out.
+ */
+static void
+run_marker(struct marker_t *marker)
+{
+    struct heap_t *heap;
+    struct evil_object_t *object;
+    size_t partition;
+
+    heap = marker->heap;
+    current_marker = marker;
+
+    for (partition = marker->index; partition < NUM_ROOT_PARTITIONS; partition += heap->num_markers)
+    {
+        mark_root_partition(heap, heap->environment, (enum root_partition_t)partition);
+    }
+
+    do
+    {
+        while ((object = pop_marker_object(&marker->deque)) != NULL
+            || (object = steal_grey_object(marker)) != NULL)
+        {
+            trace_object(heap, object);
+        }
+    }
+    while (wait_for_grey_objects(marker));
+
+    current_marker = NULL;
+}
+
+static void
+marker_main(struct marker_t *marker)
+{
+    struct heap_t *heap;
+
+    heap = marker->heap;
+    mark_lock(&heap->mark_lock);
+
+    for (;;)
+    {
+        while (marker->cycle == heap->mark_cycle && !heap->markers_shutting_down)
+            mark_wait(&heap->mark_start, &heap->mark_lock);
+
+        if (heap->markers_shutting_down)
+            break;
+
+        marker->cycle = heap->mark_cycle;
+        mark_unlock(&heap->mark_lock);
+        run_marker(marker);
+        mark_lock(&heap->mark_lock);
+
+        ++heap->num_markers_done;
+        mark_signal(&heap->mark_done);
+    }
+
+    mark_unlock(&heap->mark_lock);
+}
+
+#if defined(_MSC_VER)
+    static DWORD WINAPI
+    marker_thread_main(LPVOID context)
+    {
+        marker_main(context);
+
+        return 0;
+    }
+
+    static int
+    start_marker_thread(struct marker_t *marker)
+    {
+        marker->thread = CreateThread(NULL, 0, marker_thread_main, marker, 0, NULL);
+
+        return marker->thread != NULL;
+    }
+
+    static void
+    join_marker_thread(struct marker_t *marker)
+    {
+        WaitForSingleObject(marker->thread, INFINITE);
+        CloseHandle(marker->thread);
+    }
+#else
+    static void *
+    marker_thread_main(void *context)
+    {
+        marker_main(context);
+
+        return NULL;
+    }
+
+    static int
+    start_marker_thread(struct marker_t *marker)
+    {
+        return pthread_create(&marker->thread, NULL, marker_thread_main, marker) == 0;
+    }
+
+    static void
+    join_marker_thread(struct marker_t *marker)
+    {
+        pthread_join(marker->thread, NULL);
+    }
+#endif
+
+/*
+ * Markers that fail to start are done without, down to the collecting
+ * thread's own.
+ */
+static void
+start_markers(struct heap_t *heap)
+{
+    size_t markers_size;
+    size_t i;
+
+    markers_size = (heap->mark_threads + 1) * sizeof(struct marker_t);
+    heap->markers = evil_aligned_alloc(sizeof(void *), markers_size);
+    memset(heap->markers, 0, markers_size);
+
+    mark_mutex_create(&heap->mark_lock);
+    mark_condition_create(&heap->mark_start);
+    mark_condition_create(&heap->mark_done);
+    heap->markers_shutting_down = 0;
+
+    for (i = 0; i <= heap->mark_threads; ++i)
+    {
+        heap->markers[i].heap = heap;
+        heap->markers[i].index = i;
+        heap->markers[i].cycle = heap->mark_cycle;
+        heap->markers[i].deque.array = create_mark_array(EVIL_INITIAL_GREY_OBJECTS);
+    }
+
+    mark_lock(&heap->mark_lock);
+
+    for (heap->num_markers = 1; heap->num_markers <= heap->mark_threads; ++heap->num_markers)
+    {
+        if (!start_marker_thread(&heap->markers[heap->num_markers]))
+            break;
+    }
+
+    mark_unlock(&heap->mark_lock);
+}
+
+static void
+stop_markers(struct heap_t *heap)
+{
+    size_t i;
+
+    if (heap->markers == NULL)
+    {
+        return;
+    }
+
+    mark_lock(&heap->mark_lock);
+    heap->markers_shutting_down = 1;
+    mark_broadcast(&heap->mark_start);
+    mark_unlock(&heap->mark_lock);
+
+    for (i = 1; i < heap->num_markers; ++i)
+    {
+        join_marker_thread(&heap->markers[i]);
+    }
+
+    mark_condition_destroy(&heap->mark_done);
+    mark_condition_destroy(&heap->mark_start);
+    mark_mutex_destroy(&heap->mark_lock);
+
+    for (i = 0; i <= heap->mark_threads; ++i)
+    {
+        destroy_mark_arrays(heap->markers[i].deque.array);
+    }
+
+    evil_aligned_free(heap->markers);
+    heap->markers = NULL;
+    heap->num_markers = 0;
+}
+
+static void
+mark_in_parallel(struct heap_t *heap)
+{
+    size_t i;
+
+    heap->num_idle_markers = 0;
+
+    mark_lock(&heap->mark_lock);
+    ++heap->mark_cycle;
+    heap->num_markers_done = 0;
+    mark_broadcast(&heap->mark_start);
+    mark_unlock(&heap->mark_lock);
+
+    run_marker(heap->markers);
+
+    mark_lock(&heap->mark_lock);
+
+    while (heap->num_markers_done < heap->num_markers - 1)
+        mark_wait(&heap->mark_done, &heap->mark_lock);
+
+    mark_unlock(&heap->mark_lock);
+
+    /*
+     * No one can be reading the arrays the deques outgrew any more.
+     */
+    for (i = 0; i < heap->num_markers; ++i)
+    {
+        destroy_mark_arrays(heap->markers[i].deque.array->previous);
+        heap->markers[i].deque.array->previous = NULL;
+    }
+}
+#endif
+
+/*
+ * Marks everything the roots lead to, with the heap's mark threads if it
+ * has any.
+ */
+static void
+mark_heap(struct heap_t *heap, struct evil_environment_t *environment)
+{
+#if ENABLE_PARALLEL_MARKING
+    if (heap->mark_threads > 0)
+    {
+        if (heap->markers == NULL)
+        {
+            start_markers(heap);
+        }
+
+        if (heap->num_markers > 1)
+        {
+            mark_in_parallel(heap);
+            return;
+        }
+    }
+#endif
+
+    mark_roots(heap, environment);
+    trace_grey_objects(heap);
+}
+
+void
+evil_set_gc_mark_threads(struct evil_environment_t *environment, size_t count)
+{
+#if ENABLE_PARALLEL_MARKING
+    struct heap_t *heap;
+
+    heap = environment->heap;
+
+    if (count != heap->mark_threads)
+    {
+        stop_markers(heap);
+        heap->mark_threads = count;
+    }
+#else
+    UNUSED(environment);
+    UNUSED(count);
+#endif
+}
+
+static void
+initialize_bucket_costs(struct heap_t *heap)
+{
+    size_t i;
+    size_t num_buckets;
+    struct heap_bucket_t *bucket_base;
+    struct bucket_cost_t *costs;
+
+    /*
+     * Bucket costs are determined by the number of in-references to all 
+     * objects in the bucket. More expensive buckets will have more live
+     * objects and more references into the bucket.
+     *
+     * That said, all references across the whole system will have to be 
+     * updated if *any* bucket is compacted so it doesn't do a lot to alleviate
+     * that pain. It does however allow us to see which buckets are definitely
+     * empty and which buckets may cost a lot to compact.
+     */
+
+    bucket_base = heap->bucket_base;
+    costs = heap->bucket_costs;
+    for (i = 0, num_buckets = heap->num_buckets; i < num_buckets; ++i)
+    {
+        /*
+         * The bucket pointer is inserted into the cost structure so that we
+         * can know which bucket we are referring to after the cost array is
+         * sorted.
+         */
+        costs[i].bucket = bucket_base + i;
+
+        /*
+         * Initial cost is set to zero so that if a bucket is not referenced
+         * at all then we can assume it is completely dead and can be trivially
+         * reclaimed.
+         */
+        costs[i].cost = INITIAL_COST;
+
+        bucket_base[i].pinned = 0;
+        bucket_base[i].evacuated = 0;
+    }
+}
+
+static void
+reclaim_bucket(struct heap_t *heap, struct heap_bucket_t *bucket)
+{
+    bucket->ptr = bucket->base;
+    bucket->free = 1;
+    bucket->link.next = &heap->free_list->link;
+    heap->free_list = bucket;
+    ++heap->num_free;
+}
+
+/*
+ * Objects can be marked through pointers to their elements alone, which
+ * only counts against the buckets the elements are in, so a run is live if
+ * any of its buckets is. The costs have to be in bucket order.
+ */
+static int
+is_run_live(struct heap_t *heap, struct heap_bucket_t *run)
+{
+    size_t i;
+    size_t k;
+
+    i = (size_t)(run - heap->bucket_base);
+
+    for (k = 0; k < run->run_length; ++k)
+    {
+        if (heap->bucket_costs[i + k].cost != INITIAL_COST)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static size_t
+reclaim_run(struct heap_t *heap, struct heap_bucket_t *run)
+{
+    size_t k;
+    size_t run_length;
+
+    run_length = run->run_length;
+
+    for (k = run_length; k-- > 0; )
+    {
+        run[k].run = NULL;
+        run[k].run_length = 0;
+        run[k].top = run[k].base + EVIL_PAGE_SIZE;
+        reclaim_bucket(heap, run + k);
+    }
+
+    return run_length;
+}
+
+static size_t
+reclaim_empty_buckets(struct heap_t *heap)
+{
+    size_t i;
+    size_t num_reclaimed;
+    struct bucket_cost_t *costs;
+    struct heap_bucket_t *run;
+
+    num_reclaimed = 0;
+    costs = heap->bucket_costs;
+
+    /*
+     * Buckets are freed from the top of the heap down so that the free list
+     * hands out the lowest ones first, leaving the top for runs.
+     */
+    for (i = heap->num_buckets; i-- > 0; )
+    {
+        struct heap_bucket_t *bucket;
+
+        bucket = costs[i].bucket;
+
+        /*
+         * Runs are reclaimed whole, and their other buckets skipped over.
+         */
+        if (bucket->run != NULL)
+        {
+            run = bucket->run;
+
+            if (!is_run_live(heap, run))
+            {
+                num_reclaimed += reclaim_run(heap, run);
+            }
+
+            i = (size_t)(run - heap->bucket_base);
+            continue;
+        }
+
+        if (costs[i].cost == INITIAL_COST && bucket != heap->reserve)
+        {
+            reclaim_bucket(heap, bucket);
+            ++num_reclaimed;
+        }
+    }
+
+    return num_reclaimed;
+}
+
+static int
+is_vector_tag(unsigned char tag)
+{
+    return tag == TAG_VECTOR || tag == TAG_PAIR || tag == TAG_PROCEDURE || tag == TAG_SPECIAL_FUNCTION;
+}
+
+/*
+ * The space an object takes up in its bucket, which is what was asked of
+ * perform_alloc rounded the same way.
+ */
+static size_t
+object_size(struct evil_object_t *object)
+{
+    size_t size;
+    unsigned char tag;
+
+    tag = object->tag_count.tag;
+
+    if (is_vector_tag(tag))
+    {
+        size = offsetof(struct evil_object_t, value) + object->tag_count.count * sizeof(struct evil_object_t);
+    }
+    else if (tag == TAG_STRING)
+    {
+        size = sizeof(struct evil_object_t) + object->tag_count.count;
+    }
+    else
+    {
+        size = sizeof(struct evil_object_t);
+    }
+
+    return (size + EVIL_DEFAULT_ALIGN_MASK) & (~EVIL_DEFAULT_ALIGN_MASK);
+}
+
+/*
+ * Marking also marks the elements of vectors, and an element can be live
+ * without the vector holding it being marked when it is only referred to
+ * through a pointer to the element, like a binding's location.
+ */
+static int
+is_live_object(struct heap_t *heap, struct evil_object_t *object)
+{
+    uint32_t i;
+
+    if (is_marked(heap, object))
+    {
+        return 1;
+    }
+
+    if (is_vector_tag(object->tag_count.tag))
+    {
+        for (i = 0; i < object->tag_count.count; ++i)
+        {
+            if (is_marked(heap, VECTOR_BASE(object) + i))
+            {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * An evacuated object takes its marks along. Those of whatever was in the
+ * to-space before are overwritten.
+ */
+static void
+move_marks(struct heap_t *heap, char *from, char *to, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i += EVIL_DEFAULT_ALIGN)
+    {
+        set_mark(heap, to + i, is_marked(heap, from + i));
+    }
+}
+
+static int
+compare_bucket_costs(const void *a, const void *b)
+{
+    size_t cost_a;
+    size_t cost_b;
+
+    cost_a = ((const struct bucket_cost_t *)a)->cost;
+    cost_b = ((const struct bucket_cost_t *)b)->cost;
+
+    return (cost_a > cost_b) - (cost_a < cost_b);
+}
+
+static int
+compare_forwarding_entries(const void *a, const void *b)
+{
+    const char *from_a;
+    const char *from_b;
+
+    from_a = ((const struct forwarding_entry_t *)a)->from;
+    from_b = ((const struct forwarding_entry_t *)b)->from;
+
+    return (from_a > from_b) - (from_a < from_b);
+}
+
+/*
+ * The to-space starts out as the reserve bucket. Buckets join it once they
+ * have been evacuated, in the order they were evacuated in, so each bucket
+ * emptied makes room for the next.
+ */
+struct to_space_t
+{
+    struct heap_bucket_t *bucket;
+    char *ptr;
+    struct heap_bucket_t *next;
+    struct heap_bucket_t *last;
+};
+
+static char *
+to_space_alloc(struct to_space_t *to_space, size_t size)
+{
+    char *mem;
+
+    if (to_space->bucket->top - to_space->ptr < (ptrdiff_t)size)
+    {
+        if (to_space->next == NULL)
+        {
+            return NULL;
+        }
+
+        to_space->bucket = to_space->next;
+        to_space->ptr = to_space->bucket->base;
+        to_space->next = (to_space->bucket == to_space->last) ? NULL : (struct heap_bucket_t *)to_space->bucket->link.next;
+    }
+
+    mem = to_space->ptr;
+    to_space->ptr += size;
+
+    return mem;
+}
+
+/*
+ * Moves the live objects out of the bucket, recording where each went in
+ * the forwarding table, if they all fit in the to-space and the table.
+ */
+static int
+evacuate_bucket(struct heap_t *heap, struct heap_bucket_t *bucket, struct to_space_t *to_space)
+{
+    struct to_space_t trial;
+    size_t num_live;
+    size_t size;
+    char *i;
+
+    trial = *to_space;
+    num_live = 0;
+
+    for (i = bucket->base; i < bucket->ptr; i += size)
+    {
+        size = object_size((struct evil_object_t *)i);
+
+        if (!is_live_object(heap, (struct evil_object_t *)i))
+        {
+            continue;
+        }
+
+        if (to_space_alloc(&trial, size) == NULL)
+        {
+            return 0;
+        }
+
+        ++num_live;
+    }
+
+    assert(i == bucket->ptr);
+
+    if (heap->num_forwarding + num_live > heap->max_forwarding)
+    {
+        return 0;
+    }
+
+    for (i = bucket->base; i < bucket->ptr; i += size)
+    {
+        struct forwarding_entry_t *entry;
+        struct heap_bucket_t *previous_bucket;
+        char *previous_ptr;
+
+        size = object_size((struct evil_object_t *)i);
+
+        if (!is_live_object(heap, (struct evil_object_t *)i))
+        {
+            continue;
+        }
+
+        previous_bucket = to_space->bucket;
+        previous_ptr = to_space->ptr;
+
+        entry = &heap->forwarding[heap->num_forwarding++];
+        entry->from = i;
+        entry->to = to_space_alloc(to_space, size);
+        entry->size = size;
+
+        if (to_space->bucket != previous_bucket)
+        {
+            previous_bucket->ptr = previous_ptr;
+        }
+
+        memcpy(entry->to, entry->from, size);
+        move_marks(heap, entry->from, entry->to, size);
+    }
+
+    bucket->evacuated = 1;
+
+    /*
+     * Nothing refers to the evacuated bucket's old contents any more so it
+     * can be reused as to-space.
+     */
+    if (to_space->next == NULL)
+    {
+        to_space->next = bucket;
+    }
+    else
+    {
+        to_space->last->link.next = &bucket->link;
+    }
+
+    to_space->last = bucket;
+
+    return 1;
+}
+
+/*
+ * Evacuates the cheapest buckets that aren't pinned, cheap ones being those
+ * with the fewest live objects, and returns the number of buckets freed.
+ */
+static size_t
+evacuate_buckets(struct heap_t *heap)
+{
+    size_t i;
+    size_t num_buckets;
+    size_t num_freed;
+    struct bucket_cost_t *costs;
+    struct heap_bucket_t *bucket;
+    struct to_space_t to_space;
+
+    costs = heap->bucket_costs;
+    num_buckets = heap->num_buckets;
+    qsort(costs, num_buckets, sizeof(struct bucket_cost_t), compare_bucket_costs);
+
+    to_space.bucket = heap->reserve;
+    to_space.ptr = heap->reserve->base;
+    to_space.next = NULL;
+    to_space.last = NULL;
+    heap->num_forwarding = 0;
+
+    for (i = 0; i < num_buckets; ++i)
+    {
+        bucket = costs[i].bucket;
+
+        if (costs[i].cost == INITIAL_COST || bucket->pinned || bucket->run != NULL || bucket == heap->reserve)
+        {
+            continue;
+        }
+
+        evacuate_bucket(heap, bucket, &to_space);
+    }
+
+    qsort(heap->forwarding, heap->num_forwarding, sizeof(struct forwarding_entry_t), compare_forwarding_entries);
+
+    /*
+     * Buckets the to-space never got to are free, the rest of it is live. A
+     * reserve that was used is replaced by gc_collect.
+     */
+    to_space.bucket->ptr = to_space.ptr;
+    num_freed = 0;
+
+    if (heap->reserve->ptr != heap->reserve->base)
+    {
+        heap->reserve = NULL;
+    }
+
+    while (to_space.next != NULL)
+    {
+        bucket = to_space.next;
+        to_space.next = (bucket == to_space.last) ? NULL : (struct heap_bucket_t *)bucket->link.next;
+        bucket->ptr = bucket->base;
+
+        reclaim_bucket(heap, bucket);
+        ++num_freed;
+    }
+
+    return num_freed;
+}
+
+static struct evil_object_t *
+forward_pointer(struct heap_t *heap, struct evil_object_t *object)
+{
+    struct heap_bucket_t *bucket;
+    struct forwarding_entry_t *entry;
+    char *address;
+    size_t low;
+    size_t high;
+
+    bucket = find_bucket(heap, object);
+
+    if (bucket == NULL || !bucket->evacuated)
+    {
+        return object;
+    }
+
+    /*
+     * Pointers can point inside of moved objects so the entry wanted is the
+     * last one that starts at or before the address.
+     */
+    address = (char *)object;
+    low = 0;
+    high = heap->num_forwarding;
+
+    while (low < high)
+    {
+        size_t mid;
+
+        mid = low + (high - low) / 2;
+
+        if (heap->forwarding[mid].from <= address)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    if (low == 0)
+    {
+        return object;
+    }
+
+    entry = &heap->forwarding[low - 1];
+
+    if (address >= entry->from + entry->size)
+    {
+        return object;
+    }
+
+    return (struct evil_object_t *)(entry->to + (address - entry->from));
+}
+
+static void
+forward_slot(struct heap_t *heap, struct evil_object_t *slot)
+{
+    unsigned char tag;
+
+    tag = slot->tag_count.tag;
+
+    if ((tag == TAG_REFERENCE || tag == TAG_INNER_REFERENCE) && slot->value.ref != NULL)
+    {
+        slot->value.ref = forward_pointer(heap, slot->value.ref);
+    }
+}
+
+/*
+ * Every object left in the heap is updated, live or not, as walking the
+ * buckets is cheaper than tracing the live ones again.
+ */
+static void
+forward_heap_objects(struct heap_t *heap)
+{
+    size_t i;
+    size_t num_buckets;
+    struct heap_bucket_t *bucket;
+
+    for (i = 0, num_buckets = heap->num_buckets; i < num_buckets; ++i)
+    {
+        char *j;
+        size_t size;
+
+        bucket = heap->bucket_base + i;
+
+        for (j = bucket->base; j < bucket->ptr; j += size)
+        {
+            struct evil_object_t *object;
+
+            object = (struct evil_object_t *)j;
+            size = object_size(object);
+
+            if (is_vector_tag(object->tag_count.tag))
+            {
+                uint32_t k;
+
+                for (k = 0; k < object->tag_count.count; ++k)
+                {
+                    forward_slot(heap, VECTOR_BASE(object) + k);
+                }
+            }
+            else
+            {
+                forward_slot(heap, object);
+            }
+        }
+    }
+}
+
+static void
+forward_evaluation_stack(struct heap_t *heap, struct evil_object_t *stack_ptr, struct evil_object_t *stack_top)
+{
+    struct evil_object_t *i;
+
+    for (i = stack_ptr + 1; i < stack_top; ++i)
+    {
+        forward_slot(heap, i);
+    }
+}
+
+static void
+forward_stack_segments(struct heap_t *heap, struct vm_stack_segment_t *segment, struct evil_object_t *stack_ptr)
+{
+    forward_evaluation_stack(heap, stack_ptr, segment->top);
+
+    for (; segment->previous != NULL; segment = segment->previous)
+    {
+        forward_evaluation_stack(heap, segment->return_slot, segment->previous->top);
+    }
+}
+
+/*
+ * The same roots as mark_roots.
+ */
+static void
+forward_roots(struct heap_t *heap, struct evil_environment_t *environment)
+{
+    struct vm_scheduler_t *scheduler;
+    struct dlist_t *i;
+    size_t j;
+
+    forward_stack_segments(heap, environment->stack_segment, environment->stack_ptr);
+
+    scheduler = environment->scheduler;
+
+    for (j = 0; j < scheduler->num_fibers; ++j)
+    {
+        struct vm_fiber_t *fiber;
+
+        fiber = scheduler->fibers[j];
+
+        if (fiber == NULL || fiber == scheduler->current)
+            continue;
+
+        if (fiber->state == VM_FIBER_DONE)
+        {
+            forward_slot(heap, &fiber->result);
+        }
+        else
+        {
+            forward_stack_segments(heap, fiber->stack_segment, fiber->sp);
+            forward_slot(heap, &fiber->procedure);
+        }
+    }
+
+    if (environment->suspension != NULL)
+        forward_slot(heap, &environment->suspension->procedure);
+
+    forward_slot(heap, &environment->lexical_environment);
+
+    for (i = heap->active_object_handles.next; i != &heap->active_object_handles; i = i->next)
+    {
+        struct evil_object_handle_t *handle;
+
+        handle = (struct evil_object_handle_t *)i;
+        handle->object = forward_pointer(heap, handle->object);
+    }
+}
+
+static int
+is_card_dirty(struct heap_t *heap, void *ptr)
+{
+    return heap->card_base[(size_t)((char *)ptr - heap->base) / EVIL_CARD_SIZE];
+}
+
+/*
+ * References from old objects to young ones are all on dirty cards, so the
+ * slots of old objects on those cards are roots of a nursery collection.
+ */
+static void
+mark_dirty_cards(struct heap_t *heap)
+{
+    size_t i;
+    size_t num_buckets;
+
+    for (i = 0, num_buckets = heap->num_buckets; i < num_buckets; ++i)
+    {
+        struct heap_bucket_t *bucket;
+        unsigned char *cards;
+        char *j;
+        size_t size;
+
+        bucket = heap->bucket_base + i;
+        cards = heap->card_base + i * EVIL_CARDS_PER_BUCKET;
+
+        /*
+         * A large object's slots are on the cards of its whole run, the
+         * rest of which is empty.
+         */
+        if (bucket->young || memchr(cards, 1, EVIL_CARDS_PER_BUCKET * (bucket->run == bucket ? bucket->run_length : 1)) == NULL)
+        {
+            continue;
+        }
+
+        for (j = bucket->base; j < bucket->ptr; j += size)
+        {
+            struct evil_object_t *object;
+
+            object = (struct evil_object_t *)j;
+            size = object_size(object);
+
+            if (is_vector_tag(object->tag_count.tag))
+            {
+                uint32_t k;
+
+                for (k = 0; k < object->tag_count.count; ++k)
+                {
+                    if (is_card_dirty(heap, VECTOR_BASE(object) + k))
+                    {
+                        trace_slot(heap, VECTOR_BASE(object) + k);
+                    }
+                }
+            }
+            else if (is_card_dirty(heap, object))
+            {
+                trace_slot(heap, object);
+            }
+        }
+    }
+}
+
+static void
+reclaim_young_buckets(struct heap_t *heap)
+{
+    size_t i;
+    struct bucket_cost_t *costs;
+    struct heap_bucket_t *run;
+
+    costs = heap->bucket_costs;
+
+    /*
+     * In the same order as reclaim_empty_buckets.
+     */
+    for (i = heap->num_buckets; i-- > 0; )
+    {
+        struct heap_bucket_t *bucket;
+
+        bucket = costs[i].bucket;
+
+        if (!bucket->young)
+        {
+            continue;
+        }
+
+        if (bucket->run != NULL)
+        {
+            run = bucket->run;
+
+            if (!is_run_live(heap, run))
+            {
+                reclaim_run(heap, run);
+            }
+
+            i = (size_t)(run - heap->bucket_base);
+        }
+        else if (costs[i].cost == INITIAL_COST)
+        {
+            reclaim_bucket(heap, bucket);
+        }
+    }
+}
+
+static void
+clear_dead_slot(struct evil_object_t *slot)
+{
+    unsigned char tag;
 
-                for (i = 0; i < elements; ++i)
-                {
-                    scan_object(heap, base + i, flag);
-                }
+    tag = slot->tag_count.tag;
 
-                return 1;
-            }
-            break;
+    if (tag == TAG_REFERENCE || tag == TAG_INNER_REFERENCE)
+    {
+        slot->value.ref = NULL;
+    }
+}
 
-        case TAG_ENVIRONMENT:
-            /*
-             * TODO: Post-symbol-table-fragment refactoring, this will need
-             * attention.
-             */
-            break;
+/*
+ * Dead objects left behind in buckets that survive a collection may refer
+ * to objects that were reclaimed, and may share a card with a live object
+ * that a later nursery collection scans. Their references are cleared so
+ * that the scan doesn't follow them.
+ */
+static void
+clear_dead_references_in_bucket(struct heap_t *heap, struct heap_bucket_t *bucket)
+{
+    char *i;
+    size_t size;
 
-        case TAG_REFERENCE:
-            scan_object(heap, object->value.ref, flag);
-            return 0;
+    for (i = bucket->base; i < bucket->ptr; i += size)
+    {
+        struct evil_object_t *object;
 
-        case TAG_INNER_REFERENCE:
-            {
-                struct evil_object_t *parent;
+        object = (struct evil_object_t *)i;
+        size = object_size(object);
 
-                parent = object->value.ref;
+        if (is_marked(heap, object))
+        {
+            continue;
+        }
 
-                if (scan_object(heap, parent, flag))
-                {
-                    struct evil_object_t *base;
+        if (is_vector_tag(object->tag_count.tag))
+        {
+            uint32_t k;
 
-                    base = VECTOR_BASE(parent);
-                    scan_object(heap, base + object->tag_count.count, flag);
+            for (k = 0; k < object->tag_count.count; ++k)
+            {
+                if (!is_marked(heap, VECTOR_BASE(object) + k))
+                {
+                    clear_dead_slot(VECTOR_BASE(object) + k);
                 }
             }
-            return 0;
-
-        default:
-            /*
-             * Unhandled object type?
-             */
-            BREAK();
-            break;
+        }
+        else
+        {
+            clear_dead_slot(object);
+        }
     }
-
-    return 0;
 }
 
 static void
-mark_evaluation_stack(struct heap_t *heap, struct evil_object_t *stack_ptr, struct evil_object_t *stack_top, unsigned char flag)
+clear_dead_references(struct heap_t *heap, int young_only)
 {
-    struct evil_object_t *i;
+    size_t i;
+    size_t num_buckets;
 
-    for (i = stack_ptr + 1; i < stack_top; ++i)
+    for (i = 0, num_buckets = heap->num_buckets; i < num_buckets; ++i)
     {
-        scan_object(heap, i, flag);
+        struct heap_bucket_t *bucket;
+
+        bucket = heap->bucket_base + i;
+
+        if (young_only && !bucket->young)
+        {
+            continue;
+        }
+
+        clear_dead_references_in_bucket(heap, bucket);
     }
 }
 
+/*
+ * Whatever survives a collection is old. The cards are cleaned but for
+ * those of objects kept by handles, as their holders may store references
+ * to younger objects in them without reporting it.
+ */
 static void
-mark_object_handles(struct heap_t *heap, unsigned char flag)
+promote_survivors(struct heap_t *heap)
 {
-    struct dlist_t *i;
+    size_t i;
+    struct dlist_t *j;
 
-    for (i = heap->active_object_handles.next; i != &heap->active_object_handles; i = i->next)
+    for (i = 0; i < heap->num_buckets; ++i)
     {
-        struct evil_object_handle_t *handle;
+        heap->bucket_base[i].young = 0;
+    }
 
-        handle = (struct evil_object_handle_t *)i;
-        scan_object(heap, handle->object, flag);
+    heap->num_young = 0;
+    memset(heap->card_base, 0, heap->num_cards);
+
+    for (j = heap->active_object_handles.next; j != &heap->active_object_handles; j = j->next)
+    {
+        struct evil_object_t *object;
+        size_t first;
+        size_t last;
+
+        object = ((struct evil_object_handle_t *)j)->object;
+
+        if (find_bucket(heap, object) == NULL)
+        {
+            continue;
+        }
+
+        first = (size_t)((char *)object - heap->base) / EVIL_CARD_SIZE;
+        last = (size_t)((char *)object + object_size(object) - 1 - heap->base) / EVIL_CARD_SIZE;
+        memset(heap->card_base + first, 1, last - first + 1);
+    }
+
+    heap->full_collection_pending = heap->evacuation_inhibited > 0;
+}
+
+void
+gc_collect_nursery(struct heap_t *heap)
+{
+    struct evil_environment_t *environment;
+    size_t i;
+
+    environment = heap->environment;
+    assert(environment != NULL);
+    assert(heap->phase == GC_PHASE_IDLE);
+
+    /*
+     * Stores made while evacuation is inhibited aren't reported.
+     */
+    if (!ENABLE_GENERATIONAL_GC || heap->evacuation_inhibited > 0 || heap->full_collection_pending)
+    {
+        gc_collect(heap);
+        return;
+    }
+
+    initialize_bucket_costs(heap);
+
+    heap->collecting_nursery = 1;
+    mark_roots(heap, environment);
+    mark_dirty_cards(heap);
+    trace_grey_objects(heap);
+    heap->collecting_nursery = 0;
+
+    /*
+     * Young buckets with anything live in them are promoted whole. Only
+     * young objects were marked, so only their marks need clearing.
+     */
+    reclaim_young_buckets(heap);
+    clear_dead_references(heap, 1);
+
+    for (i = 0; i < heap->num_buckets; ++i)
+    {
+        if (heap->bucket_base[i].young)
+        {
+            clear_bucket_marks(heap, heap->bucket_base + i);
+        }
+    }
+
+    promote_survivors(heap);
+    ++environment->binding_epoch;
+
+    heap->current_bucket = acquire_bucket(heap);
+
+    if (heap->current_bucket == NULL)
+    {
+        gc_collect(heap);
     }
 }
 
+static uint64_t
+read_clock_microseconds(void)
+{
+#if defined(_MSC_VER)
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000
+        + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / (uint64_t)frequency.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+#endif
+}
+
+/*
+ * Incremental collections start once fewer buckets are free than the
+ * nursery takes up, so that the marking has as long as it takes to fill
+ * them to finish in. Until the collection is done the nursery isn't
+ * collected on its own.
+ */
 static void
-mark_roots(struct heap_t *heap, struct evil_environment_t *environment, unsigned char flag)
+consider_incremental_collection(struct heap_t *heap)
 {
-    mark_evaluation_stack(heap, environment->stack_ptr, environment->stack_top, flag);
-    scan_object(heap, &environment->lexical_environment, flag);
-    mark_object_handles(heap, flag);
+    if (!ENABLE_INCREMENTAL_GC
+        || heap->phase != GC_PHASE_IDLE
+        || heap->pause_budget == 0
+        || heap->evacuation_inhibited > 0
+        || heap->incremental_stalled
+        || heap->num_free >= heap->nursery_size)
+    {
+        return;
+    }
+
+    initialize_bucket_costs(heap);
+    heap->phase = GC_PHASE_MARKING;
+    mark_roots(heap, heap->environment);
 }
 
+/*
+ * Drops an incremental collection part way through, for a collection of
+ * the whole heap to take its place.
+ */
 static void
-initialize_bucket_costs(struct heap_t *heap)
+abandon_incremental_collection(struct heap_t *heap)
 {
     size_t i;
-    size_t num_buckets;
-    struct heap_bucket_t *bucket_base;
-    struct bucket_cost_t *costs;
 
-    /*
-     * Bucket costs are determined by the number of in-references to all 
-     * objects in the bucket. More expensive buckets will have more live
-     * objects and more references into the bucket.
-     *
-     * That said, all references across the whole system will have to be 
-     * updated if *any* bucket is compacted so it doesn't do a lot to alleviate
-     * that pain. It does however allow us to see which buckets are definitely
-     * empty and which buckets may cost a lot to compact.
-     */
+    memset(heap->mark_bits, 0, heap->num_buckets * EVIL_MARK_BYTES_PER_BUCKET);
+    heap->num_grey = 0;
 
-    bucket_base = heap->bucket_base;
-    costs = heap->bucket_costs;
-    for (i = 0, num_buckets = heap->num_buckets; i < num_buckets; ++i)
+    for (i = 0; i < heap->num_buckets; ++i)
     {
-        /*
-         * The bucket pointer is inserted into the cost structure so that we
-         * can know which bucket we are referring to after the cost array is
-         * sorted.
-         */
-        costs[i].bucket = bucket_base + i;
+        heap->bucket_base[i].unswept = 0;
+    }
 
-        /*
-         * Initial cost is set to zero so that if a bucket is not referenced
-         * at all then we can assume it is completely dead and can be trivially
-         * reclaimed.
-         */
-        costs[i].cost = INITIAL_COST;
+    heap->phase = GC_PHASE_IDLE;
+}
+
+/*
+ * Returns whether the grey objects ran out before the deadline.
+ */
+static int
+trace_grey_objects_until(struct heap_t *heap, uint64_t deadline)
+{
+    size_t num_traced;
+
+    for (num_traced = 1; heap->num_grey > 0; ++num_traced)
+    {
+        trace_object(heap, heap->grey[--heap->num_grey]);
+
+        if (num_traced % EVIL_GREY_OBJECTS_PER_CLOCK_CHECK == 0 && read_clock_microseconds() >= deadline)
+        {
+            return heap->num_grey == 0;
+        }
     }
+
+    return 1;
 }
 
+/*
+ * Clears the dead objects of the buckets that survived the marking, and
+ * their marks, until the deadline.
+ */
 static void
-reclaim_bucket(struct heap_t *heap, struct heap_bucket_t *bucket)
+sweep_buckets(struct heap_t *heap, uint64_t deadline)
 {
-    bucket->ptr = bucket->base;
-    bucket->link.next = &heap->free_list->link;
-    heap->free_list = bucket;
+    struct heap_bucket_t *bucket;
+    size_t k;
+
+    while (heap->sweep_cursor < heap->num_buckets)
+    {
+        bucket = heap->bucket_base + heap->sweep_cursor++;
+
+        if (!bucket->unswept)
+        {
+            continue;
+        }
+
+#if ENABLE_GENERATIONAL_GC
+        clear_dead_references_in_bucket(heap, bucket);
+#endif
+
+        for (k = 0; k < (bucket->run == bucket ? bucket->run_length : 1); ++k)
+        {
+            clear_bucket_marks(heap, bucket + k);
+        }
+
+        bucket->unswept = 0;
+
+        if (read_clock_microseconds() >= deadline)
+        {
+            return;
+        }
+    }
+
+    heap->phase = GC_PHASE_IDLE;
 }
 
-static size_t
-reclaim_empty_buckets(struct heap_t *heap)
+/*
+ * The last pause of an incremental collection's marking. The roots aren't
+ * covered by the write barrier so they are marked again, as are the slots
+ * of objects kept by handles, whose holders don't report their stores.
+ * Objects allocated during the marking are only live if they are found
+ * now. The empty buckets are reclaimed, and the rest left to be swept.
+ */
+static void
+finish_marking(struct heap_t *heap)
 {
-    size_t i;
-    size_t num_buckets;
-    size_t num_reclaimed;
-    struct bucket_cost_t *costs;
+    struct dlist_t *i;
+    size_t j;
 
-    num_reclaimed = 0;
-    costs = heap->bucket_costs;
-    for (i = 0, num_buckets = heap->num_buckets; i < num_buckets; ++i)
+    mark_roots(heap, heap->environment);
+
+    for (i = heap->active_object_handles.next; i != &heap->active_object_handles; i = i->next)
     {
-        struct heap_bucket_t *bucket;
+        struct evil_object_t *object;
 
-        bucket = costs[i].bucket;
-        if (costs[i].cost == INITIAL_COST)
+        object = ((struct evil_object_handle_t *)i)->object;
+
+        if (object != NULL)
         {
-            reclaim_bucket(heap, bucket);
-            ++num_reclaimed;
+            trace_object(heap, object);
         }
     }
 
-    return num_reclaimed;
+    trace_grey_objects(heap);
+
+    heap->free_list = NULL;
+    heap->num_free = 0;
+    reclaim_empty_buckets(heap);
+
+    /*
+     * Incremental collections can't compact the heap. One that leaves it
+     * as short of buckets as it started leaves the next collection to a
+     * compacting one.
+     */
+    heap->incremental_stalled = heap->num_free < heap->nursery_size;
+
+    for (j = 0; j < heap->num_buckets; ++j)
+    {
+        struct heap_bucket_t *bucket;
+
+        bucket = heap->bucket_base + j;
+        bucket->unswept = !bucket->free && bucket != heap->reserve && (bucket->run == NULL || bucket->run == bucket);
+    }
+
+    heap->phase = GC_PHASE_SWEEPING;
+    heap->sweep_cursor = 0;
+
+    ++heap->environment->binding_epoch;
+    promote_survivors(heap);
+
+    /*
+     * Nothing is allocated from the buckets left to sweep, as the new
+     * objects would be unmarked.
+     */
+    if (acquire_bucket(heap) == NULL)
+    {
+        sweep_buckets(heap, UINT64_MAX);
+    }
+}
+
+static void
+step_incremental_collection(struct heap_t *heap)
+{
+    uint64_t deadline;
+
+    deadline = read_clock_microseconds() + heap->pause_budget;
+
+    if (heap->phase == GC_PHASE_MARKING)
+    {
+        if (trace_grey_objects_until(heap, deadline))
+        {
+            finish_marking(heap);
+        }
+    }
+    else if (heap->phase == GC_PHASE_SWEEPING)
+    {
+        sweep_buckets(heap, deadline);
+    }
 }
 
 void
-gc_collect(struct heap_t *heap)
+evil_set_gc_pause_budget(struct evil_environment_t *environment, uint64_t microseconds)
+{
+    environment->heap->pause_budget = microseconds;
+}
+
+/*
+ * Compacting collections evacuate buckets even when there are empty ones
+ * to reclaim, which large allocations need when the free buckets are too
+ * scattered to make a run of.
+ */
+static void
+collect_heap(struct heap_t *heap, int compact)
 {
     struct evil_environment_t *environment;
     size_t num_reclaimed;
@@ -631,16 +3111,68 @@ gc_collect(struct heap_t *heap)
     environment = heap->environment;
     assert(environment != NULL);
 
+    if (heap->phase != GC_PHASE_IDLE)
+    {
+        abandon_incremental_collection(heap);
+    }
+
     initialize_bucket_costs(heap);
-    mark_roots(heap, environment, FLAG_MARKED);
+    mark_heap(heap, environment);
+    heap->incremental_stalled = 0;
 
     /*
-     * Pick through all the buckets that are empty and reclaim them.
+     * Pick through all the buckets that are empty and reclaim them. That
+     * includes the ones already on the free list, which is only empty if
+     * the collection was forced by running out of buckets, so the list is
+     * rebuilt from scratch.
      */
 
+    heap->free_list = NULL;
+    heap->num_free = 0;
     num_reclaimed = reclaim_empty_buckets(heap);
 
-    mark_roots(heap, environment, FLAG_UNMARKED);
+    /*
+     * If there are no buckets reclaimed then we sort the bucket cost list and
+     * start compacting the cheapest buckets into the reserve. The marks are
+     * still needed to tell which objects to move, and move along with them.
+     */
+    if ((num_reclaimed == 0 || compact) && heap->reserve != NULL && heap->evacuation_inhibited == 0)
+    {
+        num_reclaimed += evacuate_buckets(heap);
+
+        if (heap->num_forwarding > 0)
+        {
+            forward_roots(heap, environment);
+            forward_heap_objects(heap);
+        }
+    }
+
+#if ENABLE_GENERATIONAL_GC
+    clear_dead_references(heap, 0);
+#endif
+
+    memset(heap->mark_bits, 0, heap->num_buckets * EVIL_MARK_BYTES_PER_BUCKET);
+
+    /*
+     * Reclaimed lexical environments may be reallocated at the same address
+     * so any inline caches keyed on them have to be dropped, as do caches of
+     * the locations of bindings that were moved.
+     */
+    ++environment->binding_epoch;
+    promote_survivors(heap);
+
+    /*
+     * A new reserve is only set aside when that leaves a bucket to allocate
+     * from.
+     */
+    if (heap->reserve == NULL && num_reclaimed > 1)
+    {
+        heap->reserve = heap->free_list;
+        heap->free_list = (struct heap_bucket_t *)heap->reserve->link.next;
+        heap->reserve->free = 0;
+        --heap->num_free;
+        --num_reclaimed;
+    }
 
     if (num_reclaimed > 0)
     {
@@ -657,12 +3189,16 @@ gc_collect(struct heap_t *heap)
     }
 
     /*
-     * If there are no buckets reclaimed then we sort the bucket cost list and
-     * start compacting the cheapest buckets. There is one problem -- we need
-     * at least one bucket to compact into. I'll add that as a TODO.
+     * Everything is live, pinned, or the compaction had to be skipped.
      */
 
     BREAK();
 }
 
+void
+gc_collect(struct heap_t *heap)
+{
+    collect_heap(heap, 0);
+}
+
 
@@ -9,6 +9,43 @@
 
 #include "object.h"
 
+/*
+ * Generational collection. The buckets allocated from since the last
+ * collection make up the nursery, which is collected on its own whenever it
+ * grows to EVIL_NURSERY_BUCKETS buckets; the buckets with survivors are
+ * promoted to the old space as they are. The whole heap is only collected
+ * once it runs out of buckets.
+ *
+ * Nursery collections don't mark old objects, so stores of references into
+ * objects that may be old have to be reported with gc_write_barrier.
+ */
+#ifndef ENABLE_GENERATIONAL_GC
+#   define ENABLE_GENERATIONAL_GC 1
+#endif
+
+/*
+ * Incremental collection. Once fewer buckets are free than the nursery
+ * takes up, the whole heap is marked a slice at a time as buckets are
+ * filled, see evil_set_gc_pause_budget. Objects the marking has traced can
+ * still be stored into, so while it is under way gc_write_barrier marks what
+ * is stored as well.
+ */
+#ifndef ENABLE_INCREMENTAL_GC
+#   define ENABLE_INCREMENTAL_GC 1
+#endif
+
+/*
+ * Parallel marking, see evil_set_gc_mark_threads. It needs threads and
+ * atomic operations, so it is only on where futures would be.
+ */
+#ifndef ENABLE_PARALLEL_MARKING
+#   if defined(_MSC_VER) || defined(__unix__) || defined(__APPLE__)
+#       define ENABLE_PARALLEL_MARKING 1
+#   else
+#       define ENABLE_PARALLEL_MARKING 0
+#   endif
+#endif
+
 struct heap_t;
 
 struct heap_parameters_t;
@@ -31,4 +68,32 @@ gc_alloc_vector(struct heap_t *heap, size_t count);
 void
 gc_collect(struct heap_t *heap);
 
+void
+gc_collect_nursery(struct heap_t *heap);
+
+/*
+ * Dirties the card holding the slot, if it is in the heap, so that the
+ * next nursery collection finds what it refers to, and marks what it refers
+ * to if an incremental collection is marking. Objects that are kept by
+ * handles across a collection have their cards dirtied afterwards, and are
+ * scanned again at the end of incremental marking, which covers filling in
+ * an object after allocating what it refers to.
+ */
+void
+gc_write_barrier(struct heap_t *heap, struct evil_object_t *slot);
+
+/*
+ * Collections compact the heap by moving objects when there are no empty
+ * buckets to reclaim. Code that keeps raw pointers to objects across
+ * allocations, which the collector can't update, inhibits that for the
+ * duration. Calls nest. Such code doesn't report its stores either, so the
+ * collections it sees, and the one after, collect the whole heap, and any
+ * incremental marking is finished first.
+ */
+void
+gc_inhibit_evacuation(struct heap_t *heap);
+
+void
+gc_allow_evacuation(struct heap_t *heap);
+
 #endif
@@ -0,0 +1,2383 @@
+/***********************************************************************
+ * evilscheme, Copyright (c) 2012-2015, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE.TXT for details.
+ ***********************************************************************/
+
+/*
+ * MAP_ANONYMOUS is not part of POSIX.1-2001.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "base.h"
+#include "evil_scheme.h"
+#include "jit.h"
+#include "object.h"
+#include "runtime.h"
+#include "vm.h"
+
+#if ENABLE_JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Native code is allocated out of executable chunks that belong to the
+ * environment of the procedure it was compiled from, so environments that
+ * run on different threads never write to a chunk the other is executing.
+ * The chunks are only freed with their environment and the total amount
+ * per environment is capped. Once the cap is reached procedures simply stay
+ * interpreted.
+ */
+#define JIT_CHUNK_SIZE (256 * 1024)
+#define JIT_MAX_CODE_SIZE (64 * 1024 * 1024)
+
+#define JIT_OBJECT_SIZE ((int)sizeof(struct evil_object_t))
+#define JIT_VALUE_OFFSET ((int)offsetof(struct evil_object_t, value))
+#define JIT_COUNT_OFFSET ((int)offsetof(struct evil_object_t, tag_count.count))
+
+/*
+ * The templates address objects as 16 byte slots with the value at offset
+ * 8.
+ */
+typedef char jit_object_layout_check[(sizeof(struct evil_object_t) == 16 && offsetof(struct evil_object_t, value) == 8) ? 1 : -1];
+
+enum jit_register_t
+{
+    JIT_RAX,
+    JIT_RCX,
+    JIT_RDX,
+    JIT_RBX,
+    JIT_RSP,
+    JIT_RBP,
+    JIT_RSI,
+    JIT_RDI,
+    JIT_R8,
+    JIT_R9,
+    JIT_R10,
+    JIT_R11,
+    JIT_R12,
+    JIT_R13,
+    JIT_R14,
+    JIT_R15,
+
+    /*
+     * The VM state lives in callee saved registers for the duration of the
+     * native code: the evaluation stack pointer, the program area and the
+     * jit_context_t they are written back to on exit.
+     */
+    JIT_SP = JIT_RBX,
+    JIT_PA = JIT_R12,
+    JIT_CONTEXT = JIT_R13
+};
+
+enum jit_condition_t
+{
+    JIT_CC_AE = 0x3,
+    JIT_CC_E = 0x4,
+    JIT_CC_NE = 0x5,
+    JIT_CC_A = 0x7,
+    JIT_CC_NP = 0xb,
+    JIT_CC_L = 0xc,
+    JIT_CC_GE = 0xd,
+    JIT_CC_LE = 0xe,
+    JIT_CC_G = 0xf,
+    JIT_CC_ALWAYS = -1
+};
+
+enum jit_numeric_kind_t
+{
+    JIT_NUMERIC_ANY,
+    JIT_NUMERIC_FIXNUM,
+    JIT_NUMERIC_FLONUM
+};
+
+struct jit_code_t
+{
+    unsigned char *native;
+
+    /*
+     * Indexed by bytecode offset. Holds the offset of the instruction's
+     * native code or -1 if no instruction starts at that offset.
+     */
+    int *native_offsets;
+    int num_bytes;
+
+    /*
+     * The loop trace, if one has been compiled, is entered at trace_entry
+     * and only while the lexical environment is the one it was recorded in.
+     */
+    unsigned char *trace;
+    int trace_entry;
+    struct evil_object_t *trace_lexical_environment;
+    int loop_count;
+    int trace_attempts;
+};
+
+/*
+ * Operands of the numeric templates: an object at displacement bytes from
+ * the base register, or a fixnum immediate if base is negative.
+ */
+struct jit_operand_t
+{
+    int base;
+    int displacement;
+    int64_t immediate;
+};
+
+enum jit_patch_kind_t
+{
+    JIT_PATCH_BRANCH,
+    JIT_PATCH_EXIT
+};
+
+struct jit_patch_t
+{
+    enum jit_patch_kind_t kind;
+    size_t location;
+    int bytecode_offset;
+};
+
+struct jit_emitter_t
+{
+    unsigned char *buffer;
+    size_t size;
+    size_t capacity;
+    int failed;
+
+    struct jit_patch_t *patches;
+    size_t num_patches;
+    size_t patch_capacity;
+
+    size_t exit_location;
+    int current_offset;
+};
+
+typedef int (*jit_entry_t)(struct jit_context_t *, void *);
+
+union jit_entry_cast_t
+{
+    jit_entry_t entry;
+    void *pointer;
+};
+
+struct jit_code_chunk_t
+{
+    struct jit_code_chunk_t *previous;
+    unsigned char *memory;
+    size_t size;
+    size_t used;
+};
+
+struct jit_code_cache_t
+{
+    struct jit_code_chunk_t *chunk;
+    size_t total_size;
+};
+
+static struct evil_environment_t *
+jit_environment(struct evil_object_t *procedure)
+{
+    return (struct evil_environment_t *)deref(&VECTOR_BASE(procedure)[FIELD_ENVIRONMENT]);
+}
+
+static void *
+jit_allocate_executable(struct evil_environment_t *environment, const void *code, size_t size)
+{
+    struct jit_code_cache_t *cache;
+    struct jit_code_chunk_t *chunk;
+    unsigned char *native;
+
+    size = (size + 15) & ~(size_t)15;
+    cache = environment->code_cache;
+
+    if (cache == NULL)
+    {
+        cache = calloc(1, sizeof(struct jit_code_cache_t));
+
+        if (cache == NULL)
+        {
+            return NULL;
+        }
+
+        environment->code_cache = cache;
+    }
+
+    chunk = cache->chunk;
+
+    if (chunk == NULL || chunk->used + size > chunk->size)
+    {
+        size_t page_size;
+        size_t chunk_size;
+        void *memory;
+
+        page_size = (size_t)sysconf(_SC_PAGESIZE);
+        chunk_size = size > JIT_CHUNK_SIZE ? size : JIT_CHUNK_SIZE;
+        chunk_size = (chunk_size + page_size - 1) & ~(page_size - 1);
+
+        if (cache->total_size + chunk_size > JIT_MAX_CODE_SIZE)
+        {
+            return NULL;
+        }
+
+        chunk = malloc(sizeof(struct jit_code_chunk_t));
+
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+
+        memory = mmap(NULL, chunk_size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (memory == MAP_FAILED)
+        {
+            free(chunk);
+            return NULL;
+        }
+
+        chunk->previous = cache->chunk;
+        chunk->memory = memory;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        cache->chunk = chunk;
+        cache->total_size += chunk_size;
+    }
+
+    /*
+     * The chunk is only writable while the new code is copied in.
+     */
+    native = chunk->memory + chunk->used;
+
+    if (mprotect(chunk->memory, chunk->size, PROT_READ | PROT_WRITE) != 0)
+    {
+        return NULL;
+    }
+
+    memcpy(native, code, size);
+    chunk->used += size;
+
+    if (mprotect(chunk->memory, chunk->size, PROT_READ | PROT_EXEC) != 0)
+    {
+        BREAK();
+    }
+
+    return native;
+}
+
+void
+jit_code_cache_destroy(struct jit_code_cache_t *cache)
+{
+    struct jit_code_chunk_t *chunk;
+
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    for (chunk = cache->chunk; chunk != NULL; )
+    {
+        struct jit_code_chunk_t *previous;
+
+        previous = chunk->previous;
+        munmap(chunk->memory, chunk->size);
+        free(chunk);
+        chunk = previous;
+    }
+
+    free(cache);
+}
+
+static void
+jit_emit_byte(struct jit_emitter_t *emitter, unsigned char byte)
+{
+    if (emitter->size == emitter->capacity)
+    {
+        size_t capacity;
+        unsigned char *buffer;
+
+        capacity = emitter->capacity ? emitter->capacity * 2 : 1024;
+        buffer = realloc(emitter->buffer, capacity);
+
+        if (buffer == NULL)
+        {
+            emitter->failed = 1;
+            return;
+        }
+
+        emitter->buffer = buffer;
+        emitter->capacity = capacity;
+    }
+
+    emitter->buffer[emitter->size++] = byte;
+}
+
+static void
+jit_emit_u32(struct jit_emitter_t *emitter, uint32_t value)
+{
+    int i;
+
+    for (i = 0; i < 4; ++i)
+    {
+        jit_emit_byte(emitter, (unsigned char)(value >> (i * 8)));
+    }
+}
+
+static void
+jit_emit_u64(struct jit_emitter_t *emitter, uint64_t value)
+{
+    jit_emit_u32(emitter, (uint32_t)value);
+    jit_emit_u32(emitter, (uint32_t)(value >> 32));
+}
+
+static void
+jit_emit_prefix_rex_opcode(struct jit_emitter_t *emitter, unsigned char prefix, int wide, unsigned opcode, int reg, int rm)
+{
+    unsigned char rex;
+
+    /*
+     * Mandatory prefixes come before REX, and two byte opcodes are passed
+     * in as 0x0fXX.
+     */
+    if (prefix)
+    {
+        jit_emit_byte(emitter, prefix);
+    }
+
+    rex = (unsigned char)(0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+
+    if (rex != 0x40)
+    {
+        jit_emit_byte(emitter, rex);
+    }
+
+    if (opcode > 0xff)
+    {
+        jit_emit_byte(emitter, (unsigned char)(opcode >> 8));
+    }
+
+    jit_emit_byte(emitter, (unsigned char)opcode);
+}
+
+/*
+ * <op> reg, [base + displacement]
+ */
+static void
+jit_emit_memory(struct jit_emitter_t *emitter, unsigned char prefix, int wide, unsigned opcode, int reg, int base, int displacement)
+{
+    unsigned char modrm;
+
+    jit_emit_prefix_rex_opcode(emitter, prefix, wide, opcode, reg, base);
+    modrm = (unsigned char)(((reg & 7) << 3) | (base & 7));
+
+    /*
+     * A base of rbp/r13 without a displacement encodes rip relative
+     * addressing and rsp/r12 need a SIB byte.
+     */
+    if (displacement == 0 && (base & 7) != JIT_RBP)
+    {
+        jit_emit_byte(emitter, modrm);
+    }
+    else if (displacement >= -128 && displacement <= 127)
+    {
+        jit_emit_byte(emitter, (unsigned char)(0x40 | modrm));
+    }
+    else
+    {
+        jit_emit_byte(emitter, (unsigned char)(0x80 | modrm));
+    }
+
+    if ((base & 7) == JIT_RSP)
+    {
+        jit_emit_byte(emitter, 0x24);
+    }
+
+    if (displacement != 0 || (base & 7) == JIT_RBP)
+    {
+        if (displacement >= -128 && displacement <= 127)
+        {
+            jit_emit_byte(emitter, (unsigned char)displacement);
+        }
+        else
+        {
+            jit_emit_u32(emitter, (uint32_t)displacement);
+        }
+    }
+}
+
+/*
+ * <op> reg, rm
+ */
+static void
+jit_emit_register(struct jit_emitter_t *emitter, unsigned char prefix, int wide, unsigned opcode, int reg, int rm)
+{
+    jit_emit_prefix_rex_opcode(emitter, prefix, wide, opcode, reg, rm);
+    jit_emit_byte(emitter, (unsigned char)(0xc0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+static void
+jit_emit_mov_immediate(struct jit_emitter_t *emitter, int reg, uint64_t value)
+{
+    jit_emit_prefix_rex_opcode(emitter, 0, 1, 0xb8 + (reg & 7), 0, reg);
+    jit_emit_u64(emitter, value);
+}
+
+static void
+jit_emit_adjust_sp(struct jit_emitter_t *emitter, int num_objects)
+{
+    /*
+     * add/sub rbx, imm8
+     */
+    jit_emit_register(emitter, 0, 1, 0x83, num_objects > 0 ? 0 : 5, JIT_SP);
+    jit_emit_byte(emitter, (unsigned char)((num_objects > 0 ? num_objects : -num_objects) * JIT_OBJECT_SIZE));
+}
+
+static void
+jit_emit_store_header(struct jit_emitter_t *emitter, int base, int displacement, unsigned char tag)
+{
+    /*
+     * mov dword [tag], tag; mov dword [count], 1
+     */
+    jit_emit_memory(emitter, 0, 0, 0xc7, 0, base, displacement);
+    jit_emit_u32(emitter, tag);
+    jit_emit_memory(emitter, 0, 0, 0xc7, 0, base, displacement + JIT_COUNT_OFFSET);
+    jit_emit_u32(emitter, 1);
+}
+
+static void
+jit_emit_store_constant(struct jit_emitter_t *emitter, int base, int displacement, unsigned char tag, uint64_t bits)
+{
+    int64_t value;
+
+    value = (int64_t)bits;
+
+    if (value >= INT32_MIN && value <= INT32_MAX)
+    {
+        jit_emit_memory(emitter, 0, 1, 0xc7, 0, base, displacement + JIT_VALUE_OFFSET);
+        jit_emit_u32(emitter, (uint32_t)value);
+    }
+    else
+    {
+        jit_emit_mov_immediate(emitter, JIT_RAX, bits);
+        jit_emit_memory(emitter, 0, 1, 0x89, JIT_RAX, base, displacement + JIT_VALUE_OFFSET);
+    }
+
+    jit_emit_store_header(emitter, base, displacement, tag);
+}
+
+static void
+jit_emit_check_tag(struct jit_emitter_t *emitter, struct jit_operand_t operand, unsigned char tag)
+{
+    jit_emit_memory(emitter, 0, 0, 0x80, 7, operand.base, operand.displacement);
+    jit_emit_byte(emitter, tag);
+}
+
+/*
+ * Emits a jump with a 32 bit displacement and returns the location of the
+ * displacement for jit_bind or the patch list.
+ */
+static size_t
+jit_emit_jump(struct jit_emitter_t *emitter, int condition)
+{
+    if (condition == JIT_CC_ALWAYS)
+    {
+        jit_emit_byte(emitter, 0xe9);
+    }
+    else
+    {
+        jit_emit_byte(emitter, 0x0f);
+        jit_emit_byte(emitter, (unsigned char)(0x80 | condition));
+    }
+
+    jit_emit_u32(emitter, 0);
+
+    return emitter->size - 4;
+}
+
+static void
+jit_bind_to(struct jit_emitter_t *emitter, size_t location, size_t target)
+{
+    uint32_t displacement;
+
+    if (emitter->failed)
+    {
+        return;
+    }
+
+    displacement = (uint32_t)((int32_t)target - (int32_t)(location + 4));
+    memcpy(emitter->buffer + location, &displacement, 4);
+}
+
+static void
+jit_bind(struct jit_emitter_t *emitter, size_t location)
+{
+    jit_bind_to(emitter, location, emitter->size);
+}
+
+static void
+jit_add_patch(struct jit_emitter_t *emitter, enum jit_patch_kind_t kind, size_t location, int bytecode_offset)
+{
+    if (emitter->num_patches == emitter->patch_capacity)
+    {
+        size_t capacity;
+        struct jit_patch_t *patches;
+
+        capacity = emitter->patch_capacity ? emitter->patch_capacity * 2 : 64;
+        patches = realloc(emitter->patches, capacity * sizeof(struct jit_patch_t));
+
+        if (patches == NULL)
+        {
+            emitter->failed = 1;
+            return;
+        }
+
+        emitter->patches = patches;
+        emitter->patch_capacity = capacity;
+    }
+
+    emitter->patches[emitter->num_patches].kind = kind;
+    emitter->patches[emitter->num_patches].location = location;
+    emitter->patches[emitter->num_patches].bytecode_offset = bytecode_offset;
+    ++emitter->num_patches;
+}
+
+/*
+ * Leaves the native code if the condition holds, resuming interpretation at
+ * the current instruction. The guards run before an instruction changes any
+ * state so the interpreter simply executes it again.
+ */
+static void
+jit_emit_exit_if(struct jit_emitter_t *emitter, int condition)
+{
+    size_t location;
+
+    location = jit_emit_jump(emitter, condition);
+    jit_add_patch(emitter, JIT_PATCH_EXIT, location, emitter->current_offset);
+}
+
+static void
+jit_emit_branch_if(struct jit_emitter_t *emitter, int condition, int bytecode_offset)
+{
+    size_t location;
+
+    location = jit_emit_jump(emitter, condition);
+    jit_add_patch(emitter, JIT_PATCH_BRANCH, location, bytecode_offset);
+}
+
+static struct jit_operand_t
+jit_slot(short slot)
+{
+    struct jit_operand_t operand;
+
+    operand.base = JIT_PA;
+    operand.displacement = slot * JIT_OBJECT_SIZE;
+    operand.immediate = 0;
+
+    return operand;
+}
+
+/*
+ * Index 1 is the top of the stack and index 0 the first free slot.
+ */
+static struct jit_operand_t
+jit_stack(int index)
+{
+    struct jit_operand_t operand;
+
+    operand.base = JIT_SP;
+    operand.displacement = index * JIT_OBJECT_SIZE;
+    operand.immediate = 0;
+
+    return operand;
+}
+
+static struct jit_operand_t
+jit_immediate(int64_t immediate)
+{
+    struct jit_operand_t operand;
+
+    operand.base = -1;
+    operand.displacement = 0;
+    operand.immediate = immediate;
+
+    return operand;
+}
+
+static uint64_t
+jit_double_bits(double value)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof bits);
+
+    return bits;
+}
+
+/*
+ * Loads the operand into an xmm register as a double, converting fixnums the
+ * way the interpreter's CONDITIONAL_DEMOTE does.
+ */
+static void
+jit_emit_load_double(struct jit_emitter_t *emitter, int xmm, struct jit_operand_t operand, enum jit_numeric_kind_t kind)
+{
+    size_t not_flonum;
+    size_t loaded;
+
+    if (operand.base < 0)
+    {
+        jit_emit_mov_immediate(emitter, JIT_RAX, jit_double_bits((double)operand.immediate));
+        jit_emit_register(emitter, 0x66, 1, 0x0f6e, xmm, JIT_RAX);
+        return;
+    }
+
+    jit_emit_check_tag(emitter, operand, TAG_FLONUM);
+
+    if (kind == JIT_NUMERIC_FLONUM)
+    {
+        jit_emit_exit_if(emitter, JIT_CC_NE);
+        jit_emit_memory(emitter, 0xf2, 0, 0x0f10, xmm, operand.base, operand.displacement + JIT_VALUE_OFFSET);
+        return;
+    }
+
+    not_flonum = jit_emit_jump(emitter, JIT_CC_NE);
+    jit_emit_memory(emitter, 0xf2, 0, 0x0f10, xmm, operand.base, operand.displacement + JIT_VALUE_OFFSET);
+    loaded = jit_emit_jump(emitter, JIT_CC_ALWAYS);
+    jit_bind(emitter, not_flonum);
+    jit_emit_check_tag(emitter, operand, TAG_FIXNUM);
+    jit_emit_exit_if(emitter, JIT_CC_NE);
+    jit_emit_memory(emitter, 0xf2, 1, 0x0f2a, xmm, operand.base, operand.displacement + JIT_VALUE_OFFSET);
+    jit_bind(emitter, loaded);
+}
+
+
+/*
+ * Checks that both operands are fixnums and loads a into rax. For fixnum
+ * only templates a failed check leaves the native code; otherwise it jumps
+ * to one of the not_fixnum locations, which the caller binds.
+ */
+static void
+jit_emit_load_fixnum_pair(struct jit_emitter_t *emitter, struct jit_operand_t a, struct jit_operand_t b, enum jit_numeric_kind_t kind, size_t *not_fixnum)
+{
+    struct jit_operand_t operands[2];
+    int i;
+
+    operands[0] = a;
+    operands[1] = b;
+
+    for (i = 0; i < 2; ++i)
+    {
+        not_fixnum[i] = 0;
+
+        if (operands[i].base < 0)
+        {
+            continue;
+        }
+
+        jit_emit_check_tag(emitter, operands[i], TAG_FIXNUM);
+
+        if (kind == JIT_NUMERIC_FIXNUM)
+        {
+            jit_emit_exit_if(emitter, JIT_CC_NE);
+        }
+        else
+        {
+            not_fixnum[i] = jit_emit_jump(emitter, JIT_CC_NE);
+        }
+    }
+
+    if (a.base < 0)
+    {
+        jit_emit_mov_immediate(emitter, JIT_RAX, (uint64_t)a.immediate);
+    }
+    else
+    {
+        jit_emit_memory(emitter, 0, 1, 0x8b, JIT_RAX, a.base, a.displacement + JIT_VALUE_OFFSET);
+    }
+}
+
+/*
+ * rax = rax OP b for fixnums. Division leaves the native code for divisors
+ * that would trap.
+ */
+static void
+jit_emit_fixnum_operation(struct jit_emitter_t *emitter, char operation, struct jit_operand_t b)
+{
+    if (b.base < 0)
+    {
+        switch (operation)
+        {
+            case '+':
+                jit_emit_register(emitter, 0, 1, 0x83, 0, JIT_RAX);
+                jit_emit_byte(emitter, (unsigned char)b.immediate);
+                break;
+            case '-':
+                jit_emit_register(emitter, 0, 1, 0x83, 5, JIT_RAX);
+                jit_emit_byte(emitter, (unsigned char)b.immediate);
+                break;
+            case '*':
+                jit_emit_register(emitter, 0, 1, 0x69, JIT_RAX, JIT_RAX);
+                jit_emit_u32(emitter, (uint32_t)b.immediate);
+                break;
+            case '/':
+                if (b.immediate == 0 || b.immediate == -1)
+                {
+                    jit_emit_exit_if(emitter, JIT_CC_ALWAYS);
+                    break;
+                }
+
+                jit_emit_mov_immediate(emitter, JIT_RCX, (uint64_t)b.immediate);
+                jit_emit_byte(emitter, 0x48);
+                jit_emit_byte(emitter, 0x99);
+                jit_emit_register(emitter, 0, 1, 0xf7, 7, JIT_RCX);
+                break;
+        }
+
+        return;
+    }
+
+    switch (operation)
+    {
+        case '+':
+            jit_emit_memory(emitter, 0, 1, 0x03, JIT_RAX, b.base, b.displacement + JIT_VALUE_OFFSET);
+            break;
+        case '-':
+            jit_emit_memory(emitter, 0, 1, 0x2b, JIT_RAX, b.base, b.displacement + JIT_VALUE_OFFSET);
+            break;
+        case '*':
+            jit_emit_memory(emitter, 0, 1, 0x0faf, JIT_RAX, b.base, b.displacement + JIT_VALUE_OFFSET);
+            break;
+        case '/':
+            /*
+             * mov rcx, b; test rcx, rcx; cmp rcx, -1; cqo; idiv rcx
+             */
+            jit_emit_memory(emitter, 0, 1, 0x8b, JIT_RCX, b.base, b.displacement + JIT_VALUE_OFFSET);
+            jit_emit_register(emitter, 0, 1, 0x85, JIT_RCX, JIT_RCX);
+            jit_emit_exit_if(emitter, JIT_CC_E);
+            jit_emit_register(emitter, 0, 1, 0x83, 7, JIT_RCX);
+            jit_emit_byte(emitter, 0xff);
+            jit_emit_exit_if(emitter, JIT_CC_E);
+            jit_emit_byte(emitter, 0x48);
+            jit_emit_byte(emitter, 0x99);
+            jit_emit_register(emitter, 0, 1, 0xf7, 7, JIT_RCX);
+            break;
+    }
+}
+
+static unsigned
+jit_flonum_opcode(char operation)
+{
+    switch (operation)
+    {
+        case '+':
+            return 0x0f58;
+        case '-':
+            return 0x0f5c;
+        case '*':
+            return 0x0f59;
+        default:
+            return 0x0f5e;
+    }
+}
+
+/*
+ * dst = a OP b with the interpreter's numeric rules: fixnum arithmetic if
+ * both operands are fixnums and flonum arithmetic otherwise. Anything that
+ * is not a number leaves the native code before dst is written, as does a
+ * type that the instruction was not quickened for.
+ */
+static void
+jit_emit_arithmetic(struct jit_emitter_t *emitter, char operation, struct jit_operand_t a, struct jit_operand_t b, struct jit_operand_t dst, enum jit_numeric_kind_t kind)
+{
+    size_t not_fixnum[2];
+    size_t done;
+    int i;
+
+    done = 0;
+
+    if (kind != JIT_NUMERIC_FLONUM)
+    {
+        jit_emit_load_fixnum_pair(emitter, a, b, kind, not_fixnum);
+        jit_emit_fixnum_operation(emitter, operation, b);
+        jit_emit_memory(emitter, 0, 1, 0x89, JIT_RAX, dst.base, dst.displacement + JIT_VALUE_OFFSET);
+        jit_emit_store_header(emitter, dst.base, dst.displacement, TAG_FIXNUM);
+
+        if (kind == JIT_NUMERIC_FIXNUM)
+        {
+            return;
+        }
+
+        done = jit_emit_jump(emitter, JIT_CC_ALWAYS);
+
+        for (i = 0; i < 2; ++i)
+        {
+            if (not_fixnum[i])
+            {
+                jit_bind(emitter, not_fixnum[i]);
+            }
+        }
+    }
+
+    jit_emit_load_double(emitter, 0, a, kind);
+    jit_emit_load_double(emitter, 1, b, kind);
+    jit_emit_register(emitter, 0xf2, 0, jit_flonum_opcode(operation), 0, 1);
+    jit_emit_memory(emitter, 0xf2, 0, 0x0f11, 0, dst.base, dst.displacement + JIT_VALUE_OFFSET);
+    jit_emit_store_header(emitter, dst.base, dst.displacement, TAG_FLONUM);
+
+    if (done)
+    {
+        jit_bind(emitter, done);
+    }
+}
+
+/*
+ * eax = (a OP b) ? 1 : 0, where comparison selects OP in the order of the
+ * CMPN opcodes: =, <, >, <=, >=.
+ */
+static void
+jit_emit_compare(struct jit_emitter_t *emitter, int comparison, struct jit_operand_t a, struct jit_operand_t b, enum jit_numeric_kind_t kind)
+{
+    static const unsigned char fixnum_conditions[] = { JIT_CC_E, JIT_CC_L, JIT_CC_G, JIT_CC_LE, JIT_CC_GE };
+    size_t not_fixnum[2];
+    size_t done;
+    int i;
+
+    done = 0;
+
+    /*
+     * cmp rax, b; setcc al
+     */
+    jit_emit_load_fixnum_pair(emitter, a, b, kind, not_fixnum);
+    jit_emit_memory(emitter, 0, 1, 0x3b, JIT_RAX, b.base, b.displacement + JIT_VALUE_OFFSET);
+    jit_emit_register(emitter, 0, 0, 0x0f90 | fixnum_conditions[comparison], 0, JIT_RAX);
+
+    if (kind != JIT_NUMERIC_FIXNUM)
+    {
+        done = jit_emit_jump(emitter, JIT_CC_ALWAYS);
+
+        for (i = 0; i < 2; ++i)
+        {
+            if (not_fixnum[i])
+            {
+                jit_bind(emitter, not_fixnum[i]);
+            }
+        }
+
+        jit_emit_load_double(emitter, 0, a, kind);
+        jit_emit_load_double(emitter, 1, b, kind);
+
+        /*
+         * ucomisd sets the flags like an unsigned comparison and reports
+         * NaNs as unordered, which must compare false. a < b is tested as
+         * b > a so that the unordered result (CF = ZF = PF = 1) never
+         * satisfies the condition.
+         */
+        switch (comparison)
+        {
+            case 0:
+                jit_emit_register(emitter, 0x66, 0, 0x0f2e, 0, 1);
+                jit_emit_register(emitter, 0, 0, 0x0f90 | JIT_CC_E, 0, JIT_RAX);
+                jit_emit_register(emitter, 0, 0, 0x0f90 | JIT_CC_NP, 0, JIT_RCX);
+                jit_emit_register(emitter, 0, 0, 0x20, JIT_RCX, JIT_RAX);
+                break;
+            case 1:
+                jit_emit_register(emitter, 0x66, 0, 0x0f2e, 1, 0);
+                jit_emit_register(emitter, 0, 0, 0x0f90 | JIT_CC_A, 0, JIT_RAX);
+                break;
+            case 2:
+                jit_emit_register(emitter, 0x66, 0, 0x0f2e, 0, 1);
+                jit_emit_register(emitter, 0, 0, 0x0f90 | JIT_CC_A, 0, JIT_RAX);
+                break;
+            case 3:
+                jit_emit_register(emitter, 0x66, 0, 0x0f2e, 1, 0);
+                jit_emit_register(emitter, 0, 0, 0x0f90 | JIT_CC_AE, 0, JIT_RAX);
+                break;
+            default:
+                jit_emit_register(emitter, 0x66, 0, 0x0f2e, 0, 1);
+                jit_emit_register(emitter, 0, 0, 0x0f90 | JIT_CC_AE, 0, JIT_RAX);
+                break;
+        }
+
+        jit_bind(emitter, done);
+    }
+
+    /*
+     * movzx eax, al
+     */
+    jit_emit_register(emitter, 0, 0, 0x0fb6, JIT_RAX, JIT_RAX);
+}
+
+static void
+jit_emit_push_compare(struct jit_emitter_t *emitter, int comparison, struct jit_operand_t a, struct jit_operand_t b, enum jit_numeric_kind_t kind)
+{
+    jit_emit_compare(emitter, comparison, a, b, kind);
+    jit_emit_memory(emitter, 0, 1, 0x89, JIT_RAX, JIT_SP, 2 * JIT_OBJECT_SIZE + JIT_VALUE_OFFSET);
+    jit_emit_store_header(emitter, JIT_SP, 2 * JIT_OBJECT_SIZE, TAG_BOOLEAN);
+    jit_emit_adjust_sp(emitter, 1);
+}
+
+static void
+jit_emit_stack_arithmetic(struct jit_emitter_t *emitter, char operation, struct jit_operand_t a, struct jit_operand_t b, enum jit_numeric_kind_t kind)
+{
+    jit_emit_arithmetic(emitter, operation, a, b, jit_stack(2), kind);
+    jit_emit_adjust_sp(emitter, 1);
+}
+
+static short
+jit_read_s2(const unsigned char *bytes)
+{
+    union convert_two_t c2;
+
+    memcpy(c2.bytes, bytes, 2);
+
+    return c2.s2;
+}
+
+static char
+jit_operation(unsigned char opcode)
+{
+    switch (opcode)
+    {
+        case OPCODE_ADD:
+        case OPCODE_ADD_FIX_FIX:
+        case OPCODE_ADD_FLO_FLO:
+        case OPCODE_RADD:
+        case OPCODE_RADD_IMM:
+            return '+';
+        case OPCODE_SUB:
+        case OPCODE_SUB_FIX_FIX:
+        case OPCODE_SUB_FLO_FLO:
+        case OPCODE_RSUB:
+        case OPCODE_RSUB_IMM:
+            return '-';
+        case OPCODE_MUL:
+        case OPCODE_MUL_FIX_FIX:
+        case OPCODE_MUL_FLO_FLO:
+        case OPCODE_RMUL:
+        case OPCODE_RMUL_IMM:
+            return '*';
+        default:
+            return '/';
+    }
+}
+
+/*
+ * Emits the template for the instruction at pc. Instructions without a
+ * template leave the native code so the interpreter can execute them.
+ */
+static void
+jit_emit_instruction(struct jit_emitter_t *emitter, const unsigned char *pc, int next_offset)
+{
+    unsigned char opcode;
+
+    opcode = *pc;
+
+    switch (opcode)
+    {
+        case OPCODE_LDSLOT_X:
+            /*
+             * movdqu xmm0, [slot]; movdqu [sp], xmm0
+             */
+            jit_emit_memory(emitter, 0xf3, 0, 0x0f6f, 0, JIT_PA, jit_read_s2(pc + 1) * JIT_OBJECT_SIZE);
+            jit_emit_memory(emitter, 0xf3, 0, 0x0f7f, 0, JIT_SP, 0);
+            jit_emit_adjust_sp(emitter, -1);
+            break;
+        case OPCODE_STSLOT_X:
+            jit_emit_adjust_sp(emitter, 1);
+            jit_emit_memory(emitter, 0xf3, 0, 0x0f6f, 0, JIT_SP, 0);
+            jit_emit_memory(emitter, 0xf3, 0, 0x0f7f, 0, JIT_PA, jit_read_s2(pc + 1) * JIT_OBJECT_SIZE);
+            break;
+        case OPCODE_LDIMM_1_BOOL:
+            jit_emit_store_constant(emitter, JIT_SP, 0, TAG_BOOLEAN, pc[1]);
+            jit_emit_adjust_sp(emitter, -1);
+            break;
+        case OPCODE_LDIMM_1_CHAR:
+            jit_emit_store_constant(emitter, JIT_SP, 0, TAG_CHAR, pc[1]);
+            jit_emit_adjust_sp(emitter, -1);
+            break;
+        case OPCODE_LDIMM_1_FIXNUM:
+            jit_emit_store_constant(emitter, JIT_SP, 0, TAG_FIXNUM, pc[1]);
+            jit_emit_adjust_sp(emitter, -1);
+            break;
+        case OPCODE_LDIMM_1_FLONUM:
+            jit_emit_store_constant(emitter, JIT_SP, 0, TAG_FLONUM, jit_double_bits((double)pc[1]));
+            jit_emit_adjust_sp(emitter, -1);
+            break;
+        case OPCODE_LDIMM_4_FIXNUM:
+        case OPCODE_LDIMM_4_FLONUM:
+            {
+                union convert_four_t c4;
+
+                memcpy(c4.bytes, pc + 1, 4);
+
+                if (opcode == OPCODE_LDIMM_4_FIXNUM)
+                {
+                    jit_emit_store_constant(emitter, JIT_SP, 0, TAG_FIXNUM, (uint64_t)(int64_t)c4.s4);
+                }
+                else
+                {
+                    jit_emit_store_constant(emitter, JIT_SP, 0, TAG_FLONUM, jit_double_bits((double)c4.f4));
+                }
+
+                jit_emit_adjust_sp(emitter, -1);
+            }
+            break;
+        case OPCODE_LDIMM_8_FIXNUM:
+        case OPCODE_LDIMM_8_FLONUM:
+        case OPCODE_LDIMM_8_SYMBOL:
+            {
+                union convert_eight_t c8;
+                unsigned char tag;
+
+                memcpy(c8.bytes, pc + 1, 8);
+                tag = (opcode == OPCODE_LDIMM_8_FIXNUM) ? TAG_FIXNUM : (opcode == OPCODE_LDIMM_8_FLONUM) ? TAG_FLONUM : TAG_SYMBOL;
+                jit_emit_store_constant(emitter, JIT_SP, 0, tag, c8.u8);
+                jit_emit_adjust_sp(emitter, -1);
+            }
+            break;
+        case OPCODE_LDEMPTY:
+            jit_emit_store_constant(emitter, JIT_SP, 0, TAG_REFERENCE, (uint64_t)(uintptr_t)empty_pair);
+            jit_emit_adjust_sp(emitter, -1);
+            break;
+        case OPCODE_POP:
+            jit_emit_adjust_sp(emitter, 1);
+            break;
+        case OPCODE_NOP:
+            break;
+        case OPCODE_BRANCH:
+            jit_emit_branch_if(emitter, JIT_CC_ALWAYS, next_offset + jit_read_s2(pc + 1));
+            break;
+        case OPCODE_COND_BRANCH:
+            /*
+             * Anything but #f branches.
+             */
+            jit_emit_adjust_sp(emitter, 1);
+            jit_emit_check_tag(emitter, jit_stack(0), TAG_BOOLEAN);
+            jit_emit_branch_if(emitter, JIT_CC_NE, next_offset + jit_read_s2(pc + 1));
+            jit_emit_memory(emitter, 0, 1, 0x83, 7, JIT_SP, JIT_VALUE_OFFSET);
+            jit_emit_byte(emitter, 0);
+            jit_emit_branch_if(emitter, JIT_CC_NE, next_offset + jit_read_s2(pc + 1));
+            break;
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+            jit_emit_stack_arithmetic(emitter, jit_operation(opcode), jit_stack(2), jit_stack(1), JIT_NUMERIC_ANY);
+            break;
+        case OPCODE_ADD_FIX_FIX:
+        case OPCODE_SUB_FIX_FIX:
+        case OPCODE_MUL_FIX_FIX:
+        case OPCODE_DIV_FIX_FIX:
+            jit_emit_stack_arithmetic(emitter, jit_operation(opcode), jit_stack(2), jit_stack(1), JIT_NUMERIC_FIXNUM);
+            break;
+        case OPCODE_ADD_FLO_FLO:
+        case OPCODE_SUB_FLO_FLO:
+        case OPCODE_MUL_FLO_FLO:
+        case OPCODE_DIV_FLO_FLO:
+            jit_emit_stack_arithmetic(emitter, jit_operation(opcode), jit_stack(2), jit_stack(1), JIT_NUMERIC_FLONUM);
+            break;
+        case OPCODE_CMPN_EQ:
+        case OPCODE_CMPN_LT:
+        case OPCODE_CMPN_GT:
+        case OPCODE_CMPN_LE:
+        case OPCODE_CMPN_GE:
+            jit_emit_push_compare(emitter, opcode - OPCODE_CMPN_EQ, jit_stack(1), jit_stack(2), JIT_NUMERIC_ANY);
+            break;
+        case OPCODE_CMPN_EQ_FIX:
+        case OPCODE_CMPN_LT_FIX:
+        case OPCODE_CMPN_GT_FIX:
+        case OPCODE_CMPN_LE_FIX:
+        case OPCODE_CMPN_GE_FIX:
+            jit_emit_push_compare(emitter, opcode - OPCODE_CMPN_EQ_FIX, jit_stack(1), jit_stack(2), JIT_NUMERIC_FIXNUM);
+            break;
+        case OPCODE_CMPN_EQ_SLOTS_BRANCH:
+        case OPCODE_CMPN_LT_SLOTS_BRANCH:
+        case OPCODE_CMPN_GT_SLOTS_BRANCH:
+        case OPCODE_CMPN_LE_SLOTS_BRANCH:
+        case OPCODE_CMPN_GE_SLOTS_BRANCH:
+            /*
+             * [slot b][slot a][offset]; test eax, eax
+             */
+            jit_emit_compare(emitter, opcode - OPCODE_CMPN_EQ_SLOTS_BRANCH, jit_slot(jit_read_s2(pc + 3)), jit_slot(jit_read_s2(pc + 1)), JIT_NUMERIC_ANY);
+            jit_emit_register(emitter, 0, 0, 0x85, JIT_RAX, JIT_RAX);
+            jit_emit_branch_if(emitter, JIT_CC_NE, next_offset + jit_read_s2(pc + 5));
+            break;
+        case OPCODE_ADD_IMM_SLOT:
+            jit_emit_arithmetic(emitter, '+', jit_immediate((signed char)pc[1]), jit_slot(jit_read_s2(pc + 2)), jit_stack(0), JIT_NUMERIC_ANY);
+            jit_emit_adjust_sp(emitter, -1);
+            break;
+        case OPCODE_SUB_SLOT_IMM:
+            jit_emit_arithmetic(emitter, '-', jit_slot(jit_read_s2(pc + 2)), jit_immediate((signed char)pc[1]), jit_stack(0), JIT_NUMERIC_ANY);
+            jit_emit_adjust_sp(emitter, -1);
+            break;
+        case OPCODE_RADD:
+        case OPCODE_RSUB:
+        case OPCODE_RMUL:
+        case OPCODE_RDIV:
+            jit_emit_arithmetic(emitter, jit_operation(opcode), jit_slot(jit_read_s2(pc + 3)), jit_slot(jit_read_s2(pc + 5)), jit_slot(jit_read_s2(pc + 1)), JIT_NUMERIC_ANY);
+            break;
+        case OPCODE_RADD_IMM:
+        case OPCODE_RSUB_IMM:
+        case OPCODE_RMUL_IMM:
+        case OPCODE_RDIV_IMM:
+            jit_emit_arithmetic(emitter, jit_operation(opcode), jit_slot(jit_read_s2(pc + 3)), jit_immediate((signed char)pc[5]), jit_slot(jit_read_s2(pc + 1)), JIT_NUMERIC_ANY);
+            break;
+        default:
+            jit_emit_exit_if(emitter, JIT_CC_ALWAYS);
+            break;
+    }
+}
+
+/*
+ * The entry point of every procedure's native code is a small trampoline
+ * that loads the VM state into registers and jumps to the native code of
+ * the instruction to start at. All exits go through a common epilogue that
+ * stores the stack pointer back and returns the bytecode offset in eax.
+ */
+static void
+jit_emit_prologue(struct jit_emitter_t *emitter)
+{
+    /*
+     * push rbx; push r12; push r13; mov r13, rdi
+     */
+    jit_emit_byte(emitter, 0x53);
+    jit_emit_byte(emitter, 0x41);
+    jit_emit_byte(emitter, 0x54);
+    jit_emit_byte(emitter, 0x41);
+    jit_emit_byte(emitter, 0x55);
+    jit_emit_register(emitter, 0, 1, 0x89, JIT_RDI, JIT_CONTEXT);
+
+    /*
+     * mov rbx, [r13 + sp]; mov r12, [r13 + program_area]; jmp rsi
+     */
+    jit_emit_memory(emitter, 0, 1, 0x8b, JIT_SP, JIT_CONTEXT, (int)offsetof(struct jit_context_t, sp));
+    jit_emit_memory(emitter, 0, 1, 0x8b, JIT_PA, JIT_CONTEXT, (int)offsetof(struct jit_context_t, program_area));
+    jit_emit_register(emitter, 0, 0, 0xff, 4, JIT_RSI);
+
+    /*
+     * mov [r13 + sp], rbx; pop r13; pop r12; pop rbx; ret
+     */
+    emitter->exit_location = emitter->size;
+    jit_emit_memory(emitter, 0, 1, 0x89, JIT_SP, JIT_CONTEXT, (int)offsetof(struct jit_context_t, sp));
+    jit_emit_byte(emitter, 0x41);
+    jit_emit_byte(emitter, 0x5d);
+    jit_emit_byte(emitter, 0x41);
+    jit_emit_byte(emitter, 0x5c);
+    jit_emit_byte(emitter, 0x5b);
+    jit_emit_byte(emitter, 0xc3);
+}
+
+/*
+ * Resolves branches and emits one exit stub per instruction that can leave
+ * the native code: mov eax, offset; jmp exit. Traces have no bytecode
+ * branches and pass in a NULL code.
+ */
+static int
+jit_resolve_patches(struct jit_emitter_t *emitter, struct jit_code_t *code)
+{
+    size_t i;
+    int stub_offset;
+    size_t stub_location;
+
+    stub_offset = -1;
+    stub_location = 0;
+
+    for (i = 0; i < emitter->num_patches; ++i)
+    {
+        struct jit_patch_t *patch;
+
+        patch = &emitter->patches[i];
+
+        if (patch->kind == JIT_PATCH_BRANCH)
+        {
+            int target;
+
+            target = patch->bytecode_offset;
+
+            if (code == NULL || target < 0 || target >= code->num_bytes || code->native_offsets[target] < 0)
+            {
+                return 0;
+            }
+
+            jit_bind_to(emitter, patch->location, (size_t)code->native_offsets[target]);
+        }
+        else
+        {
+            if (patch->bytecode_offset != stub_offset)
+            {
+                size_t exit_jump;
+
+                stub_offset = patch->bytecode_offset;
+                stub_location = emitter->size;
+                jit_emit_byte(emitter, 0xb8);
+                jit_emit_u32(emitter, (uint32_t)stub_offset);
+                exit_jump = jit_emit_jump(emitter, JIT_CC_ALWAYS);
+                jit_bind_to(emitter, exit_jump, emitter->exit_location);
+            }
+
+            jit_bind_to(emitter, patch->location, stub_location);
+        }
+    }
+
+    return 1;
+}
+
+static struct evil_object_t *
+jit_byte_code(struct evil_object_t *procedure)
+{
+    struct evil_object_t *byte_code;
+
+    byte_code = deref(&VECTOR_BASE(procedure)[FIELD_CODE]);
+    assert(byte_code->tag_count.tag == TAG_STRING);
+
+    return byte_code;
+}
+
+struct jit_code_t *
+jit_compile(struct evil_object_t *procedure)
+{
+    struct evil_object_t *native_code;
+    struct evil_object_t *byte_code;
+    const unsigned char *bytes;
+    struct jit_emitter_t emitter;
+    struct jit_code_t *code;
+    int offset;
+    int size;
+
+    native_code = &VECTOR_BASE(procedure)[FIELD_NATIVE_CODE];
+    byte_code = jit_byte_code(procedure);
+    bytes = (const unsigned char *)byte_code->value.string_value;
+
+    code = malloc(sizeof(struct jit_code_t) + byte_code->tag_count.count * sizeof(int));
+
+    if (code == NULL)
+    {
+        return NULL;
+    }
+
+    code->native_offsets = (int *)(code + 1);
+    code->num_bytes = byte_code->tag_count.count;
+    code->trace = NULL;
+    code->trace_entry = 0;
+    code->trace_lexical_environment = NULL;
+    code->loop_count = 0;
+    code->trace_attempts = 0;
+    memset(&emitter, 0, sizeof emitter);
+
+    for (offset = 0; offset < code->num_bytes; ++offset)
+    {
+        code->native_offsets[offset] = -1;
+    }
+
+    jit_emit_prologue(&emitter);
+
+    for (offset = 0; offset < code->num_bytes; offset += size)
+    {
+        size = vm_instruction_size(bytes + offset);
+
+        if (size == 0)
+        {
+            goto compile_failed;
+        }
+
+        code->native_offsets[offset] = (int)emitter.size;
+        emitter.current_offset = offset;
+        jit_emit_instruction(&emitter, bytes + offset, offset + size);
+    }
+
+    /*
+     * Bytecode always ends in a RETURN, so execution never runs off the
+     * end of the native code.
+     */
+    if (!jit_resolve_patches(&emitter, code) || emitter.failed)
+    {
+        goto compile_failed;
+    }
+
+    code->native = jit_allocate_executable(jit_environment(procedure), emitter.buffer, emitter.size);
+
+    if (code->native == NULL)
+    {
+        goto compile_failed;
+    }
+
+    free(emitter.buffer);
+    free(emitter.patches);
+
+    native_code->tag_count.tag = TAG_EXTERNAL_FUNCTION;
+    native_code->tag_count.flag = 0;
+    native_code->tag_count.count = 1;
+    native_code->value.fixnum_value = (int64_t)(intptr_t)code;
+
+    return code;
+
+compile_failed:
+    free(emitter.buffer);
+    free(emitter.patches);
+    free(code);
+
+    return NULL;
+}
+
+int
+jit_run(struct jit_code_t *code, struct jit_context_t *context, int offset)
+{
+    union jit_entry_cast_t entry;
+    int native_offset;
+
+    assert(offset >= 0 && offset < code->num_bytes);
+
+#if ENABLE_JIT_TRACING
+    if (offset == 0 && code->trace != NULL
+            && deref(evil_resolve_object_handle(context->lexical_environment_handle)) == code->trace_lexical_environment)
+    {
+        entry.pointer = code->trace;
+        offset = entry.entry(context, code->trace + code->trace_entry);
+    }
+#endif
+
+    native_offset = code->native_offsets[offset];
+
+    if (native_offset < 0)
+    {
+        return offset;
+    }
+
+    entry.pointer = code->native;
+
+    return entry.entry(context, code->native + native_offset);
+}
+
+#if ENABLE_JIT_TRACING
+
+/*
+ * What the recorder saw for an instruction: the tags of its numeric
+ * operands, in the order the templates take them, and whether each was
+ * reached through an inner reference like the ones vector-ref returns. For
+ * calls it holds the procedure that was called.
+ */
+struct jit_trace_entry_t
+{
+    int offset;
+    unsigned char tags[2];
+    unsigned char indirect[2];
+    struct evil_object_t *callee;
+};
+
+struct jit_trace_recorder_t
+{
+    struct evil_object_t *procedure;
+    struct evil_object_t *program_area;
+    int num_entries;
+    struct jit_trace_entry_t entries[JIT_MAX_TRACE_LENGTH];
+};
+
+static struct evil_object_t *
+jit_lexical_environment(struct evil_object_t *procedure)
+{
+    return deref(&VECTOR_BASE(procedure)[FIELD_LEXICAL_ENVIRONMENT]);
+}
+
+/*
+ * Returns the location cached by the global lookup instruction at pc if the
+ * cache is valid in the procedure's lexical environment, which is the one a
+ * loop runs in.
+ */
+static struct evil_object_t *
+jit_cached_location(struct evil_object_t *procedure, const unsigned char *pc)
+{
+    struct vm_inline_cache_t cache;
+
+    memcpy(&cache, pc + 1 + 8, VM_INLINE_CACHE_SIZE);
+
+    if (cache.binding_epoch != jit_environment(procedure)->binding_epoch
+            || cache.lexical_environment != jit_lexical_environment(procedure))
+    {
+        return NULL;
+    }
+
+    return cache.location;
+}
+
+/*
+ * Returns the object the cached global at pc refers to, or NULL.
+ */
+static struct evil_object_t *
+jit_cached_target(struct evil_object_t *procedure, const unsigned char *pc)
+{
+    struct evil_object_t *location;
+
+    location = jit_cached_location(procedure, pc);
+
+    if (location == NULL || location->tag_count.tag != TAG_REFERENCE)
+    {
+        return NULL;
+    }
+
+    return location->value.ref;
+}
+
+static int
+jit_record_operand(struct jit_trace_entry_t *entry, int index, const struct evil_object_t *object)
+{
+    if (object->tag_count.tag == TAG_INNER_REFERENCE)
+    {
+        object = object->value.ref + object->tag_count.count;
+        entry->indirect[index] = 1;
+    }
+
+    entry->tags[index] = object->tag_count.tag;
+
+    return object->tag_count.tag == TAG_FIXNUM || object->tag_count.tag == TAG_FLONUM;
+}
+
+static const struct evil_object_t *
+jit_record_slot(const struct evil_object_t *program_area, const unsigned char *bytes)
+{
+    return program_area + jit_read_s2(bytes);
+}
+
+struct jit_trace_recorder_t *
+jit_count_loop(struct evil_object_t *procedure, struct evil_object_t *program_area)
+{
+    struct jit_code_t *code;
+    struct jit_trace_recorder_t *recorder;
+
+    code = jit_native_code(procedure);
+
+    if (code == NULL || code->trace != NULL || code->trace_attempts == JIT_MAX_TRACE_ATTEMPTS)
+    {
+        return NULL;
+    }
+
+    if (++code->loop_count < JIT_TRACE_THRESHOLD)
+    {
+        return NULL;
+    }
+
+    code->loop_count = 0;
+    ++code->trace_attempts;
+
+    if (vm_procedure_header(procedure).num_args == VARIADIC)
+    {
+        code->trace_attempts = JIT_MAX_TRACE_ATTEMPTS;
+        return NULL;
+    }
+
+    recorder = malloc(sizeof(struct jit_trace_recorder_t));
+
+    if (recorder != NULL)
+    {
+        recorder->procedure = procedure;
+        recorder->program_area = program_area;
+        recorder->num_entries = 0;
+    }
+
+    return recorder;
+}
+
+static int
+jit_is_builtin(struct evil_object_t *target, evil_special_function_t builtin)
+{
+    return target->tag_count.tag == TAG_SPECIAL_FUNCTION
+        && VECTOR_BASE(target)[FIELD_CODE].value.special_function_value == builtin;
+}
+
+int
+jit_record_instruction(struct jit_trace_recorder_t *recorder, struct evil_object_t *procedure, const unsigned char *pc, struct evil_object_t *sp, struct evil_object_t *program_area)
+{
+    struct jit_trace_entry_t *entry;
+    struct evil_object_t *target;
+    int supported;
+
+    if (procedure != recorder->procedure || program_area != recorder->program_area)
+    {
+        return 1;
+    }
+
+    if (recorder->num_entries == JIT_MAX_TRACE_LENGTH)
+    {
+        free(recorder);
+        return 0;
+    }
+
+    entry = &recorder->entries[recorder->num_entries++];
+    memset(entry, 0, sizeof(struct jit_trace_entry_t));
+    entry->offset = (int)(pc - (const unsigned char *)jit_byte_code(procedure)->value.string_value);
+    supported = 1;
+
+    switch (*pc)
+    {
+        case OPCODE_LDSLOT_X:
+        case OPCODE_STSLOT_X:
+        case OPCODE_LDIMM_1_BOOL:
+        case OPCODE_LDIMM_1_CHAR:
+        case OPCODE_LDIMM_1_FIXNUM:
+        case OPCODE_LDIMM_1_FLONUM:
+        case OPCODE_LDIMM_4_FIXNUM:
+        case OPCODE_LDIMM_4_FLONUM:
+        case OPCODE_LDIMM_8_FIXNUM:
+        case OPCODE_LDIMM_8_FLONUM:
+        case OPCODE_LDIMM_8_SYMBOL:
+        case OPCODE_LDEMPTY:
+        case OPCODE_LDFN:
+        case OPCODE_POP:
+        case OPCODE_NOP:
+        case OPCODE_BRANCH:
+        case OPCODE_COND_BRANCH:
+            break;
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_ADD_FIX_FIX:
+        case OPCODE_SUB_FIX_FIX:
+        case OPCODE_MUL_FIX_FIX:
+        case OPCODE_DIV_FIX_FIX:
+        case OPCODE_ADD_FLO_FLO:
+        case OPCODE_SUB_FLO_FLO:
+        case OPCODE_MUL_FLO_FLO:
+        case OPCODE_DIV_FLO_FLO:
+            supported = jit_record_operand(entry, 0, sp + 2) & jit_record_operand(entry, 1, sp + 1);
+            break;
+        case OPCODE_CMPN_EQ:
+        case OPCODE_CMPN_LT:
+        case OPCODE_CMPN_GT:
+        case OPCODE_CMPN_LE:
+        case OPCODE_CMPN_GE:
+        case OPCODE_CMPN_EQ_FIX:
+        case OPCODE_CMPN_LT_FIX:
+        case OPCODE_CMPN_GT_FIX:
+        case OPCODE_CMPN_LE_FIX:
+        case OPCODE_CMPN_GE_FIX:
+            supported = jit_record_operand(entry, 0, sp + 1) & jit_record_operand(entry, 1, sp + 2);
+            break;
+        case OPCODE_CMPN_EQ_SLOTS_BRANCH:
+        case OPCODE_CMPN_LT_SLOTS_BRANCH:
+        case OPCODE_CMPN_GT_SLOTS_BRANCH:
+        case OPCODE_CMPN_LE_SLOTS_BRANCH:
+        case OPCODE_CMPN_GE_SLOTS_BRANCH:
+            supported = jit_record_operand(entry, 0, jit_record_slot(program_area, pc + 3)) & jit_record_operand(entry, 1, jit_record_slot(program_area, pc + 1));
+            break;
+        case OPCODE_ADD_IMM_SLOT:
+            entry->tags[0] = TAG_FIXNUM;
+            supported = jit_record_operand(entry, 1, jit_record_slot(program_area, pc + 2));
+            break;
+        case OPCODE_SUB_SLOT_IMM:
+            entry->tags[1] = TAG_FIXNUM;
+            supported = jit_record_operand(entry, 0, jit_record_slot(program_area, pc + 2));
+            break;
+        case OPCODE_RADD:
+        case OPCODE_RSUB:
+        case OPCODE_RMUL:
+        case OPCODE_RDIV:
+            supported = jit_record_operand(entry, 0, jit_record_slot(program_area, pc + 3)) & jit_record_operand(entry, 1, jit_record_slot(program_area, pc + 5));
+            break;
+        case OPCODE_RADD_IMM:
+        case OPCODE_RSUB_IMM:
+        case OPCODE_RMUL_IMM:
+        case OPCODE_RDIV_IMM:
+            entry->tags[1] = TAG_FIXNUM;
+            supported = jit_record_operand(entry, 0, jit_record_slot(program_area, pc + 3));
+            break;
+        case OPCODE_LOAD:
+            supported = (sp + 1)->tag_count.tag == TAG_REFERENCE;
+            break;
+        case OPCODE_SET:
+            /*
+             * Only stores of plain values through inner references, as in
+             * (set! (vector-ref v i) x), which need no write barrier.
+             */
+            entry->tags[1] = (sp + 2)->tag_count.tag;
+            supported = (sp + 1)->tag_count.tag == TAG_INNER_REFERENCE
+                && entry->tags[1] != TAG_REFERENCE
+                && entry->tags[1] != TAG_INNER_REFERENCE;
+            break;
+        case OPCODE_GET_BOUND_LOCATION:
+            supported = jit_cached_location(procedure, pc) != NULL;
+            break;
+        case OPCODE_VECTOR_REF:
+            entry->tags[1] = (sp + 2)->tag_count.tag;
+            /* FALLTHROUGH */
+        case OPCODE_VECTOR_LENGTH:
+            entry->tags[0] = (sp + 1)->tag_count.tag;
+            /* FALLTHROUGH */
+        case OPCODE_VECTOR_SET:
+        case OPCODE_CONS:
+        case OPCODE_CALL_GLOBAL:
+            target = jit_cached_target(procedure, pc);
+            entry->callee = target;
+            supported = target != NULL
+                && (target->tag_count.tag == TAG_SPECIAL_FUNCTION
+                    || (target->tag_count.tag == TAG_PROCEDURE && vm_procedure_header(target).num_args != VARIADIC));
+
+            /*
+             * Yielding and joining switch fibers, which the VM only does
+             * between instructions it runs itself.
+             */
+            supported = supported
+                && !jit_is_builtin(target, evil_yield)
+                && !jit_is_builtin(target, evil_join);
+            break;
+        case OPCODE_TAILCALL_GLOBAL:
+        case OPCODE_BRANCH_IF_SELF:
+            supported = jit_cached_target(procedure, pc) == procedure;
+            break;
+        case OPCODE_LOOP:
+            supported = pc + 3 + jit_read_s2(pc + 1) == (const unsigned char *)jit_byte_code(procedure)->value.string_value;
+            break;
+        case OPCODE_TAILCALL:
+            supported = (sp + 1)->tag_count.tag == TAG_REFERENCE && (sp + 1)->value.ref == procedure;
+            break;
+        default:
+            supported = 0;
+            break;
+    }
+
+    if (!supported)
+    {
+        free(recorder);
+    }
+
+    return supported;
+}
+
+/*
+ * Picks the numeric template for the types that were recorded. Mixed
+ * fixnum and flonum operands are left to the generic template, but not if
+ * an operand is reached through an inner reference: the interpreter
+ * converts the fixnum operand to a flonum in place, which there would write
+ * through the reference.
+ */
+static int
+jit_trace_kind(const struct jit_trace_entry_t *entry, struct jit_operand_t a, struct jit_operand_t b, enum jit_numeric_kind_t *kind)
+{
+    int num_fixnums;
+    int num_flonums;
+    int i;
+
+    num_fixnums = 0;
+    num_flonums = 0;
+
+    for (i = 0; i < 2; ++i)
+    {
+        if ((i == 0 ? a : b).base < 0)
+        {
+            continue;
+        }
+
+        if (entry->tags[i] == TAG_FIXNUM)
+        {
+            ++num_fixnums;
+        }
+        else if (entry->tags[i] == TAG_FLONUM)
+        {
+            ++num_flonums;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    if (num_flonums == 0)
+    {
+        *kind = JIT_NUMERIC_FIXNUM;
+    }
+    else if (num_fixnums == 0)
+    {
+        *kind = JIT_NUMERIC_FLONUM;
+    }
+    else if (entry->indirect[0] || entry->indirect[1])
+    {
+        return 0;
+    }
+    else
+    {
+        *kind = JIT_NUMERIC_ANY;
+    }
+
+    return 1;
+}
+
+/*
+ * Follows an operand that was recorded as an inner reference to the object
+ * it refers to, whose address is left in the scratch register.
+ */
+static struct jit_operand_t
+jit_emit_trace_operand(struct jit_emitter_t *emitter, struct jit_operand_t operand, int indirect, int scratch)
+{
+    if (operand.base < 0 || !indirect)
+    {
+        return operand;
+    }
+
+    /*
+     * mov scratch32, [count]; shl scratch, 4; add scratch, [ref]
+     */
+    jit_emit_check_tag(emitter, operand, TAG_INNER_REFERENCE);
+    jit_emit_exit_if(emitter, JIT_CC_NE);
+    jit_emit_memory(emitter, 0, 0, 0x8b, scratch, operand.base, operand.displacement + JIT_COUNT_OFFSET);
+    jit_emit_register(emitter, 0, 1, 0xc1, 4, scratch);
+    jit_emit_byte(emitter, 4);
+    jit_emit_memory(emitter, 0, 1, 0x03, scratch, operand.base, operand.displacement + JIT_VALUE_OFFSET);
+
+    operand.base = scratch;
+    operand.displacement = 0;
+
+    return operand;
+}
+
+/*
+ * Leaves the trace unless the inline cache of the global lookup at pc is
+ * still valid, and loads the cached location into rax.
+ */
+static void
+jit_emit_cache_guard(struct jit_emitter_t *emitter, struct evil_object_t *procedure, const unsigned char *pc)
+{
+    jit_emit_mov_immediate(emitter, JIT_RCX, (uint64_t)(uintptr_t)(pc + 1 + 8));
+    jit_emit_mov_immediate(emitter, JIT_RAX, (uint64_t)(uintptr_t)&jit_environment(procedure)->binding_epoch);
+    jit_emit_memory(emitter, 0, 1, 0x8b, JIT_RAX, JIT_RAX, 0);
+    jit_emit_memory(emitter, 0, 1, 0x3b, JIT_RAX, JIT_RCX, (int)offsetof(struct vm_inline_cache_t, binding_epoch));
+    jit_emit_exit_if(emitter, JIT_CC_NE);
+    jit_emit_mov_immediate(emitter, JIT_RAX, (uint64_t)(uintptr_t)jit_lexical_environment(procedure));
+    jit_emit_memory(emitter, 0, 1, 0x3b, JIT_RAX, JIT_RCX, (int)offsetof(struct vm_inline_cache_t, lexical_environment));
+    jit_emit_exit_if(emitter, JIT_CC_NE);
+    jit_emit_memory(emitter, 0, 1, 0x8b, JIT_RAX, JIT_RCX, (int)offsetof(struct vm_inline_cache_t, location));
+}
+
+/*
+ * Leaves the trace unless the object at base refers to target.
+ */
+static void
+jit_emit_target_guard(struct jit_emitter_t *emitter, int base, int displacement, struct evil_object_t *target)
+{
+    struct jit_operand_t operand;
+
+    operand.base = base;
+    operand.displacement = displacement;
+    operand.immediate = 0;
+
+    jit_emit_check_tag(emitter, operand, TAG_REFERENCE);
+    jit_emit_exit_if(emitter, JIT_CC_NE);
+    jit_emit_mov_immediate(emitter, JIT_RCX, (uint64_t)(uintptr_t)target);
+    jit_emit_memory(emitter, 0, 1, 0x3b, JIT_RCX, base, displacement + JIT_VALUE_OFFSET);
+    jit_emit_exit_if(emitter, JIT_CC_NE);
+}
+
+/*
+ * Leaves the trace unless the object on the stack refers to a vector, whose
+ * address is left in rax.
+ */
+static void
+jit_emit_trace_vector_guard(struct jit_emitter_t *emitter, int index)
+{
+    struct jit_operand_t vector;
+
+    vector.base = JIT_RAX;
+    vector.displacement = 0;
+    vector.immediate = 0;
+
+    jit_emit_check_tag(emitter, jit_stack(index), TAG_REFERENCE);
+    jit_emit_exit_if(emitter, JIT_CC_NE);
+    jit_emit_memory(emitter, 0, 1, 0x8b, JIT_RAX, JIT_SP, index * JIT_OBJECT_SIZE + JIT_VALUE_OFFSET);
+    jit_emit_check_tag(emitter, vector, TAG_VECTOR);
+    jit_emit_exit_if(emitter, JIT_CC_NE);
+}
+
+/*
+ * Calls from traces work like the interpreter's OPCODE_CALL: the arguments
+ * on top of the stack are replaced by the result. Procedures run in a
+ * nested vm_run, in their own lexical environment, and so do the calls
+ * builtins request.
+ */
+static void
+jit_trace_call(struct jit_context_t *context, struct evil_object_t *fn, int num_args)
+{
+    struct evil_object_t *sp;
+    struct evil_object_t *procedure_base;
+    struct evil_object_t result;
+
+    sp = context->sp;
+    procedure_base = VECTOR_BASE(fn);
+
+    /*
+     * The stack pointer is saved here in case the call ends up in the
+     * garbage collector.
+     */
+    context->environment->stack_ptr = sp;
+
+    if (fn->tag_count.tag == TAG_SPECIAL_FUNCTION)
+    {
+        struct evil_environment_t *fn_environment;
+        evil_special_function_t function_pointer;
+
+        fn_environment = (struct evil_environment_t *)deref(&procedure_base[FIELD_ENVIRONMENT]);
+        function_pointer = procedure_base[FIELD_CODE].value.special_function_value;
+        result = function_pointer(fn_environment, context->lexical_environment_handle, num_args, sp + 1);
+        result = vm_finish_call_request(fn_environment, context->lexical_environment_handle, result);
+    }
+    else
+    {
+        result = vm_run(context->environment, context->lexical_environment_handle, fn, num_args, sp + 1);
+    }
+
+    sp += num_args - 1;
+    *(sp + 1) = result;
+    context->sp = sp;
+}
+
+static void
+jit_emit_trace_call(struct jit_emitter_t *emitter, struct evil_object_t *fn, int num_args)
+{
+    /*
+     * mov [r13 + sp], rbx; mov rdi, r13; call jit_trace_call;
+     * mov rbx, [r13 + sp]
+     */
+    jit_emit_memory(emitter, 0, 1, 0x89, JIT_SP, JIT_CONTEXT, (int)offsetof(struct jit_context_t, sp));
+    jit_emit_register(emitter, 0, 1, 0x89, JIT_CONTEXT, JIT_RDI);
+    jit_emit_mov_immediate(emitter, JIT_RSI, (uint64_t)(uintptr_t)fn);
+    jit_emit_mov_immediate(emitter, JIT_RDX, (uint64_t)num_args);
+    jit_emit_mov_immediate(emitter, JIT_RAX, (uint64_t)(uintptr_t)jit_trace_call);
+    jit_emit_register(emitter, 0, 0, 0xff, 2, JIT_RAX);
+    jit_emit_memory(emitter, 0, 1, 0x8b, JIT_SP, JIT_CONTEXT, (int)offsetof(struct jit_context_t, sp));
+}
+
+/*
+ * Counts the loop iteration against the running fiber's time slice, which
+ * the interpreter counts calls and back edges against. When the slice is
+ * about to run out the trace is left at the back edge, before it has
+ * changed anything, so that the interpreter takes it and switches fibers or
+ * suspends a metered invocation; see vm_scheduler_t.
+ */
+static void
+jit_emit_trace_safepoint(struct jit_emitter_t *emitter, struct evil_object_t *procedure)
+{
+    int *budget;
+
+    budget = &jit_environment(procedure)->scheduler->budget;
+
+    /*
+     * mov rcx, budget; cmp dword [rcx], 1; jle exit; dec dword [rcx]
+     */
+    jit_emit_mov_immediate(emitter, JIT_RCX, (uint64_t)(uintptr_t)budget);
+    jit_emit_memory(emitter, 0, 0, 0x83, 7, JIT_RCX, 0);
+    jit_emit_byte(emitter, 1);
+    jit_emit_exit_if(emitter, JIT_CC_LE);
+    jit_emit_memory(emitter, 0, 0, 0xff, 1, JIT_RCX, 0);
+}
+
+/*
+ * Closes the loop: the stack is reset to below the locals and the trace
+ * starts over.
+ */
+static void
+jit_emit_trace_restart(struct jit_emitter_t *emitter, struct evil_object_t *procedure, size_t head)
+{
+    int num_locals;
+
+    num_locals = vm_procedure_header(procedure).num_locals;
+
+    /*
+     * lea rbx, [r12 - (slots + 1 + locals) * 16]
+     */
+    jit_emit_memory(emitter, 0, 1, 0x8d, JIT_SP, JIT_PA, -(VM_SLOT_COUNT + 1 + num_locals) * JIT_OBJECT_SIZE);
+    jit_bind_to(emitter, jit_emit_jump(emitter, JIT_CC_ALWAYS), head);
+}
+
+/*
+ * The self tail call that closes the loop: the arguments starting at the
+ * given stack index are moved into the program area before restarting.
+ */
+static void
+jit_emit_trace_loop(struct jit_emitter_t *emitter, struct evil_object_t *procedure, int first_arg, size_t head)
+{
+    int num_args;
+    int i;
+
+    num_args = vm_procedure_header(procedure).num_args;
+
+    for (i = 0; i < num_args; ++i)
+    {
+        jit_emit_memory(emitter, 0xf3, 0, 0x0f6f, 0, JIT_SP, (first_arg + i) * JIT_OBJECT_SIZE);
+        jit_emit_memory(emitter, 0xf3, 0, 0x0f7f, 0, JIT_PA, i * JIT_OBJECT_SIZE);
+    }
+
+    jit_emit_trace_restart(emitter, procedure, head);
+}
+
+/*
+ * Emits the trace code for the index'th recorded instruction. Returns 0 if
+ * the instruction cannot be part of a trace.
+ */
+static int
+jit_emit_trace_instruction(struct jit_emitter_t *emitter, struct jit_trace_recorder_t *recorder, int index, size_t head)
+{
+    struct evil_object_t *procedure;
+    const struct jit_trace_entry_t *entry;
+    const unsigned char *pc;
+    unsigned char opcode;
+    struct jit_operand_t a;
+    struct jit_operand_t b;
+    enum jit_numeric_kind_t kind;
+    int fall_through;
+    int next;
+
+    procedure = recorder->procedure;
+    entry = &recorder->entries[index];
+    pc = (const unsigned char *)jit_byte_code(procedure)->value.string_value + entry->offset;
+    opcode = *pc;
+    fall_through = entry->offset + vm_instruction_size(pc);
+    next = (index + 1 < recorder->num_entries) ? recorder->entries[index + 1].offset : -1;
+
+    /*
+     * Only branches may leave the straight line and only the back edge that
+     * closes the loop may end it.
+     */
+    switch (opcode)
+    {
+        case OPCODE_BRANCH:
+            return next == fall_through + jit_read_s2(pc + 1);
+        case OPCODE_COND_BRANCH:
+        case OPCODE_CMPN_EQ_SLOTS_BRANCH:
+        case OPCODE_CMPN_LT_SLOTS_BRANCH:
+        case OPCODE_CMPN_GT_SLOTS_BRANCH:
+        case OPCODE_CMPN_LE_SLOTS_BRANCH:
+        case OPCODE_CMPN_GE_SLOTS_BRANCH:
+            if (next < 0)
+            {
+                return 0;
+            }
+            break;
+        case OPCODE_BRANCH_IF_SELF:
+            if (next != fall_through + jit_read_s2(pc + 1 + 8 + VM_INLINE_CACHE_SIZE))
+            {
+                return 0;
+            }
+            break;
+        case OPCODE_TAILCALL:
+        case OPCODE_TAILCALL_GLOBAL:
+        case OPCODE_LOOP:
+            if (next >= 0)
+            {
+                return 0;
+            }
+            break;
+        default:
+            if (next != fall_through)
+            {
+                return 0;
+            }
+            break;
+    }
+
+    switch (opcode)
+    {
+        case OPCODE_COND_BRANCH:
+            {
+                int target;
+                size_t not_boolean;
+
+                /*
+                 * Guards that the condition goes the recorded way: the
+                 * branch is taken for anything but #f.
+                 */
+                target = fall_through + jit_read_s2(pc + 1);
+
+                if (target == fall_through)
+                {
+                    jit_emit_adjust_sp(emitter, 1);
+                    break;
+                }
+
+                jit_emit_check_tag(emitter, jit_stack(1), TAG_BOOLEAN);
+
+                if (next == target)
+                {
+                    not_boolean = jit_emit_jump(emitter, JIT_CC_NE);
+                    jit_emit_memory(emitter, 0, 1, 0x83, 7, JIT_SP, JIT_OBJECT_SIZE + JIT_VALUE_OFFSET);
+                    jit_emit_byte(emitter, 0);
+                    jit_emit_exit_if(emitter, JIT_CC_E);
+                    jit_bind(emitter, not_boolean);
+                }
+                else if (next == fall_through)
+                {
+                    jit_emit_exit_if(emitter, JIT_CC_NE);
+                    jit_emit_memory(emitter, 0, 1, 0x83, 7, JIT_SP, JIT_OBJECT_SIZE + JIT_VALUE_OFFSET);
+                    jit_emit_byte(emitter, 0);
+                    jit_emit_exit_if(emitter, JIT_CC_NE);
+                }
+                else
+                {
+                    return 0;
+                }
+
+                jit_emit_adjust_sp(emitter, 1);
+            }
+            break;
+        case OPCODE_CMPN_EQ_SLOTS_BRANCH:
+        case OPCODE_CMPN_LT_SLOTS_BRANCH:
+        case OPCODE_CMPN_GT_SLOTS_BRANCH:
+        case OPCODE_CMPN_LE_SLOTS_BRANCH:
+        case OPCODE_CMPN_GE_SLOTS_BRANCH:
+            a = jit_slot(jit_read_s2(pc + 3));
+            b = jit_slot(jit_read_s2(pc + 1));
+
+            if (!jit_trace_kind(entry, a, b, &kind))
+            {
+                return 0;
+            }
+
+            a = jit_emit_trace_operand(emitter, a, entry->indirect[0], JIT_RSI);
+            b = jit_emit_trace_operand(emitter, b, entry->indirect[1], JIT_RDI);
+            jit_emit_compare(emitter, opcode - OPCODE_CMPN_EQ_SLOTS_BRANCH, a, b, kind);
+            jit_emit_register(emitter, 0, 0, 0x85, JIT_RAX, JIT_RAX);
+
+            if (next == fall_through + jit_read_s2(pc + 5))
+            {
+                jit_emit_exit_if(emitter, JIT_CC_E);
+            }
+            else if (next == fall_through)
+            {
+                jit_emit_exit_if(emitter, JIT_CC_NE);
+            }
+            else
+            {
+                return 0;
+            }
+            break;
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_ADD_FIX_FIX:
+        case OPCODE_SUB_FIX_FIX:
+        case OPCODE_MUL_FIX_FIX:
+        case OPCODE_DIV_FIX_FIX:
+        case OPCODE_ADD_FLO_FLO:
+        case OPCODE_SUB_FLO_FLO:
+        case OPCODE_MUL_FLO_FLO:
+        case OPCODE_DIV_FLO_FLO:
+            if (!jit_trace_kind(entry, jit_stack(2), jit_stack(1), &kind))
+            {
+                return 0;
+            }
+
+            a = jit_emit_trace_operand(emitter, jit_stack(2), entry->indirect[0], JIT_RSI);
+            b = jit_emit_trace_operand(emitter, jit_stack(1), entry->indirect[1], JIT_RDI);
+            jit_emit_stack_arithmetic(emitter, jit_operation(opcode), a, b, kind);
+            break;
+        case OPCODE_CMPN_EQ:
+        case OPCODE_CMPN_LT:
+        case OPCODE_CMPN_GT:
+        case OPCODE_CMPN_LE:
+        case OPCODE_CMPN_GE:
+        case OPCODE_CMPN_EQ_FIX:
+        case OPCODE_CMPN_LT_FIX:
+        case OPCODE_CMPN_GT_FIX:
+        case OPCODE_CMPN_LE_FIX:
+        case OPCODE_CMPN_GE_FIX:
+            if (!jit_trace_kind(entry, jit_stack(1), jit_stack(2), &kind))
+            {
+                return 0;
+            }
+
+            a = jit_emit_trace_operand(emitter, jit_stack(1), entry->indirect[0], JIT_RSI);
+            b = jit_emit_trace_operand(emitter, jit_stack(2), entry->indirect[1], JIT_RDI);
+            jit_emit_push_compare(emitter, (opcode >= OPCODE_CMPN_EQ_FIX) ? opcode - OPCODE_CMPN_EQ_FIX : opcode - OPCODE_CMPN_EQ, a, b, kind);
+            break;
+        case OPCODE_ADD_IMM_SLOT:
+        case OPCODE_SUB_SLOT_IMM:
+            if (opcode == OPCODE_ADD_IMM_SLOT)
+            {
+                a = jit_immediate((signed char)pc[1]);
+                b = jit_slot(jit_read_s2(pc + 2));
+            }
+            else
+            {
+                a = jit_slot(jit_read_s2(pc + 2));
+                b = jit_immediate((signed char)pc[1]);
+            }
+
+            if (!jit_trace_kind(entry, a, b, &kind))
+            {
+                return 0;
+            }
+
+            a = jit_emit_trace_operand(emitter, a, entry->indirect[0], JIT_RSI);
+            b = jit_emit_trace_operand(emitter, b, entry->indirect[1], JIT_RDI);
+            jit_emit_arithmetic(emitter, opcode == OPCODE_ADD_IMM_SLOT ? '+' : '-', a, b, jit_stack(0), kind);
+            jit_emit_adjust_sp(emitter, -1);
+            break;
+        case OPCODE_RADD:
+        case OPCODE_RSUB:
+        case OPCODE_RMUL:
+        case OPCODE_RDIV:
+        case OPCODE_RADD_IMM:
+        case OPCODE_RSUB_IMM:
+        case OPCODE_RMUL_IMM:
+        case OPCODE_RDIV_IMM:
+            a = jit_slot(jit_read_s2(pc + 3));
+            b = (opcode >= OPCODE_RADD_IMM) ? jit_immediate((signed char)pc[5]) : jit_slot(jit_read_s2(pc + 5));
+
+            if (!jit_trace_kind(entry, a, b, &kind))
+            {
+                return 0;
+            }
+
+            a = jit_emit_trace_operand(emitter, a, entry->indirect[0], JIT_RSI);
+            b = jit_emit_trace_operand(emitter, b, entry->indirect[1], JIT_RDI);
+            jit_emit_arithmetic(emitter, jit_operation(opcode), a, b, jit_slot(jit_read_s2(pc + 1)), kind);
+            break;
+        case OPCODE_LDFN:
+            jit_emit_store_constant(emitter, JIT_SP, 0, TAG_REFERENCE, (uint64_t)(uintptr_t)procedure);
+            jit_emit_adjust_sp(emitter, -1);
+            break;
+        case OPCODE_LOAD:
+            {
+                size_t bound;
+
+                /*
+                 * mov rax, [ref]; cmp rax, empty_pair; movdqu xmm0, [rax];
+                 * movdqu [ref], xmm0
+                 */
+                jit_emit_check_tag(emitter, jit_stack(1), TAG_REFERENCE);
+                jit_emit_exit_if(emitter, JIT_CC_NE);
+                jit_emit_memory(emitter, 0, 1, 0x8b, JIT_RAX, JIT_SP, JIT_OBJECT_SIZE + JIT_VALUE_OFFSET);
+                jit_emit_mov_immediate(emitter, JIT_RCX, (uint64_t)(uintptr_t)empty_pair);
+                jit_emit_register(emitter, 0, 1, 0x3b, JIT_RAX, JIT_RCX);
+                bound = jit_emit_jump(emitter, JIT_CC_NE);
+                jit_emit_exit_if(emitter, JIT_CC_ALWAYS);
+                jit_bind(emitter, bound);
+                jit_emit_memory(emitter, 0xf3, 0, 0x0f6f, 0, JIT_RAX, 0);
+                jit_emit_memory(emitter, 0xf3, 0, 0x0f7f, 0, JIT_SP, JIT_OBJECT_SIZE);
+            }
+            break;
+        case OPCODE_SET:
+            /*
+             * [value][inner reference] -> []
+             */
+            jit_emit_check_tag(emitter, jit_stack(1), TAG_INNER_REFERENCE);
+            jit_emit_exit_if(emitter, JIT_CC_NE);
+            jit_emit_check_tag(emitter, jit_stack(2), entry->tags[1]);
+            jit_emit_exit_if(emitter, JIT_CC_NE);
+            a = jit_emit_trace_operand(emitter, jit_stack(1), 1, JIT_RSI);
+            jit_emit_check_tag(emitter, a, TAG_STRING);
+            jit_emit_exit_if(emitter, JIT_CC_E);
+            jit_emit_memory(emitter, 0xf3, 0, 0x0f6f, 0, JIT_SP, 2 * JIT_OBJECT_SIZE);
+            jit_emit_memory(emitter, 0xf3, 0, 0x0f7f, 0, a.base, 0);
+            jit_emit_adjust_sp(emitter, 2);
+            break;
+        case OPCODE_GET_BOUND_LOCATION:
+            jit_emit_cache_guard(emitter, procedure, pc);
+            jit_emit_memory(emitter, 0, 1, 0x89, JIT_RAX, JIT_SP, JIT_VALUE_OFFSET);
+            jit_emit_store_header(emitter, JIT_SP, 0, TAG_REFERENCE);
+            jit_emit_adjust_sp(emitter, -1);
+            break;
+        case OPCODE_VECTOR_REF:
+            jit_emit_cache_guard(emitter, procedure, pc);
+            jit_emit_target_guard(emitter, JIT_RAX, 0, entry->callee);
+
+            /*
+             * Other operands, like the inner references nested vector-refs
+             * leave, are passed to the builtin, which resolves them the way
+             * the interpreter does.
+             */
+            if (!jit_is_builtin(entry->callee, evil_vector_ref) || entry->tags[0] != TAG_REFERENCE || entry->tags[1] != TAG_FIXNUM)
+            {
+                jit_emit_trace_call(emitter, entry->callee, 2);
+                break;
+            }
+
+            /*
+             * [vector][index] -> [inner reference]
+             * cmp byte [index], TAG_FIXNUM; mov rcx, [index];
+             * mov edx, [rax + count]; cmp rcx, rdx; jae exit
+             */
+            jit_emit_trace_vector_guard(emitter, 1);
+            jit_emit_check_tag(emitter, jit_stack(2), TAG_FIXNUM);
+            jit_emit_exit_if(emitter, JIT_CC_NE);
+            jit_emit_memory(emitter, 0, 1, 0x8b, JIT_RCX, JIT_SP, 2 * JIT_OBJECT_SIZE + JIT_VALUE_OFFSET);
+            jit_emit_memory(emitter, 0, 0, 0x8b, JIT_RDX, JIT_RAX, JIT_COUNT_OFFSET);
+            jit_emit_register(emitter, 0, 1, 0x3b, JIT_RCX, JIT_RDX);
+            jit_emit_exit_if(emitter, JIT_CC_AE);
+
+            /*
+             * mov [index + count], ecx; lea rax, [rax + 8];
+             * mov [index + 8], rax
+             */
+            jit_emit_store_header(emitter, JIT_SP, 2 * JIT_OBJECT_SIZE, TAG_INNER_REFERENCE);
+            jit_emit_memory(emitter, 0, 0, 0x89, JIT_RCX, JIT_SP, 2 * JIT_OBJECT_SIZE + JIT_COUNT_OFFSET);
+            jit_emit_memory(emitter, 0, 1, 0x8d, JIT_RAX, JIT_RAX, JIT_VALUE_OFFSET);
+            jit_emit_memory(emitter, 0, 1, 0x89, JIT_RAX, JIT_SP, 2 * JIT_OBJECT_SIZE + JIT_VALUE_OFFSET);
+            jit_emit_adjust_sp(emitter, 1);
+            break;
+        case OPCODE_VECTOR_LENGTH:
+            jit_emit_cache_guard(emitter, procedure, pc);
+            jit_emit_target_guard(emitter, JIT_RAX, 0, entry->callee);
+
+            if (!jit_is_builtin(entry->callee, evil_vector_length) || entry->tags[0] != TAG_REFERENCE)
+            {
+                jit_emit_trace_call(emitter, entry->callee, 1);
+                break;
+            }
+
+            /*
+             * [vector] -> [fixnum]
+             * mov ecx, [rax + count]; mov [vector + 8], rcx
+             */
+            jit_emit_trace_vector_guard(emitter, 1);
+            jit_emit_memory(emitter, 0, 0, 0x8b, JIT_RCX, JIT_RAX, JIT_COUNT_OFFSET);
+            jit_emit_memory(emitter, 0, 1, 0x89, JIT_RCX, JIT_SP, JIT_OBJECT_SIZE + JIT_VALUE_OFFSET);
+            jit_emit_store_header(emitter, JIT_SP, JIT_OBJECT_SIZE, TAG_FIXNUM);
+            break;
+        case OPCODE_VECTOR_SET:
+        case OPCODE_CONS:
+        case OPCODE_CALL_GLOBAL:
+            jit_emit_cache_guard(emitter, procedure, pc);
+            jit_emit_target_guard(emitter, JIT_RAX, 0, entry->callee);
+            jit_emit_trace_call(emitter, entry->callee, jit_read_s2(pc + 1 + 8 + VM_INLINE_CACHE_SIZE));
+            break;
+        case OPCODE_TAILCALL_GLOBAL:
+            jit_emit_cache_guard(emitter, procedure, pc);
+            jit_emit_target_guard(emitter, JIT_RAX, 0, procedure);
+            jit_emit_trace_safepoint(emitter, procedure);
+            jit_emit_trace_loop(emitter, procedure, 1, head);
+            break;
+        case OPCODE_TAILCALL:
+            jit_emit_target_guard(emitter, JIT_SP, JIT_OBJECT_SIZE, procedure);
+            jit_emit_trace_safepoint(emitter, procedure);
+            jit_emit_trace_loop(emitter, procedure, 2, head);
+            break;
+        case OPCODE_BRANCH_IF_SELF:
+            jit_emit_cache_guard(emitter, procedure, pc);
+            jit_emit_target_guard(emitter, JIT_RAX, 0, procedure);
+            break;
+        case OPCODE_LOOP:
+            jit_emit_trace_safepoint(emitter, procedure);
+            jit_emit_trace_restart(emitter, procedure, head);
+            break;
+        case OPCODE_LDSLOT_X:
+        case OPCODE_STSLOT_X:
+        case OPCODE_LDIMM_1_BOOL:
+        case OPCODE_LDIMM_1_CHAR:
+        case OPCODE_LDIMM_1_FIXNUM:
+        case OPCODE_LDIMM_1_FLONUM:
+        case OPCODE_LDIMM_4_FIXNUM:
+        case OPCODE_LDIMM_4_FLONUM:
+        case OPCODE_LDIMM_8_FIXNUM:
+        case OPCODE_LDIMM_8_FLONUM:
+        case OPCODE_LDIMM_8_SYMBOL:
+        case OPCODE_LDEMPTY:
+        case OPCODE_POP:
+        case OPCODE_NOP:
+            jit_emit_instruction(emitter, pc, fall_through);
+            break;
+        default:
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Compiles the recorded loop into a trace for the procedure. The trace
+ * starts with the same trampoline as the procedure's native code.
+ */
+static void
+jit_compile_trace(struct jit_trace_recorder_t *recorder)
+{
+    struct jit_code_t *code;
+    struct jit_emitter_t emitter;
+    unsigned char *native;
+    size_t head;
+    int i;
+
+    code = jit_native_code(recorder->procedure);
+    memset(&emitter, 0, sizeof emitter);
+    jit_emit_prologue(&emitter);
+    head = emitter.size;
+
+    if (code == NULL || recorder->num_entries == 0 || recorder->entries[0].offset != 0)
+    {
+        goto compile_failed;
+    }
+
+    for (i = 0; i < recorder->num_entries; ++i)
+    {
+        emitter.current_offset = recorder->entries[i].offset;
+
+        if (!jit_emit_trace_instruction(&emitter, recorder, i, head))
+        {
+            goto compile_failed;
+        }
+    }
+
+    if (!jit_resolve_patches(&emitter, NULL) || emitter.failed)
+    {
+        goto compile_failed;
+    }
+
+    native = jit_allocate_executable(jit_environment(recorder->procedure), emitter.buffer, emitter.size);
+
+    if (native != NULL)
+    {
+        code->trace = native;
+        code->trace_entry = (int)head;
+        code->trace_lexical_environment = jit_lexical_environment(recorder->procedure);
+    }
+
+compile_failed:
+    free(emitter.buffer);
+    free(emitter.patches);
+}
+
+int
+jit_finish_trace(struct jit_trace_recorder_t *recorder, struct evil_object_t *program_area)
+{
+    if (program_area != recorder->program_area)
+    {
+        return 0;
+    }
+
+    jit_compile_trace(recorder);
+    free(recorder);
+
+    return 1;
+}
+
+void
+jit_cancel_trace(struct jit_trace_recorder_t *recorder)
+{
+    free(recorder);
+}
+
+#endif
+
+#else
+
+struct jit_code_t *
+jit_compile(struct evil_object_t *procedure)
+{
+    UNUSED(procedure);
+
+    return NULL;
+}
+
+int
+jit_run(struct jit_code_t *code, struct jit_context_t *context, int offset)
+{
+    UNUSED(code);
+    UNUSED(context);
+
+    return offset;
+}
+
+void
+jit_code_cache_destroy(struct jit_code_cache_t *cache)
+{
+    UNUSED(cache);
+}
+
+#endif
@@ -0,0 +1,186 @@
+/***********************************************************************
+ * evilscheme, Copyright (c) 2012-2015, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE.TXT for details.
+ ***********************************************************************/
+
+#ifndef EVIL_JIT_H
+#define EVIL_JIT_H
+
+#include <stdint.h>
+
+#include "object.h"
+#include "vm.h"
+
+/*
+ * Baseline JIT: translates a procedure's bytecode, one instruction template
+ * at a time, into x86-64 machine code that works directly on the VM's
+ * evaluation stack and program area. Only straight line code is translated:
+ * loads, stores, immediates, branches and numeric arithmetic/comparisons.
+ * Calls, returns, global lookups and anything else leave the native code and
+ * continue in the interpreter at that instruction, as does any type guard
+ * that fails. The interpreter enters native code again at the next call,
+ * tail call, return or loop back edge that lands in a compiled procedure.
+ *
+ * It is only available on x86-64 Linux with a GCC compatible compiler.
+ */
+#ifndef ENABLE_JIT
+#   if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__)
+#       define ENABLE_JIT 1
+#   else
+#       define ENABLE_JIT 0
+#   endif
+#endif
+
+/*
+ * A procedure is compiled on the call that brings its FIELD_NATIVE_CODE
+ * countdown to zero, so on its second call by default. Most top level forms
+ * are only ever called once and are not worth compiling. A countdown of zero
+ * means the procedure is never compiled.
+ */
+#ifndef JIT_CALL_THRESHOLD
+#   define JIT_CALL_THRESHOLD 2
+#endif
+
+/*
+ * Loop tracing: loops are self tail calls, or the OPCODE_LOOP jumps the
+ * compiler turns them into, so once a compiled procedure has taken either
+ * back edge JIT_TRACE_THRESHOLD times the interpreter records the path one
+ * iteration takes from the top of the procedure back around to the back
+ * edge, along with the types it saw. The path is compiled into a trace:
+ * straight line native code where every branch and type check the recording
+ * depended on is a guard, and which loops back to its own start instead of
+ * performing the tail call. A failed guard leaves the trace and execution
+ * continues in the procedure's baseline native code at that instruction.
+ * Each time around, a trace counts against the running fiber's time slice
+ * like the interpreter's back edges do and leaves when it runs out, which
+ * is what lets fibers be preempted and metered invocations be suspended in
+ * hot loops. Recording needs threaded dispatch, as it works by swapping the
+ * dispatch table.
+ */
+#ifndef ENABLE_JIT_TRACING
+#   define ENABLE_JIT_TRACING ENABLE_JIT
+#endif
+
+#ifndef JIT_TRACE_THRESHOLD
+#   define JIT_TRACE_THRESHOLD 16
+#endif
+
+#define JIT_MAX_TRACE_LENGTH 256
+#define JIT_MAX_TRACE_ATTEMPTS 4
+
+struct evil_environment_t;
+struct evil_object_handle_t;
+struct jit_code_t;
+struct jit_code_cache_t;
+struct jit_trace_recorder_t;
+
+/*
+ * The part of the interpreter state that native code reads and updates.
+ */
+struct jit_context_t
+{
+    struct evil_object_t *sp;
+    struct evil_object_t *program_area;
+    struct evil_environment_t *environment;
+    struct evil_object_handle_t *lexical_environment_handle;
+};
+
+/*
+ * Frees the native code of an environment, see evil_environment_t.
+ */
+void
+jit_code_cache_destroy(struct jit_code_cache_t *cache);
+
+/*
+ * Translates the procedure's bytecode and stores the result in its
+ * FIELD_NATIVE_CODE. Returns NULL if the procedure cannot be compiled, in
+ * which case it stays interpreted.
+ */
+struct jit_code_t *
+jit_compile(struct evil_object_t *procedure);
+
+/*
+ * Runs the native code starting at the instruction at the given bytecode
+ * offset until it exits. Returns the bytecode offset of the instruction the
+ * interpreter must resume at.
+ */
+int
+jit_run(struct jit_code_t *code, struct jit_context_t *context, int offset);
+
+/*
+ * Counts a loop back edge taken by the procedure in the frame at
+ * program_area. Returns a recorder if the loop just became hot and should be
+ * traced, starting with the next instruction executed.
+ */
+struct jit_trace_recorder_t *
+jit_count_loop(struct evil_object_t *procedure, struct evil_object_t *program_area);
+
+/*
+ * Records the instruction at pc, which is about to be executed. Instructions
+ * executed in frames other than the one being traced are skipped. Returns 0
+ * and frees the recorder if the loop cannot be traced.
+ */
+int
+jit_record_instruction(struct jit_trace_recorder_t *recorder, struct evil_object_t *procedure, const unsigned char *pc, struct evil_object_t *sp, struct evil_object_t *program_area);
+
+/*
+ * Called on every loop back edge while recording. Returns 0 if it was taken
+ * by some other frame; otherwise the loop has been recorded, the
+ * trace is compiled if possible and the recorder is freed.
+ */
+int
+jit_finish_trace(struct jit_trace_recorder_t *recorder, struct evil_object_t *program_area);
+
+/*
+ * Frees the recorder without compiling anything, for when the interpreter
+ * switches away from the frame being traced.
+ */
+void
+jit_cancel_trace(struct jit_trace_recorder_t *recorder);
+
+/*
+ * The procedure's FIELD_NATIVE_CODE holds the fixnum call countdown until
+ * the procedure is compiled and afterwards a TAG_EXTERNAL_FUNCTION object
+ * holding the native code.
+ */
+static inline struct jit_code_t *
+jit_native_code(struct evil_object_t *procedure)
+{
+    struct evil_object_t *native_code;
+
+    native_code = &VECTOR_BASE(procedure)[FIELD_NATIVE_CODE];
+
+    if (native_code->tag_count.tag != TAG_EXTERNAL_FUNCTION)
+    {
+        return NULL;
+    }
+
+    return (struct jit_code_t *)(intptr_t)native_code->value.fixnum_value;
+}
+
+/*
+ * Counts a call to the procedure and compiles it once it becomes hot.
+ * Returns the procedure's native code, or NULL if it has none.
+ */
+static inline struct jit_code_t *
+jit_count_call(struct evil_object_t *procedure)
+{
+    struct evil_object_t *native_code;
+
+    native_code = &VECTOR_BASE(procedure)[FIELD_NATIVE_CODE];
+
+    if (native_code->tag_count.tag == TAG_EXTERNAL_FUNCTION)
+    {
+        return (struct jit_code_t *)(intptr_t)native_code->value.fixnum_value;
+    }
+
+    if (native_code->value.fixnum_value > 0 && --native_code->value.fixnum_value == 0)
+    {
+        return jit_compile(procedure);
+    }
+
+    return NULL;
+}
+
+#endif
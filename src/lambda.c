@@ -13,10 +13,12 @@
 #include "base.h"
 #include "environment.h"
 #include "gc.h"
+#include "jit.h"
 #include "lambda.h"
 #include "linear_allocator.h"
 #include "object.h"
 #include "runtime.h"
+#include "verify.h"
 #include "vm.h"
 
 #define UNKNOWN_ARG -1
@@ -28,6 +30,15 @@
 #define MAX(a,b) ((a)>(b)?(a):(b))
 #endif
 
+/*
+ * The register code generator compiles arithmetic over locals and numeric
+ * literals to the OPCODE_R<binop> instructions, which operate on program
+ * area slots directly. Everything else is always compiled to stack code.
+ */
+#ifndef ENABLE_REGISTER_CODEGEN
+#   define ENABLE_REGISTER_CODEGEN 1
+#endif
+
 #define SYMBOL_IF           0x8325f07b4eb2a24
 #define SYMBOL_ADD          0xaf63bd4c8601b7f4
 #define SYMBOL_SUB          0xaf63bd4c8601b7f2
@@ -42,6 +53,10 @@
 #define SYMBOL_NULLP        0xb4d24b59678288cd
 #define SYMBOL_FIRST        0xc0de9a9b8ec0e479
 #define SYMBOL_REST         0x9ab4817ea75b3deb
+#define SYMBOL_VECTOR_REF   0x9e792f7bf21904d4
+#define SYMBOL_VECTOR_SET   0x5a005e9c5d11c7c0
+#define SYMBOL_VECTOR_LENGTH 0x510df20d3bfde9a9
+#define SYMBOL_CONS         0x1ccadd7ef114bd8e
 #define SYMBOL_LAMBDA       0xdb4485ae65d0c568
 #define SYMBOL_SET          0x92eb577ea331d824
 #define SYMBOL_LET          0xd8b7ad186b906050
@@ -74,9 +89,11 @@ struct function_local_t
     struct slist_t link;
 
     /*
-     * TODO: Should this be an object handle instead of a pointer?
+     * Procedures compiled for nested lambdas aren't referred to by anything
+     * else until they are stored in the enclosing procedure, and the
+     * compiler allocates in between.
      */
-    struct evil_object_t *object;
+    struct evil_object_handle_t *object;
 };
 
 struct closure_variable_t
@@ -101,6 +118,14 @@ struct compiler_context_t
     struct evil_object_handle_t *lexical_environment;
     struct evil_object_handle_t *parent_environment;
     int closure_has_allocated_environment;
+
+    /*
+     * The symbol the lambda being compiled is about to be defined as, if
+     * any, and the symbol the define currently being compiled in this
+     * context binds a lambda to. See compile_self_tailcalls.
+     */
+    struct evil_object_t *self_symbol;
+    struct evil_object_t *defined_symbol;
 };
 
 static struct compiler_context_t *
@@ -130,6 +155,14 @@ compile_load_function_local(struct compiler_context_t *context, struct instructi
 static void
 disassemble_bytecode(struct evil_environment_t *environment, const unsigned char *ptr, size_t num_bytes);
 
+#if ENABLE_REGISTER_CODEGEN
+static int
+is_nested_register_expression(struct compiler_context_t *context, struct evil_object_t *args);
+
+static struct instruction_t *
+compile_register_expression_to_stack(struct compiler_context_t *context, struct instruction_t *next, unsigned char opcode, struct evil_object_t *args);
+#endif
+
 static void
 create_slots_for_args(
         struct compiler_context_t *context,
@@ -236,6 +269,7 @@ compile_if(struct compiler_context_t *context, struct instruction_t *next, struc
     struct instruction_t *cond_br;
     struct instruction_t *br;
     struct instruction_t *nop;
+    struct instruction_t *ldempty;
     struct instruction_t *cond_br_target;
 
     test_form = CAR(body);
@@ -273,9 +307,14 @@ compile_if(struct compiler_context_t *context, struct instruction_t *next, struc
         /*
          * Since there's no alternate, we emit a nop that is the branch target
          * if the conditional is not taken. This can be eliminated by a pass
-         * through the bytecode at a later date if desired.
+         * through the bytecode at a later date if desired. The untaken path
+         * still needs a value on the stack, so it pushes the empty pair,
+         * which stands in for unspecified values.
          */
-        br->link.next = &cond_br->link;
+        ldempty = allocate_instruction(context);
+        ldempty->opcode = OPCODE_LDEMPTY;
+        ldempty->link.next = &cond_br->link;
+        br->link.next = &ldempty->link;
         br->reloc = nop;
         nop->link.next = &consequent_code->link;
 
@@ -304,6 +343,13 @@ compile_add(struct compiler_context_t *context, struct instruction_t *next, stru
     struct evil_object_t *arg;
     int i;
 
+#if ENABLE_REGISTER_CODEGEN
+    if (is_nested_register_expression(context, args))
+    {
+        return compile_register_expression_to_stack(context, next, OPCODE_RADD, args);
+    }
+#endif
+
     insn = next;
     arg = args;
     i = 0;
@@ -347,6 +393,13 @@ compile_sub(struct compiler_context_t *context, struct instruction_t *next, stru
     int i;
     int num_parameters;
 
+#if ENABLE_REGISTER_CODEGEN
+    if (is_nested_register_expression(context, args))
+    {
+        return compile_register_expression_to_stack(context, next, OPCODE_RSUB, args);
+    }
+#endif
+
     insn = next;
     arg = args;
     i = 0;
@@ -403,6 +456,13 @@ compile_mul(struct compiler_context_t *context, struct instruction_t *next, stru
     int i;
     int num_parameters;
 
+#if ENABLE_REGISTER_CODEGEN
+    if (is_nested_register_expression(context, args))
+    {
+        return compile_register_expression_to_stack(context, next, OPCODE_RMUL, args);
+    }
+#endif
+
     insn = next;
     arg = args;
     i = 0;
@@ -459,6 +519,13 @@ compile_div(struct compiler_context_t *context, struct instruction_t *next, stru
     int i;
     int num_parameters;
 
+#if ENABLE_REGISTER_CODEGEN
+    if (is_nested_register_expression(context, args))
+    {
+        return compile_register_expression_to_stack(context, next, OPCODE_RDIV, args);
+    }
+#endif
+
     insn = next;
     arg = args;
     i = 0;
@@ -599,14 +666,9 @@ compile_direct_call(struct compiler_context_t *context, struct instruction_t *ne
     struct compiler_context_t *closure_root_context;
 
     /*
-     * Optimization opportunity -- tail calls to self can be replaced with
-     * branch to beginning of function. The difficulty will be detecting if
-     * we are branching to ourself. This will not be possible if we're compiling
-     * the form (define foo (lambda (x) ...))) because the slot foo can later be
-     * rebound, but if we're compiling (define (foo x) ...) I think it would be
-     * acceptable behavior to perform this optimization.
-     *
-     * TODO: Once the parser recognizes (define (foo x) ...), add this in.
+     * Tail calls to self are replaced with a guarded branch to the beginning
+     * of the function once tail positions are known, see
+     * compile_self_tailcalls.
      */
 
     num_args = 0;
@@ -637,6 +699,54 @@ compile_direct_call(struct compiler_context_t *context, struct instruction_t *ne
     return emit_call(context, function_symbol, num_args);
 }
 
+static struct instruction_t *
+compile_primitive_call(struct compiler_context_t *context, struct instruction_t *next, struct evil_object_t *function, struct evil_object_t *args, unsigned char opcode, int expected_num_args)
+{
+    int num_args;
+    struct evil_object_t *arg;
+    struct instruction_t *evaluated_args;
+    struct instruction_t *primitive;
+    struct stack_slot_t *previous_local_slot;
+    struct compiler_context_t *closure_root_context;
+
+    /*
+     * Calls to vector-ref, vector-set!, vector-length and cons are emitted
+     * as a single instruction that performs the operation inline as long as
+     * the global still refers to the builtin. The instruction is laid out
+     * like CALL_GLOBAL and the VM falls back to calling whatever the symbol
+     * is bound to otherwise, so rebinding these names keeps working. A local
+     * variable of the same name is an ordinary call.
+     */
+    num_args = 0;
+
+    for (arg = args; arg != empty_pair; arg = CDR(arg))
+    {
+        ++num_args;
+    }
+
+    if (num_args != expected_num_args || get_stack_slot(context->stack_slots, function->value.symbol_hash) != NULL)
+    {
+        return compile_direct_call(context, next, function, args);
+    }
+
+    num_args = 0;
+    evaluated_args = compile_arg_eval(context, next, args, &num_args);
+
+    if ((closure_root_context = identify_local_in_previous_context(context, function->value.symbol_hash, &previous_local_slot)) != NULL)
+    {
+        bind_symbol_for_scoped_environment(context, closure_root_context, function, previous_local_slot);
+    }
+
+    primitive = allocate_instruction(context);
+    primitive->opcode = opcode;
+    primitive->size = 10 + VM_INLINE_CACHE_SIZE;
+    primitive->data.call_global.symbol_hash = function->value.symbol_hash;
+    primitive->data.call_global.num_args = (unsigned short)num_args;
+    primitive->link.next = &evaluated_args->link;
+
+    return primitive;
+}
+
 static struct instruction_t *
 compile_nullp(struct compiler_context_t *context, struct instruction_t *next, struct evil_object_t *args)
 {
@@ -777,7 +887,7 @@ compile_get_bound_location(struct compiler_context_t *context, struct instructio
 
     get_bound_location = allocate_instruction(context);
     get_bound_location->opcode = OPCODE_GET_BOUND_LOCATION;
-    get_bound_location->size = 8;
+    get_bound_location->size = 8 + VM_INLINE_CACHE_SIZE;
     get_bound_location->data.u8 = symbol->value.symbol_hash;
     get_bound_location->link.next = &next->link;
 
@@ -835,6 +945,213 @@ count_active_stack_slots(struct stack_slot_t *slots)
     return i;
 }
 
+#if ENABLE_REGISTER_CODEGEN
+static unsigned char
+register_opcode(struct evil_object_t *form)
+{
+    struct evil_object_t *function_symbol;
+
+    if (form->tag_count.tag != TAG_PAIR || form == empty_pair)
+    {
+        return OPCODE_INVALID;
+    }
+
+    function_symbol = CAR(form);
+
+    if (function_symbol->tag_count.tag != TAG_SYMBOL)
+    {
+        return OPCODE_INVALID;
+    }
+
+    switch (function_symbol->value.symbol_hash)
+    {
+        case SYMBOL_ADD:
+            return OPCODE_RADD;
+        case SYMBOL_SUB:
+            return OPCODE_RSUB;
+        case SYMBOL_MUL:
+            return OPCODE_RMUL;
+        case SYMBOL_DIV:
+            return OPCODE_RDIV;
+        default:
+            return OPCODE_INVALID;
+    }
+}
+
+static inline int
+is_register_immediate(struct evil_object_t *form)
+{
+    return form->tag_count.tag == TAG_FIXNUM
+        && form->value.fixnum_value >= -128
+        && form->value.fixnum_value <= 127;
+}
+
+static int
+is_register_expression(struct compiler_context_t *context, struct evil_object_t *args);
+
+static int
+is_register_operand(struct compiler_context_t *context, struct evil_object_t *form)
+{
+    switch (form->tag_count.tag)
+    {
+        case TAG_FIXNUM:
+        case TAG_FLONUM:
+            return 1;
+        case TAG_SYMBOL:
+            return get_stack_slot(context->stack_slots, form->value.symbol_hash) != NULL;
+        case TAG_PAIR:
+            return register_opcode(form) != OPCODE_INVALID && is_register_expression(context, CDR(form));
+        default:
+            return 0;
+    }
+}
+
+static int
+is_register_expression(struct compiler_context_t *context, struct evil_object_t *args)
+{
+    /*
+     * Only binary operations whose operands are locals, numeric literals or
+     * other such operations are compiled to register code. Restricting the
+     * operands this way means they have no side effects, so it does not
+     * matter that a register instruction reads its source slots after the
+     * operands to its right have been evaluated.
+     */
+    if (count_parameters(args) != 2)
+    {
+        return 0;
+    }
+
+    return is_register_operand(context, CAR(args))
+        && is_register_operand(context, CAR(CDR(args)));
+}
+
+static int
+is_nested_register_expression(struct compiler_context_t *context, struct evil_object_t *args)
+{
+    /*
+     * A lone operation whose result is pushed to the stack is no shorter in
+     * register form than in stack form, so this is only used when at least
+     * one of the operands is itself an operation.
+     */
+    return is_register_expression(context, args)
+        && (CAR(args)->tag_count.tag == TAG_PAIR || CAR(CDR(args))->tag_count.tag == TAG_PAIR);
+}
+
+static short
+allocate_register_temporary(struct compiler_context_t *context, int *num_temporaries)
+{
+    int slot_index;
+
+    /*
+     * Temporaries live just past the let-bound slots that are currently in
+     * scope. Register expressions contain no let forms so nothing else can
+     * claim these slots while the expression is being compiled.
+     */
+    slot_index = count_active_stack_slots(context->stack_slots) + (*num_temporaries)++;
+    assert(slot_index >= 0 && slot_index < 65536);
+
+    context->max_stack_slots = MAX(context->max_stack_slots, slot_index + 1);
+
+    return (short)vm_slot_index(slot_index);
+}
+
+static struct instruction_t *
+compile_register_expression(struct compiler_context_t *context, struct instruction_t *next, unsigned char opcode, struct evil_object_t *args, short dst, int *num_temporaries);
+
+static struct instruction_t *
+compile_register_operand(struct compiler_context_t *context, struct instruction_t *next, struct evil_object_t *form, short *slot, int *num_temporaries)
+{
+    if (form->tag_count.tag == TAG_SYMBOL)
+    {
+        *slot = get_stack_slot(context->stack_slots, form->value.symbol_hash)->index;
+        return next;
+    }
+
+    *slot = allocate_register_temporary(context, num_temporaries);
+
+    if (form->tag_count.tag == TAG_PAIR)
+    {
+        return compile_register_expression(context, next, register_opcode(form), CDR(form), *slot, num_temporaries);
+    }
+
+    return compile_store_slot(context, compile_literal(context, next, form), *slot);
+}
+
+static struct instruction_t *
+compile_register_expression(struct compiler_context_t *context, struct instruction_t *next, unsigned char opcode, struct evil_object_t *args, short dst, int *num_temporaries)
+{
+    struct evil_object_t *lhs_form;
+    struct evil_object_t *rhs_form;
+    struct instruction_t *insn;
+    int first_temporary;
+
+    lhs_form = CAR(args);
+    rhs_form = CAR(CDR(args));
+    first_temporary = *num_temporaries;
+
+    if ((opcode == OPCODE_RADD || opcode == OPCODE_RMUL)
+            && is_register_immediate(lhs_form)
+            && !is_register_immediate(rhs_form))
+    {
+        struct evil_object_t *temp;
+
+        temp = lhs_form;
+        lhs_form = rhs_form;
+        rhs_form = temp;
+    }
+
+    insn = allocate_instruction(context);
+    insn->opcode = opcode;
+    insn->size = 6;
+    insn->data.registers.dst = dst;
+    insn->link.next = &compile_register_operand(context, next, lhs_form, &insn->data.registers.src[0], num_temporaries)->link;
+
+    if (is_register_immediate(rhs_form))
+    {
+        /*
+         * The immediate forms directly follow their register counterparts
+         * in the opcode enumeration.
+         */
+        insn->opcode = (unsigned char)(opcode + (OPCODE_RADD_IMM - OPCODE_RADD));
+        insn->size = 5;
+        insn->data.registers.immediate = (char)rhs_form->value.fixnum_value;
+    }
+    else
+    {
+        insn->link.next = &compile_register_operand(context, (struct instruction_t *)insn->link.next, rhs_form, &insn->data.registers.src[1], num_temporaries)->link;
+    }
+
+    /*
+     * The operands' temporaries are dead once this instruction has consumed
+     * them, so they can be handed out again.
+     */
+    *num_temporaries = first_temporary;
+
+    return insn;
+}
+
+static struct instruction_t *
+compile_register_expression_to_stack(struct compiler_context_t *context, struct instruction_t *next, unsigned char opcode, struct evil_object_t *args)
+{
+    int num_temporaries;
+    short dst;
+    struct instruction_t *insn;
+    struct instruction_t *load;
+
+    num_temporaries = 0;
+    dst = allocate_register_temporary(context, &num_temporaries);
+    insn = compile_register_expression(context, next, opcode, args, dst, &num_temporaries);
+
+    load = allocate_instruction(context);
+    load->opcode = OPCODE_LDSLOT_X;
+    load->size = 2;
+    load->data.s2 = dst;
+    load->link.next = &insn->link;
+
+    return load;
+}
+#endif
+
 static void
 link_initializer_sequence(struct slist_t *initializer, struct slist_t *next)
 {
@@ -1002,7 +1319,6 @@ compile_define_impl(struct compiler_context_t *context, uint64_t symbol_hash, st
     struct instruction_t *define_symbol_location;
     struct instruction_t *define_function;
     struct instruction_t *call;
-    struct instruction_t *pop;
     struct evil_object_t define_symbol;
 
     symbol = allocate_instruction(context);
@@ -1025,11 +1341,12 @@ compile_define_impl(struct compiler_context_t *context, uint64_t symbol_hash, st
     call->opcode = OPCODE_CALL;
     call->link.next = &define_function->link;
 
-    pop = allocate_instruction(context);
-    pop->opcode = OPCODE_POP;
-    pop->link.next = &call->link;
-
-    return pop;
+    /*
+     * Like any other form, a definition leaves its value, the value bound,
+     * on the stack. Popping it left a procedure whose last form was a
+     * definition returning the slot above its stack.
+     */
+    return call;
 }
 
 static struct instruction_t *
@@ -1042,9 +1359,18 @@ compile_define(struct compiler_context_t *context, struct instruction_t *next, s
     symbol_form = CAR(args);
     value_form = CAR(CDR(args));
 
+    assert(symbol_form->tag_count.tag == TAG_SYMBOL);
+
+    if (value_form->tag_count.tag == TAG_PAIR
+            && CAR(value_form)->tag_count.tag == TAG_SYMBOL
+            && CAR(value_form)->value.symbol_hash == SYMBOL_LAMBDA)
+    {
+        context->defined_symbol = symbol_form;
+    }
+
     value = compile_form(context, next, value_form);
+    context->defined_symbol = NULL;
 
-    assert(symbol_form->tag_count.tag == TAG_SYMBOL);
     symbol_hash = symbol_form->value.symbol_hash;
 
     return compile_define_impl(context, symbol_hash, value);
@@ -1086,6 +1412,29 @@ compile_set(struct compiler_context_t *context, struct instruction_t *next, stru
     place_form = CAR(args);
     value_form = CAR(CDR(args));
 
+#if ENABLE_REGISTER_CODEGEN
+    if (place_form->tag_count.tag == TAG_SYMBOL
+            && register_opcode(value_form) != OPCODE_INVALID
+            && is_register_expression(context, CDR(value_form)))
+    {
+        struct stack_slot_t *stack_slot;
+
+        /*
+         * Setting a local to the result of an arithmetic expression lets the
+         * last register instruction write the local directly.
+         */
+        stack_slot = get_stack_slot(context->stack_slots, place_form->value.symbol_hash);
+
+        if (stack_slot != NULL)
+        {
+            int num_temporaries;
+
+            num_temporaries = 0;
+            return compile_register_expression(context, next, register_opcode(value_form), CDR(value_form), stack_slot->index, &num_temporaries);
+        }
+    }
+#endif
+
     value = compile_form(context, next, value_form);
 
     if (place_form->tag_count.tag == TAG_PAIR)
@@ -1350,6 +1699,14 @@ compile_form(struct compiler_context_t *context, struct instruction_t *next, str
                     return compile_first(context, next, function_args);
                 case SYMBOL_REST:
                     return compile_rest(context, next, function_args);
+                case SYMBOL_VECTOR_REF:
+                    return compile_primitive_call(context, next, function_symbol, function_args, OPCODE_VECTOR_REF, 2);
+                case SYMBOL_VECTOR_SET:
+                    return compile_primitive_call(context, next, function_symbol, function_args, OPCODE_VECTOR_SET, 3);
+                case SYMBOL_VECTOR_LENGTH:
+                    return compile_primitive_call(context, next, function_symbol, function_args, OPCODE_VECTOR_LENGTH, 1);
+                case SYMBOL_CONS:
+                    return compile_primitive_call(context, next, function_symbol, function_args, OPCODE_CONS, 2);
                 case SYMBOL_LAMBDA:
                     return compile_lambda(context, next, function_args);
                 case SYMBOL_SET:
@@ -1452,6 +1809,7 @@ assemble(struct evil_environment_t *environment, struct compiler_context_t *cont
     size_t idx;
     size_t fn_local_idx;
     struct evil_object_t *procedure_base;
+    struct verify_error_t verify_error;
 
     /*
      * This must be the last function called as it destructively alters the
@@ -1482,10 +1840,10 @@ assemble(struct evil_environment_t *environment, struct compiler_context_t *cont
         procedure_base[FIELD_LEXICAL_ENVIRONMENT] = environment->lexical_environment;
     }
 
-    procedure_base[FIELD_NUM_ARGS] = make_fixnum_object(context->num_args);
-    procedure_base[FIELD_NUM_LOCALS] = make_fixnum_object(context->max_stack_slots);
-    procedure_base[FIELD_NUM_FN_LOCALS] = make_fixnum_object(context->num_fn_locals);
+    procedure_base[FIELD_HEADER] = vm_make_procedure_header(context->num_args, context->max_stack_slots);
     procedure_base[FIELD_CODE] = make_ref(byte_code);
+    procedure_base[FIELD_NATIVE_CODE] = make_fixnum_object(JIT_CALL_THRESHOLD);
+    procedure_base[FIELD_NAME] = (context->self_symbol != NULL) ? *context->self_symbol : make_empty_ref();
 
     for (i = insns; i != NULL; i = i->next)
     {
@@ -1512,20 +1870,49 @@ assemble(struct evil_environment_t *environment, struct compiler_context_t *cont
                     idx += 2;
                 }
                 break;
+            case OPCODE_CMPN_EQ_SLOTS_BRANCH:
+            case OPCODE_CMPN_LT_SLOTS_BRANCH:
+            case OPCODE_CMPN_GT_SLOTS_BRANCH:
+            case OPCODE_CMPN_LE_SLOTS_BRANCH:
+            case OPCODE_CMPN_GE_SLOTS_BRANCH:
+                {
+                    union convert_two_t c2;
+
+                    c2.s2 = insn->data.compare_slots.slots[0];
+                    memcpy(&bytes[idx], c2.bytes, 2);
+                    c2.s2 = insn->data.compare_slots.slots[1];
+                    memcpy(&bytes[idx + 2], c2.bytes, 2);
+                    idx += 4;
+                }
+                /* FALLTHROUGH */
             case OPCODE_BRANCH:
             case OPCODE_COND_BRANCH:
+            case OPCODE_BRANCH_IF_SELF:
+            case OPCODE_LOOP:
                 {
                     int offset;
                     int target_offset;
                     int diff;
                     union convert_two_t c2;
 
+                    if (opcode == OPCODE_BRANCH_IF_SELF)
+                    {
+                        union convert_eight_t c8;
+
+                        c8.u8 = insn->data.u8;
+                        memcpy(&bytes[idx], c8.bytes, 8);
+                        idx += 8;
+
+                        memset(&bytes[idx], 0, VM_INLINE_CACHE_SIZE);
+                        idx += VM_INLINE_CACHE_SIZE;
+                    }
+
                     /*
                      * We add 1 to the offset of the current instruction
                      * because this one accounts for the PC's offset after
                      * it has decoded the opcode.
                      */
-                    offset = insn->offset + 3;
+                    offset = insn->offset + 1 + (int)size;
                     target_offset = insn->reloc->offset;
                     diff = target_offset - offset;
 
@@ -1536,6 +1923,70 @@ assemble(struct evil_environment_t *environment, struct compiler_context_t *cont
                     idx += 2;
                 }
                 break;
+            case OPCODE_CALL_GLOBAL:
+            case OPCODE_TAILCALL_GLOBAL:
+            case OPCODE_VECTOR_REF:
+            case OPCODE_VECTOR_SET:
+            case OPCODE_VECTOR_LENGTH:
+            case OPCODE_CONS:
+                {
+                    union convert_eight_t c8;
+                    union convert_two_t c2;
+
+                    c8.u8 = insn->data.call_global.symbol_hash;
+                    memcpy(&bytes[idx], c8.bytes, 8);
+                    idx += 8;
+
+                    memset(&bytes[idx], 0, VM_INLINE_CACHE_SIZE);
+                    idx += VM_INLINE_CACHE_SIZE;
+
+                    c2.u2 = insn->data.call_global.num_args;
+                    memcpy(&bytes[idx], c2.bytes, 2);
+                    idx += 2;
+                }
+                break;
+            case OPCODE_ADD_IMM_SLOT:
+            case OPCODE_SUB_SLOT_IMM:
+                {
+                    union convert_two_t c2;
+
+                    bytes[idx++] = (unsigned char)insn->data.immediate_slot.immediate;
+                    c2.s2 = insn->data.immediate_slot.slot;
+                    memcpy(&bytes[idx], c2.bytes, 2);
+                    idx += 2;
+                }
+                break;
+            case OPCODE_RADD:
+            case OPCODE_RSUB:
+            case OPCODE_RMUL:
+            case OPCODE_RDIV:
+            case OPCODE_RADD_IMM:
+            case OPCODE_RSUB_IMM:
+            case OPCODE_RMUL_IMM:
+            case OPCODE_RDIV_IMM:
+                {
+                    union convert_two_t c2;
+
+                    c2.s2 = insn->data.registers.dst;
+                    memcpy(&bytes[idx], c2.bytes, 2);
+                    idx += 2;
+
+                    c2.s2 = insn->data.registers.src[0];
+                    memcpy(&bytes[idx], c2.bytes, 2);
+                    idx += 2;
+
+                    if (insn->opcode >= OPCODE_RADD_IMM)
+                    {
+                        bytes[idx++] = (unsigned char)insn->data.registers.immediate;
+                    }
+                    else
+                    {
+                        c2.s2 = insn->data.registers.src[1];
+                        memcpy(&bytes[idx], c2.bytes, 2);
+                        idx += 2;
+                    }
+                }
+                break;
             case OPCODE_LDIMM_1_BOOL:
             case OPCODE_LDIMM_1_CHAR:
             case OPCODE_LDIMM_1_FIXNUM:
@@ -1577,6 +2028,15 @@ assemble(struct evil_environment_t *environment, struct compiler_context_t *cont
                 }
                 break;
             case OPCODE_GET_BOUND_LOCATION:
+                {
+                    union convert_eight_t c8;
+                    c8.u8 = insn->data.u8;
+                    memcpy(&bytes[idx], c8.bytes, 8);
+                    idx += 8;
+                    memset(&bytes[idx], 0, VM_INLINE_CACHE_SIZE);
+                    idx += VM_INLINE_CACHE_SIZE;
+                }
+                break;
             case OPCODE_LDIMM_8_SYMBOL:
                 {
                     union convert_eight_t c8;
@@ -1613,7 +2073,8 @@ assemble(struct evil_environment_t *environment, struct compiler_context_t *cont
 
         local = (struct function_local_t *)local_slots;
 
-        procedure_base[FIELD_LOCALS + fn_local_idx] = make_ref(local->object);
+        procedure_base[FIELD_LOCALS + fn_local_idx] = make_ref(evil_resolve_object_handle(local->object));
+        evil_destroy_object_handle(environment, local->object);
     }
 
     /*
@@ -1621,6 +2082,16 @@ assemble(struct evil_environment_t *environment, struct compiler_context_t *cont
      */
     evil_destroy_object_handle(environment, byte_code_ptr);
 
+    /*
+     * Bytecode that fails verification is a bug in the compiler.
+     */
+    if (!verify_procedure(environment, procedure, &verify_error))
+    {
+        disassemble_bytecode(environment, bytes, num_bytes);
+        evil_printf("verification failed at %d: %s\n", (int)verify_error.offset, verify_error.message);
+        assert(0 && "bytecode verification failed");
+    }
+
     return procedure;
 }
 
@@ -1643,7 +2114,21 @@ is_branch(struct instruction_t *insn)
 
     opcode = insn->opcode;
 
-    return opcode == OPCODE_BRANCH || opcode == OPCODE_COND_BRANCH;
+    switch (opcode)
+    {
+        case OPCODE_BRANCH:
+        case OPCODE_COND_BRANCH:
+        case OPCODE_CMPN_EQ_SLOTS_BRANCH:
+        case OPCODE_CMPN_LT_SLOTS_BRANCH:
+        case OPCODE_CMPN_GT_SLOTS_BRANCH:
+        case OPCODE_CMPN_LE_SLOTS_BRANCH:
+        case OPCODE_CMPN_GE_SLOTS_BRANCH:
+        case OPCODE_BRANCH_IF_SELF:
+        case OPCODE_LOOP:
+            return 1;
+        default:
+            return 0;
+    }
 }
 
 static void
@@ -1746,6 +2231,414 @@ promote_tailcalls(struct instruction_t *root)
     return root;
 }
 
+static void
+compile_self_tailcall(struct compiler_context_t *context, struct instruction_t *successor, struct instruction_t *tailcall, struct instruction_t *first)
+{
+    struct instruction_t *load;
+    struct instruction_t *get_bound_location;
+    struct instruction_t *branch_if_self;
+    struct instruction_t *store;
+    struct instruction_t *loop;
+    int num_args;
+    int i;
+
+    /*
+     * In program order the tail call is
+     *     [args] GET_BOUND_LOCATION self, LOAD, TAILCALL n
+     * and becomes
+     *     [args] BRANCH_IF_SELF self, GET_BOUND_LOCATION self, LOAD,
+     *     TAILCALL n, RETURN, STSLOT 0, ..., STSLOT n - 1, LOOP first
+     * The arguments are all evaluated before any of the stores so they
+     * still see the old values of the argument slots.
+     */
+    load = (struct instruction_t *)tailcall->link.next;
+    get_bound_location = (struct instruction_t *)load->link.next;
+    num_args = tailcall->data.u2;
+
+    branch_if_self = allocate_instruction(context);
+    branch_if_self->opcode = OPCODE_BRANCH_IF_SELF;
+    branch_if_self->size = 10 + VM_INLINE_CACHE_SIZE;
+    branch_if_self->data.u8 = get_bound_location->data.u8;
+    branch_if_self->link.next = get_bound_location->link.next;
+    get_bound_location->link.next = &branch_if_self->link;
+
+    /*
+     * A tail call to a special function continues with the next
+     * instruction, which must return the result.
+     */
+    store = allocate_instruction(context);
+    store->opcode = OPCODE_RETURN;
+    store->link.next = &tailcall->link;
+
+    for (i = 0; i < num_args; ++i)
+    {
+        struct instruction_t *stslot;
+
+        stslot = allocate_instruction(context);
+        stslot->opcode = OPCODE_STSLOT_X;
+        stslot->size = 2;
+        stslot->data.s2 = (short)i;
+        stslot->link.next = &store->link;
+        store = stslot;
+
+        if (i == 0)
+        {
+            branch_if_self->reloc = stslot;
+        }
+    }
+
+    loop = allocate_instruction(context);
+    loop->opcode = OPCODE_LOOP;
+    loop->size = 2;
+    loop->reloc = first;
+    loop->link.next = &store->link;
+    successor->link.next = &loop->link;
+
+    if (num_args == 0)
+    {
+        branch_if_self->reloc = loop;
+    }
+}
+
+static struct instruction_t *
+compile_self_tailcalls(struct compiler_context_t *context, struct instruction_t *root)
+{
+    struct instruction_t *insn;
+    struct instruction_t *successor;
+    struct instruction_t *first;
+    uint64_t symbol_hash;
+
+    /*
+     * A tail call to the global the procedure is being defined as is almost
+     * always a loop, so it is compiled to store the arguments into the
+     * argument slots and jump back to the start of the procedure, which
+     * saves tearing down and rebuilding the frame. The global may have been
+     * rebound to something else by the time the call executes, so the jump
+     * is guarded by BRANCH_IF_SELF and the original tail call is kept as
+     * the fallback. This is not done for procedures with closure variables
+     * as their environment is created on entry.
+     */
+    if (context->self_symbol == NULL)
+    {
+        return root;
+    }
+
+    symbol_hash = context->self_symbol->value.symbol_hash;
+
+    for (first = root; first->link.next != NULL; first = (struct instruction_t *)first->link.next)
+        ;
+
+    successor = NULL;
+
+    for (insn = root; insn != NULL; insn = (struct instruction_t *)insn->link.next)
+    {
+        struct instruction_t *load;
+        struct instruction_t *get_bound_location;
+
+        if (insn->opcode == OPCODE_TAILCALL && successor != NULL && insn->data.u2 == context->num_args)
+        {
+            load = (struct instruction_t *)insn->link.next;
+            get_bound_location = load != NULL ? (struct instruction_t *)load->link.next : NULL;
+
+            if (get_bound_location != NULL
+                    && load->opcode == OPCODE_LOAD
+                    && get_bound_location->opcode == OPCODE_GET_BOUND_LOCATION
+                    && get_bound_location->data.u8 == symbol_hash)
+            {
+                compile_self_tailcall(context, successor, insn, first);
+            }
+        }
+
+        successor = insn;
+    }
+
+    return root;
+}
+
+static int
+is_branch_target(struct instruction_t *root, struct instruction_t *target)
+{
+    struct slist_t *i;
+
+    for (i = &root->link; i != NULL; i = i->next)
+    {
+        struct instruction_t *insn;
+
+        insn = (struct instruction_t *)i;
+
+        if (is_branch(insn) && insn->reloc == target)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static unsigned char
+fused_compare_branch_opcode(unsigned char compare_opcode)
+{
+    switch (compare_opcode)
+    {
+        case OPCODE_CMPN_EQ:
+            return OPCODE_CMPN_EQ_SLOTS_BRANCH;
+        case OPCODE_CMPN_LT:
+            return OPCODE_CMPN_LT_SLOTS_BRANCH;
+        case OPCODE_CMPN_GT:
+            return OPCODE_CMPN_GT_SLOTS_BRANCH;
+        case OPCODE_CMPN_LE:
+            return OPCODE_CMPN_LE_SLOTS_BRANCH;
+        case OPCODE_CMPN_GE:
+            return OPCODE_CMPN_GE_SLOTS_BRANCH;
+        default:
+            return OPCODE_INVALID;
+    }
+}
+
+static struct instruction_t *
+fuse_sequence_ending_at(struct instruction_t *root, struct instruction_t *insn)
+{
+    struct instruction_t *n1;
+    struct instruction_t *n2;
+    struct instruction_t *n3;
+
+    /*
+     * The instruction chain is in reverse order, so insn is the last
+     * instruction of a candidate sequence and n1, n2, n3 are the ones that
+     * precede it. The fused instruction overwrites the first instruction of
+     * the sequence so that branches targeting the sequence stay valid, but
+     * none of the other instructions may be a branch target.
+     */
+    n1 = (struct instruction_t *)insn->link.next;
+    n2 = n1 != NULL ? (struct instruction_t *)n1->link.next : NULL;
+    n3 = n2 != NULL ? (struct instruction_t *)n2->link.next : NULL;
+
+    if (n2 == NULL)
+    {
+        return NULL;
+    }
+
+    switch (insn->opcode)
+    {
+        case OPCODE_COND_BRANCH:
+            {
+                unsigned char fused_opcode;
+                short slot_b;
+                short slot_a;
+
+                fused_opcode = fused_compare_branch_opcode(n1->opcode);
+
+                if (fused_opcode == OPCODE_INVALID
+                        || n2->opcode != OPCODE_LDSLOT_X
+                        || n3 == NULL
+                        || n3->opcode != OPCODE_LDSLOT_X
+                        || is_branch_target(root, insn)
+                        || is_branch_target(root, n1)
+                        || is_branch_target(root, n2))
+                {
+                    return NULL;
+                }
+
+                slot_b = n3->data.s2;
+                slot_a = n2->data.s2;
+
+                n3->opcode = fused_opcode;
+                n3->size = 6;
+                n3->data.compare_slots.slots[0] = slot_b;
+                n3->data.compare_slots.slots[1] = slot_a;
+                n3->reloc = insn->reloc;
+
+                return n3;
+            }
+        case OPCODE_CALL:
+        case OPCODE_TAILCALL:
+            {
+                uint64_t symbol_hash;
+                unsigned short num_args;
+
+                if (n1->opcode != OPCODE_LOAD
+                        || n2->opcode != OPCODE_GET_BOUND_LOCATION
+                        || is_branch_target(root, insn)
+                        || is_branch_target(root, n1))
+                {
+                    return NULL;
+                }
+
+                symbol_hash = n2->data.u8;
+                num_args = insn->data.u2;
+
+                n2->opcode = (insn->opcode == OPCODE_CALL) ? OPCODE_CALL_GLOBAL : OPCODE_TAILCALL_GLOBAL;
+                n2->size = 10 + VM_INLINE_CACHE_SIZE;
+                n2->data.call_global.symbol_hash = symbol_hash;
+                n2->data.call_global.num_args = num_args;
+
+                return n2;
+            }
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+            {
+                struct instruction_t *slot;
+                struct instruction_t *immediate;
+
+                if (n2->opcode == OPCODE_LDIMM_1_FIXNUM && n1->opcode == OPCODE_LDSLOT_X && insn->opcode == OPCODE_ADD)
+                {
+                    immediate = n2;
+                    slot = n1;
+                }
+                else if (n2->opcode == OPCODE_LDSLOT_X && n1->opcode == OPCODE_LDIMM_1_FIXNUM)
+                {
+                    immediate = n1;
+                    slot = n2;
+                }
+                else
+                {
+                    return NULL;
+                }
+
+                if (is_branch_target(root, insn) || is_branch_target(root, n1))
+                {
+                    return NULL;
+                }
+
+                /*
+                 * Both operand orders are fine for ADD since the fused
+                 * instruction only ever sees a fixnum immediate and numeric
+                 * addition commutes.
+                 */
+                n2->data.immediate_slot.slot = slot->data.s2;
+                n2->data.immediate_slot.immediate = immediate->data.s1;
+                n2->opcode = (insn->opcode == OPCODE_ADD) ? OPCODE_ADD_IMM_SLOT : OPCODE_SUB_SLOT_IMM;
+                n2->size = 3;
+
+                return n2;
+            }
+        default:
+            return NULL;
+    }
+}
+
+static struct instruction_t *
+fuse_superinstructions(struct instruction_t *root)
+{
+    struct instruction_t *insn;
+    struct instruction_t *successor;
+
+    /*
+     * successor is the instruction that follows insn in program order, which
+     * is the one that links to it in the reversed chain.
+     */
+    successor = NULL;
+    insn = root;
+
+    while (insn != NULL)
+    {
+        struct instruction_t *fused;
+
+        fused = fuse_sequence_ending_at(root, insn);
+
+        if (fused != NULL)
+        {
+            if (successor == NULL)
+            {
+                root = fused;
+            }
+            else
+            {
+                successor->link.next = &fused->link;
+            }
+
+            insn = fused;
+        }
+
+        successor = insn;
+        insn = (struct instruction_t *)insn->link.next;
+    }
+
+    return root;
+}
+
+#if ENABLE_REGISTER_CODEGEN
+static struct instruction_t *
+lower_register_instructions(struct compiler_context_t *context, struct instruction_t *root)
+{
+    struct instruction_t *insn;
+    struct instruction_t *successor;
+
+    /*
+     * demote_closure_references only knows how to rewrite LDSLOT and STSLOT
+     * so when a function's locals are captured its register instructions
+     * are expanded back into the equivalent stack code first.
+     */
+    successor = NULL;
+    insn = root;
+
+    while (insn != NULL)
+    {
+        struct instruction_t *next;
+        unsigned char opcode;
+
+        next = (struct instruction_t *)insn->link.next;
+        opcode = insn->opcode;
+
+        if (opcode >= OPCODE_RADD && opcode <= OPCODE_RDIV_IMM)
+        {
+            struct instruction_t *rhs;
+            struct instruction_t *binop;
+            struct instruction_t *store;
+            int is_immediate;
+
+            is_immediate = opcode >= OPCODE_RADD_IMM;
+
+            rhs = allocate_instruction(context);
+
+            if (is_immediate)
+            {
+                rhs->opcode = OPCODE_LDIMM_1_FIXNUM;
+                rhs->size = 1;
+                rhs->data.s1 = insn->data.registers.immediate;
+            }
+            else
+            {
+                rhs->opcode = OPCODE_LDSLOT_X;
+                rhs->size = 2;
+                rhs->data.s2 = insn->data.registers.src[1];
+            }
+
+            rhs->link.next = &insn->link;
+
+            binop = allocate_instruction(context);
+            binop->opcode = (unsigned char)(OPCODE_ADD + (opcode - (is_immediate ? OPCODE_RADD_IMM : OPCODE_RADD)));
+            binop->link.next = &rhs->link;
+
+            store = compile_store_slot(context, binop, insn->data.registers.dst);
+
+            /*
+             * The register instruction becomes the first instruction of the
+             * expansion so branches that target it still land on the start
+             * of the sequence.
+             */
+            insn->opcode = OPCODE_LDSLOT_X;
+            insn->size = 2;
+            insn->data.s2 = insn->data.registers.src[0];
+
+            if (successor == NULL)
+            {
+                root = store;
+            }
+            else
+            {
+                successor->link.next = &store->link;
+            }
+        }
+
+        successor = insn;
+        insn = next;
+    }
+
+    return root;
+}
+#endif
+
 static void
 print_hex_bytes(const unsigned char *c, size_t size)
 {
@@ -2059,7 +2952,11 @@ disassemble_bytecode(struct evil_environment_t *environment, const unsigned char
                     evil_printf("GET_BOUND_LOCATION %s\n", find_symbol_name(environment, c8.u8));
                 }
 
-                i += 9;
+                /*
+                 * The inline cache is not printed as its contents depend on
+                 * whether and where the code has run.
+                 */
+                i += 9 + VM_INLINE_CACHE_SIZE;
                 break;
             case OPCODE_ADD:
                 print_hex_bytes(ptr + i, 1);
@@ -2114,6 +3011,180 @@ disassemble_bytecode(struct evil_environment_t *environment, const unsigned char
             case OPCODE_BREAK:
                 print_hex_bytes(ptr + i, 1);
                 evil_printf("BREAK\n");
+                ++i;
+                break;
+            case OPCODE_CMPN_EQ_SLOTS_BRANCH:
+            case OPCODE_CMPN_LT_SLOTS_BRANCH:
+            case OPCODE_CMPN_GT_SLOTS_BRANCH:
+            case OPCODE_CMPN_LE_SLOTS_BRANCH:
+            case OPCODE_CMPN_GE_SLOTS_BRANCH:
+                {
+                    static const char *names[] = { "EQ", "LT", "GT", "LE", "GE" };
+                    union convert_two_t c2;
+                    int slot_b;
+                    int slot_a;
+
+                    memcpy(c2.bytes, ptr + i + 1, 2);
+                    slot_b = c2.s2;
+                    memcpy(c2.bytes, ptr + i + 3, 2);
+                    slot_a = c2.s2;
+                    memcpy(c2.bytes, ptr + i + 5, 2);
+                    print_hex_bytes(ptr + i, 7);
+
+                    evil_printf("CMPN_%s_SLOTS_BRANCH %d %d %d\n", names[c - OPCODE_CMPN_EQ_SLOTS_BRANCH], slot_b, slot_a, c2.s2 + i + 7);
+                }
+
+                i += 7;
+                break;
+            case OPCODE_CALL_GLOBAL:
+            case OPCODE_TAILCALL_GLOBAL:
+            case OPCODE_VECTOR_REF:
+            case OPCODE_VECTOR_SET:
+            case OPCODE_VECTOR_LENGTH:
+            case OPCODE_CONS:
+                {
+                    static const char *names[] = { "VECTOR_REF", "VECTOR_SET", "VECTOR_LENGTH", "CONS" };
+                    union convert_eight_t c8;
+                    union convert_two_t c2;
+                    const char *name;
+
+                    memcpy(c8.bytes, ptr + i + 1, 8);
+                    memcpy(c2.bytes, ptr + i + 9 + VM_INLINE_CACHE_SIZE, 2);
+                    print_hex_bytes(ptr + i, 9);
+
+                    if (c >= OPCODE_VECTOR_REF)
+                    {
+                        name = names[c - OPCODE_VECTOR_REF];
+                    }
+                    else
+                    {
+                        name = c == OPCODE_CALL_GLOBAL ? "CALL_GLOBAL" : "TAILCALL_GLOBAL";
+                    }
+
+                    evil_printf("%s %s %d\n",
+                            name,
+                            find_symbol_name(environment, c8.u8),
+                            c2.s2);
+                }
+
+                i += 11 + VM_INLINE_CACHE_SIZE;
+                break;
+            case OPCODE_BRANCH_IF_SELF:
+                {
+                    union convert_eight_t c8;
+                    union convert_two_t c2;
+
+                    memcpy(c8.bytes, ptr + i + 1, 8);
+                    memcpy(c2.bytes, ptr + i + 9 + VM_INLINE_CACHE_SIZE, 2);
+                    print_hex_bytes(ptr + i, 9);
+
+                    evil_printf("BRANCH_IF_SELF %s %d\n",
+                            find_symbol_name(environment, c8.u8),
+                            c2.s2 + (int)i + 11 + (int)VM_INLINE_CACHE_SIZE);
+                }
+
+                i += 11 + VM_INLINE_CACHE_SIZE;
+                break;
+            case OPCODE_LOOP:
+                {
+                    union convert_two_t c2;
+
+                    memcpy(c2.bytes, ptr + i + 1, 2);
+                    print_hex_bytes(ptr + i, 3);
+
+                    evil_printf("LOOP %d\n", c2.s2 + (int)i + 3);
+                }
+
+                i += 3;
+                break;
+            case OPCODE_ADD_IMM_SLOT:
+            case OPCODE_SUB_SLOT_IMM:
+                {
+                    union convert_two_t c2;
+                    int immediate;
+
+                    immediate = (signed char)ptr[i + 1];
+                    memcpy(c2.bytes, ptr + i + 2, 2);
+                    print_hex_bytes(ptr + i, 4);
+
+                    if (c == OPCODE_ADD_IMM_SLOT)
+                    {
+                        evil_printf("ADD_IMM_SLOT %d %d\n", immediate, c2.s2);
+                    }
+                    else
+                    {
+                        evil_printf("SUB_SLOT_IMM %d %d\n", c2.s2, immediate);
+                    }
+                }
+
+                i += 4;
+                break;
+            case OPCODE_RADD:
+            case OPCODE_RSUB:
+            case OPCODE_RMUL:
+            case OPCODE_RDIV:
+                {
+                    static const char *names[] = { "RADD", "RSUB", "RMUL", "RDIV" };
+                    union convert_two_t dst;
+                    union convert_two_t a;
+                    union convert_two_t b;
+
+                    memcpy(dst.bytes, ptr + i + 1, 2);
+                    memcpy(a.bytes, ptr + i + 3, 2);
+                    memcpy(b.bytes, ptr + i + 5, 2);
+                    print_hex_bytes(ptr + i, 7);
+
+                    evil_printf("%s %d %d %d\n", names[c - OPCODE_RADD], dst.s2, a.s2, b.s2);
+                }
+
+                i += 7;
+                break;
+            case OPCODE_RADD_IMM:
+            case OPCODE_RSUB_IMM:
+            case OPCODE_RMUL_IMM:
+            case OPCODE_RDIV_IMM:
+                {
+                    static const char *names[] = { "RADD_IMM", "RSUB_IMM", "RMUL_IMM", "RDIV_IMM" };
+                    union convert_two_t dst;
+                    union convert_two_t a;
+
+                    memcpy(dst.bytes, ptr + i + 1, 2);
+                    memcpy(a.bytes, ptr + i + 3, 2);
+                    print_hex_bytes(ptr + i, 6);
+
+                    evil_printf("%s %d %d %d\n", names[c - OPCODE_RADD_IMM], dst.s2, a.s2, (signed char)ptr[i + 5]);
+                }
+
+                i += 6;
+                break;
+            case OPCODE_ADD_FIX_FIX:
+            case OPCODE_SUB_FIX_FIX:
+            case OPCODE_MUL_FIX_FIX:
+            case OPCODE_DIV_FIX_FIX:
+            case OPCODE_ADD_FLO_FLO:
+            case OPCODE_SUB_FLO_FLO:
+            case OPCODE_MUL_FLO_FLO:
+            case OPCODE_DIV_FLO_FLO:
+            case OPCODE_CMPN_EQ_FIX:
+            case OPCODE_CMPN_LT_FIX:
+            case OPCODE_CMPN_GT_FIX:
+            case OPCODE_CMPN_LE_FIX:
+            case OPCODE_CMPN_GE_FIX:
+                {
+                    static const char *names[] = {
+                        "ADD_FIX_FIX", "SUB_FIX_FIX", "MUL_FIX_FIX", "DIV_FIX_FIX",
+                        "ADD_FLO_FLO", "SUB_FLO_FLO", "MUL_FLO_FLO", "DIV_FLO_FLO",
+                        "CMPN_EQ_FIX", "CMPN_LT_FIX", "CMPN_GT_FIX", "CMPN_LE_FIX", "CMPN_GE_FIX"
+                    };
+
+                    /*
+                     * These only show up in code that has already run and
+                     * been quickened by the VM.
+                     */
+                    print_hex_bytes(ptr + i, 1);
+                    evil_printf("%s\n", names[c - OPCODE_ADD_FIX_FIX]);
+                }
+
                 ++i;
                 break;
             default:
@@ -2257,29 +3328,61 @@ compile_form_to_bytecode(struct compiler_context_t *previous_context, struct evi
     struct instruction_t *root;
     struct compiler_context_t context;
 
+    /*
+     * The compiler holds on to the forms it is compiling, and to the
+     * procedures of nested lambdas, with plain pointers.
+     */
+    gc_inhibit_evacuation(environment->heap);
+
     args = CAR(lambda_body);
     root = NULL;
 
     initialize_compiler_context(&context, environment, args, previous_context);
 
+    if (previous_context != NULL)
+    {
+        context.self_symbol = previous_context->defined_symbol;
+        previous_context->defined_symbol = NULL;
+    }
+
     for (body = CDR(lambda_body); body != empty_pair; body = CDR(body))
     {
         root = compile_form(&context, root, CAR(body));
     }
 
+    /*
+     * A procedure with an empty body returns the empty list rather than
+     * whatever happens to be above its frame.
+     */
+    if (root == NULL)
+    {
+        root = linear_allocator_alloc(context.pool, sizeof(struct instruction_t));
+        root->opcode = OPCODE_LDEMPTY;
+    }
+
     root = add_return_insn(&context, root);
     collapse_nops(root);
     eliminate_branch_to_return(root);
     root = promote_tailcalls(root);
 
-    if (context.closure_variables != NULL)
+    if (context.closure_variables == NULL)
     {
+        root = compile_self_tailcalls(&context, root);
+    }
+    else
+    {
+#if ENABLE_REGISTER_CODEGEN
+        root = lower_register_instructions(&context, root);
+#endif
         root = demote_closure_references(&context, root);
     }
 
+    root = fuse_superinstructions(root);
+
     procedure = assemble(environment, &context, root);
 
     destroy_compiler_context(&context);
+    gc_allow_evacuation(environment->heap);
 
     return make_ref(procedure);
 }
@@ -2337,7 +3440,7 @@ compile_load_function_local(struct compiler_context_t *context, struct instructi
     struct instruction_t *load;
 
     function_local = linear_allocator_alloc(context->pool, sizeof(struct function_local_t));
-    function_local->object = object;
+    function_local->object = evil_create_object_handle(context->environment, object);
     function_local->link.next = &context->locals->link;
     context->locals = function_local;
     local_idx = context->num_fn_locals++;
@@ -32,6 +32,35 @@ struct instruction_t
         uint64_t u8;
         int64_t s8;
         double f8;
+
+        /*
+         * Operands of the superinstructions formed by the peephole pass.
+         */
+        struct
+        {
+            short slots[2];
+        } compare_slots;
+        struct
+        {
+            uint64_t symbol_hash;
+            unsigned short num_args;
+        } call_global;
+        struct
+        {
+            char immediate;
+            short slot;
+        } immediate_slot;
+
+        /*
+         * Operands of the register instructions.
+         */
+        struct
+        {
+            short dst;
+            short src[2];
+            char immediate;
+        } registers;
+
         char string[1];
     } data;
 };
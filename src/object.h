@@ -11,7 +11,7 @@
 #include <stdint.h>
 #include "base.h"
 
-extern struct evil_object_t *empty_pair;
+extern struct evil_object_t *const empty_pair;
 
 const char *
 type_name(enum evil_tag_t tag);
@@ -89,12 +89,12 @@ make_inner_reference(struct evil_object_t *object, int64_t index)
 {
     struct evil_object_t inner_reference;
 
-    assert(index >= 0 && index < 65536);
+    assert(index >= 0 && index <= UINT32_MAX);
     assert(object != NULL);
 
     inner_reference.tag_count.tag = TAG_INNER_REFERENCE;
     inner_reference.tag_count.flag = 0;
-    inner_reference.tag_count.count = (unsigned short)index;
+    inner_reference.tag_count.count = (uint32_t)index;
     inner_reference.value.ref = object;
 
     return inner_reference;
@@ -112,6 +112,23 @@ make_empty_ref(void)
     return make_ref(empty_pair);
 }
 
+/*
+ * The value of definitions, whose value R4RS leaves unspecified. It is a
+ * reference to nothing, which dereferences to NULL and prints as nothing.
+ */
+static inline struct evil_object_t
+make_unspecified(void)
+{
+    struct evil_object_t unspecified;
+
+    unspecified.tag_count.tag = TAG_INNER_REFERENCE;
+    unspecified.tag_count.flag = 0;
+    unspecified.tag_count.count = 0;
+    unspecified.value.ref = NULL;
+
+    return unspecified;
+}
+
 static inline struct evil_object_t
 make_fixnum_object(int64_t value)
 {
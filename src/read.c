@@ -650,6 +650,7 @@ evil_read(struct evil_environment_t *environment, struct evil_object_handle_t *l
 {
     struct evil_object_t *arg;
     struct evil_object_handle_t *head;
+    struct evil_object_t result;
 
     UNUSED(environment);
     UNUSED(lexical_environment);
@@ -659,7 +660,14 @@ evil_read(struct evil_environment_t *environment, struct evil_object_handle_t *l
     arg = deref(args);
     assert(arg->tag_count.tag == TAG_STRING);
 
+    /*
+     * The tokenizer walks the text of the string in place.
+     */
+    gc_inhibit_evacuation(environment->heap);
     head = tokenize(environment, arg->value.string_value);
-    return create_object_from_token_stream(environment, head);
+    result = create_object_from_token_stream(environment, head);
+    gc_allow_evacuation(environment->heap);
+
+    return result;
 }
 
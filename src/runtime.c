@@ -13,13 +13,21 @@
 #include "base.h"
 #include "evil_scheme.h"
 #include "environment.h"
+#include "future.h"
 #include "gc.h"
+#include "jit.h"
 #include "object.h"
 #include "runtime.h"
 #include "vm.h"
 
-struct evil_object_t empty_pair_storage = { { TAG_PAIR, 0, 0 }, { 0 } };
-struct evil_object_t *empty_pair = &empty_pair_storage;
+/*
+ * The empty pair is shared by every environment. Lookups of unbound
+ * symbols return it as their location, so STORE and SET break rather than
+ * write through it; nothing else writes to it and the garbage collector
+ * doesn't mark it either, so it can be read-only.
+ */
+static const struct evil_object_t empty_pair_storage = { { TAG_PAIR, 0, 0 }, { 0 } };
+struct evil_object_t *const empty_pair = (struct evil_object_t *)&empty_pair_storage;
 
 #define DEFAULT_SYMBOL_INTERNMENT_PAGE_SIZE 4096
 
@@ -61,10 +69,10 @@ environment_initialize(struct evil_environment_t *environment)
         int num_args;
     };
 
-    static struct special_function_initializer_t initializers[] =
+    static const struct special_function_initializer_t initializers[] =
     {
         { "read", evil_read, 1 },
-        { "eval", evil_eval, 1 },
+        { "eval", evil_eval_builtin, 1 },
         { "print", evil_print, 1 },
         { "cons", evil_cons, 2 },
         { "define", evil_define, 2 },
@@ -72,13 +80,21 @@ environment_initialize(struct evil_environment_t *environment)
         { "apply", evil_apply, VARIADIC },
         { "vector", evil_vector, VARIADIC },
         { "make-vector", evil_make_vector, VARIADIC },
-        { "vector-length", evil_vector_ref, 1 },
+        { "vector-length", evil_vector_length, 1 },
         { "vector-ref", evil_vector_ref, 2 },
         { "vector-set!", evil_vector_set, 3 },
         { "vector-fill!", evil_vector_fill, 2 },
         { "disassemble", evil_disassemble, 1 },
         { "string->symbol", string_to_symbol, 1 },
-        { "symbol->string", symbol_to_string, 1 }
+        { "symbol->string", symbol_to_string, 1 },
+        { "vm-profile", evil_vm_profile, VARIADIC },
+        { "sampler-start", evil_sampler_start, VARIADIC },
+        { "sampler-stop", evil_sampler_stop, VARIADIC },
+        { "spawn", evil_spawn, 1 },
+        { "yield", evil_yield, 0 },
+        { "join", evil_join, 1 },
+        { "future", evil_future, 1 },
+        { "touch", evil_touch, 1 }
     };
     #define NUM_INITIALIZERS (sizeof initializers / sizeof initializers[0])
     size_t i;
@@ -108,13 +124,14 @@ environment_initialize(struct evil_environment_t *environment)
 
         procedure_base[FIELD_ENVIRONMENT] = make_ref((struct evil_object_t *)environment);
         procedure_base[FIELD_LEXICAL_ENVIRONMENT] = environment->lexical_environment;
-        procedure_base[FIELD_NUM_ARGS] = make_fixnum_object(initializers[i].num_args);
-        procedure_base[FIELD_NUM_LOCALS] = make_fixnum_object(0);
-        procedure_base[FIELD_NUM_FN_LOCALS] = make_fixnum_object(0);
+        procedure_base[FIELD_HEADER] = vm_make_procedure_header(initializers[i].num_args, 0);
         procedure_base[FIELD_CODE] = function;
+        procedure_base[FIELD_NATIVE_CODE] = make_fixnum_object(0);
+        procedure_base[FIELD_NAME] = symbol;
 
         place = bind(environment, environment->lexical_environment, symbol);
         *place = make_ref(procedure);
+        gc_write_barrier(environment->heap, place);
     }
 }
 
@@ -146,12 +163,12 @@ evil_environment_create(void *stack, size_t stack_size, void *heap_mem, size_t h
 
     env->tag_count.tag = TAG_ENVIRONMENT;
     env->tag_count.count = 1;
-    env->stack_bottom = stack;
-    env->stack_top = (struct evil_object_t *)((char *)stack + stack_size) - 1;
-    env->stack_ptr = env->stack_top;
-    memset(stack, 0, stack_size);
+    vm_stack_create(env, stack, stack_size);
 
     env->heap = heap;
+    env->binding_epoch = 1;
+    env->profile = vm_profile_create();
+    env->scheduler = vm_scheduler_create(env);
 
     lexical_environment_ptr = gc_alloc_vector(heap, FIELD_LEX_ENV_NUM_FIELDS);
     VECTOR_BASE(lexical_environment_ptr)[FIELD_LEX_ENV_PARENT_ENVIRONMENT] = make_empty_ref();
@@ -191,7 +208,13 @@ evil_destroy_string_internment_pages(struct symbol_string_internment_page_t *pag
 void
 evil_environment_destroy(struct evil_environment_t *environment)
 {
+    future_pool_destroy(environment->futures);
     gc_destroy(environment->heap);
+    vm_profile_destroy(environment->profile);
+    vm_discard_suspension(environment);
+    vm_scheduler_destroy(environment->scheduler);
+    jit_code_cache_destroy(environment->code_cache);
+    vm_stack_destroy(environment);
 
     evil_destroy_hasn_internment_pages(environment->symbol_names.hash_internment_page_base);
     evil_destroy_string_internment_pages(environment->symbol_names.string_internment_page_base);
@@ -9,8 +9,15 @@
 
 #include "object.h"
 
+struct future_pool_t;
 struct heap_t;
+struct jit_code_cache_t;
 struct symbol_table_fragment_t;
+struct vm_profile_t;
+struct vm_scheduler_t;
+struct vm_activation_t;
+struct vm_stack_segment_t;
+struct vm_suspension_t;
 
 struct symbol_string_internment_page_t;
 struct symbol_hash_internment_page_t;
@@ -34,16 +41,67 @@ struct evil_environment_t
 
     /*
      * These fields hold the saved VM state in case execution is interrupted
-     * or postponed.
+     * or postponed. The top and bottom are those of the current stack
+     * segment, see vm_stack_segment_t.
      */
     struct evil_object_t *stack_top;
     struct evil_object_t *stack_bottom;
     struct evil_object_t *stack_ptr;
+    struct vm_stack_segment_t *stack_segment;
+
+    /*
+     * The rest of the registers of a vm_run invocation that ran out of
+     * fuel, NULL unless one is suspended. See vm_run_with_fuel.
+     */
+    struct vm_suspension_t *suspension;
+
+    /*
+     * A call a builtin has asked the VM to make in its place, see
+     * vm_request_call. The procedure is NULL unless one is pending.
+     */
+    struct evil_object_t *call_procedure;
+    struct evil_object_t *call_args;
+    int call_num_args;
 
     struct heap_t *heap;
 
     struct interned_symbol_names_table_t symbol_names;
     struct evil_object_t lexical_environment;
+
+    /*
+     * Bumped whenever a new binding is created or the garbage collector
+     * runs. The VM's inline caches for global lookups are only trusted if
+     * they were filled in during the current epoch.
+     */
+    uint64_t binding_epoch;
+
+    /*
+     * Opcode counters kept by the VM, NULL unless it is built with
+     * ENABLE_VM_PROFILING. See vm.h.
+     */
+    struct vm_profile_t *profile;
+
+    /*
+     * The innermost running VM invocation, see vm.h.
+     */
+    struct vm_activation_t *volatile activation;
+
+    /*
+     * The environment's fibers, see vm_fiber_t.
+     */
+    struct vm_scheduler_t *scheduler;
+
+    /*
+     * Executable memory holding the native code of the environment's
+     * procedures, allocated by the JIT on first use.
+     */
+    struct jit_code_cache_t *code_cache;
+
+    /*
+     * The worker environments that run the environment's futures, created
+     * by its first future, see future.h.
+     */
+    struct future_pool_t *futures;
 };
 
 struct evil_environment_t *
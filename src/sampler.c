@@ -0,0 +1,503 @@
+/***********************************************************************
+ * evilscheme, Copyright (c) 2012-2015, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE.TXT for details.
+ ***********************************************************************/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base.h"
+#include "evil_scheme.h"
+#include "object.h"
+#include "runtime.h"
+#include "sampler.h"
+#include "vm.h"
+
+#if ENABLE_SAMPLER
+#   include <signal.h>
+#   include <time.h>
+#endif
+
+DISABLE_WARNING(4996)
+
+#if ENABLE_SAMPLER
+
+/*
+ * Each sample is a run of procedure name hashes in the frame buffer, from
+ * the innermost frame out. A hash of 0 is an anonymous procedure.
+ */
+struct sampler_sample_t
+{
+    uint32_t offset;
+    uint32_t depth;
+};
+
+struct sampler_t
+{
+    /*
+     * The environment that started the sampler owns it, and the sample
+     * buffers, until its samples have been written. The signal handler only
+     * samples while the environment is set.
+     */
+    struct evil_environment_t *owner;
+    struct evil_environment_t *volatile environment;
+    struct sampler_sample_t *samples;
+    uint64_t *frames;
+    volatile uint32_t num_samples;
+    volatile uint32_t num_frames;
+    volatile uint32_t num_dropped;
+    int handler_installed;
+    timer_t timer;
+};
+
+static struct sampler_t sampler;
+
+/*
+ * Set on the thread the sampled environment runs on. The timer measures
+ * that thread's CPU time, but the signal is sent to the process and may
+ * land on another thread, which must not walk a stack that is changing
+ * under it.
+ */
+static EVIL_THREAD_LOCAL volatile sig_atomic_t sampler_on_this_thread;
+
+static int
+sampler_in_stack(struct evil_environment_t *environment, struct evil_object_t *program_area)
+{
+    struct vm_stack_segment_t *segment;
+
+    for (segment = environment->stack_segment; segment != NULL; segment = segment->previous)
+    {
+        if (program_area >= segment->bottom + VM_SLOT_COUNT && program_area <= segment->top)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void
+sampler_release(void)
+{
+    __sync_synchronize();
+    sampler.owner = NULL;
+}
+
+static uint64_t
+sampler_procedure_name(struct evil_object_t *procedure)
+{
+    struct evil_object_t *name;
+
+    name = &VECTOR_BASE(procedure)[FIELD_NAME];
+
+    return (name->tag_count.tag == TAG_SYMBOL) ? name->value.symbol_hash : 0;
+}
+
+static void
+sampler_signal_handler(int signal_number)
+{
+    struct evil_environment_t *environment;
+    struct vm_activation_t *activation;
+    uint64_t *frames;
+    uint32_t offset;
+    uint32_t depth;
+
+    UNUSED(signal_number);
+
+    environment = sampler.environment;
+
+    if (environment == NULL || !sampler_on_this_thread)
+        return;
+
+    offset = sampler.num_frames;
+
+    if (sampler.num_samples == SAMPLER_MAX_SAMPLES
+            || offset + SAMPLER_MAX_DEPTH > SAMPLER_MAX_FRAMES)
+    {
+        ++sampler.num_dropped;
+        return;
+    }
+
+    frames = sampler.frames + offset;
+    depth = 0;
+
+    /*
+     * The published frame is the innermost one of its vm_run invocation;
+     * its callers are found through the return address and program area
+     * chain slots below each frame's arguments, up to the bottom frame
+     * whose return address has no procedure. Anything that doesn't look
+     * like a well formed frame ends the walk rather than being followed.
+     */
+    for (activation = environment->activation;
+            activation != NULL && depth < SAMPLER_MAX_DEPTH;
+            activation = activation->previous)
+    {
+        struct evil_object_t *procedure;
+        struct evil_object_t *program_area;
+
+        procedure = activation->procedure;
+        program_area = activation->program_area;
+
+        while (depth < SAMPLER_MAX_DEPTH)
+        {
+            struct evil_object_t *return_address;
+            struct evil_object_t *prev_program_area_ref;
+
+            if (procedure == NULL
+                    || procedure->tag_count.tag != TAG_PROCEDURE
+                    || !sampler_in_stack(environment, program_area))
+            {
+                break;
+            }
+
+            frames[depth++] = sampler_procedure_name(procedure);
+
+            return_address = program_area - VM_SLOT_PC_CHAIN;
+            prev_program_area_ref = program_area - VM_SLOT_PROGRAM_AREA_CHAIN;
+
+            if (return_address->tag_count.tag != TAG_INNER_REFERENCE
+                    || prev_program_area_ref->tag_count.tag != TAG_REFERENCE)
+            {
+                break;
+            }
+
+            procedure = return_address->value.ref;
+            program_area = prev_program_area_ref->value.ref;
+        }
+    }
+
+    sampler.samples[sampler.num_samples].offset = offset;
+    sampler.samples[sampler.num_samples].depth = depth;
+    sampler.num_frames = offset + depth;
+    ++sampler.num_samples;
+}
+
+int
+sampler_start(struct evil_environment_t *environment, int frequency)
+{
+    struct sigaction action;
+    struct sigevent event;
+    struct itimerspec interval;
+    long period;
+
+    if (frequency <= 0)
+        return 0;
+
+    /*
+     * Environments on other threads may be trying to start the sampler at
+     * the same time.
+     */
+    if (sampler.owner != environment
+            && !__sync_bool_compare_and_swap(&sampler.owner, NULL, environment))
+    {
+        return 0;
+    }
+
+    if (sampler.environment != NULL)
+        return 0;
+
+    if (sampler.samples == NULL)
+    {
+        sampler.samples = calloc(SAMPLER_MAX_SAMPLES, sizeof(struct sampler_sample_t));
+        sampler.frames = calloc(SAMPLER_MAX_FRAMES, sizeof(uint64_t));
+
+        if (sampler.samples == NULL || sampler.frames == NULL)
+        {
+            free(sampler.samples);
+            free(sampler.frames);
+            sampler.samples = NULL;
+            sampler.frames = NULL;
+            sampler_release();
+
+            return 0;
+        }
+    }
+
+    sampler.num_samples = 0;
+    sampler.num_frames = 0;
+    sampler.num_dropped = 0;
+
+    /*
+     * The handler stays installed once the sampler has been used; with no
+     * environment set it ignores any signal still in flight from a
+     * stopped timer.
+     */
+    if (!sampler.handler_installed)
+    {
+        memset(&action, 0, sizeof action);
+        action.sa_handler = sampler_signal_handler;
+        sigemptyset(&action.sa_mask);
+#ifdef SA_RESTART
+        action.sa_flags = SA_RESTART;
+#endif
+
+        if (sigaction(SIGPROF, &action, NULL) != 0)
+        {
+            sampler_release();
+            return 0;
+        }
+
+        sampler.handler_installed = 1;
+    }
+
+    memset(&event, 0, sizeof event);
+    event.sigev_notify = SIGEV_SIGNAL;
+    event.sigev_signo = SIGPROF;
+
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &sampler.timer) != 0)
+    {
+        sampler_release();
+        return 0;
+    }
+
+    period = 1000000000L / frequency;
+
+    if (period == 0)
+        period = 1;
+
+    interval.it_interval.tv_sec = period / 1000000000L;
+    interval.it_interval.tv_nsec = period % 1000000000L;
+    interval.it_value = interval.it_interval;
+
+    sampler_on_this_thread = 1;
+    sampler.environment = environment;
+
+    if (timer_settime(sampler.timer, 0, &interval, NULL) != 0)
+    {
+        sampler.environment = NULL;
+        sampler_on_this_thread = 0;
+        timer_delete(sampler.timer);
+        sampler_release();
+
+        return 0;
+    }
+
+    return 1;
+}
+
+void
+sampler_stop(void)
+{
+    if (sampler.environment == NULL || !sampler_on_this_thread)
+        return;
+
+    timer_delete(sampler.timer);
+    sampler.environment = NULL;
+    sampler_on_this_thread = 0;
+}
+
+static int
+sampler_sample_comparer(const void *a, const void *b)
+{
+    const struct sampler_sample_t *left = a;
+    const struct sampler_sample_t *right = b;
+    uint32_t i;
+
+    for (i = 0; i < left->depth && i < right->depth; ++i)
+    {
+        uint64_t left_name = sampler.frames[left->offset + left->depth - i - 1];
+        uint64_t right_name = sampler.frames[right->offset + right->depth - i - 1];
+
+        if (left_name != right_name)
+            return (left_name < right_name) ? -1 : 1;
+    }
+
+    if (left->depth != right->depth)
+        return (left->depth < right->depth) ? -1 : 1;
+
+    return 0;
+}
+
+static void
+sampler_write_name(struct evil_environment_t *environment, FILE *file, uint64_t hash)
+{
+    const char *name;
+
+    if (hash == 0)
+    {
+        name = "[anonymous]";
+    }
+    else
+    {
+        name = find_symbol_name(environment, hash);
+
+        if (name == NULL)
+            name = "[unknown]";
+    }
+
+    if (file != NULL)
+        fputs(name, file);
+    else
+        evil_printf("%s", name);
+}
+
+int
+sampler_write_folded(struct evil_environment_t *environment, FILE *file)
+{
+    uint32_t num_samples;
+    uint32_t i;
+
+    if (sampler.owner != environment)
+        return 0;
+
+    assert(sampler.environment == NULL);
+
+    num_samples = sampler.num_samples;
+
+    if (num_samples == 0)
+    {
+        sampler_release();
+        return 0;
+    }
+
+    qsort(sampler.samples, num_samples, sizeof(struct sampler_sample_t), sampler_sample_comparer);
+
+    for (i = 0; i < num_samples; )
+    {
+        struct sampler_sample_t *sample;
+        uint32_t count;
+        uint32_t j;
+
+        sample = &sampler.samples[i];
+
+        for (count = 1; i + count < num_samples; ++count)
+        {
+            if (sampler_sample_comparer(sample, &sampler.samples[i + count]) != 0)
+                break;
+        }
+
+        if (sample->depth == 0)
+        {
+            if (file != NULL)
+                fputs("[runtime]", file);
+            else
+                evil_printf("[runtime]");
+        }
+
+        for (j = sample->depth; j > 0; --j)
+        {
+            sampler_write_name(environment, file, sampler.frames[sample->offset + j - 1]);
+
+            if (j > 1)
+            {
+                if (file != NULL)
+                    fputc(';', file);
+                else
+                    evil_printf(";");
+            }
+        }
+
+        if (file != NULL)
+            fprintf(file, " %u\n", count);
+        else
+            evil_printf(" %u\n", count);
+
+        i += count;
+    }
+
+    if (sampler.num_dropped != 0)
+    {
+        if (file != NULL)
+            fprintf(file, "[dropped] %u\n", sampler.num_dropped);
+        else
+            evil_printf("[dropped] %u\n", sampler.num_dropped);
+    }
+
+    sampler_release();
+
+    return (int)num_samples;
+}
+
+#else
+
+int
+sampler_start(struct evil_environment_t *environment, int frequency)
+{
+    UNUSED(environment);
+    UNUSED(frequency);
+
+    return 0;
+}
+
+void
+sampler_stop(void)
+{
+}
+
+int
+sampler_write_folded(struct evil_environment_t *environment, FILE *file)
+{
+    UNUSED(environment);
+    UNUSED(file);
+
+    return 0;
+}
+
+#endif
+
+struct evil_object_t
+evil_sampler_start(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *args)
+{
+    struct evil_object_t result;
+    int frequency;
+
+    UNUSED(lexical_environment);
+
+    /*
+     * (sampler-start [frequency]) starts sampling the environment at the
+     * given number of samples per second of CPU time, returning #f if the
+     * sampler is unavailable or already running.
+     */
+    frequency = SAMPLER_DEFAULT_FREQUENCY;
+
+    if (num_args > 0)
+    {
+        assert(args[0].tag_count.tag == TAG_FIXNUM);
+        frequency = (int)args[0].value.fixnum_value;
+    }
+
+    result.tag_count.tag = TAG_BOOLEAN;
+    result.tag_count.flag = 0;
+    result.tag_count.count = 1;
+    result.value.fixnum_value = sampler_start(environment, frequency);
+
+    return result;
+}
+
+struct evil_object_t
+evil_sampler_stop(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *args)
+{
+    FILE *file;
+    int num_samples;
+
+    UNUSED(lexical_environment);
+
+    /*
+     * (sampler-stop [path]) stops sampling and writes the folded stacks to
+     * the file at path, or prints them if no path is given. Returns the
+     * number of samples taken.
+     */
+    sampler_stop();
+    file = NULL;
+
+    if (num_args > 0)
+    {
+        struct evil_object_t *path;
+
+        path = deref(&args[0]);
+        assert(path->tag_count.tag == TAG_STRING);
+
+        file = fopen(path->value.string_value, "w");
+
+        if (file == NULL)
+            return make_fixnum_object(-1);
+    }
+
+    num_samples = sampler_write_folded(environment, file);
+
+    if (file != NULL)
+        fclose(file);
+
+    return make_fixnum_object(num_samples);
+}
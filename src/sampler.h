@@ -0,0 +1,70 @@
+/***********************************************************************
+ * evilscheme, Copyright (c) 2012-2015, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE.TXT for details.
+ ***********************************************************************/
+
+#ifndef EVIL_SAMPLER_H
+#define EVIL_SAMPLER_H
+
+#include <stdio.h>
+
+#include "object.h"
+
+/*
+ * Statistical profiler: a SIGPROF timer interrupts the process at a fixed
+ * rate of the sampled thread's CPU time and the signal handler walks the VM's frame chain,
+ * starting at the environment's published activation (see
+ * vm_activation_t), recording the names of the procedures on the stack.
+ * The handler only reads the stack and the procedures on it and appends to
+ * buffers that are allocated up front, so it is async-signal-safe. Samples
+ * taken once the buffers are full are dropped.
+ *
+ * Builtins are not frames of their own; time spent in them is charged to
+ * the procedure that called them.
+ *
+ * Only one environment in the process can be sampled at a time; it owns the
+ * sampler from sampler_start until its samples have been written, and
+ * sampler_start fails in any other environment meanwhile. The timer must be
+ * started and stopped on the thread the environment runs on. It is only
+ * available on POSIX systems with timer_create.
+ */
+#ifndef ENABLE_SAMPLER
+#   if defined(__unix__)
+#       define ENABLE_SAMPLER 1
+#   else
+#       define ENABLE_SAMPLER 0
+#   endif
+#endif
+
+#define SAMPLER_DEFAULT_FREQUENCY 997
+#define SAMPLER_MAX_DEPTH 128
+#define SAMPLER_MAX_SAMPLES 65536
+#define SAMPLER_MAX_FRAMES (1024 * 1024)
+
+/*
+ * Starts sampling the environment the given number of times per second of
+ * CPU time. Returns 0 if the sampler is already running or unavailable.
+ */
+int
+sampler_start(struct evil_environment_t *environment, int frequency);
+
+/*
+ * Stops the timer if it was started on this thread. The samples are kept
+ * until they are written.
+ */
+void
+sampler_stop(void);
+
+/*
+ * Writes the samples as folded stacks, one line per distinct stack with the
+ * procedure names from the outermost frame in, separated by semicolons, and
+ * followed by the number of samples, which is the input format of
+ * flamegraph.pl. The output goes through evil_printf if file is NULL.
+ * Writing releases the sampler for other environments. Returns the number
+ * of samples, or 0 if the environment doesn't own the sampler.
+ */
+int
+sampler_write_folded(struct evil_environment_t *environment, FILE *file);
+
+#endif
@@ -0,0 +1,900 @@
+/***********************************************************************
+ * evilscheme, Copyright (c) 2012-2015, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE.TXT for details.
+ ***********************************************************************/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base.h"
+#include "environment.h"
+#include "evil_scheme.h"
+#include "gc.h"
+#include "jit.h"
+#include "object.h"
+#include "runtime.h"
+#include "serialize.h"
+#include "vm.h"
+
+/*
+ * The layout of a serialized value, where numbers are unsigned LEB128
+ * unless noted otherwise:
+ *
+ *   [number of symbols] { [length] [name bytes] }
+ *   [number of objects] { [tag byte] [count] }
+ *   { object contents: the bytes of strings, the slots of everything else }
+ *   [number of globals] { [symbol index] [slot] }
+ *   [slot]
+ *
+ * The headers of all objects come first so that the reader can allocate
+ * every object before filling any of them in, which is what lets
+ * references point forward and form cycles.
+ *
+ * A slot is its tag byte, with SERIALIZE_COUNT_FLAG set and the count
+ * following if the count isn't 1, and then:
+ *   - references: a serialize_reference_t, plus the object number for
+ *     SERIALIZE_REFERENCE_OBJECT,
+ *   - inner references: 0 for the unspecified value or the object number
+ *     plus one,
+ *   - symbols: 0 for the empty hash or the symbol index plus one,
+ *   - flonums and external functions: the 8 bytes of the value,
+ *   - anything else: the value as a zigzag encoded signed number.
+ */
+#define SERIALIZE_COUNT_FLAG 0x80
+
+enum serialize_reference_t
+{
+    SERIALIZE_REFERENCE_EMPTY_PAIR,
+    SERIALIZE_REFERENCE_ENVIRONMENT,
+    SERIALIZE_REFERENCE_LEXICAL_ENVIRONMENT,
+    SERIALIZE_REFERENCE_OBJECT
+};
+
+#define SERIALIZE_INITIAL_CAPACITY 64
+
+/*
+ * Open addressing map from object addresses and symbol hashes to their
+ * numbers. A key of 0 marks an empty bucket.
+ */
+struct serialize_map_t
+{
+    uint64_t *keys;
+    size_t *values;
+    size_t capacity;
+    size_t count;
+};
+
+struct serialize_global_t
+{
+    uint64_t symbol_hash;
+    struct evil_object_t *location;
+};
+
+struct serialize_writer_t
+{
+    struct evil_environment_t *environment;
+    struct evil_object_t *lexical_environment;
+
+    /*
+     * The objects found so far in the order they are numbered. The ones
+     * past the first num_scanned haven't had their contents scanned yet.
+     */
+    struct serialize_map_t object_map;
+    struct evil_object_t **objects;
+    unsigned char *is_code;
+    size_t num_objects;
+    size_t num_scanned;
+    size_t objects_capacity;
+
+    struct serialize_map_t symbol_map;
+    uint64_t *symbols;
+    size_t num_symbols;
+    size_t symbols_capacity;
+
+    struct serialize_global_t *globals;
+    size_t num_globals;
+    size_t globals_capacity;
+
+    unsigned char *buffer;
+    size_t size;
+    size_t capacity;
+};
+
+struct serialize_reader_t
+{
+    struct evil_environment_t *environment;
+    const unsigned char *ptr;
+    const unsigned char *end;
+
+    uint64_t *symbols;
+    size_t num_symbols;
+
+    struct evil_object_handle_t **handles;
+    size_t num_objects;
+};
+
+static void *
+serialize_grow(void *array, size_t *capacity, size_t element_size)
+{
+    size_t new_capacity;
+
+    new_capacity = (*capacity == 0) ? SERIALIZE_INITIAL_CAPACITY : *capacity * 2;
+    array = realloc(array, new_capacity * element_size);
+    assert(array != NULL);
+    *capacity = new_capacity;
+
+    return array;
+}
+
+static size_t
+serialize_map_bucket(const struct serialize_map_t *map, uint64_t key)
+{
+    size_t mask;
+    size_t bucket;
+
+    /*
+     * Object addresses are aligned and symbol hashes are already well
+     * mixed; the multiply spreads the former over the buckets.
+     */
+    mask = map->capacity - 1;
+    bucket = (size_t)((key * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & mask;
+
+    while (map->keys[bucket] != 0 && map->keys[bucket] != key)
+        bucket = (bucket + 1) & mask;
+
+    return bucket;
+}
+
+static int
+serialize_map_find(const struct serialize_map_t *map, uint64_t key, size_t *value)
+{
+    size_t bucket;
+
+    if (map->capacity == 0)
+        return 0;
+
+    bucket = serialize_map_bucket(map, key);
+
+    if (map->keys[bucket] == 0)
+        return 0;
+
+    *value = map->values[bucket];
+
+    return 1;
+}
+
+static void
+serialize_map_insert(struct serialize_map_t *map, uint64_t key, size_t value)
+{
+    size_t bucket;
+
+    assert(key != 0);
+
+    if ((map->count + 1) * 2 > map->capacity)
+    {
+        struct serialize_map_t old;
+        size_t i;
+
+        old = *map;
+        map->capacity = (old.capacity == 0) ? SERIALIZE_INITIAL_CAPACITY : old.capacity * 2;
+        map->keys = calloc(map->capacity, sizeof(uint64_t));
+        map->values = calloc(map->capacity, sizeof(size_t));
+        assert(map->keys != NULL && map->values != NULL);
+
+        for (i = 0; i < old.capacity; ++i)
+        {
+            if (old.keys[i] != 0)
+            {
+                bucket = serialize_map_bucket(map, old.keys[i]);
+                map->keys[bucket] = old.keys[i];
+                map->values[bucket] = old.values[i];
+            }
+        }
+
+        free(old.keys);
+        free(old.values);
+    }
+
+    bucket = serialize_map_bucket(map, key);
+    assert(map->keys[bucket] == 0);
+    map->keys[bucket] = key;
+    map->values[bucket] = value;
+    ++map->count;
+}
+
+static void
+serialize_map_destroy(struct serialize_map_t *map)
+{
+    free(map->keys);
+    free(map->values);
+}
+
+static size_t
+serialize_add_symbol(struct serialize_writer_t *writer, uint64_t symbol_hash)
+{
+    size_t index;
+
+    if (symbol_hash == INVALID_HASH)
+        return 0;
+
+    if (serialize_map_find(&writer->symbol_map, symbol_hash, &index))
+        return index + 1;
+
+    if (writer->num_symbols == writer->symbols_capacity)
+        writer->symbols = serialize_grow(writer->symbols, &writer->symbols_capacity, sizeof(uint64_t));
+
+    index = writer->num_symbols++;
+    writer->symbols[index] = symbol_hash;
+    serialize_map_insert(&writer->symbol_map, symbol_hash, index);
+
+    return index + 1;
+}
+
+static enum serialize_reference_t
+serialize_reference_kind(struct serialize_writer_t *writer, struct evil_object_t *object)
+{
+    if (object == empty_pair)
+        return SERIALIZE_REFERENCE_EMPTY_PAIR;
+
+    if (object->tag_count.tag == TAG_ENVIRONMENT)
+        return SERIALIZE_REFERENCE_ENVIRONMENT;
+
+    if (object == writer->lexical_environment)
+        return SERIALIZE_REFERENCE_LEXICAL_ENVIRONMENT;
+
+    return SERIALIZE_REFERENCE_OBJECT;
+}
+
+static size_t
+serialize_add_object(struct serialize_writer_t *writer, struct evil_object_t *object)
+{
+    size_t index;
+
+    if (serialize_map_find(&writer->object_map, (uint64_t)(uintptr_t)object, &index))
+        return index;
+
+    assert(is_reference_type(object));
+
+    if (writer->num_objects == writer->objects_capacity)
+    {
+        size_t capacity;
+
+        capacity = writer->objects_capacity;
+        writer->objects = serialize_grow(writer->objects, &writer->objects_capacity, sizeof(struct evil_object_t *));
+        writer->is_code = serialize_grow(writer->is_code, &capacity, 1);
+    }
+
+    index = writer->num_objects++;
+    writer->objects[index] = object;
+    writer->is_code[index] = 0;
+    serialize_map_insert(&writer->object_map, (uint64_t)(uintptr_t)object, index);
+
+    return index;
+}
+
+static void
+serialize_visit_slot(struct serialize_writer_t *writer, struct evil_object_t *slot)
+{
+    switch (slot->tag_count.tag)
+    {
+        case TAG_SYMBOL:
+            serialize_add_symbol(writer, slot->value.symbol_hash);
+            break;
+        case TAG_REFERENCE:
+            if (serialize_reference_kind(writer, slot->value.ref) == SERIALIZE_REFERENCE_OBJECT)
+                serialize_add_object(writer, slot->value.ref);
+
+            break;
+        case TAG_INNER_REFERENCE:
+            if (slot->value.ref != NULL)
+                serialize_add_object(writer, slot->value.ref);
+
+            break;
+        default:
+            break;
+    }
+}
+
+static uint64_t
+serialize_read_symbol_operand(const unsigned char *pc)
+{
+    union convert_eight_t c8;
+
+    memcpy(c8.bytes, pc + 1, 8);
+
+    return c8.u8;
+}
+
+/*
+ * The instructions that look a symbol up in the lexical environment, all of
+ * which are followed by an inline cache.
+ */
+static int
+serialize_is_global_lookup(unsigned char opcode)
+{
+    switch (opcode)
+    {
+        case OPCODE_GET_BOUND_LOCATION:
+        case OPCODE_CALL_GLOBAL:
+        case OPCODE_TAILCALL_GLOBAL:
+        case OPCODE_BRANCH_IF_SELF:
+        case OPCODE_VECTOR_REF:
+        case OPCODE_VECTOR_SET:
+        case OPCODE_VECTOR_LENGTH:
+        case OPCODE_CONS:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void
+serialize_add_global(struct serialize_writer_t *writer, struct evil_object_t *procedure, uint64_t symbol_hash)
+{
+    struct evil_object_t *location;
+    struct evil_object_t *value;
+    size_t i;
+
+    /*
+     * Only names that resolve to the root lexical environment are globals;
+     * anything bound further in is copied along with the procedure's
+     * lexical environment.
+     */
+    location = get_bound_location_in_lexical_environment(&VECTOR_BASE(procedure)[FIELD_LEXICAL_ENVIRONMENT], symbol_hash, 1);
+
+    if (location == empty_pair || location != get_bound_location(writer->environment, symbol_hash, 0))
+        return;
+
+    for (i = 0; i < writer->num_globals; ++i)
+    {
+        if (writer->globals[i].symbol_hash == symbol_hash)
+            return;
+    }
+
+    value = deref(location);
+
+    if (value != NULL
+            && value->tag_count.tag == TAG_SPECIAL_FUNCTION
+            && VECTOR_BASE(value)[FIELD_NAME].value.symbol_hash == symbol_hash)
+    {
+        return;
+    }
+
+    if (writer->num_globals == writer->globals_capacity)
+        writer->globals = serialize_grow(writer->globals, &writer->globals_capacity, sizeof(struct serialize_global_t));
+
+    writer->globals[writer->num_globals].symbol_hash = symbol_hash;
+    writer->globals[writer->num_globals].location = location;
+    ++writer->num_globals;
+
+    serialize_add_symbol(writer, symbol_hash);
+    serialize_visit_slot(writer, location);
+}
+
+static void
+serialize_visit_code(struct serialize_writer_t *writer, struct evil_object_t *procedure)
+{
+    struct evil_object_t *byte_code;
+    const unsigned char *pc;
+    const unsigned char *end;
+
+    byte_code = deref(&VECTOR_BASE(procedure)[FIELD_CODE]);
+    writer->is_code[serialize_add_object(writer, byte_code)] = 1;
+
+    pc = (const unsigned char *)byte_code->value.string_value;
+    end = pc + byte_code->tag_count.count;
+
+    while (pc < end)
+    {
+        int size;
+
+        size = vm_instruction_size(pc);
+        assert(size > 0);
+
+        if (*pc == OPCODE_LDIMM_8_SYMBOL)
+            serialize_add_symbol(writer, serialize_read_symbol_operand(pc));
+        else if (serialize_is_global_lookup(*pc))
+            serialize_add_global(writer, procedure, serialize_read_symbol_operand(pc));
+
+        pc += size;
+    }
+}
+
+static void
+serialize_scan(struct serialize_writer_t *writer)
+{
+    /*
+     * Numbering objects as they are found makes the object list its own
+     * work queue.
+     */
+    while (writer->num_scanned < writer->num_objects)
+    {
+        struct evil_object_t *object;
+        uint32_t i;
+
+        object = writer->objects[writer->num_scanned++];
+
+        if (object->tag_count.tag == TAG_STRING)
+            continue;
+
+        for (i = 0; i < object->tag_count.count; ++i)
+            serialize_visit_slot(writer, &VECTOR_BASE(object)[i]);
+
+        if (object->tag_count.tag == TAG_PROCEDURE)
+            serialize_visit_code(writer, object);
+    }
+}
+
+static void
+serialize_put_bytes(struct serialize_writer_t *writer, const void *bytes, size_t num_bytes)
+{
+    while (writer->size + num_bytes > writer->capacity)
+        writer->buffer = serialize_grow(writer->buffer, &writer->capacity, 1);
+
+    memcpy(writer->buffer + writer->size, bytes, num_bytes);
+    writer->size += num_bytes;
+}
+
+static void
+serialize_put_byte(struct serialize_writer_t *writer, unsigned char byte)
+{
+    serialize_put_bytes(writer, &byte, 1);
+}
+
+static void
+serialize_put_number(struct serialize_writer_t *writer, uint64_t number)
+{
+    while (number >= 0x80)
+    {
+        serialize_put_byte(writer, (unsigned char)(number | 0x80));
+        number >>= 7;
+    }
+
+    serialize_put_byte(writer, (unsigned char)number);
+}
+
+static void
+serialize_put_signed_number(struct serialize_writer_t *writer, int64_t number)
+{
+    serialize_put_number(writer, ((uint64_t)number << 1) ^ (uint64_t)(number >> 63));
+}
+
+static void
+serialize_put_slot(struct serialize_writer_t *writer, const struct evil_object_t *slot)
+{
+    unsigned char tag;
+    size_t index;
+
+    tag = slot->tag_count.tag;
+
+    if (slot->tag_count.count != 1)
+    {
+        serialize_put_byte(writer, (unsigned char)(tag | SERIALIZE_COUNT_FLAG));
+        serialize_put_number(writer, slot->tag_count.count);
+    }
+    else
+    {
+        serialize_put_byte(writer, tag);
+    }
+
+    switch (tag)
+    {
+        case TAG_REFERENCE:
+            {
+                enum serialize_reference_t kind;
+
+                kind = serialize_reference_kind(writer, slot->value.ref);
+                serialize_put_number(writer, (uint64_t)kind);
+
+                if (kind == SERIALIZE_REFERENCE_OBJECT)
+                {
+                    serialize_map_find(&writer->object_map, (uint64_t)(uintptr_t)slot->value.ref, &index);
+                    serialize_put_number(writer, index);
+                }
+            }
+            break;
+        case TAG_INNER_REFERENCE:
+            if (slot->value.ref == NULL)
+            {
+                serialize_put_number(writer, 0);
+            }
+            else
+            {
+                serialize_map_find(&writer->object_map, (uint64_t)(uintptr_t)slot->value.ref, &index);
+                serialize_put_number(writer, index + 1);
+            }
+            break;
+        case TAG_SYMBOL:
+            serialize_put_number(writer, serialize_add_symbol(writer, slot->value.symbol_hash));
+            break;
+        case TAG_FLONUM:
+        case TAG_EXTERNAL_FUNCTION:
+            serialize_put_bytes(writer, &slot->value, 8);
+            break;
+        default:
+            assert(is_value_tag(tag) && tag != TAG_ENVIRONMENT);
+            serialize_put_signed_number(writer, slot->value.fixnum_value);
+            break;
+    }
+}
+
+static void
+serialize_put_code(struct serialize_writer_t *writer, const struct evil_object_t *byte_code)
+{
+    const unsigned char *pc;
+    const unsigned char *end;
+    static const unsigned char empty_cache[VM_INLINE_CACHE_SIZE];
+
+    pc = (const unsigned char *)byte_code->value.string_value;
+    end = pc + byte_code->tag_count.count;
+
+    /*
+     * Inline caches hold addresses in the source environment; zeroed, they
+     * never match and are filled in again on first use.
+     */
+    while (pc < end)
+    {
+        int size;
+
+        size = vm_instruction_size(pc);
+
+        if (serialize_is_global_lookup(*pc))
+        {
+            serialize_put_bytes(writer, pc, 9);
+            serialize_put_bytes(writer, empty_cache, VM_INLINE_CACHE_SIZE);
+            serialize_put_bytes(writer, pc + 9 + VM_INLINE_CACHE_SIZE, (size_t)size - 9 - VM_INLINE_CACHE_SIZE);
+        }
+        else
+        {
+            serialize_put_bytes(writer, pc, (size_t)size);
+        }
+
+        pc += size;
+    }
+}
+
+static void
+serialize_put_object(struct serialize_writer_t *writer, size_t index)
+{
+    struct evil_object_t *object;
+    uint32_t i;
+
+    object = writer->objects[index];
+
+    if (object->tag_count.tag == TAG_STRING)
+    {
+        if (writer->is_code[index])
+            serialize_put_code(writer, object);
+        else
+            serialize_put_bytes(writer, object->value.string_value, object->tag_count.count);
+
+        return;
+    }
+
+    for (i = 0; i < object->tag_count.count; ++i)
+    {
+        struct evil_object_t *slot;
+
+        slot = &VECTOR_BASE(object)[i];
+
+        /*
+         * Native code belongs to the source environment; the copy starts
+         * counting calls towards compiling its own.
+         */
+        if (object->tag_count.tag == TAG_PROCEDURE && i == FIELD_NATIVE_CODE && slot->tag_count.tag == TAG_EXTERNAL_FUNCTION)
+        {
+            struct evil_object_t countdown;
+
+            countdown = make_fixnum_object(JIT_CALL_THRESHOLD);
+            serialize_put_slot(writer, &countdown);
+            continue;
+        }
+
+        serialize_put_slot(writer, slot);
+    }
+}
+
+unsigned char *
+serialize_value(struct evil_environment_t *environment, const struct evil_object_t *value, size_t *size)
+{
+    struct serialize_writer_t writer;
+    size_t i;
+
+    memset(&writer, 0, sizeof writer);
+    writer.environment = environment;
+    writer.lexical_environment = deref(&environment->lexical_environment);
+
+    /*
+     * Results straight off the evaluation stack can refer to a value held
+     * in a slot of a vector or pair, like the result of vector-ref; the
+     * value itself is what gets copied.
+     */
+    while ((value->tag_count.tag == TAG_REFERENCE
+                || (value->tag_count.tag == TAG_INNER_REFERENCE && value->value.ref != NULL))
+            && !is_reference_type(deref((struct evil_object_t *)value)))
+    {
+        value = deref((struct evil_object_t *)value);
+    }
+
+    serialize_visit_slot(&writer, (struct evil_object_t *)value);
+    serialize_scan(&writer);
+
+    /*
+     * The symbols are written first but only complete once every slot has
+     * been visited; the scan above finds them all.
+     */
+    serialize_put_number(&writer, writer.num_symbols);
+
+    for (i = 0; i < writer.num_symbols; ++i)
+    {
+        const char *name;
+        size_t length;
+
+        name = find_symbol_name(environment, writer.symbols[i]);
+        assert(name != NULL);
+        length = strlen(name);
+
+        serialize_put_number(&writer, length);
+        serialize_put_bytes(&writer, name, length);
+    }
+
+    serialize_put_number(&writer, writer.num_objects);
+
+    for (i = 0; i < writer.num_objects; ++i)
+    {
+        serialize_put_byte(&writer, writer.objects[i]->tag_count.tag);
+        serialize_put_number(&writer, writer.objects[i]->tag_count.count);
+    }
+
+    for (i = 0; i < writer.num_objects; ++i)
+        serialize_put_object(&writer, i);
+
+    serialize_put_number(&writer, writer.num_globals);
+
+    for (i = 0; i < writer.num_globals; ++i)
+    {
+        serialize_put_number(&writer, serialize_add_symbol(&writer, writer.globals[i].symbol_hash) - 1);
+        serialize_put_slot(&writer, writer.globals[i].location);
+    }
+
+    serialize_put_slot(&writer, value);
+
+    serialize_map_destroy(&writer.object_map);
+    serialize_map_destroy(&writer.symbol_map);
+    free(writer.objects);
+    free(writer.is_code);
+    free(writer.symbols);
+    free(writer.globals);
+
+    *size = writer.size;
+
+    return writer.buffer;
+}
+
+static unsigned char
+deserialize_get_byte(struct serialize_reader_t *reader)
+{
+    assert(reader->ptr < reader->end);
+
+    return *reader->ptr++;
+}
+
+static uint64_t
+deserialize_get_number(struct serialize_reader_t *reader)
+{
+    uint64_t number;
+    int shift;
+
+    number = 0;
+
+    for (shift = 0; ; shift += 7)
+    {
+        unsigned char byte;
+
+        byte = deserialize_get_byte(reader);
+        number |= (uint64_t)(byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0)
+            return number;
+    }
+}
+
+static int64_t
+deserialize_get_signed_number(struct serialize_reader_t *reader)
+{
+    uint64_t number;
+
+    number = deserialize_get_number(reader);
+
+    return (int64_t)(number >> 1) ^ -(int64_t)(number & 1);
+}
+
+static const unsigned char *
+deserialize_get_bytes(struct serialize_reader_t *reader, size_t num_bytes)
+{
+    const unsigned char *bytes;
+
+    assert((size_t)(reader->end - reader->ptr) >= num_bytes);
+    bytes = reader->ptr;
+    reader->ptr += num_bytes;
+
+    return bytes;
+}
+
+static struct evil_object_t *
+deserialize_object(struct serialize_reader_t *reader, uint64_t index)
+{
+    assert(index < reader->num_objects);
+
+    return evil_resolve_object_handle(reader->handles[index]);
+}
+
+static void
+deserialize_get_slot(struct serialize_reader_t *reader, struct evil_object_t *slot)
+{
+    unsigned char tag;
+    uint64_t number;
+
+    tag = deserialize_get_byte(reader);
+    slot->tag_count.flag = 0;
+    slot->tag_count.count = 1;
+
+    if (tag & SERIALIZE_COUNT_FLAG)
+    {
+        tag &= (unsigned char)~SERIALIZE_COUNT_FLAG;
+        slot->tag_count.count = (uint32_t)deserialize_get_number(reader);
+    }
+
+    slot->tag_count.tag = tag;
+
+    switch (tag)
+    {
+        case TAG_REFERENCE:
+            switch (deserialize_get_number(reader))
+            {
+                case SERIALIZE_REFERENCE_EMPTY_PAIR:
+                    slot->value.ref = empty_pair;
+                    break;
+                case SERIALIZE_REFERENCE_ENVIRONMENT:
+                    slot->value.ref = (struct evil_object_t *)reader->environment;
+                    break;
+                case SERIALIZE_REFERENCE_LEXICAL_ENVIRONMENT:
+                    slot->value.ref = deref(&reader->environment->lexical_environment);
+                    break;
+                default:
+                    slot->value.ref = deserialize_object(reader, deserialize_get_number(reader));
+                    break;
+            }
+            break;
+        case TAG_INNER_REFERENCE:
+            number = deserialize_get_number(reader);
+            slot->value.ref = (number == 0) ? NULL : deserialize_object(reader, number - 1);
+            break;
+        case TAG_SYMBOL:
+            number = deserialize_get_number(reader);
+            assert(number <= reader->num_symbols);
+            slot->value.symbol_hash = (number == 0) ? INVALID_HASH : reader->symbols[number - 1];
+            break;
+        case TAG_FLONUM:
+        case TAG_EXTERNAL_FUNCTION:
+            memcpy(&slot->value, deserialize_get_bytes(reader, 8), 8);
+            break;
+        default:
+            slot->value.fixnum_value = deserialize_get_signed_number(reader);
+            break;
+    }
+}
+
+static struct evil_object_t *
+deserialize_allocate(struct serialize_reader_t *reader, unsigned char tag, size_t count)
+{
+    struct heap_t *heap;
+    struct evil_object_t *object;
+
+    heap = reader->environment->heap;
+
+    if (tag == TAG_STRING)
+        return gc_alloc(heap, TAG_STRING, count);
+
+    assert(tag == TAG_VECTOR || tag == TAG_PAIR || tag == TAG_PROCEDURE || tag == TAG_SPECIAL_FUNCTION);
+    object = gc_alloc_vector(heap, count);
+    object->tag_count.tag = tag;
+
+    return object;
+}
+
+struct evil_object_t
+deserialize_value(struct evil_environment_t *environment, const unsigned char *buffer, size_t size)
+{
+    struct serialize_reader_t reader;
+    struct evil_object_t value;
+    size_t num_globals;
+    size_t i;
+
+    memset(&reader, 0, sizeof reader);
+    reader.environment = environment;
+    reader.ptr = buffer;
+    reader.end = buffer + size;
+
+    reader.num_symbols = (size_t)deserialize_get_number(&reader);
+    reader.symbols = malloc((reader.num_symbols + 1) * sizeof(uint64_t));
+    assert(reader.symbols != NULL);
+
+    for (i = 0; i < reader.num_symbols; ++i)
+    {
+        size_t length;
+
+        length = (size_t)deserialize_get_number(&reader);
+        reader.symbols[i] = register_symbol_from_bytes(environment, deserialize_get_bytes(&reader, length), length);
+    }
+
+    /*
+     * Every object is kept alive by a handle until the value is complete,
+     * as they only become reachable from each other once they are filled
+     * in.
+     */
+    reader.num_objects = (size_t)deserialize_get_number(&reader);
+    reader.handles = malloc((reader.num_objects + 1) * sizeof(struct evil_object_handle_t *));
+    assert(reader.handles != NULL);
+
+    for (i = 0; i < reader.num_objects; ++i)
+    {
+        unsigned char tag;
+        size_t count;
+
+        tag = deserialize_get_byte(&reader);
+        count = (size_t)deserialize_get_number(&reader);
+        reader.handles[i] = evil_create_object_handle(environment, deserialize_allocate(&reader, tag, count));
+    }
+
+    for (i = 0; i < reader.num_objects; ++i)
+    {
+        struct evil_object_t *object;
+        uint32_t ii;
+
+        object = deserialize_object(&reader, i);
+
+        if (object->tag_count.tag == TAG_STRING)
+        {
+            memcpy(object->value.string_value, deserialize_get_bytes(&reader, object->tag_count.count), object->tag_count.count);
+            continue;
+        }
+
+        for (ii = 0; ii < object->tag_count.count; ++ii)
+            deserialize_get_slot(&reader, &VECTOR_BASE(object)[ii]);
+    }
+
+    num_globals = (size_t)deserialize_get_number(&reader);
+
+    for (i = 0; i < num_globals; ++i)
+    {
+        struct evil_object_t symbol;
+        struct evil_object_t *location;
+        uint64_t index;
+
+        index = deserialize_get_number(&reader);
+        assert(index < reader.num_symbols);
+
+        symbol.tag_count.tag = TAG_SYMBOL;
+        symbol.tag_count.flag = 0;
+        symbol.tag_count.count = 1;
+        symbol.value.symbol_hash = reader.symbols[index];
+
+        location = bind(environment, environment->lexical_environment, symbol);
+        deserialize_get_slot(&reader, location);
+        gc_write_barrier(environment->heap, location);
+    }
+
+    deserialize_get_slot(&reader, &value);
+    assert(reader.ptr == reader.end);
+
+    for (i = 0; i < reader.num_objects; ++i)
+        evil_destroy_object_handle(environment, reader.handles[i]);
+
+    free(reader.handles);
+    free(reader.symbols);
+
+    return value;
+}
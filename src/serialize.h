@@ -0,0 +1,50 @@
+/***********************************************************************
+ * evilscheme, Copyright (c) 2012-2015, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE.TXT for details.
+ ***********************************************************************/
+
+#ifndef EVIL_SERIALIZE_H
+#define EVIL_SERIALIZE_H
+
+#include <stddef.h>
+
+#include "object.h"
+
+/*
+ * Deep copies of values between environments, which may be running on
+ * different threads. A value is written into a self contained buffer
+ * without touching the other environment and later read into it, so the
+ * two environments never share any objects.
+ *
+ * Everything reachable from the value is copied, keeping shared structure
+ * and cycles. The objects are numbered and references are written as
+ * object numbers, symbols as indices into a table of their names and
+ * integers as variable length numbers, so copies stay close to the size of
+ * the objects' contents.
+ *
+ * A procedure refers to the globals its code names by symbol rather than
+ * through a reference, so the bindings of those globals are copied along
+ * with it and bound in the destination environment, except for builtins
+ * still bound under their own names. The destination's root lexical
+ * environment stands in for the source's. Procedures lose their native
+ * code and the VM's inline caches, which are only valid in the environment
+ * they were made in.
+ */
+
+/*
+ * Returns a buffer allocated with malloc holding a copy of the value and
+ * stores its size.
+ */
+unsigned char *
+serialize_value(struct evil_environment_t *environment, const struct evil_object_t *value, size_t *size);
+
+/*
+ * Copies the value in the buffer into the environment and returns it. The
+ * value is not reachable by the garbage collector until the caller stores
+ * it somewhere it is.
+ */
+struct evil_object_t
+deserialize_value(struct evil_environment_t *environment, const unsigned char *buffer, size_t size);
+
+#endif
@@ -0,0 +1,755 @@
+/***********************************************************************
+ * evilscheme, Copyright (c) 2012-2015, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE.TXT for details.
+ ***********************************************************************/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base.h"
+#include "object.h"
+#include "runtime.h"
+#include "verify.h"
+#include "vm.h"
+
+#ifndef MAX
+#   define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/*
+ * What the verifier knows about an instruction: how many stack entries it
+ * consumes and produces, and where control can go next. Tail calls leave
+ * the frame, but if they called a builtin the builtin's result is returned
+ * by the RETURN that must follow them.
+ */
+struct verify_instruction_t
+{
+    int size;
+    int pops;
+    int pushes;
+    int has_target;
+    size_t target;
+    int falls_through;
+    int clears_stack;
+    int is_tail_call;
+};
+
+enum verify_type_t
+{
+    VERIFY_TYPE_UNKNOWN,
+    VERIFY_TYPE_BOOLEAN,
+    VERIFY_TYPE_FIXNUM,
+    VERIFY_TYPE_REFERENCE,
+    VERIFY_TYPE_INNER_REFERENCE
+};
+
+struct verify_context_t
+{
+    struct evil_environment_t *environment;
+    const unsigned char *code;
+    size_t num_bytes;
+    int num_args;
+    int num_locals;
+    int num_fn_locals;
+    int max_depth;
+
+    /*
+     * The stack depth on entry to the instruction starting at each offset,
+     * or -1 if no path reaches it (yet).
+     */
+    int *depths;
+    size_t *worklist;
+    size_t worklist_size;
+    char *queued;
+    struct verify_error_t *error;
+};
+
+static int
+verify_fail(struct verify_context_t *context, size_t offset, const char *message)
+{
+    if (context->error != NULL)
+    {
+        context->error->offset = offset;
+        context->error->message = message;
+    }
+
+    return 0;
+}
+
+static short
+verify_read_short(const unsigned char *pc)
+{
+    union convert_two_t c2;
+
+    memcpy(c2.bytes, pc, 2);
+
+    return c2.s2;
+}
+
+static int
+verify_slot(struct verify_context_t *context, short slot)
+{
+    if (slot >= 0)
+        return slot < context->num_args;
+
+    return slot <= -VM_SLOT_COUNT - 1
+        && slot >= -VM_SLOT_COUNT - context->num_locals;
+}
+
+static int
+verify_symbol(struct verify_context_t *context, const unsigned char *pc)
+{
+    union convert_eight_t c8;
+
+    memcpy(c8.bytes, pc, 8);
+
+    return find_symbol_name(context->environment, c8.u8) != NULL;
+}
+
+static int
+verify_branch(struct verify_context_t *context, size_t offset, struct verify_instruction_t *instruction, short displacement)
+{
+    ptrdiff_t target;
+
+    target = (ptrdiff_t)offset + instruction->size + displacement;
+
+    if (target < 0 || (size_t)target >= context->num_bytes)
+        return verify_fail(context, offset, "branch target is outside the procedure");
+
+    instruction->has_target = 1;
+    instruction->target = (size_t)target;
+
+    return 1;
+}
+
+/*
+ * Decodes the instruction at the offset and checks its operands, other than
+ * those that depend on the stack depth.
+ */
+static int
+verify_decode(struct verify_context_t *context, size_t offset, struct verify_instruction_t *instruction)
+{
+    const unsigned char *pc;
+    size_t remaining;
+    unsigned char opcode;
+
+    pc = context->code + offset;
+    remaining = context->num_bytes - offset;
+    opcode = *pc;
+
+    memset(instruction, 0, sizeof *instruction);
+    instruction->falls_through = 1;
+
+    if (opcode == OPCODE_LDSTR && memchr(pc + 1, 0, remaining - 1) == NULL)
+        return verify_fail(context, offset, "string constant is not terminated");
+
+    instruction->size = vm_instruction_size(pc);
+
+    if (instruction->size == 0
+            || opcode == OPCODE_INVALID
+            || opcode == OPCODE_NOT)
+    {
+        return verify_fail(context, offset, "invalid opcode");
+    }
+
+    if ((size_t)instruction->size > remaining)
+        return verify_fail(context, offset, "instruction runs past the end of the procedure");
+
+    switch (opcode)
+    {
+        case OPCODE_LDSLOT_X:
+            if (!verify_slot(context, verify_read_short(pc + 1)))
+                return verify_fail(context, offset, "slot out of range");
+
+            instruction->pushes = 1;
+            break;
+        case OPCODE_STSLOT_X:
+            if (!verify_slot(context, verify_read_short(pc + 1)))
+                return verify_fail(context, offset, "slot out of range");
+
+            instruction->pops = 1;
+            break;
+        case OPCODE_LDIMM_1_BOOL:
+            if (pc[1] > 1)
+                return verify_fail(context, offset, "boolean constant is not 0 or 1");
+
+            instruction->pushes = 1;
+            break;
+        case OPCODE_LDIMM_8_SYMBOL:
+        case OPCODE_GET_BOUND_LOCATION:
+            if (!verify_symbol(context, pc + 1))
+                return verify_fail(context, offset, "symbol is not interned");
+
+            instruction->pushes = 1;
+            break;
+        case OPCODE_LDFN:
+            /*
+             * Function locals are loaded with LDFN, LDIMM_1_FIXNUM <field>,
+             * MAKE_REF, LOAD.
+             */
+            if (remaining > 3 && pc[1] == OPCODE_LDIMM_1_FIXNUM && pc[3] == OPCODE_MAKE_REF)
+            {
+                int field;
+
+                field = (signed char)pc[2];
+
+                if (field < FIELD_LOCALS || field >= FIELD_LOCALS + context->num_fn_locals)
+                    return verify_fail(context, offset, "function local out of range");
+            }
+
+            instruction->pushes = 1;
+            break;
+        case OPCODE_LDIMM_1_CHAR:
+        case OPCODE_LDIMM_1_FIXNUM:
+        case OPCODE_LDIMM_1_FLONUM:
+        case OPCODE_LDIMM_4_FIXNUM:
+        case OPCODE_LDIMM_4_FLONUM:
+        case OPCODE_LDIMM_8_FIXNUM:
+        case OPCODE_LDIMM_8_FLONUM:
+        case OPCODE_LDSTR:
+        case OPCODE_LDEMPTY:
+            instruction->pushes = 1;
+            break;
+        case OPCODE_LOAD:
+        case OPCODE_LDTYPE:
+            instruction->pops = 1;
+            instruction->pushes = 1;
+            break;
+        case OPCODE_STORE:
+        case OPCODE_SET:
+            instruction->pops = 2;
+            break;
+        case OPCODE_MAKE_REF:
+        case OPCODE_CMP_EQUAL:
+        case OPCODE_CMPN_EQ:
+        case OPCODE_CMPN_LT:
+        case OPCODE_CMPN_GT:
+        case OPCODE_CMPN_LE:
+        case OPCODE_CMPN_GE:
+        case OPCODE_CMPN_EQ_FIX:
+        case OPCODE_CMPN_LT_FIX:
+        case OPCODE_CMPN_GT_FIX:
+        case OPCODE_CMPN_LE_FIX:
+        case OPCODE_CMPN_GE_FIX:
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_XOR:
+        case OPCODE_ADD_FIX_FIX:
+        case OPCODE_SUB_FIX_FIX:
+        case OPCODE_MUL_FIX_FIX:
+        case OPCODE_DIV_FIX_FIX:
+        case OPCODE_ADD_FLO_FLO:
+        case OPCODE_SUB_FLO_FLO:
+        case OPCODE_MUL_FLO_FLO:
+        case OPCODE_DIV_FLO_FLO:
+            instruction->pops = 2;
+            instruction->pushes = 1;
+            break;
+        case OPCODE_BRANCH:
+            instruction->falls_through = 0;
+            return verify_branch(context, offset, instruction, verify_read_short(pc + 1));
+        case OPCODE_COND_BRANCH:
+            instruction->pops = 1;
+            return verify_branch(context, offset, instruction, verify_read_short(pc + 1));
+        case OPCODE_CALL:
+        case OPCODE_TAILCALL:
+            instruction->pops = (unsigned short)verify_read_short(pc + 1) + 1;
+            instruction->pushes = 1;
+            instruction->is_tail_call = opcode == OPCODE_TAILCALL;
+            break;
+        case OPCODE_RETURN:
+            instruction->pops = 1;
+            instruction->falls_through = 0;
+            break;
+        case OPCODE_NOP:
+        case OPCODE_BREAK:
+            break;
+        case OPCODE_POP:
+            instruction->pops = 1;
+            break;
+        case OPCODE_CMPN_EQ_SLOTS_BRANCH:
+        case OPCODE_CMPN_LT_SLOTS_BRANCH:
+        case OPCODE_CMPN_GT_SLOTS_BRANCH:
+        case OPCODE_CMPN_LE_SLOTS_BRANCH:
+        case OPCODE_CMPN_GE_SLOTS_BRANCH:
+            if (!verify_slot(context, verify_read_short(pc + 1)) || !verify_slot(context, verify_read_short(pc + 3)))
+                return verify_fail(context, offset, "slot out of range");
+
+            return verify_branch(context, offset, instruction, verify_read_short(pc + 5));
+        case OPCODE_CALL_GLOBAL:
+        case OPCODE_TAILCALL_GLOBAL:
+        case OPCODE_VECTOR_REF:
+        case OPCODE_VECTOR_SET:
+        case OPCODE_VECTOR_LENGTH:
+        case OPCODE_CONS:
+            {
+                static const int primitive_args[] = { 2, 3, 1, 2 };
+                int num_args;
+
+                if (!verify_symbol(context, pc + 1))
+                    return verify_fail(context, offset, "symbol is not interned");
+
+                num_args = (unsigned short)verify_read_short(pc + 9 + VM_INLINE_CACHE_SIZE);
+
+                /*
+                 * The inline paths of the primitive operations take their
+                 * operands straight off the stack.
+                 */
+                if (opcode >= OPCODE_VECTOR_REF && num_args != primitive_args[opcode - OPCODE_VECTOR_REF])
+                    return verify_fail(context, offset, "wrong number of arguments to a primitive operation");
+
+                instruction->pops = num_args;
+                instruction->pushes = 1;
+                instruction->is_tail_call = opcode == OPCODE_TAILCALL_GLOBAL;
+            }
+            break;
+        case OPCODE_ADD_IMM_SLOT:
+        case OPCODE_SUB_SLOT_IMM:
+            if (!verify_slot(context, verify_read_short(pc + 2)))
+                return verify_fail(context, offset, "slot out of range");
+
+            instruction->pushes = 1;
+            break;
+        case OPCODE_RADD:
+        case OPCODE_RSUB:
+        case OPCODE_RMUL:
+        case OPCODE_RDIV:
+            if (!verify_slot(context, verify_read_short(pc + 5)))
+                return verify_fail(context, offset, "slot out of range");
+            /* FALLTHROUGH */
+        case OPCODE_RADD_IMM:
+        case OPCODE_RSUB_IMM:
+        case OPCODE_RMUL_IMM:
+        case OPCODE_RDIV_IMM:
+            if (!verify_slot(context, verify_read_short(pc + 1)) || !verify_slot(context, verify_read_short(pc + 3)))
+                return verify_fail(context, offset, "slot out of range");
+            break;
+        case OPCODE_BRANCH_IF_SELF:
+            if (!verify_symbol(context, pc + 1))
+                return verify_fail(context, offset, "symbol is not interned");
+
+            return verify_branch(context, offset, instruction, verify_read_short(pc + 9 + VM_INLINE_CACHE_SIZE));
+        case OPCODE_LOOP:
+            instruction->falls_through = 0;
+            instruction->clears_stack = 1;
+            return verify_branch(context, offset, instruction, verify_read_short(pc + 1));
+        default:
+            return verify_fail(context, offset, "invalid opcode");
+    }
+
+    return 1;
+}
+
+static void
+verify_queue(struct verify_context_t *context, size_t offset)
+{
+    if (!context->queued[offset])
+    {
+        context->queued[offset] = 1;
+        context->worklist[context->worklist_size++] = offset;
+    }
+}
+
+static int
+verify_merge_depth(struct verify_context_t *context, size_t from, size_t offset, int depth)
+{
+    if (context->depths[offset] == -1)
+    {
+        context->depths[offset] = depth;
+        verify_queue(context, offset);
+
+        return 1;
+    }
+
+    /*
+     * RETURN only looks at the top of the stack.
+     */
+    if (context->code[offset] == OPCODE_RETURN && depth >= 1)
+        return 1;
+
+    if (context->depths[offset] != depth)
+        return verify_fail(context, from, "stack depth differs between paths");
+
+    return 1;
+}
+
+/*
+ * The first pass finds every reachable instruction and the stack depth at
+ * each of them.
+ */
+static int
+verify_stack(struct verify_context_t *context)
+{
+    size_t offset;
+
+    context->depths[0] = 0;
+    verify_queue(context, 0);
+
+    while (context->worklist_size > 0)
+    {
+        struct verify_instruction_t instruction;
+        int depth;
+
+        offset = context->worklist[--context->worklist_size];
+        context->queued[offset] = 0;
+        depth = context->depths[offset];
+
+        if (!verify_decode(context, offset, &instruction))
+            return 0;
+
+        if (instruction.pops > depth)
+            return verify_fail(context, offset, "stack underflow");
+
+        depth += instruction.pushes - instruction.pops;
+        context->max_depth = MAX(context->max_depth, depth);
+
+        if (instruction.has_target
+                && !verify_merge_depth(context, offset, instruction.target, instruction.clears_stack ? 0 : depth))
+        {
+            return 0;
+        }
+
+        if (!instruction.falls_through)
+            continue;
+
+        if (offset + instruction.size == context->num_bytes)
+            return verify_fail(context, offset, "execution runs past the end of the procedure");
+
+        /*
+         * A tail call that returns here leaves only the builtin's result on
+         * the stack.
+         */
+        if (instruction.is_tail_call)
+        {
+            if (context->code[offset + instruction.size] != OPCODE_RETURN)
+                return verify_fail(context, offset, "tail call is not followed by a return");
+
+            depth = 1;
+        }
+
+        if (!verify_merge_depth(context, offset, offset + instruction.size, depth))
+            return 0;
+    }
+
+    /*
+     * Branch targets must not land inside another instruction.
+     */
+    for (offset = 0; offset < context->num_bytes; ++offset)
+    {
+        struct verify_instruction_t instruction;
+        size_t i;
+
+        if (context->depths[offset] == -1)
+            continue;
+
+        verify_decode(context, offset, &instruction);
+
+        for (i = 1; i < (size_t)instruction.size; ++i)
+        {
+            if (context->depths[offset + i] != -1)
+                return verify_fail(context, offset + i, "branch into the middle of an instruction");
+        }
+    }
+
+    return 1;
+}
+
+static unsigned char
+verify_join_type(unsigned char a, unsigned char b)
+{
+    return (a == b) ? a : VERIFY_TYPE_UNKNOWN;
+}
+
+static int
+verify_slot_index(struct verify_context_t *context, short slot)
+{
+    return (slot >= 0) ? slot : context->num_args + (-slot - VM_SLOT_COUNT - 1);
+}
+
+/*
+ * Computes the types after the instruction at the offset from the types
+ * before it. The stack entries start after the slots, bottom first.
+ */
+static void
+verify_transfer_types(struct verify_context_t *context, size_t offset, struct verify_instruction_t *instruction, unsigned char *types)
+{
+    const unsigned char *pc;
+    unsigned char *stack;
+    unsigned char result;
+    int depth;
+
+    pc = context->code + offset;
+    stack = types + context->num_args + context->num_locals;
+    depth = context->depths[offset];
+    result = VERIFY_TYPE_UNKNOWN;
+
+    switch (*pc)
+    {
+        case OPCODE_LDSLOT_X:
+            result = types[verify_slot_index(context, verify_read_short(pc + 1))];
+            break;
+        case OPCODE_STSLOT_X:
+            types[verify_slot_index(context, verify_read_short(pc + 1))] = stack[depth - 1];
+            break;
+        case OPCODE_LDIMM_1_BOOL:
+        case OPCODE_CMP_EQUAL:
+        case OPCODE_CMPN_EQ:
+        case OPCODE_CMPN_LT:
+        case OPCODE_CMPN_GT:
+        case OPCODE_CMPN_LE:
+        case OPCODE_CMPN_GE:
+        case OPCODE_CMPN_EQ_FIX:
+        case OPCODE_CMPN_LT_FIX:
+        case OPCODE_CMPN_GT_FIX:
+        case OPCODE_CMPN_LE_FIX:
+        case OPCODE_CMPN_GE_FIX:
+            result = VERIFY_TYPE_BOOLEAN;
+            break;
+        case OPCODE_LDIMM_1_FIXNUM:
+        case OPCODE_LDIMM_4_FIXNUM:
+        case OPCODE_LDIMM_8_FIXNUM:
+        case OPCODE_LDTYPE:
+            result = VERIFY_TYPE_FIXNUM;
+            break;
+        case OPCODE_LDSTR:
+        case OPCODE_LDEMPTY:
+        case OPCODE_LDFN:
+        case OPCODE_GET_BOUND_LOCATION:
+            result = VERIFY_TYPE_REFERENCE;
+            break;
+        case OPCODE_MAKE_REF:
+            result = VERIFY_TYPE_INNER_REFERENCE;
+            break;
+        case OPCODE_RADD:
+        case OPCODE_RSUB:
+        case OPCODE_RMUL:
+        case OPCODE_RDIV:
+        case OPCODE_RADD_IMM:
+        case OPCODE_RSUB_IMM:
+        case OPCODE_RMUL_IMM:
+        case OPCODE_RDIV_IMM:
+            types[verify_slot_index(context, verify_read_short(pc + 1))] = VERIFY_TYPE_UNKNOWN;
+            break;
+        default:
+            break;
+    }
+
+    depth -= instruction->pops;
+
+    if (instruction->pushes)
+        stack[depth] = result;
+}
+
+/*
+ * Returns non-zero if the operands the interpreter would type check are
+ * known to have the right types.
+ */
+static int
+verify_operand_types(struct verify_context_t *context, size_t offset, const unsigned char *types)
+{
+    const unsigned char *stack;
+    unsigned char top;
+    int depth;
+
+    stack = types + context->num_args + context->num_locals;
+    depth = context->depths[offset];
+    top = (depth > 0) ? stack[depth - 1] : VERIFY_TYPE_UNKNOWN;
+
+    switch (context->code[offset])
+    {
+        case OPCODE_LOAD:
+        case OPCODE_STORE:
+        case OPCODE_SET:
+            return top == VERIFY_TYPE_REFERENCE || top == VERIFY_TYPE_INNER_REFERENCE;
+        case OPCODE_MAKE_REF:
+            return top == VERIFY_TYPE_FIXNUM && stack[depth - 2] == VERIFY_TYPE_REFERENCE;
+        case OPCODE_COND_BRANCH:
+            return top == VERIFY_TYPE_BOOLEAN;
+        default:
+            return 1;
+    }
+}
+
+static int
+verify_merge_types(struct verify_context_t *context, unsigned char *states, char *reached, size_t offset, const unsigned char *types)
+{
+    unsigned char *state;
+    int width;
+    int changed;
+    int i;
+
+    width = context->num_args + context->num_locals + context->max_depth;
+    state = states + offset * width;
+
+    if (!reached[offset])
+    {
+        reached[offset] = 1;
+        memcpy(state, types, width);
+
+        return 1;
+    }
+
+    changed = 0;
+
+    for (i = 0; i < width; ++i)
+    {
+        unsigned char joined;
+
+        joined = verify_join_type(state[i], types[i]);
+        changed |= joined != state[i];
+        state[i] = joined;
+    }
+
+    return changed;
+}
+
+/*
+ * The second pass propagates types along the paths the first pass found
+ * until they no longer change. Every type only ever moves to unknown, so
+ * this terminates.
+ */
+static int
+verify_types(struct verify_context_t *context)
+{
+    unsigned char *states;
+    unsigned char *types;
+    char *reached;
+    size_t offset;
+    int width;
+    int proven;
+
+    width = context->num_args + context->num_locals + context->max_depth;
+
+    if (width == 0)
+        return 1;
+
+    states = calloc(context->num_bytes, width);
+    types = calloc(1, width);
+    reached = calloc(context->num_bytes, 1);
+
+    if (states == NULL || types == NULL || reached == NULL)
+    {
+        free(states);
+        free(types);
+        free(reached);
+
+        return 0;
+    }
+
+    verify_merge_types(context, states, reached, 0, types);
+    verify_queue(context, 0);
+
+    while (context->worklist_size > 0)
+    {
+        struct verify_instruction_t instruction;
+
+        offset = context->worklist[--context->worklist_size];
+        context->queued[offset] = 0;
+
+        verify_decode(context, offset, &instruction);
+        memcpy(types, states + offset * width, width);
+        verify_transfer_types(context, offset, &instruction, types);
+
+        if (instruction.has_target
+                && verify_merge_types(context, states, reached, instruction.target, types))
+        {
+            verify_queue(context, instruction.target);
+        }
+
+        if (instruction.falls_through
+                && !instruction.is_tail_call
+                && verify_merge_types(context, states, reached, offset + instruction.size, types))
+        {
+            verify_queue(context, offset + instruction.size);
+        }
+    }
+
+    proven = 1;
+
+    for (offset = 0; offset < context->num_bytes && proven; ++offset)
+    {
+        if (reached[offset])
+            proven = verify_operand_types(context, offset, states + offset * width);
+    }
+
+    free(states);
+    free(types);
+    free(reached);
+
+    return proven;
+}
+
+int
+verify_procedure(struct evil_environment_t *environment, struct evil_object_t *procedure, struct verify_error_t *error)
+{
+    struct verify_context_t context;
+    struct vm_procedure_header_t header;
+    struct evil_object_t *byte_code;
+    size_t i;
+    int verified;
+
+    assert(procedure->tag_count.tag == TAG_PROCEDURE);
+
+    byte_code = deref(&VECTOR_BASE(procedure)[FIELD_CODE]);
+    assert(byte_code->tag_count.tag == TAG_STRING);
+
+    header = vm_procedure_header(procedure);
+    header.flags &= ~(VM_PROCEDURE_VERIFIED | VM_PROCEDURE_TYPES_VERIFIED);
+
+    memset(&context, 0, sizeof context);
+    context.environment = environment;
+    context.code = (const unsigned char *)byte_code->value.string_value;
+    context.num_bytes = byte_code->tag_count.count;
+    context.num_args = header.num_args;
+    context.num_locals = header.num_locals;
+    context.num_fn_locals = procedure->tag_count.count - FIELD_LOCALS;
+    context.error = error;
+
+    if (context.num_bytes == 0)
+    {
+        vm_set_procedure_header(procedure, header);
+        return verify_fail(&context, 0, "procedure has no code");
+    }
+
+    context.depths = malloc(context.num_bytes * sizeof(int));
+    context.worklist = malloc(context.num_bytes * sizeof(size_t));
+    context.queued = calloc(context.num_bytes, 1);
+
+    if (context.depths == NULL || context.worklist == NULL || context.queued == NULL)
+    {
+        verified = verify_fail(&context, 0, "out of memory");
+    }
+    else
+    {
+        for (i = 0; i < context.num_bytes; ++i)
+            context.depths[i] = -1;
+
+        verified = verify_stack(&context);
+
+        if (verified && context.max_depth > 0xffff)
+            verified = verify_fail(&context, 0, "evaluation stack too deep");
+
+        if (verified)
+        {
+            header.stack_depth = (unsigned short)context.max_depth;
+            header.flags |= VM_PROCEDURE_VERIFIED;
+
+            if (verify_types(&context))
+                header.flags |= VM_PROCEDURE_TYPES_VERIFIED;
+        }
+    }
+
+    free(context.depths);
+    free(context.worklist);
+    free(context.queued);
+
+    vm_set_procedure_header(procedure, header);
+
+    return verified;
+}
@@ -0,0 +1,58 @@
+/***********************************************************************
+ * evilscheme, Copyright (c) 2012-2015, Maximilian Burke
+ * This file is distributed under the FreeBSD license.
+ * See LICENSE.TXT for details.
+ ***********************************************************************/
+
+#ifndef EVIL_VERIFY_H
+#define EVIL_VERIFY_H
+
+#include <stddef.h>
+
+#include "object.h"
+
+/*
+ * Bytecode verifier. Every procedure is verified once, right after the
+ * compiler assembles it, by following every path through its bytecode and
+ * tracking the depth of the evaluation stack. It proves that:
+ *
+ *   - every instruction decodes completely within the bytecode and every
+ *     branch lands on the first byte of an instruction,
+ *   - control never runs off the end of the bytecode and a tail call is
+ *     always followed by a RETURN,
+ *   - the stack depth is the same on every path into an instruction, never
+ *     drops below the procedure's local slots and covers every instruction's
+ *     operands,
+ *   - every slot operand names an argument or a local slot, never the saved
+ *     program area chain or return address,
+ *   - constant operands are valid: booleans are 0 or 1, strings are
+ *     terminated, symbols are interned, primitive operations have their
+ *     fixed number of arguments and function locals are in range.
+ *
+ * A procedure that passes is marked VM_PROCEDURE_VERIFIED, which lets the
+ * interpreter rely on the above instead of checking it as it runs, and the
+ * deepest its evaluation stack gets is recorded in its header for the
+ * stack overflow checks in calls.
+ *
+ * A second pass tracks what it can of the types of the slots and the stack
+ * entries. If it finds that every operand the interpreter would otherwise
+ * type check, the references of LOAD, STORE, MAKE_REF and SET and the
+ * condition of COND_BRANCH, always has the right type, the procedure is also
+ * marked VM_PROCEDURE_TYPES_VERIFIED and the interpreter skips those checks
+ * for it.
+ */
+
+struct verify_error_t
+{
+    size_t offset;
+    const char *message;
+};
+
+/*
+ * Verifies the procedure and sets its header flags. Returns 0, and fills in
+ * the error if one is given, if the bytecode is malformed.
+ */
+int
+verify_procedure(struct evil_environment_t *environment, struct evil_object_t *procedure, struct verify_error_t *error);
+
+#endif
@@ -7,11 +7,14 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "base.h"
 #include "environment.h"
+#include "evil_scheme.h"
 #include "gc.h"
+#include "jit.h"
 #include "object.h"
 #include "runtime.h"
 #include "vm.h"
@@ -49,24 +52,143 @@ DISABLE_WARNING(4710)
 #   define VM_ASSERT(x)
 #endif
 
+/*
+ * Operand type checks that are only made for procedures where the bytecode
+ * verifier could not prove them, see verify.h. The structural properties the
+ * verifier proves for every procedure, such as the frame layout RETURN
+ * relies on, are not checked at all.
+ */
+#if ENABLE_VM_ASSERTS
+#   define VM_TYPE_ASSERT(x) if (!(vm_procedure_header(procedure).flags & VM_PROCEDURE_TYPES_VERIFIED)) { VM_ASSERT(x); } else (void)0
+#else
+#   define VM_TYPE_ASSERT(x)
+#endif
+
 #define VM_TRACE_OP_IMPL(x) do { VM_TRACE_FN("[vm] %32s program_area begin: %p sp begin: %p", #x, (void *)program_area, (void *)sp); } while (0)
 #define VM_TRACE_IMPL(x) do { VM_TRACE_FN("[vm] %s", x); } while (0)
 #define VM_TRACE_STACK() VM_TRACE_FN(" sp end: %p\n", (void *)sp); vm_trace_stack(environment, sp, program_area)
 
+/*
+ * Threaded dispatch: with GCC-compatible compilers each opcode handler ends
+ * in an indirect jump through a table of label addresses instead of looping
+ * back to the top of the switch. Every handler then has its own indirect
+ * branch, which the branch predictor can track separately. The switch is
+ * still used to enter the loop and is the portable fallback.
+ */
+#ifndef ENABLE_VM_THREADED_DISPATCH
+#   ifdef __GNUC__
+#       define ENABLE_VM_THREADED_DISPATCH 1
+#   else
+#       define ENABLE_VM_THREADED_DISPATCH 0
+#   endif
+#endif
+
+#if ENABLE_VM_THREADED_DISPATCH
+#   define VM_OPCODE(x) case x: vm_op_##x
+#   define VM_DISPATCH() do { VM_PROFILE_OP(*pc); goto *dispatch_table[*pc++]; } while (0)
+#else
+#   define VM_OPCODE(x) case x
+#   define VM_DISPATCH() continue
+#endif
+
 #if ENABLE_VM_TRACING
 #   define VM_TRACE_OP(x) VM_TRACE_OP_IMPL(x)
 #   define VM_TRACE(x) VM_TRACE_IMPL(x)
-#   define VM_CONTINUE() VM_TRACE_STACK(); vm_trace_fn_locals(environment, procedure, program_area); continue
+#   define VM_CONTINUE() VM_TRACE_STACK(); vm_trace_fn_locals(environment, procedure, program_area); VM_DISPATCH()
 #else
 #   define VM_TRACE_OP(x)
 #   define VM_TRACE(x)
-#   define VM_CONTINUE() continue
+#   define VM_CONTINUE() VM_DISPATCH()
+#endif
+
+/*
+ * Loop traces are recorded by pointing dispatch at a table that sends every
+ * opcode through the recorder first. While recording, execution stays in
+ * the interpreter.
+ */
+#define VM_TRACE_RECORDING (ENABLE_JIT && ENABLE_JIT_TRACING && ENABLE_VM_THREADED_DISPATCH)
+
+#if VM_TRACE_RECORDING
+#   define VM_RECORDING() (trace_recorder != NULL)
+#else
+#   define VM_RECORDING() 0
+#endif
+
+#if ENABLE_JIT
+/*
+ * Runs native code, if the procedure has any, from the current pc. When the
+ * native code exits, the interpreter carries on with the instruction it
+ * stopped at.
+ */
+#   define VM_ENTER_NATIVE_CODE(CODE) do {                                                  \
+        struct jit_code_t *native_code = (CODE);                                            \
+                                                                                            \
+        if (native_code != NULL && !VM_RECORDING())                                         \
+        {                                                                                   \
+            struct jit_context_t jit_context;                                               \
+                                                                                            \
+            jit_context.sp = sp;                                                            \
+            jit_context.program_area = program_area;                                        \
+            jit_context.environment = environment;                                          \
+            jit_context.lexical_environment_handle = lexical_environment_handle;            \
+            pc = pc_base + jit_run(native_code, &jit_context, (int)(pc - pc_base));         \
+            sp = jit_context.sp;                                                            \
+        }                                                                                   \
+    } while (0)
+#else
+#   define VM_ENTER_NATIVE_CODE(CODE)
+#endif
+
+/*
+ * Publishes the current frame for the sampling profiler, see
+ * vm_activation_t. The compiler barrier keeps the stores that build the
+ * frame ahead of the ones that publish it; the signal handler runs on the
+ * same thread, so no hardware fence is needed.
+ */
+#if defined(__GNUC__)
+#   define VM_SIGNAL_FENCE() __asm__ __volatile__("" ::: "memory")
+#elif defined(_MSC_VER)
+#   define VM_SIGNAL_FENCE() _ReadWriteBarrier()
+#else
+#   define VM_SIGNAL_FENCE()
 #endif
 
+#define VM_PUBLISH_ACTIVATION() do {                                                        \
+        VM_SIGNAL_FENCE();                                                                  \
+        activation.procedure = procedure;                                                   \
+        activation.program_area = program_area;                                             \
+    } while (0)
+
 #ifndef MIN
 #   define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+#ifndef MAX
+#   define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/*
+ * Caches the bounds of the current stack segment in vm_run's locals:
+ * frames must leave room for the scratch slots above the bottom, and
+ * returning through segment_entry means leaving the segment. The first
+ * segment is never left.
+ */
+#define VM_LOAD_STACK_SEGMENT() do {                                                        \
+        stack_limit = environment->stack_bottom + VM_STACK_SCRATCH_SLOTS;                   \
+        segment_entry = (environment->stack_segment->previous != NULL)                      \
+            ? environment->stack_top - 1                                                    \
+            : NULL;                                                                         \
+    } while (0)
+
+/*
+ * Calls and loop iterations use up the running fiber's time slice, see
+ * vm_fiber_t. Yielding and blocking end it early.
+ */
+#define VM_FIBER_SAFEPOINT() do {                                                           \
+        if (--scheduler->budget <= 0)                                                       \
+            goto vm_fiber_switch;                                                           \
+    } while (0)
+
 #define STACK_PUSH(stack, x) do { *(stack--) = x; } while (0)
 #define STACK_POP(stack) *(++stack)
 #ifndef NDEBUG
@@ -76,8 +198,15 @@ DISABLE_WARNING(4710)
 #   define VALIDATE_STACK(env)
 #endif
 
-static char trace_buf[1048576];
-static size_t trace_buf_idx;
+/*
+ * The ring buffer ENABLE_VM_BUFFER_TRACE writes the trace to, one per
+ * thread so each holds the trace of the environments that ran there. It is
+ * allocated by the first trace.
+ */
+#define VM_TRACE_BUF_SIZE 1048576
+
+static EVIL_THREAD_LOCAL char *trace_buf;
+static EVIL_THREAD_LOCAL size_t trace_buf_idx;
 
 #if ENABLE_VM_BUFFER_TRACE
     static void
@@ -147,6 +276,75 @@ static size_t trace_buf_idx;
         }                                                                                   \
     } while (0)
 
+#define TWO_TAGS(A, B) (((A) << 8) | (B))
+#define FIXNUM_PAIR TWO_TAGS(TAG_FIXNUM, TAG_FIXNUM)
+#define FLONUM_PAIR TWO_TAGS(TAG_FLONUM, TAG_FLONUM)
+
+/*
+ * Quickening: the generic arithmetic and comparison instructions rewrite
+ * their own opcode byte to a type specialized variant based on the operands
+ * they see, or back to the generic opcode if the operands are mixed. All of
+ * these instructions are a single byte so the opcode is at pc[-1].
+ */
+#define QUICKEN_BINOP(GENERIC_OPCODE, FIX_OPCODE, FLO_OPCODE) {                             \
+        switch (TWO_TAGS((sp + 2)->tag_count.tag, (sp + 1)->tag_count.tag))                 \
+        {                                                                                   \
+            case FIXNUM_PAIR:                                                               \
+                pc[-1] = FIX_OPCODE;                                                        \
+                break;                                                                      \
+            case FLONUM_PAIR:                                                               \
+                pc[-1] = FLO_OPCODE;                                                        \
+                break;                                                                      \
+            default:                                                                        \
+                pc[-1] = GENERIC_OPCODE;                                                    \
+                break;                                                                      \
+        }                                                                                   \
+    }
+
+#define QUICKEN_CMPN(GENERIC_OPCODE, FIX_OPCODE) {                                          \
+        pc[-1] = (TWO_TAGS((sp + 1)->tag_count.tag, (sp + 2)->tag_count.tag) == FIXNUM_PAIR) \
+            ? FIX_OPCODE                                                                    \
+            : GENERIC_OPCODE;                                                               \
+    }
+
+#define FIX_FIX_BINOP(OP, GENERIC_LABEL) {                                                  \
+        struct evil_object_t *a = sp + 2;                                                   \
+        struct evil_object_t *b = sp + 1;                                                  \
+                                                                                            \
+        if (TWO_TAGS(a->tag_count.tag, b->tag_count.tag) != FIXNUM_PAIR)                    \
+        {                                                                                   \
+            goto GENERIC_LABEL;                                                             \
+        }                                                                                   \
+                                                                                            \
+        a->value.fixnum_value = a->value.fixnum_value OP b->value.fixnum_value;             \
+        ++sp;                                                                               \
+    }
+
+#define FLO_FLO_BINOP(OP, GENERIC_LABEL) {                                                  \
+        struct evil_object_t *a = sp + 2;                                                   \
+        struct evil_object_t *b = sp + 1;                                                  \
+                                                                                            \
+        if (TWO_TAGS(a->tag_count.tag, b->tag_count.tag) != FLONUM_PAIR)                    \
+        {                                                                                   \
+            goto GENERIC_LABEL;                                                             \
+        }                                                                                   \
+                                                                                            \
+        a->value.flonum_value = a->value.flonum_value OP b->value.flonum_value;             \
+        ++sp;                                                                               \
+    }
+
+#define CMPN_FIX(OP, GENERIC_LABEL) {                                                       \
+        struct evil_object_t *a = sp + 1;                                                   \
+        struct evil_object_t *b = sp + 2;                                                   \
+                                                                                            \
+        if (TWO_TAGS(a->tag_count.tag, b->tag_count.tag) != FIXNUM_PAIR)                    \
+        {                                                                                   \
+            goto GENERIC_LABEL;                                                             \
+        }                                                                                   \
+                                                                                            \
+        sp = vm_push_bool(sp + 2, a->value.fixnum_value OP b->value.fixnum_value);          \
+    }
+
 #define CMPN_IMPL(OP) {                                                                     \
         struct evil_object_t *a = value_deref(sp + 1);                                      \
         struct evil_object_t *b = value_deref(sp + 2);                                      \
@@ -186,6 +384,125 @@ static size_t trace_buf_idx;
         *(sp + 1) = v;                                                                      \
     }
 
+/*
+ * The superinstructions read their operands straight out of the slots, so
+ * the values are copied before CONDITIONAL_DEMOTE gets a chance to rewrite
+ * a fixnum local as a flonum.
+ */
+#define CMPN_SLOTS_BRANCH_IMPL(OP) {                                                        \
+        union convert_two_t c2;                                                             \
+        struct evil_object_t *slot_a;                                                       \
+        struct evil_object_t *slot_b;                                                       \
+        int result;                                                                         \
+                                                                                            \
+        memcpy(c2.bytes, pc, 2);                                                            \
+        slot_b = program_area + c2.s2;                                                      \
+        memcpy(c2.bytes, pc + 2, 2);                                                        \
+        slot_a = program_area + c2.s2;                                                      \
+        memcpy(c2.bytes, pc + 4, 2);                                                        \
+        pc += 6;                                                                            \
+                                                                                            \
+        if (TWO_TAGS(slot_a->tag_count.tag, slot_b->tag_count.tag) == FIXNUM_PAIR)          \
+        {                                                                                   \
+            result = slot_a->value.fixnum_value OP slot_b->value.fixnum_value;              \
+        }                                                                                   \
+        else                                                                                \
+        {                                                                                   \
+            struct evil_object_t a = *value_deref(slot_a);                                  \
+            struct evil_object_t b = *value_deref(slot_b);                                  \
+            unsigned char a_tag = a.tag_count.tag;                                          \
+            unsigned char b_tag = b.tag_count.tag;                                          \
+                                                                                            \
+            ENSURE_NUMERIC(a_tag);                                                          \
+            ENSURE_NUMERIC(b_tag);                                                          \
+            CONDITIONAL_DEMOTE(&a, &b);                                                     \
+            result = (a_tag == TAG_FIXNUM)                                                  \
+                ? (a.value.fixnum_value OP b.value.fixnum_value)                            \
+                : (a.value.flonum_value OP b.value.flonum_value);                           \
+        }                                                                                   \
+                                                                                            \
+        if (result)                                                                         \
+        {                                                                                   \
+            pc += c2.s2;                                                                    \
+        }                                                                                   \
+    }
+
+#define NUMERIC_BINOP_STORE(OP, A, B, DST) {                                                \
+        unsigned char a_tag = A.tag_count.tag;                                              \
+        unsigned char b_tag = B.tag_count.tag;                                              \
+                                                                                            \
+        ENSURE_NUMERIC(a_tag);                                                              \
+        ENSURE_NUMERIC(b_tag);                                                              \
+        CONDITIONAL_DEMOTE(&A, &B);                                                         \
+        (DST)->tag_count.tag = a_tag;                                                       \
+        (DST)->tag_count.flag = 0;                                                          \
+        (DST)->tag_count.count = 1;                                                         \
+        if (a_tag == TAG_FIXNUM)                                                            \
+        {                                                                                   \
+            (DST)->value.fixnum_value = A.value.fixnum_value OP B.value.fixnum_value;       \
+        }                                                                                   \
+        else                                                                                \
+        {                                                                                   \
+            (DST)->value.flonum_value = A.value.flonum_value OP B.value.flonum_value;       \
+        }                                                                                   \
+    }
+
+#define NUMERIC_BINOP_VALUES(OP, A, B) {                                                    \
+        NUMERIC_BINOP_STORE(OP, A, B, sp)                                                   \
+        --sp;                                                                               \
+    }
+
+/*
+ * The register instructions copy both sources before writing the
+ * destination, which may be one of them.
+ */
+#define REGISTER_BINOP_IMPL(OP) {                                                           \
+        union convert_two_t c2;                                                             \
+        struct evil_object_t *dst;                                                          \
+        struct evil_object_t a;                                                             \
+        struct evil_object_t b;                                                             \
+                                                                                            \
+        memcpy(c2.bytes, pc, 2);                                                            \
+        dst = program_area + c2.s2;                                                         \
+        memcpy(c2.bytes, pc + 2, 2);                                                        \
+        a = *value_deref(program_area + c2.s2);                                             \
+        memcpy(c2.bytes, pc + 4, 2);                                                        \
+        b = *value_deref(program_area + c2.s2);                                             \
+        pc += 6;                                                                            \
+                                                                                            \
+        if (TWO_TAGS(a.tag_count.tag, b.tag_count.tag) == FIXNUM_PAIR)                      \
+        {                                                                                   \
+            *dst = make_fixnum_object(a.value.fixnum_value OP b.value.fixnum_value);        \
+        }                                                                                   \
+        else                                                                                \
+        {                                                                                   \
+            NUMERIC_BINOP_STORE(OP, a, b, dst)                                              \
+        }                                                                                   \
+    }
+
+#define REGISTER_BINOP_IMM_IMPL(OP) {                                                       \
+        union convert_two_t c2;                                                             \
+        struct evil_object_t *dst;                                                          \
+        struct evil_object_t a;                                                             \
+        struct evil_object_t b;                                                             \
+                                                                                            \
+        memcpy(c2.bytes, pc, 2);                                                            \
+        dst = program_area + c2.s2;                                                         \
+        memcpy(c2.bytes, pc + 2, 2);                                                        \
+        a = *value_deref(program_area + c2.s2);                                             \
+        b = make_fixnum_object((signed char)pc[4]);                                         \
+        pc += 5;                                                                            \
+                                                                                            \
+        if (a.tag_count.tag == TAG_FIXNUM)                                                  \
+        {                                                                                   \
+            *dst = make_fixnum_object(a.value.fixnum_value OP b.value.fixnum_value);        \
+        }                                                                                   \
+        else                                                                                \
+        {                                                                                   \
+            NUMERIC_BINOP_STORE(OP, a, b, dst)                                              \
+        }                                                                                   \
+    }
+
 #define FIXNUM_BINOP(OP) {                                                                  \
         struct evil_object_t *a = value_deref(sp + 2);                                      \
         struct evil_object_t *b = value_deref(sp + 1);                                      \
@@ -206,12 +523,166 @@ static size_t trace_buf_idx;
         *(sp + 1) = v;                                                                      \
     }
 
+void
+vm_stack_create(struct evil_environment_t *environment, void *stack, size_t stack_size)
+{
+    struct vm_stack_segment_t *segment;
+
+    segment = calloc(1, sizeof(struct vm_stack_segment_t));
+    assert(segment != NULL);
+
+    segment->bottom = stack;
+    segment->top = (struct evil_object_t *)((char *)stack + stack_size) - 1;
+    memset(stack, 0, stack_size);
+
+    environment->stack_segment = segment;
+    environment->stack_bottom = segment->bottom;
+    environment->stack_top = segment->top;
+    environment->stack_ptr = segment->top;
+}
+
+static void
+vm_stack_free_segments(struct vm_stack_segment_t *segment)
+{
+    while (segment != NULL)
+    {
+        struct vm_stack_segment_t *next;
+
+        next = segment->next;
+        free(segment);
+        segment = next;
+    }
+}
+
+void
+vm_stack_destroy(struct evil_environment_t *environment)
+{
+    struct vm_stack_segment_t *segment;
+
+    segment = environment->stack_segment;
+
+    while (segment->previous != NULL)
+        segment = segment->previous;
+
+    vm_stack_free_segments(segment->next);
+    free(segment);
+    environment->stack_segment = NULL;
+}
+
+struct evil_object_t *
+vm_stack_push_segment(struct evil_environment_t *environment, size_t num_slots, struct evil_object_t *return_slot)
+{
+    struct vm_stack_segment_t *current;
+    struct vm_stack_segment_t *segment;
+
+    current = environment->stack_segment;
+    segment = current->next;
+
+    if (segment != NULL && (size_t)(segment->top - segment->bottom) < num_slots)
+    {
+        vm_stack_free_segments(segment);
+        current->next = NULL;
+        segment = NULL;
+    }
+
+    if (segment == NULL)
+    {
+        size_t size;
+
+        size = MAX(VM_STACK_SEGMENT_SLOTS, num_slots + 1);
+        segment = calloc(1, sizeof(struct vm_stack_segment_t) + size * sizeof(struct evil_object_t));
+        assert(segment != NULL);
+
+        segment->previous = current;
+        segment->bottom = (struct evil_object_t *)(segment + 1);
+        segment->top = segment->bottom + size - 1;
+        current->next = segment;
+    }
+
+    segment->return_slot = return_slot;
+
+    environment->stack_bottom = segment->bottom;
+    environment->stack_top = segment->top;
+    environment->stack_ptr = segment->top;
+    environment->stack_segment = segment;
+
+    return segment->top;
+}
+
+struct evil_object_t *
+vm_stack_pop_segment(struct evil_environment_t *environment)
+{
+    struct vm_stack_segment_t *segment;
+    struct vm_stack_segment_t *previous;
+
+    segment = environment->stack_segment;
+    previous = segment->previous;
+    assert(previous != NULL);
+
+    environment->stack_segment = previous;
+    environment->stack_bottom = previous->bottom;
+    environment->stack_top = previous->top;
+    environment->stack_ptr = segment->return_slot - 1;
+
+    return segment->return_slot;
+}
+
+/*
+ * Returns non-zero if a frame with the given header, whose arguments start
+ * at program_area, fits above the stack limit.
+ */
+static inline int
+vm_frame_fits(struct evil_object_t *program_area, struct vm_procedure_header_t header, struct evil_object_t *stack_limit)
+{
+    return program_area - stack_limit >= VM_SLOT_COUNT + 1 + header.num_locals + header.stack_depth;
+}
+
+static inline size_t
+vm_frame_size(struct vm_procedure_header_t header, int num_args)
+{
+    return (size_t)num_args + VM_SLOT_COUNT + 1 + header.num_locals + header.stack_depth + VM_STACK_SCRATCH_SLOTS;
+}
+
+/*
+ * Lays out the call a builtin requested over its arguments, so that the
+ * last argument is in the slot the builtin's result was due in, which the
+ * callee then returns into. The procedure goes in the slot below the
+ * arguments and the stack pointer is returned as it would be ahead of the
+ * CALL.
+ */
+static struct evil_object_t *
+vm_take_call_request(struct evil_environment_t *environment, struct evil_object_t *return_slot, unsigned short *args_passed)
+{
+    struct evil_object_t *args;
+    int num_args;
+
+    num_args = environment->call_num_args;
+    args = return_slot + 1 - num_args;
+
+    memmove(args, environment->call_args, (size_t)num_args * sizeof(struct evil_object_t));
+    *(args - 1) = make_ref(environment->call_procedure);
+    *args_passed = (unsigned short)num_args;
+    environment->call_procedure = NULL;
+
+    return args - 2;
+}
+
 static void
-vm_push_args_to_stack(struct evil_environment_t *environment, int num_args, struct evil_object_t *args)
+vm_push_args_to_stack(struct evil_environment_t *environment, int num_args, struct evil_object_t *args, struct vm_procedure_header_t header)
 {
     struct evil_object_t *stack_ptr;
 
     stack_ptr = environment->stack_ptr;
+
+    if (!vm_frame_fits(stack_ptr - num_args, header, environment->stack_bottom + VM_STACK_SCRATCH_SLOTS))
+    {
+        /*
+         * The result is returned through the slot at the old stack pointer,
+         * which is free.
+         */
+        stack_ptr = vm_stack_push_segment(environment, vm_frame_size(header, num_args), stack_ptr);
+    }
+
     stack_ptr -= num_args;
     memmove(stack_ptr, args, num_args * sizeof(struct evil_object_t));
 
@@ -282,62 +753,449 @@ vm_push_bool(struct evil_object_t *sp, int val)
     return sp;
 }
 
-static inline void
-vm_demote_numeric(struct evil_object_t *object)
+struct vm_scheduler_t *
+vm_scheduler_create(struct evil_environment_t *environment)
 {
-#if ENABLE_VM_ASSERTS
-    VM_ASSERT_NOTRACE(object->tag_count.tag == TAG_FIXNUM);
-#endif
+    struct vm_scheduler_t *scheduler;
+    struct vm_fiber_t *main_fiber;
 
-    object->tag_count.tag = TAG_FLONUM;
-    object->value.flonum_value = (double)(object->value.fixnum_value);
+    UNUSED(environment);
+
+    scheduler = calloc(1, sizeof(struct vm_scheduler_t));
+    main_fiber = calloc(1, sizeof(struct vm_fiber_t));
+    assert(scheduler != NULL && main_fiber != NULL);
+
+    scheduler->capacity = 16;
+    scheduler->fibers = calloc(scheduler->capacity, sizeof(struct vm_fiber_t *));
+    assert(scheduler->fibers != NULL);
+
+    /*
+     * The main fiber runs on the environment's stack, which is only saved
+     * in the fiber while it is switched out.
+     */
+    main_fiber->state = VM_FIBER_RUNNABLE;
+    scheduler->fibers[0] = main_fiber;
+    scheduler->num_fibers = 1;
+    scheduler->current = main_fiber;
+    scheduler->budget = VM_FIBER_TIME_SLICE;
+    scheduler->slice = VM_FIBER_TIME_SLICE;
+    scheduler->fuel = VM_UNLIMITED_FUEL;
+
+    return scheduler;
 }
 
-static inline struct evil_object_t *
-vm_vector_index(struct evil_object_t *vector, int64_t index)
+static void
+vm_fiber_free_stack(struct vm_fiber_t *fiber)
 {
-    struct evil_tag_count_t *header;
-    void *vector_element_base;
+    struct vm_stack_segment_t *segment;
 
-    header = &vector->tag_count;
-    vector_element_base = header + 1;
+    segment = fiber->stack_segment;
 
-    return (struct evil_object_t *)vector_element_base + index;
+    if (segment == NULL)
+        return;
+
+    while (segment->previous != NULL)
+        segment = segment->previous;
+
+    vm_stack_free_segments(segment);
+    fiber->stack_segment = NULL;
 }
 
-static inline int
-vm_compare_equal_reference_type(const struct evil_object_t *a, const struct evil_object_t *b)
+void
+vm_scheduler_destroy(struct vm_scheduler_t *scheduler)
 {
-    const unsigned char a_tag = a->tag_count.tag;
-    const unsigned char b_tag = b->tag_count.tag;
+    size_t i;
 
-#if ENABLE_VM_ASSERTS
-    VM_ASSERT_NOTRACE(a_tag != TAG_REFERENCE && b_tag != TAG_REFERENCE);
-#endif
+    assert(scheduler->current == scheduler->fibers[0]);
 
-    /*
-     * If the references point to the same object, they are equal.
-     */
-    if (a == b)
-        return 1;
+    for (i = 1; i < scheduler->num_fibers; ++i)
+    {
+        if (scheduler->fibers[i] != NULL)
+        {
+            vm_fiber_free_stack(scheduler->fibers[i]);
+            free(scheduler->fibers[i]);
+        }
+    }
 
-    /*
-     * If the objects are of different types, they are NOT equal.
-     */
-    if (a_tag != b_tag)
-        return 0;
+    free(scheduler->fibers[0]);
+    free(scheduler->fibers);
+    free(scheduler);
+}
 
-    /*
-     * Equal objects should have an equal count field. For non-aggregates
-     * this should be 1 and for aggregates this should be the number of
-     * contained elements (byte code bytes, vector elements, etc.)
-     */
-    if (a->tag_count.count != b->tag_count.count)
-        return 0;
+static void
+vm_fiber_enqueue(struct vm_scheduler_t *scheduler, struct vm_fiber_t *fiber)
+{
+    fiber->next = NULL;
 
-    switch (a_tag)
+    if (scheduler->run_queue_tail != NULL)
+        scheduler->run_queue_tail->next = fiber;
+    else
+        scheduler->run_queue_head = fiber;
+
+    scheduler->run_queue_tail = fiber;
+}
+
+static struct vm_fiber_t *
+vm_fiber_dequeue(struct vm_scheduler_t *scheduler)
+{
+    struct vm_fiber_t *fiber;
+
+    fiber = scheduler->run_queue_head;
+
+    if (fiber != NULL)
     {
-        case TAG_SPECIAL_FUNCTION:
+        scheduler->run_queue_head = fiber->next;
+
+        if (scheduler->run_queue_head == NULL)
+            scheduler->run_queue_tail = NULL;
+
+        fiber->next = NULL;
+    }
+
+    return fiber;
+}
+
+static void
+vm_fiber_release(struct vm_scheduler_t *scheduler, struct vm_fiber_t *fiber)
+{
+    assert(fiber->state == VM_FIBER_DONE && fiber->stack_segment == NULL);
+
+    scheduler->fibers[fiber->id] = NULL;
+    free(fiber);
+}
+
+/*
+ * Creates a fiber whose stack holds the bottom frame of a call to the
+ * procedure, as vm_run would have built it, and puts it in the run queue.
+ */
+static struct vm_fiber_t *
+vm_fiber_create(struct evil_environment_t *environment, struct evil_object_t *procedure)
+{
+    struct vm_scheduler_t *scheduler;
+    struct vm_fiber_t *fiber;
+    struct vm_stack_segment_t *segment;
+    struct vm_procedure_header_t header;
+    struct evil_object_t *sp;
+    size_t size;
+
+    scheduler = environment->scheduler;
+    header = vm_procedure_header(procedure);
+    assert(header.num_args == 0);
+
+    if (scheduler->num_fibers == scheduler->capacity)
+    {
+        scheduler->capacity *= 2;
+        scheduler->fibers = realloc(scheduler->fibers, scheduler->capacity * sizeof(struct vm_fiber_t *));
+        assert(scheduler->fibers != NULL);
+    }
+
+    size = MAX(VM_FIBER_STACK_SLOTS, vm_frame_size(header, 0) + 1);
+    segment = calloc(1, sizeof(struct vm_stack_segment_t) + size * sizeof(struct evil_object_t));
+    fiber = calloc(1, sizeof(struct vm_fiber_t));
+    assert(segment != NULL && fiber != NULL);
+
+    segment->bottom = (struct evil_object_t *)(segment + 1);
+    segment->top = segment->bottom + size - 1;
+
+    /*
+     * With no arguments the program area starts at the top slot, which
+     * leaves the slot below it for the result like in any other segment.
+     */
+    sp = segment->top - 1;
+    fiber->program_area = sp + 1;
+    sp = vm_push_null_ref(sp);
+    sp = vm_push_return_address(sp, NULL, 0);
+    sp -= header.num_locals;
+
+    fiber->id = scheduler->num_fibers;
+    fiber->state = VM_FIBER_RUNNABLE;
+    fiber->stack_segment = segment;
+    fiber->sp = sp;
+    fiber->procedure = make_ref(procedure);
+    fiber->pc_offset = 0;
+
+    scheduler->fibers[scheduler->num_fibers++] = fiber;
+    vm_fiber_enqueue(scheduler, fiber);
+
+    return fiber;
+}
+
+/*
+ * Records the result of the running fiber, which has returned from its
+ * bottom frame, and hands it to the fibers waiting on it.
+ */
+static void
+vm_fiber_finish(struct vm_scheduler_t *scheduler, struct evil_object_t result)
+{
+    struct vm_fiber_t *fiber;
+    struct vm_fiber_t *waiter;
+
+    fiber = scheduler->current;
+    fiber->state = VM_FIBER_DONE;
+    fiber->result = result;
+    fiber->joined = fiber->waiters != NULL;
+
+    for (waiter = fiber->waiters; waiter != NULL; )
+    {
+        struct vm_fiber_t *next;
+
+        /*
+         * A blocked fiber was switched out right after its call to join,
+         * whose result goes in the slot above its stack pointer.
+         */
+        next = waiter->next;
+        *(waiter->sp + 1) = result;
+        waiter->state = VM_FIBER_RUNNABLE;
+        vm_fiber_enqueue(scheduler, waiter);
+        waiter = next;
+    }
+
+    fiber->waiters = NULL;
+}
+
+/*
+ * Takes what has been used of the time slice out of the fuel, if there is a
+ * metered invocation, and ends the slice. Returns nonzero if the fuel has
+ * run out.
+ */
+static int
+vm_scheduler_end_slice(struct vm_scheduler_t *scheduler)
+{
+    if (scheduler->fuel != VM_UNLIMITED_FUEL)
+    {
+        scheduler->fuel -= scheduler->slice - scheduler->budget;
+
+        if (scheduler->fuel < 0)
+            scheduler->fuel = 0;
+    }
+
+    scheduler->slice = 0;
+    scheduler->budget = 0;
+
+    return scheduler->fuel == 0;
+}
+
+/*
+ * Starts a time slice no longer than the fuel that is left. Once the fuel
+ * is overdrawn every safepoint ends the slice, so the metered invocation is
+ * suspended as soon as it can be.
+ */
+static void
+vm_scheduler_start_slice(struct vm_scheduler_t *scheduler)
+{
+    int slice;
+
+    slice = VM_FIBER_TIME_SLICE;
+
+    if (scheduler->fuel != VM_UNLIMITED_FUEL && scheduler->fuel < slice)
+        slice = (scheduler->fuel > 0) ? (int)scheduler->fuel : 1;
+
+    scheduler->slice = slice;
+    scheduler->budget = slice;
+}
+
+/*
+ * Called by vm_run when the running fiber's time slice is up, with its
+ * registers. Returns the fiber to run from here, which is the running one
+ * unless it has yielded, blocked or finished, or others are waiting for
+ * their turn. Switching fibers installs the new fiber's stack in the
+ * environment.
+ */
+static struct vm_fiber_t *
+vm_fiber_schedule(struct evil_environment_t *environment, struct evil_object_t *sp, struct evil_object_t *program_area, struct evil_object_t *procedure, ptrdiff_t pc_offset)
+{
+    struct vm_scheduler_t *scheduler;
+    struct vm_fiber_t *current;
+    struct vm_fiber_t *next;
+
+    scheduler = environment->scheduler;
+    current = scheduler->current;
+    vm_scheduler_start_slice(scheduler);
+
+    if (current->state == VM_FIBER_RUNNABLE
+            && (current->depth != 1 || scheduler->run_queue_head == NULL))
+    {
+        return current;
+    }
+
+    next = vm_fiber_dequeue(scheduler);
+
+    if (next == NULL)
+    {
+        evil_printf("[vm] every fiber is blocked on a join\n");
+        BREAK();
+        return current;
+    }
+
+    assert(current->depth == 1 && next->depth == 0);
+    --current->depth;
+    ++next->depth;
+
+    if (current->state == VM_FIBER_DONE)
+    {
+        vm_fiber_free_stack(current);
+
+        if (current->joined)
+            vm_fiber_release(scheduler, current);
+    }
+    else
+    {
+        current->stack_segment = environment->stack_segment;
+        current->sp = sp;
+        current->program_area = program_area;
+        current->procedure = make_ref(procedure);
+        current->pc_offset = pc_offset;
+
+        if (current->state == VM_FIBER_RUNNABLE)
+            vm_fiber_enqueue(scheduler, current);
+    }
+
+    scheduler->current = next;
+    environment->stack_segment = next->stack_segment;
+    environment->stack_bottom = next->stack_segment->bottom;
+    environment->stack_top = next->stack_segment->top;
+    environment->stack_ptr = next->sp;
+
+    return next;
+}
+
+static inline struct evil_object_t *
+vm_cached_bound_location(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment_handle, unsigned char *pc)
+{
+    union convert_eight_t c8;
+    struct vm_inline_cache_t cache;
+    struct evil_object_t *lexical_environment;
+    struct evil_object_t *location;
+
+    /*
+     * pc points at the symbol hash, which is followed by the call site's
+     * inline cache. Only successful lookups are cached; an unbound symbol
+     * takes the slow path each time until it is defined, which bumps the
+     * epoch anyways.
+     */
+    lexical_environment = evil_resolve_object_handle(lexical_environment_handle);
+    memcpy(&cache, pc + 8, VM_INLINE_CACHE_SIZE);
+
+    if (cache.binding_epoch == environment->binding_epoch
+            && cache.lexical_environment == deref(lexical_environment))
+    {
+        return cache.location;
+    }
+
+    memcpy(c8.bytes, pc, 8);
+    location = get_bound_location_in_lexical_environment(lexical_environment, c8.u8, 1);
+
+    if (location != empty_pair)
+    {
+        cache.binding_epoch = environment->binding_epoch;
+        cache.lexical_environment = deref(lexical_environment);
+        cache.location = location;
+        memcpy(pc + 8, &cache, VM_INLINE_CACHE_SIZE);
+    }
+
+    return location;
+}
+
+static inline struct evil_object_t *
+vm_push_global(struct evil_environment_t *environment, struct evil_object_t *sp, struct evil_object_handle_t *lexical_environment_handle, unsigned char *pc)
+{
+    struct evil_object_t *location;
+
+    /*
+     * This does the work of GET_BOUND_LOCATION followed by LOAD for the
+     * fused global call instructions.
+     */
+    location = vm_cached_bound_location(environment, lexical_environment_handle, pc);
+
+    if (location == empty_pair)
+    {
+        BREAK();
+    }
+
+    *(sp--) = *location;
+
+    return sp;
+}
+
+static inline int
+vm_bound_to_builtin(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment_handle, unsigned char *pc, evil_special_function_t builtin)
+{
+    struct evil_object_t *location;
+    struct evil_object_t *function;
+
+    /*
+     * The primitive instructions only run inline while their symbol still
+     * refers to the builtin they stand in for.
+     */
+    location = vm_cached_bound_location(environment, lexical_environment_handle, pc);
+
+    if (location == empty_pair)
+    {
+        return 0;
+    }
+
+    function = deref(location);
+
+    return function->tag_count.tag == TAG_SPECIAL_FUNCTION
+        && VECTOR_BASE(function)[FIELD_CODE].value.special_function_value == builtin;
+}
+
+static inline void
+vm_demote_numeric(struct evil_object_t *object)
+{
+#if ENABLE_VM_ASSERTS
+    VM_ASSERT_NOTRACE(object->tag_count.tag == TAG_FIXNUM);
+#endif
+
+    object->tag_count.tag = TAG_FLONUM;
+    object->value.flonum_value = (double)(object->value.fixnum_value);
+}
+
+static inline struct evil_object_t *
+vm_vector_index(struct evil_object_t *vector, int64_t index)
+{
+    struct evil_tag_count_t *header;
+    void *vector_element_base;
+
+    header = &vector->tag_count;
+    vector_element_base = header + 1;
+
+    return (struct evil_object_t *)vector_element_base + index;
+}
+
+static inline int
+vm_compare_equal_reference_type(const struct evil_object_t *a, const struct evil_object_t *b)
+{
+    const unsigned char a_tag = a->tag_count.tag;
+    const unsigned char b_tag = b->tag_count.tag;
+
+#if ENABLE_VM_ASSERTS
+    VM_ASSERT_NOTRACE(a_tag != TAG_REFERENCE && b_tag != TAG_REFERENCE);
+#endif
+
+    /*
+     * If the references point to the same object, they are equal.
+     */
+    if (a == b)
+        return 1;
+
+    /*
+     * If the objects are of different types, they are NOT equal.
+     */
+    if (a_tag != b_tag)
+        return 0;
+
+    /*
+     * Equal objects should have an equal count field. For non-aggregates
+     * this should be 1 and for aggregates this should be the number of
+     * contained elements (byte code bytes, vector elements, etc.)
+     */
+    if (a->tag_count.count != b->tag_count.count)
+        return 0;
+
+    switch (a_tag)
+    {
+        case TAG_SPECIAL_FUNCTION:
             return a->value.special_function_value == b->value.special_function_value;
         case TAG_PAIR:
             return vm_compare_equal(CAR(a), CAR(b)) && vm_compare_equal(CDR(a), CDR(b));
@@ -348,7 +1206,7 @@ vm_compare_equal_reference_type(const struct evil_object_t *a, const struct evil
              */
         case TAG_VECTOR:
             {
-                unsigned short i, e;
+                uint32_t i, e;
 
                 for (i = 0, e = a->tag_count.count; i != e; ++i)
                 {
@@ -511,23 +1369,13 @@ vm_extract_code_pointer(struct evil_object_t *procedure)
 static inline int
 vm_extract_num_args(struct evil_object_t *procedure)
 {
-    struct evil_object_t *num_args;
-
-    num_args = &VECTOR_BASE(procedure)[FIELD_NUM_ARGS];
-    assert(num_args->tag_count.tag == TAG_FIXNUM);
-
-    return (int)num_args->value.fixnum_value;
+    return vm_procedure_header(procedure).num_args;
 }
 
 static inline int
 vm_extract_num_locals(struct evil_object_t *procedure)
 {
-    struct evil_object_t *num_locals;
-
-    num_locals = &VECTOR_BASE(procedure)[FIELD_NUM_LOCALS];
-    assert(num_locals->tag_count.tag == TAG_FIXNUM);
-
-    return (int)num_locals->value.fixnum_value;
+    return vm_procedure_header(procedure).num_locals;
 }
 
 #if ENABLE_VM_TRACING
@@ -559,19 +1407,25 @@ vm_trace_fn_locals(struct evil_environment_t *environment, struct evil_object_t
 static void
 vm_trace_fn(const char *format, ...)
 {
-    static char buf[512];
+    char buf[512];
     va_list args;
     size_t len;
     size_t copy_len;
     size_t remainder;
 
+    if (trace_buf == NULL)
+    {
+        trace_buf = calloc(1, VM_TRACE_BUF_SIZE + 1);
+        assert(trace_buf != NULL);
+    }
+
     va_start(args, format);
     vsnprintf(buf, sizeof buf, format, args);
     va_end(args);
 
     len = strlen(buf);
 
-    copy_len = MIN(len, (sizeof trace_buf) - trace_buf_idx);
+    copy_len = MIN(len, VM_TRACE_BUF_SIZE - trace_buf_idx);
     assert(len >= copy_len);
 
     remainder = len - copy_len;
@@ -597,6 +1451,11 @@ vm_dump_trace_buf(void)
 {
     char c;
 
+    if (trace_buf == NULL)
+    {
+        return;
+    }
+
     c = trace_buf[trace_buf_idx];
     fputs(&trace_buf[trace_buf_idx], stdout);
     trace_buf[trace_buf_idx] = 0;
@@ -604,82 +1463,808 @@ vm_dump_trace_buf(void)
     trace_buf[trace_buf_idx] = c;
 }
 
+/*
+ * Returns the size of the instruction including its opcode, or 0 if the
+ * opcode is not known.
+ */
+int
+vm_instruction_size(const unsigned char *pc)
+{
+    switch (*pc)
+    {
+        case OPCODE_INVALID:
+        case OPCODE_LDEMPTY:
+        case OPCODE_LDFN:
+        case OPCODE_LOAD:
+        case OPCODE_STORE:
+        case OPCODE_MAKE_REF:
+        case OPCODE_SET:
+        case OPCODE_LDTYPE:
+        case OPCODE_CMP_EQUAL:
+        case OPCODE_CMPN_EQ:
+        case OPCODE_CMPN_LT:
+        case OPCODE_CMPN_GT:
+        case OPCODE_CMPN_LE:
+        case OPCODE_CMPN_GE:
+        case OPCODE_RETURN:
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_XOR:
+        case OPCODE_NOT:
+        case OPCODE_NOP:
+        case OPCODE_POP:
+        case OPCODE_BREAK:
+        case OPCODE_ADD_FIX_FIX:
+        case OPCODE_SUB_FIX_FIX:
+        case OPCODE_MUL_FIX_FIX:
+        case OPCODE_DIV_FIX_FIX:
+        case OPCODE_ADD_FLO_FLO:
+        case OPCODE_SUB_FLO_FLO:
+        case OPCODE_MUL_FLO_FLO:
+        case OPCODE_DIV_FLO_FLO:
+        case OPCODE_CMPN_EQ_FIX:
+        case OPCODE_CMPN_LT_FIX:
+        case OPCODE_CMPN_GT_FIX:
+        case OPCODE_CMPN_LE_FIX:
+        case OPCODE_CMPN_GE_FIX:
+            return 1;
+        case OPCODE_LDIMM_1_BOOL:
+        case OPCODE_LDIMM_1_CHAR:
+        case OPCODE_LDIMM_1_FIXNUM:
+        case OPCODE_LDIMM_1_FLONUM:
+            return 2;
+        case OPCODE_LDSLOT_X:
+        case OPCODE_STSLOT_X:
+        case OPCODE_BRANCH:
+        case OPCODE_COND_BRANCH:
+        case OPCODE_CALL:
+        case OPCODE_TAILCALL:
+        case OPCODE_LOOP:
+            return 3;
+        case OPCODE_ADD_IMM_SLOT:
+        case OPCODE_SUB_SLOT_IMM:
+            return 4;
+        case OPCODE_LDIMM_4_FIXNUM:
+        case OPCODE_LDIMM_4_FLONUM:
+            return 5;
+        case OPCODE_RADD_IMM:
+        case OPCODE_RSUB_IMM:
+        case OPCODE_RMUL_IMM:
+        case OPCODE_RDIV_IMM:
+            return 6;
+        case OPCODE_CMPN_EQ_SLOTS_BRANCH:
+        case OPCODE_CMPN_LT_SLOTS_BRANCH:
+        case OPCODE_CMPN_GT_SLOTS_BRANCH:
+        case OPCODE_CMPN_LE_SLOTS_BRANCH:
+        case OPCODE_CMPN_GE_SLOTS_BRANCH:
+        case OPCODE_RADD:
+        case OPCODE_RSUB:
+        case OPCODE_RMUL:
+        case OPCODE_RDIV:
+            return 7;
+        case OPCODE_LDIMM_8_FIXNUM:
+        case OPCODE_LDIMM_8_FLONUM:
+        case OPCODE_LDIMM_8_SYMBOL:
+            return 9;
+        case OPCODE_LDSTR:
+            return (int)strlen((const char *)pc + 1) + 2;
+        case OPCODE_GET_BOUND_LOCATION:
+            return 1 + 8 + (int)VM_INLINE_CACHE_SIZE;
+        case OPCODE_CALL_GLOBAL:
+        case OPCODE_TAILCALL_GLOBAL:
+        case OPCODE_BRANCH_IF_SELF:
+        case OPCODE_VECTOR_REF:
+        case OPCODE_VECTOR_SET:
+        case OPCODE_VECTOR_LENGTH:
+        case OPCODE_CONS:
+            return 1 + 8 + (int)VM_INLINE_CACHE_SIZE + 2;
+        default:
+            return 0;
+    }
+}
+
 int
 vm_slot_index(int slot_index)
 {
     /*
     * The stack is arranged, from high address to low:
-    * [arg 1][arg 0][return][env chain][pa chain][first slot]
-    *    1      0       -1     -2          -3        -4
+    * [arg 1][arg 0][pa chain][return][first slot]
+    *    1      0       -1        -2       -3
     * This bit of strange math below calculates the stack slot:
     */
     return -(slot_index + VM_SLOT_COUNT + 1);
 }
 
-struct evil_object_t
-vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *initial_lexical_environment, struct evil_object_t *initial_function, int num_args, struct evil_object_t *args)
-{
-    struct evil_object_handle_t *lexical_environment_handle;
-    struct evil_object_t *procedure;
-    struct evil_object_t *program_area;
-    struct evil_object_t *sp;
-    struct evil_object_t *old_stack;
-    unsigned char *pc_base;
-    unsigned char *pc;
+#if ENABLE_VM_PROFILING
+#   if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#       define VM_PROFILE_TIMESTAMP() __builtin_ia32_rdtsc()
+#   elif defined(_MSC_VER)
+#       include <intrin.h>
+#       define VM_PROFILE_TIMESTAMP() __rdtsc()
+#   else
+#       include <time.h>
+#       define VM_PROFILE_TIMESTAMP() ((uint64_t)clock())
+#   endif
 
-    lexical_environment_handle = evil_duplicate_object_handle(environment, initial_lexical_environment);
+#define VM_PROFILE_MAX_PAIRS 32
 
-    /*
-     * This is going to get really ugly if the GC moves our procedure object
-     * while we are executing something. Maybe we should pin the procedures
-     * while we are executing? Refresh after every function call and/or
-     * object creation?
-     */
+struct vm_profile_entry_t
+{
+    uint64_t count;
+    uint64_t cycles;
+    unsigned char opcode;
+    unsigned char next_opcode;
+};
 
-    procedure = deref(initial_function);
-    assert(procedure->tag_count.tag == TAG_PROCEDURE);
+static const char *
+vm_opcode_name(unsigned char opcode)
+{
+    static const char *names[256] =
+    {
+        [OPCODE_INVALID] = "INVALID",
+        [OPCODE_LDSLOT_X] = "LDSLOT_X",
+        [OPCODE_LDIMM_1_BOOL] = "LDIMM_1_BOOL",
+        [OPCODE_LDIMM_1_CHAR] = "LDIMM_1_CHAR",
+        [OPCODE_LDIMM_1_FIXNUM] = "LDIMM_1_FIXNUM",
+        [OPCODE_LDIMM_1_FLONUM] = "LDIMM_1_FLONUM",
+        [OPCODE_LDIMM_4_FIXNUM] = "LDIMM_4_FIXNUM",
+        [OPCODE_LDIMM_4_FLONUM] = "LDIMM_4_FLONUM",
+        [OPCODE_LDIMM_8_FIXNUM] = "LDIMM_8_FIXNUM",
+        [OPCODE_LDIMM_8_FLONUM] = "LDIMM_8_FLONUM",
+        [OPCODE_LDIMM_8_SYMBOL] = "LDIMM_8_SYMBOL",
+        [OPCODE_LDSTR] = "LDSTR",
+        [OPCODE_LDEMPTY] = "LDEMPTY",
+        [OPCODE_LDFN] = "LDFN",
+        [OPCODE_LOAD] = "LOAD",
+        [OPCODE_STORE] = "STORE",
+        [OPCODE_MAKE_REF] = "MAKE_REF",
+        [OPCODE_STSLOT_X] = "STSLOT_X",
+        [OPCODE_SET] = "SET",
+        [OPCODE_LDTYPE] = "LDTYPE",
+        [OPCODE_CMP_EQUAL] = "CMP_EQUAL",
+        [OPCODE_CMPN_EQ] = "CMPN_EQ",
+        [OPCODE_CMPN_LT] = "CMPN_LT",
+        [OPCODE_CMPN_GT] = "CMPN_GT",
+        [OPCODE_CMPN_LE] = "CMPN_LE",
+        [OPCODE_CMPN_GE] = "CMPN_GE",
+        [OPCODE_BRANCH] = "BRANCH",
+        [OPCODE_COND_BRANCH] = "COND_BRANCH",
+        [OPCODE_CALL] = "CALL",
+        [OPCODE_TAILCALL] = "TAILCALL",
+        [OPCODE_RETURN] = "RETURN",
+        [OPCODE_GET_BOUND_LOCATION] = "GET_BOUND_LOCATION",
+        [OPCODE_ADD] = "ADD",
+        [OPCODE_SUB] = "SUB",
+        [OPCODE_MUL] = "MUL",
+        [OPCODE_DIV] = "DIV",
+        [OPCODE_AND] = "AND",
+        [OPCODE_OR] = "OR",
+        [OPCODE_XOR] = "XOR",
+        [OPCODE_NOT] = "NOT",
+        [OPCODE_NOP] = "NOP",
+        [OPCODE_POP] = "POP",
+        [OPCODE_BREAK] = "BREAK",
+        [OPCODE_CMPN_EQ_SLOTS_BRANCH] = "CMPN_EQ_SLOTS_BRANCH",
+        [OPCODE_CMPN_LT_SLOTS_BRANCH] = "CMPN_LT_SLOTS_BRANCH",
+        [OPCODE_CMPN_GT_SLOTS_BRANCH] = "CMPN_GT_SLOTS_BRANCH",
+        [OPCODE_CMPN_LE_SLOTS_BRANCH] = "CMPN_LE_SLOTS_BRANCH",
+        [OPCODE_CMPN_GE_SLOTS_BRANCH] = "CMPN_GE_SLOTS_BRANCH",
+        [OPCODE_CALL_GLOBAL] = "CALL_GLOBAL",
+        [OPCODE_TAILCALL_GLOBAL] = "TAILCALL_GLOBAL",
+        [OPCODE_ADD_IMM_SLOT] = "ADD_IMM_SLOT",
+        [OPCODE_SUB_SLOT_IMM] = "SUB_SLOT_IMM",
+        [OPCODE_RADD] = "RADD",
+        [OPCODE_RSUB] = "RSUB",
+        [OPCODE_RMUL] = "RMUL",
+        [OPCODE_RDIV] = "RDIV",
+        [OPCODE_RADD_IMM] = "RADD_IMM",
+        [OPCODE_RSUB_IMM] = "RSUB_IMM",
+        [OPCODE_RMUL_IMM] = "RMUL_IMM",
+        [OPCODE_RDIV_IMM] = "RDIV_IMM",
+        [OPCODE_ADD_FIX_FIX] = "ADD_FIX_FIX",
+        [OPCODE_SUB_FIX_FIX] = "SUB_FIX_FIX",
+        [OPCODE_MUL_FIX_FIX] = "MUL_FIX_FIX",
+        [OPCODE_DIV_FIX_FIX] = "DIV_FIX_FIX",
+        [OPCODE_ADD_FLO_FLO] = "ADD_FLO_FLO",
+        [OPCODE_SUB_FLO_FLO] = "SUB_FLO_FLO",
+        [OPCODE_MUL_FLO_FLO] = "MUL_FLO_FLO",
+        [OPCODE_DIV_FLO_FLO] = "DIV_FLO_FLO",
+        [OPCODE_CMPN_EQ_FIX] = "CMPN_EQ_FIX",
+        [OPCODE_CMPN_LT_FIX] = "CMPN_LT_FIX",
+        [OPCODE_CMPN_GT_FIX] = "CMPN_GT_FIX",
+        [OPCODE_CMPN_LE_FIX] = "CMPN_LE_FIX",
+        [OPCODE_CMPN_GE_FIX] = "CMPN_GE_FIX",
+        [OPCODE_BRANCH_IF_SELF] = "BRANCH_IF_SELF",
+        [OPCODE_LOOP] = "LOOP",
+        [OPCODE_VECTOR_REF] = "VECTOR_REF",
+        [OPCODE_VECTOR_SET] = "VECTOR_SET",
+        [OPCODE_VECTOR_LENGTH] = "VECTOR_LENGTH",
+        [OPCODE_CONS] = "CONS"
+    };
+
+    return names[opcode] != NULL ? names[opcode] : "UNKNOWN";
+}
 
-    old_stack = environment->stack_ptr;
-    sp = old_stack;
-    pc = vm_extract_code_pointer(procedure);
-    pc_base = pc;
+static int
+vm_profile_entry_comparer(const void *a_ptr, const void *b_ptr)
+{
+    const struct vm_profile_entry_t *a;
+    const struct vm_profile_entry_t *b;
 
-    /*
-     * Stack layout for VM:
-     * [high addresses]..................................................................................[low addresses]
-     * [arg n - 1][...][arg 1][arg 0][program area chain][environment chain][return address][stack top]...[stack_bottom]
-     *                           ^
-     *       program_area -------+
-     *
-     * arg0 is at program_area[0]
-     */
+    a = a_ptr;
+    b = b_ptr;
 
-    vm_push_args_to_stack(environment, num_args, args);
-    assert(num_args == vm_extract_num_args(procedure));
-    sp = environment->stack_ptr;
+    return (a->count < b->count) ? 1 : ((a->count > b->count) ? -1 : 0);
+}
+
+static inline void
+vm_profile_op(struct vm_profile_t *profile, unsigned char opcode)
+{
+    uint64_t timestamp;
+
+    timestamp = VM_PROFILE_TIMESTAMP();
+    profile->cycles[profile->previous_opcode] += timestamp - profile->previous_timestamp;
+    ++profile->counts[opcode];
+    ++profile->pair_counts[profile->previous_opcode][opcode];
+    profile->previous_opcode = opcode;
+    profile->previous_timestamp = timestamp;
+}
 
+static inline void
+vm_profile_enter(struct vm_profile_t *profile)
+{
     /*
-     * The stack pointer points to the first free stack slot, so to point
-     * correctly at the program area the stack pointer must be incremented.
+     * Only the outermost VM invocation starts the clock, so the time spent
+     * between top level evaluations is not charged to anything. Pairs
+     * starting with OPCODE_INVALID count the entries.
      */
-    program_area = sp + 1;
-
-    sp = vm_push_null_ref(sp);                  /* program area chain */
-    sp = vm_push_null_ref(sp);                  /* environment chain */
-    sp = vm_push_return_address(sp, NULL, 0);   /* return address */
-    sp -= vm_extract_num_locals(procedure);
-
-    for (;;)
+    if (profile->depth++ == 0)
     {
-        unsigned byte = *pc++;
+        profile->previous_opcode = OPCODE_INVALID;
+        profile->previous_timestamp = VM_PROFILE_TIMESTAMP();
+    }
+}
 
-        switch (byte)
+static inline void
+vm_profile_leave(struct vm_profile_t *profile)
+{
+    uint64_t timestamp;
+
+    timestamp = VM_PROFILE_TIMESTAMP();
+    profile->cycles[profile->previous_opcode] += timestamp - profile->previous_timestamp;
+    profile->previous_timestamp = timestamp;
+    --profile->depth;
+}
+
+#   define VM_PROFILE_OP(opcode) vm_profile_op(profile, (opcode))
+#else
+#   define VM_PROFILE_OP(opcode)
+#endif
+
+struct vm_profile_t *
+vm_profile_create(void)
+{
+#if ENABLE_VM_PROFILING
+    struct vm_profile_t *profile;
+
+    profile = calloc(1, sizeof(struct vm_profile_t));
+    assert(profile != NULL);
+
+    return profile;
+#else
+    return NULL;
+#endif
+}
+
+void
+vm_profile_destroy(struct vm_profile_t *profile)
+{
+    free(profile);
+}
+
+void
+vm_profile_reset(struct evil_environment_t *environment)
+{
+    struct vm_profile_t *profile;
+    int depth;
+
+    profile = environment->profile;
+
+    if (profile == NULL)
+    {
+        return;
+    }
+
+    /*
+     * A reset from inside the VM, such as (vm-profile 'reset), keeps the
+     * clock of the running invocations going.
+     */
+    depth = profile->depth;
+    memset(profile, 0, sizeof(struct vm_profile_t));
+    profile->depth = depth;
+#if ENABLE_VM_PROFILING
+    profile->previous_timestamp = VM_PROFILE_TIMESTAMP();
+#endif
+}
+
+void
+vm_profile_dump(struct evil_environment_t *environment)
+{
+#if ENABLE_VM_PROFILING
+    struct vm_profile_t *profile;
+    struct vm_profile_entry_t *entries;
+    uint64_t total;
+    size_t num_entries;
+    size_t i;
+    int a;
+    int b;
+
+    profile = environment->profile;
+    entries = malloc(256 * 256 * sizeof(struct vm_profile_entry_t));
+    assert(entries != NULL);
+
+    total = 0;
+    num_entries = 0;
+
+    for (a = 0; a < 256; ++a)
+    {
+        if (profile->counts[a] != 0)
+        {
+            total += profile->counts[a];
+            entries[num_entries].count = profile->counts[a];
+            entries[num_entries].cycles = profile->cycles[a];
+            entries[num_entries].opcode = (unsigned char)a;
+            ++num_entries;
+        }
+    }
+
+    qsort(entries, num_entries, sizeof(struct vm_profile_entry_t), vm_profile_entry_comparer);
+    evil_printf("%-24s %14s %7s %16s %10s\n", "opcode", "count", "%", "cycles", "cycles/op");
+
+    for (i = 0; i < num_entries; ++i)
+    {
+        evil_printf("%-24s %14" PRIu64 " %6.2f%% %16" PRIu64 " %10.1f\n",
+                vm_opcode_name(entries[i].opcode),
+                entries[i].count,
+                100.0 * (double)entries[i].count / (double)total,
+                entries[i].cycles,
+                (double)entries[i].cycles / (double)entries[i].count);
+    }
+
+    num_entries = 0;
+
+    for (a = 1; a < 256; ++a)
+    {
+        for (b = 0; b < 256; ++b)
         {
-            case OPCODE_INVALID:
+            if (profile->pair_counts[a][b] != 0)
+            {
+                entries[num_entries].count = profile->pair_counts[a][b];
+                entries[num_entries].opcode = (unsigned char)a;
+                entries[num_entries].next_opcode = (unsigned char)b;
+                ++num_entries;
+            }
+        }
+    }
+
+    qsort(entries, num_entries, sizeof(struct vm_profile_entry_t), vm_profile_entry_comparer);
+    evil_printf("\n%-49s %14s %7s\n", "opcode pair", "count", "%");
+
+    for (i = 0; i < num_entries && i < VM_PROFILE_MAX_PAIRS; ++i)
+    {
+        evil_printf("%-24s %-24s %14" PRIu64 " %6.2f%%\n",
+                vm_opcode_name(entries[i].opcode),
+                vm_opcode_name(entries[i].next_opcode),
+                entries[i].count,
+                100.0 * (double)entries[i].count / (double)total);
+    }
+
+    free(entries);
+#else
+    UNUSED(environment);
+#endif
+}
+
+struct evil_object_t
+evil_vm_profile(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *args)
+{
+    struct evil_object_t result;
+    int i;
+
+    UNUSED(lexical_environment);
+
+    /*
+     * (vm-profile) prints the counters and returns the number of
+     * instructions counted so far, (vm-profile 'reset) clears them and
+     * returns #t. Both return #f if profiling is not enabled.
+     */
+    result.tag_count.tag = TAG_BOOLEAN;
+    result.tag_count.flag = 0;
+    result.tag_count.count = 1;
+    result.value.fixnum_value = 0;
+
+    if (environment->profile == NULL)
+    {
+        return result;
+    }
+
+    if (num_args > 0)
+    {
+        assert(args[0].tag_count.tag == TAG_SYMBOL
+                && args[0].value.symbol_hash == register_symbol_from_string(environment, "reset"));
+
+        vm_profile_reset(environment);
+        result.value.fixnum_value = 1;
+
+        return result;
+    }
+
+    vm_profile_dump(environment);
+    result = make_fixnum_object(0);
+
+    for (i = 0; i < 256; ++i)
+    {
+        result.value.fixnum_value += (int64_t)environment->profile->counts[i];
+    }
+
+    return result;
+}
+
+struct evil_object_t
+evil_spawn(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *args)
+{
+    struct evil_object_t *procedure;
+    struct vm_fiber_t *fiber;
+
+    UNUSED(lexical_environment);
+    UNUSED(num_args);
+
+    /*
+     * (spawn thunk) queues a fiber that calls thunk and returns its id. The
+     * fiber first runs when the spawning fiber yields, blocks or is
+     * preempted.
+     */
+    procedure = deref(&args[0]);
+    assert(procedure->tag_count.tag == TAG_PROCEDURE);
+
+    fiber = vm_fiber_create(environment, procedure);
+
+    return make_fixnum_object((int64_t)fiber->id);
+}
+
+struct evil_object_t
+evil_yield(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *args)
+{
+    UNUSED(lexical_environment);
+    UNUSED(num_args);
+    UNUSED(args);
+
+    /*
+     * (yield) ends the running fiber's time slice; the switch happens when
+     * the VM gets back from this call.
+     */
+    vm_scheduler_end_slice(environment->scheduler);
+
+    return make_unspecified();
+}
+
+struct evil_object_t
+evil_join(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, int num_args, struct evil_object_t *args)
+{
+    struct vm_scheduler_t *scheduler;
+    struct vm_fiber_t *current;
+    struct vm_fiber_t *fiber;
+    struct evil_object_t *id;
+    struct evil_object_t result;
+
+    UNUSED(lexical_environment);
+    UNUSED(num_args);
+
+    /*
+     * (join id) returns the result of the fiber, waiting for it to finish
+     * if it hasn't yet. A fiber can be joined once.
+     */
+    scheduler = environment->scheduler;
+    current = scheduler->current;
+    id = value_deref(&args[0]);
+    assert(id->tag_count.tag == TAG_FIXNUM);
+    assert(id->value.fixnum_value >= 0 && (size_t)id->value.fixnum_value < scheduler->num_fibers);
+
+    fiber = scheduler->fibers[id->value.fixnum_value];
+    assert(fiber != NULL && fiber != current);
+
+    if (fiber->state == VM_FIBER_DONE)
+    {
+        result = fiber->result;
+        vm_fiber_release(scheduler, fiber);
+
+        return result;
+    }
+
+    if (current->depth != 1)
+    {
+        evil_printf("[vm] join would block a fiber inside a nested call\n");
+        BREAK();
+        return make_unspecified();
+    }
+
+    /*
+     * The result is filled in when the fiber finishes, see vm_fiber_finish.
+     */
+    current->state = VM_FIBER_BLOCKED;
+    current->next = fiber->waiters;
+    fiber->waiters = current;
+    vm_scheduler_end_slice(scheduler);
+
+    return make_unspecified();
+}
+
+#if ENABLE_VM_THREADED_DISPATCH
+/*
+ * Taking the address of a label and computed gotos are GNU extensions, which
+ * -pedantic rejects. The range initializer below points every byte at the
+ * unknown opcode handler first and the designated entries then override it.
+ */
+#   pragma GCC diagnostic push
+#   pragma GCC diagnostic ignored "-Wpedantic"
+#   pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+
+/*
+ * Runs the procedure, or carries on with the suspended invocation if
+ * initial_function is NULL, with the given fuel. See vm_run_with_fuel.
+ */
+static enum evil_run_status_t
+vm_execute(struct evil_environment_t *environment, struct evil_object_handle_t *initial_lexical_environment, struct evil_object_t *initial_function, int num_args, struct evil_object_t *args, int64_t fuel, struct evil_object_t *result)
+{
+#if ENABLE_VM_THREADED_DISPATCH
+    static const void *const vm_dispatch_table[256] = {
+        [0 ... 255] = &&vm_op_unknown,
+        [OPCODE_INVALID] = &&vm_op_OPCODE_INVALID,
+        [OPCODE_LDSLOT_X] = &&vm_op_OPCODE_LDSLOT_X,
+        [OPCODE_LDIMM_1_BOOL] = &&vm_op_OPCODE_LDIMM_1_BOOL,
+        [OPCODE_LDIMM_1_CHAR] = &&vm_op_OPCODE_LDIMM_1_CHAR,
+        [OPCODE_LDIMM_1_FIXNUM] = &&vm_op_OPCODE_LDIMM_1_FIXNUM,
+        [OPCODE_LDIMM_1_FLONUM] = &&vm_op_OPCODE_LDIMM_1_FLONUM,
+        [OPCODE_LDIMM_4_FIXNUM] = &&vm_op_OPCODE_LDIMM_4_FIXNUM,
+        [OPCODE_LDIMM_4_FLONUM] = &&vm_op_OPCODE_LDIMM_4_FLONUM,
+        [OPCODE_LDIMM_8_FIXNUM] = &&vm_op_OPCODE_LDIMM_8_FIXNUM,
+        [OPCODE_LDIMM_8_FLONUM] = &&vm_op_OPCODE_LDIMM_8_FLONUM,
+        [OPCODE_LDIMM_8_SYMBOL] = &&vm_op_OPCODE_LDIMM_8_SYMBOL,
+        [OPCODE_LDSTR] = &&vm_op_OPCODE_LDSTR,
+        [OPCODE_LDEMPTY] = &&vm_op_OPCODE_LDEMPTY,
+        [OPCODE_LDFN] = &&vm_op_OPCODE_LDFN,
+        [OPCODE_LOAD] = &&vm_op_OPCODE_LOAD,
+        [OPCODE_STORE] = &&vm_op_OPCODE_STORE,
+        [OPCODE_MAKE_REF] = &&vm_op_OPCODE_MAKE_REF,
+        [OPCODE_STSLOT_X] = &&vm_op_OPCODE_STSLOT_X,
+        [OPCODE_SET] = &&vm_op_OPCODE_SET,
+        [OPCODE_LDTYPE] = &&vm_op_OPCODE_LDTYPE,
+        [OPCODE_CMP_EQUAL] = &&vm_op_OPCODE_CMP_EQUAL,
+        [OPCODE_CMPN_EQ] = &&vm_op_OPCODE_CMPN_EQ,
+        [OPCODE_CMPN_LT] = &&vm_op_OPCODE_CMPN_LT,
+        [OPCODE_CMPN_GT] = &&vm_op_OPCODE_CMPN_GT,
+        [OPCODE_CMPN_LE] = &&vm_op_OPCODE_CMPN_LE,
+        [OPCODE_CMPN_GE] = &&vm_op_OPCODE_CMPN_GE,
+        [OPCODE_BRANCH] = &&vm_op_OPCODE_BRANCH,
+        [OPCODE_COND_BRANCH] = &&vm_op_OPCODE_COND_BRANCH,
+        [OPCODE_CALL] = &&vm_op_OPCODE_CALL,
+        [OPCODE_TAILCALL] = &&vm_op_OPCODE_TAILCALL,
+        [OPCODE_RETURN] = &&vm_op_OPCODE_RETURN,
+        [OPCODE_GET_BOUND_LOCATION] = &&vm_op_OPCODE_GET_BOUND_LOCATION,
+        [OPCODE_ADD] = &&vm_op_OPCODE_ADD,
+        [OPCODE_SUB] = &&vm_op_OPCODE_SUB,
+        [OPCODE_MUL] = &&vm_op_OPCODE_MUL,
+        [OPCODE_DIV] = &&vm_op_OPCODE_DIV,
+        [OPCODE_AND] = &&vm_op_OPCODE_AND,
+        [OPCODE_OR] = &&vm_op_OPCODE_OR,
+        [OPCODE_XOR] = &&vm_op_OPCODE_XOR,
+        [OPCODE_NOT] = &&vm_op_OPCODE_NOT,
+        [OPCODE_NOP] = &&vm_op_OPCODE_NOP,
+        [OPCODE_POP] = &&vm_op_OPCODE_POP,
+        [OPCODE_BREAK] = &&vm_op_OPCODE_BREAK,
+        [OPCODE_CMPN_EQ_SLOTS_BRANCH] = &&vm_op_OPCODE_CMPN_EQ_SLOTS_BRANCH,
+        [OPCODE_CMPN_LT_SLOTS_BRANCH] = &&vm_op_OPCODE_CMPN_LT_SLOTS_BRANCH,
+        [OPCODE_CMPN_GT_SLOTS_BRANCH] = &&vm_op_OPCODE_CMPN_GT_SLOTS_BRANCH,
+        [OPCODE_CMPN_LE_SLOTS_BRANCH] = &&vm_op_OPCODE_CMPN_LE_SLOTS_BRANCH,
+        [OPCODE_CMPN_GE_SLOTS_BRANCH] = &&vm_op_OPCODE_CMPN_GE_SLOTS_BRANCH,
+        [OPCODE_CALL_GLOBAL] = &&vm_op_OPCODE_CALL_GLOBAL,
+        [OPCODE_TAILCALL_GLOBAL] = &&vm_op_OPCODE_TAILCALL_GLOBAL,
+        [OPCODE_ADD_IMM_SLOT] = &&vm_op_OPCODE_ADD_IMM_SLOT,
+        [OPCODE_SUB_SLOT_IMM] = &&vm_op_OPCODE_SUB_SLOT_IMM,
+        [OPCODE_RADD] = &&vm_op_OPCODE_RADD,
+        [OPCODE_RSUB] = &&vm_op_OPCODE_RSUB,
+        [OPCODE_RMUL] = &&vm_op_OPCODE_RMUL,
+        [OPCODE_RDIV] = &&vm_op_OPCODE_RDIV,
+        [OPCODE_RADD_IMM] = &&vm_op_OPCODE_RADD_IMM,
+        [OPCODE_RSUB_IMM] = &&vm_op_OPCODE_RSUB_IMM,
+        [OPCODE_RMUL_IMM] = &&vm_op_OPCODE_RMUL_IMM,
+        [OPCODE_RDIV_IMM] = &&vm_op_OPCODE_RDIV_IMM,
+        [OPCODE_ADD_FIX_FIX] = &&vm_op_OPCODE_ADD_FIX_FIX,
+        [OPCODE_SUB_FIX_FIX] = &&vm_op_OPCODE_SUB_FIX_FIX,
+        [OPCODE_MUL_FIX_FIX] = &&vm_op_OPCODE_MUL_FIX_FIX,
+        [OPCODE_DIV_FIX_FIX] = &&vm_op_OPCODE_DIV_FIX_FIX,
+        [OPCODE_ADD_FLO_FLO] = &&vm_op_OPCODE_ADD_FLO_FLO,
+        [OPCODE_SUB_FLO_FLO] = &&vm_op_OPCODE_SUB_FLO_FLO,
+        [OPCODE_MUL_FLO_FLO] = &&vm_op_OPCODE_MUL_FLO_FLO,
+        [OPCODE_DIV_FLO_FLO] = &&vm_op_OPCODE_DIV_FLO_FLO,
+        [OPCODE_CMPN_EQ_FIX] = &&vm_op_OPCODE_CMPN_EQ_FIX,
+        [OPCODE_CMPN_LT_FIX] = &&vm_op_OPCODE_CMPN_LT_FIX,
+        [OPCODE_CMPN_GT_FIX] = &&vm_op_OPCODE_CMPN_GT_FIX,
+        [OPCODE_CMPN_LE_FIX] = &&vm_op_OPCODE_CMPN_LE_FIX,
+        [OPCODE_CMPN_GE_FIX] = &&vm_op_OPCODE_CMPN_GE_FIX,
+        [OPCODE_BRANCH_IF_SELF] = &&vm_op_OPCODE_BRANCH_IF_SELF,
+        [OPCODE_LOOP] = &&vm_op_OPCODE_LOOP,
+        [OPCODE_VECTOR_REF] = &&vm_op_OPCODE_VECTOR_REF,
+        [OPCODE_VECTOR_SET] = &&vm_op_OPCODE_VECTOR_SET,
+        [OPCODE_VECTOR_LENGTH] = &&vm_op_OPCODE_VECTOR_LENGTH,
+        [OPCODE_CONS] = &&vm_op_OPCODE_CONS
+    };
+    const void *const *dispatch_table;
+#endif
+#if VM_TRACE_RECORDING
+    static const void *const vm_record_table[256] = {
+        [0 ... 255] = &&vm_op_record
+    };
+    struct jit_trace_recorder_t *trace_recorder;
+#endif
+#if ENABLE_VM_PROFILING
+    struct vm_profile_t *profile;
+#endif
+    struct vm_activation_t activation;
+    struct vm_scheduler_t *scheduler;
+    struct vm_fiber_t *entry_fiber;
+    struct vm_suspension_t *suspension;
+    int metered;
+    struct evil_object_handle_t *lexical_environment_handle;
+    struct evil_object_t *procedure;
+    struct evil_object_t *program_area;
+    struct evil_object_t *sp;
+    struct evil_object_t *old_stack;
+    struct evil_object_t *stack_limit;
+    struct evil_object_t *segment_entry;
+    unsigned char *pc_base;
+    unsigned char *pc;
+
+#if ENABLE_VM_THREADED_DISPATCH
+    dispatch_table = vm_dispatch_table;
+#endif
+#if VM_TRACE_RECORDING
+    trace_recorder = NULL;
+#endif
+#if ENABLE_VM_PROFILING
+    profile = environment->profile;
+    vm_profile_enter(profile);
+#endif
+
+    /*
+     * Only the outermost metered invocation counts fuel; one nested in it
+     * runs on the outer one's.
+     */
+    scheduler = environment->scheduler;
+    metered = fuel != VM_UNLIMITED_FUEL && scheduler->fuel == VM_UNLIMITED_FUEL;
+
+    if (metered)
+    {
+        assert(fuel > 0);
+        vm_scheduler_end_slice(scheduler);
+        scheduler->fuel = fuel;
+    }
+
+    if (initial_function == NULL)
+    {
+        suspension = environment->suspension;
+        assert(suspension != NULL);
+        environment->suspension = NULL;
+
+        procedure = suspension->procedure.value.ref;
+        program_area = suspension->program_area;
+        pc_base = vm_extract_code_pointer(procedure);
+        pc = pc_base + suspension->pc_offset;
+        old_stack = suspension->old_stack;
+        entry_fiber = suspension->entry_fiber;
+        sp = environment->stack_ptr;
+        free(suspension);
+
+        ++scheduler->current->depth;
+        lexical_environment_handle = evil_create_object_handle(environment, &VECTOR_BASE(procedure)[FIELD_LEXICAL_ENVIRONMENT]);
+        VM_LOAD_STACK_SEGMENT();
+
+        activation.previous = environment->activation;
+        VM_PUBLISH_ACTIVATION();
+        environment->activation = &activation;
+
+        /*
+         * The invocation was suspended on its way to switching fibers,
+         * which it now does with its new fuel.
+         */
+        goto vm_fiber_switch;
+    }
+
+    assert(environment->suspension == NULL);
+
+    if (metered)
+        vm_scheduler_start_slice(scheduler);
+
+    lexical_environment_handle = evil_duplicate_object_handle(environment, initial_lexical_environment);
+
+    /*
+     * This is going to get really ugly if the GC moves our procedure object
+     * while we are executing something. Maybe we should pin the procedures
+     * while we are executing? Refresh after every function call and/or
+     * object creation?
+     */
+
+    procedure = deref(initial_function);
+    assert(procedure->tag_count.tag == TAG_PROCEDURE);
+    assert(vm_procedure_header(procedure).flags & VM_PROCEDURE_VERIFIED);
+
+    /*
+     * The fiber that called in is the one that must be running when this
+     * invocation returns.
+     */
+    entry_fiber = scheduler->current;
+    ++entry_fiber->depth;
+
+    old_stack = environment->stack_ptr;
+    sp = old_stack;
+    pc = vm_extract_code_pointer(procedure);
+    pc_base = pc;
+
+    /*
+     * Stack layout for VM:
+     * [high addresses]..................................................................................[low addresses]
+     * [arg n - 1][...][arg 1][arg 0][program area chain][return address][stack top]...[stack_bottom]
+     *                           ^
+     *       program_area -------+
+     *
+     * arg0 is at program_area[0]
+     */
+
+    assert(num_args == vm_extract_num_args(procedure));
+    vm_push_args_to_stack(environment, num_args, args, vm_procedure_header(procedure));
+    sp = environment->stack_ptr;
+    VM_LOAD_STACK_SEGMENT();
+
+    /*
+     * The stack pointer points to the first free stack slot, so to point
+     * correctly at the program area the stack pointer must be incremented.
+     */
+    program_area = sp + 1;
+
+    /*
+     * Like every other frame, this one runs in its procedure's lexical
+     * environment; see vm_context_save_slots_t.
+     */
+    evil_retarget_object_handle(lexical_environment_handle, &VECTOR_BASE(procedure)[FIELD_LEXICAL_ENVIRONMENT]);
+
+    sp = vm_push_null_ref(sp);                  /* program area chain */
+    sp = vm_push_return_address(sp, NULL, 0);   /* return address */
+    sp -= vm_extract_num_locals(procedure);
+
+    activation.previous = environment->activation;
+    VM_PUBLISH_ACTIVATION();
+    environment->activation = &activation;
+
+    VM_ENTER_NATIVE_CODE(jit_count_call(procedure));
+
+    for (;;)
+    {
+        unsigned byte = *pc++;
+
+        VM_PROFILE_OP((unsigned char)byte);
+
+        switch (byte)
+        {
+            VM_OPCODE(OPCODE_INVALID):
                 VM_TRACE_OP(OPCODE_INVALID);
                 BREAK();
                 VM_CONTINUE();
-            case OPCODE_LDSLOT_X:
+            VM_OPCODE(OPCODE_LDSLOT_X):
                 VM_TRACE_OP(OPCODE_LDSLOT_X);
                 {
                     union convert_two_t c2;
@@ -692,7 +2277,7 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     STACK_PUSH(sp, program_area[offset]);
                 }
                 VM_CONTINUE();
-            case OPCODE_STSLOT_X:
+            VM_OPCODE(OPCODE_STSLOT_X):
                 VM_TRACE_OP(OPCODE_STSLOT_X);
                 {
                     union convert_two_t c2;
@@ -705,43 +2290,43 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     program_area[offset] = STACK_POP(sp);
                 }
                 VM_CONTINUE();
-            case OPCODE_LDIMM_1_BOOL:
+            VM_OPCODE(OPCODE_LDIMM_1_BOOL):
                 VM_TRACE_OP(OPCODE_LDIMM_1_BOOL);
                 LDIMM_1_BOOLEAN()
                 VM_CONTINUE();
-            case OPCODE_LDIMM_1_CHAR:
+            VM_OPCODE(OPCODE_LDIMM_1_CHAR):
                 VM_TRACE_OP(OPCODE_LDIMM_1_CHAR);
                 LDIMM_1_CHAR()
                 VM_CONTINUE();
-            case OPCODE_LDIMM_1_FIXNUM:
+            VM_OPCODE(OPCODE_LDIMM_1_FIXNUM):
                 VM_TRACE_OP(OPCODE_LDIMM_1_FIXNUM);
                 LDIMM_1_FIXNUM()
                 VM_CONTINUE();
-            case OPCODE_LDIMM_1_FLONUM:
+            VM_OPCODE(OPCODE_LDIMM_1_FLONUM):
                 VM_TRACE_OP(OPCODE_LDIMM_1_FLONUM);
                 LDIMM_1_FLONUM()
                 VM_CONTINUE();
-            case OPCODE_LDIMM_4_FIXNUM:
+            VM_OPCODE(OPCODE_LDIMM_4_FIXNUM):
                 VM_TRACE_OP(OPCODE_LDIMM_4_FIXNUM);
                 LDIMM_4_FIXNUM()
                 VM_CONTINUE();
-            case OPCODE_LDIMM_4_FLONUM:
+            VM_OPCODE(OPCODE_LDIMM_4_FLONUM):
                 VM_TRACE_OP(OPCODE_LDIMM_4_FLONUM);
                 LDIMM_4_FLONUM()
                 VM_CONTINUE();
-            case OPCODE_LDIMM_8_FIXNUM:
+            VM_OPCODE(OPCODE_LDIMM_8_FIXNUM):
                 VM_TRACE_OP(OPCODE_LDIMM_8_FIXNUM);
                 LDIMM_8_FIXNUM()
                 VM_CONTINUE();
-            case OPCODE_LDIMM_8_FLONUM:
+            VM_OPCODE(OPCODE_LDIMM_8_FLONUM):
                 VM_TRACE_OP(OPCODE_LDIMM_8_FLONUM);
                 LDIMM_8_FLONUM()
                 VM_CONTINUE();
-            case OPCODE_LDIMM_8_SYMBOL:
+            VM_OPCODE(OPCODE_LDIMM_8_SYMBOL):
                 VM_TRACE_OP(OPCODE_LDIMM_8_SYMBOL);
                 LDIMM_8_SYMBOL()
                 VM_CONTINUE();
-            case OPCODE_LDSTR:
+            VM_OPCODE(OPCODE_LDSTR):
                 VM_TRACE_OP(OPCODE_LDSTR);
                 {
                     struct evil_object_t *string_obj;
@@ -755,15 +2340,15 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     pc += string_length + 1;
                 }
                 VM_CONTINUE();
-            case OPCODE_LDEMPTY:
+            VM_OPCODE(OPCODE_LDEMPTY):
                 VM_TRACE_OP(OPCODE_LDEMPTY);
                 sp = vm_push_ref(sp, empty_pair);
                 VM_CONTINUE();
-            case OPCODE_LDFN:
+            VM_OPCODE(OPCODE_LDFN):
                 VM_TRACE_OP(OPCODE_LDFN);
                 sp = vm_push_ref(sp, procedure);
                 VM_CONTINUE();
-            case OPCODE_LOAD:
+            VM_OPCODE(OPCODE_LOAD):
                 VM_TRACE_OP(OPCODE_LOAD);
                 {
                     struct evil_object_t *ref;
@@ -773,12 +2358,12 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     ref = sp + 1;
 
                     tag = ref->tag_count.tag;
-                    VM_ASSERT(tag == TAG_REFERENCE || tag == TAG_INNER_REFERENCE);
+                    VM_TYPE_ASSERT(tag == TAG_REFERENCE || tag == TAG_INNER_REFERENCE);
 
                     if (tag == TAG_INNER_REFERENCE)
                     {
                         unsigned char evil_object_tag;
-                        unsigned short index;
+                        uint32_t index;
 
                         object = ref->value.ref;
                         evil_object_tag = object->tag_count.tag;
@@ -808,7 +2393,7 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     }
                 }
                 VM_CONTINUE();
-            case OPCODE_STORE:
+            VM_OPCODE(OPCODE_STORE):
                 VM_TRACE_OP(OPCODE_STORE);
                 {
                     struct evil_object_t *ref;
@@ -819,55 +2404,72 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     ref = sp + 1;
 
                     tag = ref->tag_count.tag;
-                    VM_ASSERT(tag == TAG_REFERENCE || tag == TAG_INNER_REFERENCE);
+                    VM_TYPE_ASSERT(tag == TAG_REFERENCE || tag == TAG_INNER_REFERENCE);
 
                     if (tag == TAG_INNER_REFERENCE)
                     {
                         unsigned char evil_object_tag;
-                        unsigned short index;
+                        uint32_t index;
 
                         object = ref->value.ref;
                         evil_object_tag = object->tag_count.tag;
                         assert(evil_object_tag == TAG_VECTOR || evil_object_tag == TAG_PROCEDURE || evil_object_tag == TAG_SPECIAL_FUNCTION);
                         index = ref->tag_count.count;
                         VECTOR_BASE(object)[index] = *object;
+                        gc_write_barrier(environment->heap, &VECTOR_BASE(object)[index]);
                     }
                     else
                     {
                         struct evil_object_t *ptr;
 
                         ptr = deref(ref);
+
+                        /*
+                         * Unbound symbols resolve to the empty pair, which is
+                         * shared and read-only.
+                         */
+                        if (ptr == empty_pair)
+                        {
+                            BREAK();
+                        }
+
                         *ptr = *object;
+                        gc_write_barrier(environment->heap, ptr);
                     }
 
                     sp += 2;
                 }
                 VM_CONTINUE();
-            case OPCODE_MAKE_REF:
+            VM_OPCODE(OPCODE_MAKE_REF):
                 VM_TRACE_OP(OPCODE_MAKE_REF);
                 {
                     struct evil_object_t * const ref = sp + 2;
                     struct evil_object_t * const index = sp + 1;
-                    VM_ASSERT(ref->tag_count.tag == TAG_REFERENCE);
-                    VM_ASSERT(index->tag_count.tag == TAG_FIXNUM);
+                    VM_TYPE_ASSERT(ref->tag_count.tag == TAG_REFERENCE);
+                    VM_TYPE_ASSERT(index->tag_count.tag == TAG_FIXNUM);
 
                     *ref = make_inner_reference(ref->value.ref, index->value.fixnum_value);
                     ++sp;
                 }
                 VM_CONTINUE();
-            case OPCODE_SET:
+            VM_OPCODE(OPCODE_SET):
                 VM_TRACE_OP(OPCODE_SET);
                 {
                     struct evil_object_t *source = sp + 2;
                     struct evil_object_t *ref = sp + 1;
                     struct evil_object_t *ref_obj;
-                    unsigned short ref_index;
+                    uint32_t ref_index;
                     unsigned char target_type;
 
-                    VM_ASSERT(ref->tag_count.tag == TAG_REFERENCE || ref->tag_count.tag == TAG_INNER_REFERENCE);
+                    VM_TYPE_ASSERT(ref->tag_count.tag == TAG_REFERENCE || ref->tag_count.tag == TAG_INNER_REFERENCE);
 
                     ref_obj = deref(ref);
 
+                    if (ref_obj == empty_pair)
+                    {
+                        BREAK();
+                    }
+
                     ref_index = ref->tag_count.count;
                     target_type = ref_obj->tag_count.tag;
 
@@ -885,12 +2487,13 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     else
                     {
                         *ref_obj = *deref(source);
+                        gc_write_barrier(environment->heap, ref_obj);
                     }
 
                     sp += 2;
                 }
                 VM_CONTINUE();
-            case OPCODE_LDTYPE:
+            VM_OPCODE(OPCODE_LDTYPE):
                 VM_TRACE_OP(OPCODE_LDTYPE);
                 {
                     struct evil_object_t *stack_slot = sp + 1;
@@ -908,7 +2511,7 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     stack_slot->tag_count.count = 1;
                 }
                 VM_CONTINUE();
-            case OPCODE_CMP_EQUAL:
+            VM_OPCODE(OPCODE_CMP_EQUAL):
                 VM_TRACE_OP(OPCODE_CMP_EQUAL);
                 {
                     struct evil_object_t *b = sp + 2;
@@ -919,27 +2522,37 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     sp = vm_push_bool(sp + 2, is_equal);
                 }
                 VM_CONTINUE();
-            case OPCODE_CMPN_EQ:
+            VM_OPCODE(OPCODE_CMPN_EQ):
                 VM_TRACE_OP(OPCODE_CMPN_EQ);
+            vm_generic_cmpn_eq:
+                QUICKEN_CMPN(OPCODE_CMPN_EQ, OPCODE_CMPN_EQ_FIX)
                 CMPN_IMPL(==)
                 VM_CONTINUE();
-            case OPCODE_CMPN_LT:
+            VM_OPCODE(OPCODE_CMPN_LT):
                 VM_TRACE_OP(OPCODE_CMPN_LT);
+            vm_generic_cmpn_lt:
+                QUICKEN_CMPN(OPCODE_CMPN_LT, OPCODE_CMPN_LT_FIX)
                 CMPN_IMPL(<)
                 VM_CONTINUE();
-            case OPCODE_CMPN_GT:
+            VM_OPCODE(OPCODE_CMPN_GT):
                 VM_TRACE_OP(OPCODE_CMPN_GT);
+            vm_generic_cmpn_gt:
+                QUICKEN_CMPN(OPCODE_CMPN_GT, OPCODE_CMPN_GT_FIX)
                 CMPN_IMPL(>)
                 VM_CONTINUE();
-            case OPCODE_CMPN_LE:
+            VM_OPCODE(OPCODE_CMPN_LE):
                 VM_TRACE_OP(OPCODE_CMPN_LE);
+            vm_generic_cmpn_le:
+                QUICKEN_CMPN(OPCODE_CMPN_LE, OPCODE_CMPN_LE_FIX)
                 CMPN_IMPL(<=)
                 VM_CONTINUE();
-            case OPCODE_CMPN_GE:
+            VM_OPCODE(OPCODE_CMPN_GE):
                 VM_TRACE_OP(OPCODE_CMPN_GE);
+            vm_generic_cmpn_ge:
+                QUICKEN_CMPN(OPCODE_CMPN_GE, OPCODE_CMPN_GE_FIX)
                 CMPN_IMPL(>=)
                 VM_CONTINUE();
-            case OPCODE_BRANCH:
+            VM_OPCODE(OPCODE_BRANCH):
                 VM_TRACE_OP(OPCODE_BRANCH);
                 {
                     union convert_two_t c2;
@@ -950,7 +2563,7 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     pc += c2.s2;
                 }
                 VM_CONTINUE();
-            case OPCODE_COND_BRANCH:
+            VM_OPCODE(OPCODE_COND_BRANCH):
                 VM_TRACE_OP(OPCODE_COND_BRANCH);
                 {
                     union convert_two_t c2;
@@ -958,7 +2571,7 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     int offset;
 
                     condition = sp + 1;
-                    VM_ASSERT(condition->tag_count.tag == TAG_BOOLEAN);
+                    VM_TYPE_ASSERT(condition->tag_count.tag == TAG_BOOLEAN);
                     c2.bytes[0] = *pc++;
                     c2.bytes[1] = *pc++;
                     offset = c2.s2;
@@ -971,27 +2584,24 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     ++sp;
                 }
                 VM_CONTINUE();
-            case OPCODE_GET_BOUND_LOCATION:
+            VM_OPCODE(OPCODE_GET_BOUND_LOCATION):
                 VM_TRACE_OP(OPCODE_GET_BOUND_LOCATION);
                 {
-                    union convert_eight_t c8;
                     struct evil_object_t *object;
-                    struct evil_object_t *lexical_environment;
-
-                    memcpy(c8.bytes, pc, 8);
-                    pc += 8;
-                    lexical_environment = evil_resolve_object_handle(lexical_environment_handle);
 
-                    object = get_bound_location_in_lexical_environment(lexical_environment, c8.u8, 1);
+                    object = vm_cached_bound_location(environment, lexical_environment_handle, pc);
+                    pc += 8 + VM_INLINE_CACHE_SIZE;
                     sp = vm_push_ref(sp, object);
                 }
                 VM_CONTINUE();
-            case OPCODE_CALL:
+            VM_OPCODE(OPCODE_CALL):
                 VM_TRACE_OP(OPCODE_CALL);
+            vm_call:
                 {
                     struct evil_object_t *old_program_area;
                     struct evil_object_t *fn;
                     struct evil_object_t *procedure_base;
+                    struct vm_procedure_header_t header;
                     unsigned char tag;
                     union convert_two_t c2;
                     unsigned short args_passed;
@@ -1000,7 +2610,10 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     memcpy(c2.bytes, pc, 2);
                     args_passed = c2.u2;
                     pc += 2;
+                    return_offset = pc - pc_base;
+                    old_program_area = program_area;
 
+                vm_call_requested:
                     fn = deref(sp + 1);
                     ++sp;
                     tag = fn->tag_count.tag;
@@ -1008,23 +2621,37 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     VM_ASSERT(tag == TAG_PROCEDURE || tag == TAG_SPECIAL_FUNCTION);
 
                     procedure_base = VECTOR_BASE(fn);
-                    return_offset = pc - pc_base;
-                    old_program_area = program_area;
                     program_area = sp + 1;
 
-                    num_args = vm_extract_num_args(fn);
+                    header = vm_procedure_header(fn);
 
-                    assert(num_args == (int)args_passed || num_args == VARIADIC);
+                    assert(header.num_args == args_passed || header.num_args == VARIADIC);
+                    VM_ASSERT(tag != TAG_PROCEDURE || (header.flags & VM_PROCEDURE_VERIFIED));
 
                     if (tag == TAG_PROCEDURE)
                     {
+                        /*
+                         * If the frame doesn't fit in this segment the
+                         * arguments move to the top of the next one, and the
+                         * result comes back through the slot of the topmost
+                         * argument here.
+                         */
+                        if (!vm_frame_fits(program_area, header, stack_limit))
+                        {
+                            sp = vm_stack_push_segment(environment, vm_frame_size(header, args_passed), program_area + args_passed - 1);
+                            sp -= args_passed;
+                            memcpy(sp, program_area, args_passed * sizeof(struct evil_object_t));
+                            program_area = sp;
+                            --sp;
+                            VM_LOAD_STACK_SEGMENT();
+                        }
+
                         /*
                          * Save the return address and create space for the local slots.
                          */
                         sp = vm_push_ref(sp, old_program_area);
-                        sp = vm_push_ref(sp, evil_resolve_object_handle(lexical_environment_handle));
                         sp = vm_push_return_address(sp, procedure, (unsigned short)return_offset);
-                        sp -= vm_extract_num_locals(fn);
+                        sp -= header.num_locals;
 
                         /*
                          * call the function!
@@ -1033,6 +2660,8 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                         pc_base = pc;
                         procedure = fn;
                         evil_retarget_object_handle(lexical_environment_handle, &procedure_base[FIELD_LEXICAL_ENVIRONMENT]);
+                        VM_PUBLISH_ACTIVATION();
+                        VM_ENTER_NATIVE_CODE(jit_count_call(fn));
                     }
                     else
                     {
@@ -1052,15 +2681,26 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                         function_pointer = procedure_base[FIELD_CODE].value.special_function_value;
 
                         result = function_pointer(fn_environment, lexical_environment_handle, args_passed, program_area);
+                        program_area = old_program_area;
+
+                        /*
+                         * A call the builtin requested is made in its place.
+                         */
+                        if (fn_environment->call_procedure != NULL)
+                        {
+                            sp = vm_take_call_request(fn_environment, sp + args_passed, &args_passed);
+                            goto vm_call_requested;
+                        }
 
                         sp += args_passed - 1;
                         *(sp + 1) = result;
-                        program_area = old_program_area;
                     }
                 }
+                VM_FIBER_SAFEPOINT();
                 VM_CONTINUE();
-            case OPCODE_TAILCALL:
+            VM_OPCODE(OPCODE_TAILCALL):
                 VM_TRACE_OP(OPCODE_TAILCALL);
+            vm_tailcall:
                 {
                     struct evil_object_t *fn;
                     struct evil_object_t *arg_slot;
@@ -1071,29 +2711,70 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     union convert_two_t c2;
                     unsigned short args_passed;
                     struct evil_object_t *prev_program_area_ref;
-                    struct evil_object_t *lexical_environment;
                     struct evil_object_t *return_address;
                     struct evil_object_t *moved_prev_program_area_ref;
-                    struct evil_object_t *moved_lexical_environment;
                     struct evil_object_t *moved_return_address;
                     struct evil_object_t *procedure_base;
+                    struct vm_procedure_header_t header;
 
                     memcpy(c2.bytes, pc, 2);
                     args_passed = c2.u2;
                     pc += 2;
 
+                vm_tailcall_requested:
                     fn = deref(sp + 1);
                     ++sp;
                     tag = fn->tag_count.tag;
 
-                    tailcall_num_args = vm_extract_num_args(fn);
+                    header = vm_procedure_header(fn);
+                    tailcall_num_args = header.num_args;
                     assert(tailcall_num_args == (int)args_passed || tailcall_num_args == VARIADIC);
+                    VM_ASSERT(tag != TAG_PROCEDURE || (header.flags & VM_PROCEDURE_VERIFIED));
+                    procedure_base = VECTOR_BASE(fn);
+
+                    /*
+                     * Builtins are called in place like in CALL and the
+                     * RETURN that follows the TAILCALL returns their result.
+                     * A call the builtin requests is made as the tail call
+                     * instead.
+                     */
+                    if (tag == TAG_SPECIAL_FUNCTION)
+                    {
+                        void *environment_address;
+                        struct evil_environment_t *fn_environment;
+                        evil_special_function_t function_pointer;
+                        struct evil_object_t result;
+
+                        /*
+                         * The stack pointer is saved here in case the call to
+                         * the C function ends up in the garbage collector.
+                         */
+                        environment->stack_ptr = sp;
+
+                        environment_address = deref(&procedure_base[FIELD_ENVIRONMENT]);
+                        fn_environment = environment_address;
+                        function_pointer = procedure_base[FIELD_CODE].value.special_function_value;
+
+                        result = function_pointer(fn_environment, lexical_environment_handle, args_passed, sp + 1);
+
+                        if (fn_environment->call_procedure != NULL)
+                        {
+                            sp = vm_take_call_request(fn_environment, sp + args_passed, &args_passed);
+                            goto vm_tailcall_requested;
+                        }
+
+                        sp += args_passed - 1;
+                        *(sp + 1) = result;
+                        VM_FIBER_SAFEPOINT();
+                        VM_CONTINUE();
+                    }
+
                     /*
                      * This code erases the current frame replacing it with the
                      * new call. At this point the stack, pre-call, where
                      * function b is performing a tail call to function a, looks
                      * like this:
-                     * [arg a0][arg a1]...[arg an]...[stuff]...[return][lex env chain][PA chain][arg b0][arg b1]...[arg bk]
+                     * [arg a0][arg a1]...[arg an]...[stuff]...[return][PA chain][arg b0][arg b1]...[arg bk]
                      * And we need to move the args a0-an on top of args b0-bk.
                      * The great thing is the return slot and the PA chain don't
                      * need to change, they can just remain the same.
@@ -1105,15 +2786,12 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                      * these values when we juggle the arguments below.
                      */
                     prev_program_area_ref = program_area - VM_SLOT_PROGRAM_AREA_CHAIN;
-                    lexical_environment = program_area - VM_SLOT_LEXICAL_ENVIRONMENT_CHAIN;
                     return_address = program_area - VM_SLOT_PC_CHAIN;
 
                     moved_prev_program_area_ref = sp;
-                    moved_lexical_environment = sp - 1;
-                    moved_return_address = sp - 2;
+                    moved_return_address = sp - 1;
 
                     *(moved_prev_program_area_ref) = *prev_program_area_ref;
-                    *(moved_lexical_environment) = *lexical_environment;
                     *(moved_return_address) = *return_address;
 
                     /*
@@ -1124,6 +2802,18 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     arg_diff = current_fn_num_args - args_passed;
                     arg_slot = program_area + arg_diff;
 
+                    /*
+                     * A frame that outgrows its segment moves to the next
+                     * one like in CALL, returning through the slot this
+                     * frame would have returned through.
+                     */
+                    if (!vm_frame_fits(arg_slot, header, stack_limit))
+                    {
+                        arg_slot = vm_stack_push_segment(environment, vm_frame_size(header, args_passed), program_area + current_fn_num_args - 1);
+                        arg_slot -= args_passed;
+                        VM_LOAD_STACK_SEGMENT();
+                    }
+
                     VM_ASSERT(arg_slot <= environment->stack_top);
 
                     /*
@@ -1136,7 +2826,7 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                      * below where the locals go.
                      */
                     sp = arg_slot - VM_SLOT_COUNT - 1;
-                    sp -= vm_extract_num_locals(fn);
+                    sp -= header.num_locals;
 
                     /*
                      * Set the new program area.
@@ -1146,141 +2836,483 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
                     /*
                      * Restore the saved program area chain and return address.
                      */
-                    *(program_area - 1) = *moved_prev_program_area_ref;
-                    *(program_area - 2) = *moved_lexical_environment;
-                    *(program_area - 3) = *moved_return_address;
-
-                    procedure_base = VECTOR_BASE(fn);
+                    *(program_area - VM_SLOT_PROGRAM_AREA_CHAIN) = *moved_prev_program_area_ref;
+                    *(program_area - VM_SLOT_PC_CHAIN) = *moved_return_address;
 
-                    if (tag == TAG_SPECIAL_FUNCTION)
+#if VM_TRACE_RECORDING
+                    /*
+                     * A self tail call is a loop's back edge.
+                     */
+                    if (fn == procedure)
                     {
-                        void *environment_address;
-                        struct evil_environment_t *fn_environment;
-                        evil_special_function_t function_pointer;
-                        struct evil_object_t result;
-
-                        /*
-                         * The stack pointer is saved here in case the call to
-                         * the C function ends up in the garbage collector.
-                         */
-                        environment->stack_ptr = sp;
-
-                        environment_address = deref(&procedure_base[FIELD_ENVIRONMENT]);
-                        fn_environment = environment_address;
-                        function_pointer = procedure_base[FIELD_CODE].value.special_function_value;
-
-                        result = function_pointer(fn_environment, lexical_environment_handle, args_passed, program_area);
-                        *sp-- = result;
+                        if (trace_recorder == NULL)
+                        {
+                            trace_recorder = jit_count_loop(fn, program_area);
+                        }
+                        else if (jit_finish_trace(trace_recorder, program_area))
+                        {
+                            trace_recorder = NULL;
+                        }
 
-                        /*
-                         * Although OPCODE_CALL's C-function code path does
-                         * an implicit return, it is not necessary here as
-                         * the TAILCALL will be followed right after with a
-                         * proper RETURN instruction.
-                         */
-                    }
-                    else
-                    {
-                        pc = vm_extract_code_pointer(fn);
-                        pc_base = pc;
-                        procedure = fn;
-                        evil_retarget_object_handle(lexical_environment_handle, deref(&procedure_base[FIELD_LEXICAL_ENVIRONMENT]));
+                        dispatch_table = VM_RECORDING() ? vm_record_table : vm_dispatch_table;
                     }
+#endif
+                    pc = vm_extract_code_pointer(fn);
+                    pc_base = pc;
+                    procedure = fn;
+                    evil_retarget_object_handle(lexical_environment_handle, &procedure_base[FIELD_LEXICAL_ENVIRONMENT]);
+                    VM_PUBLISH_ACTIVATION();
+                    VM_ENTER_NATIVE_CODE(jit_count_call(fn));
                 }
+                VM_FIBER_SAFEPOINT();
                 VM_CONTINUE();
-            case OPCODE_RETURN:
+            VM_OPCODE(OPCODE_RETURN):
                 VM_TRACE_OP(OPCODE_RETURN);
                 {
 #define RETURN_VALUE_OFFSET 2
                     struct evil_object_t *return_address;
                     struct evil_object_t *prev_program_area_ref;
-                    struct evil_object_t *prev_lexical_environment;
                     struct evil_object_t *return_value;
                     struct evil_object_t *parent;
+                    unsigned short return_offset;
 
                     return_value = sp + 1;
+                    /*
+                     * The verifier guarantees that the procedure never
+                     * touches the saved slots below its arguments.
+                     */
                     return_address = program_area - VM_SLOT_PC_CHAIN;
-                    prev_lexical_environment = program_area - VM_SLOT_LEXICAL_ENVIRONMENT_CHAIN;
                     prev_program_area_ref = program_area - VM_SLOT_PROGRAM_AREA_CHAIN;
 
-                    VM_ASSERT(return_address->tag_count.tag == TAG_INNER_REFERENCE);
-                    VM_ASSERT(prev_lexical_environment->tag_count.tag == TAG_REFERENCE);
-                    VM_ASSERT(prev_program_area_ref->tag_count.tag == TAG_REFERENCE);
-
                     parent = return_address->value.ref;
+                    return_offset = return_address->tag_count.count;
 
-                    if (parent != NULL)
-                    {
-                        pc_base = vm_extract_code_pointer(parent);
-                        pc = pc_base + return_address->tag_count.count;
-
-                        /*
-                         * The return value subsumes the slot for the topmost
-                         * passed argument (program_area - arg_count - 1).
-                         * The stack pointer is one below this (rv slot - 1).
-                         */
+                    /*
+                     * The return value subsumes the slot for the topmost
+                     * passed argument (program_area - arg_count - 1), which
+                     * is the program area chain if there are no arguments.
+                     * The stack pointer is one below this (rv slot - 1).
+                     */
+                    sp = program_area + vm_extract_num_args(procedure) - RETURN_VALUE_OFFSET;
+                    program_area = prev_program_area_ref->value.ref;
+                    *(sp + 1) = *return_value;
 
-                        sp = program_area + vm_extract_num_args(procedure) - RETURN_VALUE_OFFSET;
-                        procedure = parent;
-                        program_area = deref(prev_program_area_ref);
-                        evil_retarget_object_handle(lexical_environment_handle, prev_lexical_environment->value.ref);
+                    /*
+                     * Returning from the frame that opened the segment hands
+                     * the result back to the previous one. A frame that
+                     * moved to a new segment in a tail call leaves an empty
+                     * segment behind, so this can take several steps.
+                     */
+                    while (sp + 1 == segment_entry)
+                    {
+                        struct evil_object_t *return_slot;
 
-                        *(sp + 1) = *return_value;
+                        return_slot = vm_stack_pop_segment(environment);
+                        *return_slot = *(sp + 1);
+                        sp = return_slot - 1;
+                        VM_LOAD_STACK_SEGMENT();
                     }
-                    else
+
+                    if (parent == NULL)
                     {
-                        sp = program_area + vm_extract_num_args(procedure) - RETURN_VALUE_OFFSET;
-                        *(sp + 1) = *return_value;
+                        if (scheduler->current == entry_fiber)
+                        {
+                            goto vm_execution_done;
+                        }
 
-                        goto vm_execution_done;
+                        /*
+                         * A fiber switched to here returned from its
+                         * bottom frame.
+                         */
+                        vm_fiber_finish(scheduler, *(sp + 1));
+                        goto vm_fiber_switch;
                     }
+
+                    pc_base = vm_extract_code_pointer(parent);
+                    pc = pc_base + return_offset;
+                    procedure = parent;
+                    evil_retarget_object_handle(lexical_environment_handle, &VECTOR_BASE(parent)[FIELD_LEXICAL_ENVIRONMENT]);
+                    VM_PUBLISH_ACTIVATION();
+                    VM_ENTER_NATIVE_CODE(jit_native_code(procedure));
 #undef RETURN_VALUE_OFFSET
                 }
                 VM_CONTINUE();
-            case OPCODE_ADD:
+            VM_OPCODE(OPCODE_ADD):
                 VM_TRACE_OP(OPCODE_ADD);
+            vm_generic_add:
+                QUICKEN_BINOP(OPCODE_ADD, OPCODE_ADD_FIX_FIX, OPCODE_ADD_FLO_FLO)
                 NUMERIC_BINOP(+)
                 VM_CONTINUE();
-            case OPCODE_SUB:
+            VM_OPCODE(OPCODE_SUB):
                 VM_TRACE_OP(OPCODE_SUB);
+            vm_generic_sub:
+                QUICKEN_BINOP(OPCODE_SUB, OPCODE_SUB_FIX_FIX, OPCODE_SUB_FLO_FLO)
                 NUMERIC_BINOP(-)
                 VM_CONTINUE();
-            case OPCODE_MUL:
+            VM_OPCODE(OPCODE_MUL):
                 VM_TRACE_OP(OPCODE_MUL);
+            vm_generic_mul:
+                QUICKEN_BINOP(OPCODE_MUL, OPCODE_MUL_FIX_FIX, OPCODE_MUL_FLO_FLO)
                 NUMERIC_BINOP(*)
                 VM_CONTINUE();
-            case OPCODE_DIV:
+            VM_OPCODE(OPCODE_DIV):
                 VM_TRACE_OP(OPCODE_DIV);
+            vm_generic_div:
+                QUICKEN_BINOP(OPCODE_DIV, OPCODE_DIV_FIX_FIX, OPCODE_DIV_FLO_FLO)
                 NUMERIC_BINOP(/)
                 VM_CONTINUE();
-            case OPCODE_AND:
+            VM_OPCODE(OPCODE_AND):
                 VM_TRACE_OP(OPCODE_AND);
                 FIXNUM_BINOP(&)
                 VM_CONTINUE();
-            case OPCODE_OR:
+            VM_OPCODE(OPCODE_OR):
                 VM_TRACE_OP(OPCODE_OR);
                 FIXNUM_BINOP(|)
                 VM_CONTINUE();
-            case OPCODE_XOR:
+            VM_OPCODE(OPCODE_XOR):
                 VM_TRACE_OP(OPCODE_XOR);
                 FIXNUM_BINOP(^)
                 VM_CONTINUE();
-            case OPCODE_NOT:
+            VM_OPCODE(OPCODE_NOT):
                 VM_TRACE_OP(OPCODE_NOT);
                 BREAK();
                 VM_CONTINUE();
-            case OPCODE_POP:
+            VM_OPCODE(OPCODE_POP):
                 VM_TRACE_OP(OPCODE_POP);
                 ++sp;
                 VM_CONTINUE();
-            case OPCODE_NOP:
+            VM_OPCODE(OPCODE_NOP):
                 VM_TRACE_OP(OPCODE_NOP);
                 VM_CONTINUE();
-            case OPCODE_BREAK:
+            VM_OPCODE(OPCODE_BREAK):
                 VM_TRACE_OP(OPCODE_BREAK);
                 BREAK();
                 VM_CONTINUE();
+            VM_OPCODE(OPCODE_CMPN_EQ_SLOTS_BRANCH):
+                VM_TRACE_OP(OPCODE_CMPN_EQ_SLOTS_BRANCH);
+                CMPN_SLOTS_BRANCH_IMPL(==)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_CMPN_LT_SLOTS_BRANCH):
+                VM_TRACE_OP(OPCODE_CMPN_LT_SLOTS_BRANCH);
+                CMPN_SLOTS_BRANCH_IMPL(<)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_CMPN_GT_SLOTS_BRANCH):
+                VM_TRACE_OP(OPCODE_CMPN_GT_SLOTS_BRANCH);
+                CMPN_SLOTS_BRANCH_IMPL(>)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_CMPN_LE_SLOTS_BRANCH):
+                VM_TRACE_OP(OPCODE_CMPN_LE_SLOTS_BRANCH);
+                CMPN_SLOTS_BRANCH_IMPL(<=)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_CMPN_GE_SLOTS_BRANCH):
+                VM_TRACE_OP(OPCODE_CMPN_GE_SLOTS_BRANCH);
+                CMPN_SLOTS_BRANCH_IMPL(>=)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_CALL_GLOBAL):
+                VM_TRACE_OP(OPCODE_CALL_GLOBAL);
+                sp = vm_push_global(environment, sp, lexical_environment_handle, pc);
+                pc += 8 + VM_INLINE_CACHE_SIZE;
+                goto vm_call;
+            VM_OPCODE(OPCODE_TAILCALL_GLOBAL):
+                VM_TRACE_OP(OPCODE_TAILCALL_GLOBAL);
+                sp = vm_push_global(environment, sp, lexical_environment_handle, pc);
+                pc += 8 + VM_INLINE_CACHE_SIZE;
+                goto vm_tailcall;
+            VM_OPCODE(OPCODE_ADD_IMM_SLOT):
+                VM_TRACE_OP(OPCODE_ADD_IMM_SLOT);
+                {
+                    union convert_two_t c2;
+                    struct evil_object_t a;
+                    struct evil_object_t b;
+
+                    a = make_fixnum_object((signed char)*pc++);
+                    memcpy(c2.bytes, pc, 2);
+                    pc += 2;
+                    b = *value_deref(program_area + c2.s2);
+
+                    if (TWO_TAGS(a.tag_count.tag, b.tag_count.tag) == FIXNUM_PAIR)
+                    {
+                        *(sp--) = make_fixnum_object(a.value.fixnum_value + b.value.fixnum_value);
+                    }
+                    else
+                    {
+                        NUMERIC_BINOP_VALUES(+, a, b)
+                    }
+                }
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_SUB_SLOT_IMM):
+                VM_TRACE_OP(OPCODE_SUB_SLOT_IMM);
+                {
+                    union convert_two_t c2;
+                    struct evil_object_t a;
+                    struct evil_object_t b;
+
+                    b = make_fixnum_object((signed char)*pc++);
+                    memcpy(c2.bytes, pc, 2);
+                    pc += 2;
+                    a = *value_deref(program_area + c2.s2);
+
+                    if (TWO_TAGS(a.tag_count.tag, b.tag_count.tag) == FIXNUM_PAIR)
+                    {
+                        *(sp--) = make_fixnum_object(a.value.fixnum_value - b.value.fixnum_value);
+                    }
+                    else
+                    {
+                        NUMERIC_BINOP_VALUES(-, a, b)
+                    }
+                }
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_RADD):
+                VM_TRACE_OP(OPCODE_RADD);
+                REGISTER_BINOP_IMPL(+)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_RSUB):
+                VM_TRACE_OP(OPCODE_RSUB);
+                REGISTER_BINOP_IMPL(-)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_RMUL):
+                VM_TRACE_OP(OPCODE_RMUL);
+                REGISTER_BINOP_IMPL(*)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_RDIV):
+                VM_TRACE_OP(OPCODE_RDIV);
+                REGISTER_BINOP_IMPL(/)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_RADD_IMM):
+                VM_TRACE_OP(OPCODE_RADD_IMM);
+                REGISTER_BINOP_IMM_IMPL(+)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_RSUB_IMM):
+                VM_TRACE_OP(OPCODE_RSUB_IMM);
+                REGISTER_BINOP_IMM_IMPL(-)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_RMUL_IMM):
+                VM_TRACE_OP(OPCODE_RMUL_IMM);
+                REGISTER_BINOP_IMM_IMPL(*)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_RDIV_IMM):
+                VM_TRACE_OP(OPCODE_RDIV_IMM);
+                REGISTER_BINOP_IMM_IMPL(/)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_ADD_FIX_FIX):
+                VM_TRACE_OP(OPCODE_ADD_FIX_FIX);
+                FIX_FIX_BINOP(+, vm_generic_add)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_SUB_FIX_FIX):
+                VM_TRACE_OP(OPCODE_SUB_FIX_FIX);
+                FIX_FIX_BINOP(-, vm_generic_sub)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_MUL_FIX_FIX):
+                VM_TRACE_OP(OPCODE_MUL_FIX_FIX);
+                FIX_FIX_BINOP(*, vm_generic_mul)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_DIV_FIX_FIX):
+                VM_TRACE_OP(OPCODE_DIV_FIX_FIX);
+                FIX_FIX_BINOP(/, vm_generic_div)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_ADD_FLO_FLO):
+                VM_TRACE_OP(OPCODE_ADD_FLO_FLO);
+                FLO_FLO_BINOP(+, vm_generic_add)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_SUB_FLO_FLO):
+                VM_TRACE_OP(OPCODE_SUB_FLO_FLO);
+                FLO_FLO_BINOP(-, vm_generic_sub)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_MUL_FLO_FLO):
+                VM_TRACE_OP(OPCODE_MUL_FLO_FLO);
+                FLO_FLO_BINOP(*, vm_generic_mul)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_DIV_FLO_FLO):
+                VM_TRACE_OP(OPCODE_DIV_FLO_FLO);
+                FLO_FLO_BINOP(/, vm_generic_div)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_CMPN_EQ_FIX):
+                VM_TRACE_OP(OPCODE_CMPN_EQ_FIX);
+                CMPN_FIX(==, vm_generic_cmpn_eq)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_CMPN_LT_FIX):
+                VM_TRACE_OP(OPCODE_CMPN_LT_FIX);
+                CMPN_FIX(<, vm_generic_cmpn_lt)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_CMPN_GT_FIX):
+                VM_TRACE_OP(OPCODE_CMPN_GT_FIX);
+                CMPN_FIX(>, vm_generic_cmpn_gt)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_CMPN_LE_FIX):
+                VM_TRACE_OP(OPCODE_CMPN_LE_FIX);
+                CMPN_FIX(<=, vm_generic_cmpn_le)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_CMPN_GE_FIX):
+                VM_TRACE_OP(OPCODE_CMPN_GE_FIX);
+                CMPN_FIX(>=, vm_generic_cmpn_ge)
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_BRANCH_IF_SELF):
+                VM_TRACE_OP(OPCODE_BRANCH_IF_SELF);
+                {
+                    struct evil_object_t *location;
+                    union convert_two_t c2;
+
+                    location = vm_cached_bound_location(environment, lexical_environment_handle, pc);
+                    pc += 8 + VM_INLINE_CACHE_SIZE;
+                    memcpy(c2.bytes, pc, 2);
+                    pc += 2;
+
+                    if (location->tag_count.tag == TAG_REFERENCE && location->value.ref == procedure)
+                    {
+                        pc += c2.s2;
+                    }
+                }
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_LOOP):
+                VM_TRACE_OP(OPCODE_LOOP);
+                {
+                    union convert_two_t c2;
+
+                    memcpy(c2.bytes, pc, 2);
+                    pc += 2;
+                    pc += c2.s2;
+                    sp = program_area - VM_SLOT_COUNT - 1 - vm_extract_num_locals(procedure);
+
+#if VM_TRACE_RECORDING
+                    if (trace_recorder == NULL)
+                    {
+                        trace_recorder = jit_count_loop(procedure, program_area);
+                    }
+                    else if (jit_finish_trace(trace_recorder, program_area))
+                    {
+                        trace_recorder = NULL;
+                    }
+
+                    dispatch_table = VM_RECORDING() ? vm_record_table : vm_dispatch_table;
+#endif
+                    VM_ENTER_NATIVE_CODE(jit_native_code(procedure));
+                }
+                VM_FIBER_SAFEPOINT();
+                VM_CONTINUE();
+            VM_OPCODE(OPCODE_VECTOR_REF):
+                VM_TRACE_OP(OPCODE_VECTOR_REF);
+                if (vm_bound_to_builtin(environment, lexical_environment_handle, pc, evil_vector_ref))
+                {
+                    struct evil_object_t *vector;
+                    struct evil_object_t *index;
+
+                    vector = value_deref(sp + 1);
+                    index = value_deref(sp + 2);
+
+                    if (vector->tag_count.tag == TAG_VECTOR
+                            && index->tag_count.tag == TAG_FIXNUM
+                            && index->value.fixnum_value >= 0
+                            && index->value.fixnum_value < vector->tag_count.count)
+                    {
+                        ++sp;
+                        *(sp + 1) = make_inner_reference(VECTOR_BASE(vector), index->value.fixnum_value);
+                        pc += 10 + VM_INLINE_CACHE_SIZE;
+                        VM_CONTINUE();
+                    }
+                }
+                goto vm_call_primitive;
+            VM_OPCODE(OPCODE_VECTOR_SET):
+                VM_TRACE_OP(OPCODE_VECTOR_SET);
+                if (vm_bound_to_builtin(environment, lexical_environment_handle, pc, evil_vector_set))
+                {
+                    struct evil_object_t *vector;
+                    struct evil_object_t *index;
+                    struct evil_object_t value;
+
+                    vector = value_deref(sp + 1);
+                    index = value_deref(sp + 2);
+                    value = *(sp + 3);
+
+                    if (vector->tag_count.tag == TAG_VECTOR
+                            && index->tag_count.tag == TAG_FIXNUM
+                            && index->value.fixnum_value >= 0
+                            && index->value.fixnum_value < vector->tag_count.count)
+                    {
+                        VECTOR_BASE(vector)[index->value.fixnum_value] = value;
+                        gc_write_barrier(environment->heap, &VECTOR_BASE(vector)[index->value.fixnum_value]);
+                        sp += 2;
+                        *(sp + 1) = value;
+                        pc += 10 + VM_INLINE_CACHE_SIZE;
+                        VM_CONTINUE();
+                    }
+                }
+                goto vm_call_primitive;
+            VM_OPCODE(OPCODE_VECTOR_LENGTH):
+                VM_TRACE_OP(OPCODE_VECTOR_LENGTH);
+                if (vm_bound_to_builtin(environment, lexical_environment_handle, pc, evil_vector_length))
+                {
+                    struct evil_object_t *vector;
+
+                    vector = value_deref(sp + 1);
+
+                    if (vector->tag_count.tag == TAG_VECTOR)
+                    {
+                        *(sp + 1) = make_fixnum_object(vector->tag_count.count);
+                        pc += 10 + VM_INLINE_CACHE_SIZE;
+                        VM_CONTINUE();
+                    }
+                }
+                goto vm_call_primitive;
+            VM_OPCODE(OPCODE_CONS):
+                VM_TRACE_OP(OPCODE_CONS);
+                if (vm_bound_to_builtin(environment, lexical_environment_handle, pc, evil_cons))
+                {
+                    struct evil_object_t *pair;
+
+                    /*
+                     * The operands stay on the stack, where the garbage
+                     * collector can see them, until the pair is allocated.
+                     */
+                    environment->stack_ptr = sp;
+                    pair = gc_alloc(environment->heap, TAG_PAIR, 0);
+
+                    *RAW_CAR(pair) = *(sp + 1);
+                    *RAW_CDR(pair) = *(sp + 2);
+                    ++sp;
+                    *(sp + 1) = make_ref(pair);
+                    pc += 10 + VM_INLINE_CACHE_SIZE;
+                    VM_CONTINUE();
+                }
+            vm_call_primitive:
+                sp = vm_push_global(environment, sp, lexical_environment_handle, pc);
+                pc += 8 + VM_INLINE_CACHE_SIZE;
+                goto vm_call;
+            vm_fiber_switch:
+                {
+                    struct vm_fiber_t *current;
+                    struct vm_fiber_t *next;
+
+                    if (vm_scheduler_end_slice(scheduler) && metered && scheduler->current->depth == 1)
+                        goto vm_suspend;
+
+                    current = scheduler->current;
+                    next = vm_fiber_schedule(environment, sp, program_area, procedure, pc - pc_base);
+
+                    if (next != current)
+                    {
+#if VM_TRACE_RECORDING
+                        if (trace_recorder != NULL)
+                        {
+                            jit_cancel_trace(trace_recorder);
+                            trace_recorder = NULL;
+                            dispatch_table = vm_dispatch_table;
+                        }
+#endif
+                        sp = next->sp;
+                        program_area = next->program_area;
+                        procedure = next->procedure.value.ref;
+                        pc_base = vm_extract_code_pointer(procedure);
+                        pc = pc_base + next->pc_offset;
+                        evil_retarget_object_handle(lexical_environment_handle, &VECTOR_BASE(procedure)[FIELD_LEXICAL_ENVIRONMENT]);
+                        VM_LOAD_STACK_SEGMENT();
+                        VM_PUBLISH_ACTIVATION();
+                    }
+                }
+                VM_CONTINUE();
             default:
+#if ENABLE_VM_THREADED_DISPATCH
+            vm_op_unknown:
+#endif
                 VM_TRACE_OP_IMPL(OPCODE_UNKNOWN);
                 VM_TRACE_STACK();
                 BREAK();
@@ -1288,13 +3320,176 @@ vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *init
         }
     }
 
+#if VM_TRACE_RECORDING
+vm_op_record:
+    --pc;
+
+    if (!jit_record_instruction(trace_recorder, procedure, pc, sp, program_area))
+    {
+        trace_recorder = NULL;
+        dispatch_table = vm_dispatch_table;
+    }
+
+    goto *vm_dispatch_table[*pc++];
+#endif
+
+vm_suspend:
+#if VM_TRACE_RECORDING
+    if (trace_recorder != NULL)
+        jit_cancel_trace(trace_recorder);
+#endif
+    suspension = calloc(1, sizeof(struct vm_suspension_t));
+    assert(suspension != NULL);
+
+    suspension->procedure = make_ref(procedure);
+    suspension->program_area = program_area;
+    suspension->pc_offset = pc - pc_base;
+    suspension->old_stack = old_stack;
+    suspension->entry_fiber = entry_fiber;
+
+    /*
+     * The invocation's frames stay where they are, above the stack pointer
+     * the garbage collector marks from.
+     */
+    environment->suspension = suspension;
+    environment->stack_ptr = sp;
+    --scheduler->current->depth;
+    scheduler->fuel = VM_UNLIMITED_FUEL;
+
+#if ENABLE_VM_PROFILING
+    vm_profile_leave(profile);
+#endif
+    environment->activation = activation.previous;
+    evil_destroy_object_handle(environment, lexical_environment_handle);
+
+    return EVIL_RUN_SUSPENDED;
+
 vm_execution_done:
+#if ENABLE_VM_PROFILING
+    vm_profile_leave(profile);
+#endif
+    --entry_fiber->depth;
+
+    if (metered)
+        scheduler->fuel = VM_UNLIMITED_FUEL;
+
+    environment->activation = activation.previous;
     environment->stack_ptr = old_stack;
+    evil_destroy_object_handle(environment, lexical_environment_handle);
 
     /*
      * This should probably cons the last return value on the stack and
      * return that instead.
      */
-    return *(sp + 1);
+    *result = *(sp + 1);
+
+    return EVIL_RUN_DONE;
+}
+
+#if ENABLE_VM_THREADED_DISPATCH
+#   pragma GCC diagnostic pop
+#endif
+
+struct evil_object_t
+vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, struct evil_object_t *fn, int num_args, struct evil_object_t *args)
+{
+    struct evil_object_t result;
+
+    vm_execute(environment, lexical_environment, fn, num_args, args, VM_UNLIMITED_FUEL, &result);
+
+    return result;
+}
+
+enum evil_run_status_t
+vm_run_with_fuel(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, struct evil_object_t *fn, int num_args, struct evil_object_t *args, int64_t fuel, struct evil_object_t *result)
+{
+    return vm_execute(environment, lexical_environment, fn, num_args, args, fuel, result);
+}
+
+enum evil_run_status_t
+vm_resume(struct evil_environment_t *environment, int64_t fuel, struct evil_object_t *result)
+{
+    return vm_execute(environment, NULL, NULL, 0, NULL, fuel, result);
+}
+
+void
+vm_discard_suspension(struct evil_environment_t *environment)
+{
+    struct vm_scheduler_t *scheduler;
+    struct vm_fiber_t *current;
+    struct vm_fiber_t *main_fiber;
+
+    if (environment->suspension == NULL)
+        return;
+
+    free(environment->suspension);
+    environment->suspension = NULL;
+
+    /*
+     * A fiber other than the main one may have been running, in which case
+     * its stack is switched out for the main fiber's like vm_fiber_schedule
+     * would.
+     */
+    scheduler = environment->scheduler;
+    current = scheduler->current;
+    main_fiber = scheduler->fibers[0];
+
+    if (current != main_fiber)
+    {
+        current->stack_segment = environment->stack_segment;
+        current->sp = environment->stack_ptr;
+        scheduler->current = main_fiber;
+        environment->stack_segment = main_fiber->stack_segment;
+        environment->stack_bottom = main_fiber->stack_segment->bottom;
+        environment->stack_top = main_fiber->stack_segment->top;
+        environment->stack_ptr = main_fiber->sp;
+    }
 }
 
+
+struct evil_object_t
+vm_request_call(struct evil_environment_t *environment, struct evil_object_t *fn, int num_args, struct evil_object_t *args)
+{
+    assert(environment->call_procedure == NULL);
+    assert(fn->tag_count.tag == TAG_PROCEDURE || fn->tag_count.tag == TAG_SPECIAL_FUNCTION);
+
+    environment->call_procedure = fn;
+    environment->call_args = args;
+    environment->call_num_args = num_args;
+
+    return make_unspecified();
+}
+
+struct evil_object_t
+vm_finish_call_request(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, struct evil_object_t result)
+{
+    while (environment->call_procedure != NULL)
+    {
+        struct evil_object_t *fn;
+        struct evil_object_t *args;
+        int num_args;
+
+        fn = environment->call_procedure;
+        args = environment->call_args;
+        num_args = environment->call_num_args;
+        environment->call_procedure = NULL;
+
+        if (fn->tag_count.tag == TAG_SPECIAL_FUNCTION)
+        {
+            struct evil_object_t *procedure_base;
+            struct evil_environment_t *fn_environment;
+            evil_special_function_t function_pointer;
+
+            procedure_base = VECTOR_BASE(fn);
+            fn_environment = (struct evil_environment_t *)deref(&procedure_base[FIELD_ENVIRONMENT]);
+            function_pointer = procedure_base[FIELD_CODE].value.special_function_value;
+            result = function_pointer(fn_environment, lexical_environment, num_args, args);
+        }
+        else
+        {
+            result = vm_run(environment, lexical_environment, fn, num_args, args);
+        }
+    }
+
+    return result;
+}
@@ -7,6 +7,11 @@
 #ifndef EVIL_VM_H
 #define EVIL_VM_H
 
+#include <stddef.h>
+#include <string.h>
+
+#include "object.h"
+
 /*
  * VM design:
  * Stack based in lieu of data registers. VM contains a condition register
@@ -182,9 +187,11 @@ enum opcode_t
     OPCODE_RETURN,
 
     /*
-     * OPCODE_GET_BOUND_LOCATION [0 .. 7] | -> [slot reference | false]
+     * OPCODE_GET_BOUND_LOCATION [0 .. 7] [inline cache] | -> [slot reference | false]
      * Look up the symbol in the symbol table and push a slot reference to the
-     * top of the stack if it exists or #f if it does not.
+     * top of the stack if it exists or #f if it does not. The symbol hash is
+     * followed by a vm_inline_cache_t that remembers the result of the last
+     * successful lookup.
      */
     OPCODE_GET_BOUND_LOCATION,
 
@@ -222,6 +229,156 @@ enum opcode_t
      */
     OPCODE_BREAK,
 
+    /*
+     * Superinstructions. These are never emitted directly by the compiler's
+     * code generators but are substituted for common instruction sequences
+     * by a peephole pass that runs just before assembly.
+     */
+
+    /*
+     * OPCODE_CMPN_<condition>_SLOTS_BRANCH [slot b bytes 0..1] [slot a bytes 0..1] [offset bytes 0..1]
+     * Fuses LDSLOT b, LDSLOT a, CMPN_<condition>, COND_BRANCH. Compares the
+     * values in the two slots numerically and, if (a <condition> b) holds,
+     * branches as COND_BRANCH does. The stack is not touched.
+     */
+    OPCODE_CMPN_EQ_SLOTS_BRANCH,
+    OPCODE_CMPN_LT_SLOTS_BRANCH,
+    OPCODE_CMPN_GT_SLOTS_BRANCH,
+    OPCODE_CMPN_LE_SLOTS_BRANCH,
+    OPCODE_CMPN_GE_SLOTS_BRANCH,
+
+    /*
+     * OPCODE_CALL_GLOBAL [symbol bytes 0..7] [inline cache] [num args bytes 0..1]
+     * OPCODE_TAILCALL_GLOBAL [symbol bytes 0..7] [inline cache] [num args bytes 0..1]
+     * Fuses GET_BOUND_LOCATION, LOAD, CALL/TAILCALL. Looks up the function
+     * bound to the symbol and calls it with the arguments on the stack. The
+     * lookup is cached the same way as GET_BOUND_LOCATION's.
+     */
+    OPCODE_CALL_GLOBAL,
+    OPCODE_TAILCALL_GLOBAL,
+
+    /*
+     * OPCODE_ADD_IMM_SLOT [immediate byte 0] [slot bytes 0..1] | -> [value]
+     * Fuses LDIMM_1_FIXNUM, LDSLOT, ADD (or LDSLOT, LDIMM_1_FIXNUM, ADD).
+     * Pushes the sum of the sign extended immediate and the slot's value.
+     *
+     * OPCODE_SUB_SLOT_IMM [immediate byte 0] [slot bytes 0..1] | -> [value]
+     * Fuses LDSLOT, LDIMM_1_FIXNUM, SUB. Pushes the slot's value minus the
+     * sign extended immediate.
+     */
+    OPCODE_ADD_IMM_SLOT,
+    OPCODE_SUB_SLOT_IMM,
+
+    /*
+     * Register instructions. These address the slots of the current program
+     * area directly instead of going through the evaluation stack, so an
+     * arithmetic expression over locals needs one instruction per operation
+     * rather than one per operand plus one per operation. They are emitted
+     * by the register code generator in lambda.c when it is enabled.
+     */
+
+    /*
+     * OPCODE_R<binop> [dst slot bytes 0..1] [slot a bytes 0..1] [slot b bytes 0..1]
+     * Stores the result of [a OP b] in the destination slot. The arithmetic
+     * follows the same rules as the stack based OPCODE_<binop>. The
+     * destination may be one of the source slots.
+     */
+    OPCODE_RADD,
+    OPCODE_RSUB,
+    OPCODE_RMUL,
+    OPCODE_RDIV,
+
+    /*
+     * OPCODE_R<binop>_IMM [dst slot bytes 0..1] [slot a bytes 0..1] [immediate byte 0]
+     * Same as OPCODE_R<binop> but the right hand side is the sign extended
+     * fixnum immediate.
+     */
+    OPCODE_RADD_IMM,
+    OPCODE_RSUB_IMM,
+    OPCODE_RMUL_IMM,
+    OPCODE_RDIV_IMM,
+
+    /*
+     * Type specialized instructions. These are never emitted by the compiler.
+     * Instead the generic OPCODE_<binop> and OPCODE_CMPN_<condition>
+     * instructions rewrite their opcode byte to one of these when they see
+     * that both of their operands are fixnums or both are flonums
+     * ("quickening"). Each checks its operand types with a single guard and
+     * falls back to the generic instruction, which may rewrite the opcode
+     * again, if the guard fails.
+     */
+
+    /*
+     * OPCODE_<binop>_FIX_FIX | [a] [b] -> [a OP b]
+     * OPCODE_<binop>_FLO_FLO | [a] [b] -> [a OP b]
+     */
+    OPCODE_ADD_FIX_FIX,
+    OPCODE_SUB_FIX_FIX,
+    OPCODE_MUL_FIX_FIX,
+    OPCODE_DIV_FIX_FIX,
+    OPCODE_ADD_FLO_FLO,
+    OPCODE_SUB_FLO_FLO,
+    OPCODE_MUL_FLO_FLO,
+    OPCODE_DIV_FLO_FLO,
+
+    /*
+     * OPCODE_CMPN_<condition>_FIX | [value b] [value a] -> boolean
+     */
+    OPCODE_CMPN_EQ_FIX,
+    OPCODE_CMPN_LT_FIX,
+    OPCODE_CMPN_GT_FIX,
+    OPCODE_CMPN_LE_FIX,
+    OPCODE_CMPN_GE_FIX,
+
+    /*
+     * Self tail calls. When a procedure that is being defined as a global
+     * tail calls that same global, the compiler turns the call into a jump
+     * back to the start of the procedure, guarded by a check that the global
+     * still refers to the running procedure:
+     *
+     *       [evaluate arguments]
+     *       BRANCH_IF_SELF <symbol> loop
+     *       TAILCALL_GLOBAL <symbol> <num args>
+     *    loop:
+     *       STSLOT 0, STSLOT 1, ... STSLOT <num args - 1>
+     *       LOOP <start>
+     */
+
+    /*
+     * OPCODE_BRANCH_IF_SELF [symbol bytes 0..7] [inline cache] [offset bytes 0..1]
+     * Looks up the symbol and branches as BRANCH does if it is bound to the
+     * currently executing function. The lookup is cached the same way as
+     * GET_BOUND_LOCATION's. The stack is not touched.
+     */
+    OPCODE_BRANCH_IF_SELF,
+
+    /*
+     * OPCODE_LOOP [offset bytes 0..1]
+     * Discards everything on the stack above the current function's local
+     * slots and branches as BRANCH does. Forms evaluated for their side
+     * effects leave their values on the stack, which a TAILCALL would have
+     * discarded along with the frame.
+     */
+    OPCODE_LOOP,
+
+    /*
+     * Primitive operations. The compiler emits these for calls to the
+     * builtins of the same name, laid out like CALL_GLOBAL. If the symbol is
+     * still bound to the builtin and the operands have the expected types the
+     * operation is performed inline, otherwise the instruction behaves
+     * exactly like CALL_GLOBAL and calls whatever the symbol is bound to,
+     * which is also where out of bounds indices end up.
+     *
+     * OPCODE_VECTOR_REF [symbol bytes 0..7] [inline cache] [num args bytes 0..1] | [vector] [index] -> [slot reference]
+     * OPCODE_VECTOR_SET [symbol bytes 0..7] [inline cache] [num args bytes 0..1] | [vector] [index] [value] -> [value]
+     * OPCODE_VECTOR_LENGTH [symbol bytes 0..7] [inline cache] [num args bytes 0..1] | [vector] -> [fixnum]
+     * OPCODE_CONS [symbol bytes 0..7] [inline cache] [num args bytes 0..1] | [car] [cdr] -> [reference]
+     */
+    OPCODE_VECTOR_REF,
+    OPCODE_VECTOR_SET,
+    OPCODE_VECTOR_LENGTH,
+    OPCODE_CONS,
+
     /*
      * This last opcode is for VM tracing to help identify bad data in the
      * bytecode stream.
@@ -233,23 +390,451 @@ enum procedure_field_index_t
 {
     FIELD_ENVIRONMENT,
     FIELD_LEXICAL_ENVIRONMENT,
-    FIELD_NUM_ARGS,
-    FIELD_NUM_LOCALS,
-    FIELD_NUM_FN_LOCALS,
+
+    /*
+     * The procedure's counts packed into a vm_procedure_header_t, see below.
+     */
+    FIELD_HEADER,
     FIELD_CODE,
+
+    /*
+     * Native code produced by the JIT for this procedure, see jit.h.
+     */
+    FIELD_NATIVE_CODE,
+
+    /*
+     * The symbol the procedure was defined under, or the empty pair for
+     * anonymous procedures. Only used for diagnostics.
+     */
+    FIELD_NAME,
     FIELD_LOCALS
 };
 
+/*
+ * A call saves the caller's program area and the return address below the
+ * arguments. The caller's lexical environment is not saved as it is always
+ * the one in the FIELD_LEXICAL_ENVIRONMENT of the procedure the return
+ * address points into.
+ */
 enum vm_context_save_slots_t
 {
     VM_SLOT_PROGRAM_AREA_CHAIN = 1,
-    VM_SLOT_LEXICAL_ENVIRONMENT_CHAIN = 2,
-    VM_SLOT_PC_CHAIN = 3,
-    VM_SLOT_COUNT = 3
+    VM_SLOT_PC_CHAIN = 2,
+    VM_SLOT_COUNT = 2
 };
 
 #define VARIADIC 0xffff
 
+/*
+ * The counts that calls and returns need, packed into the value of a
+ * procedure's FIELD_HEADER so they are all read with a single load instead
+ * of decoding a boxed fixnum for each. The object is tagged as a fixnum so
+ * the garbage collector and the equality predicates treat it as plain data.
+ */
+struct vm_procedure_header_t
+{
+    unsigned short num_args;
+    unsigned short num_locals;
+
+    /*
+     * The most evaluation stack slots the procedure uses above its locals,
+     * filled in by the verifier. Calls check that this much fits in the
+     * current stack segment, see vm_stack_segment_t.
+     */
+    unsigned short stack_depth;
+    unsigned short flags;
+};
+
+/*
+ * Header flags set by the bytecode verifier, see verify.h.
+ */
+enum vm_procedure_flags_t
+{
+    /*
+     * The procedure's stack use, branches, slot indices and instruction
+     * operands are well formed.
+     */
+    VM_PROCEDURE_VERIFIED = 1,
+
+    /*
+     * Every reference operand of LOAD, STORE, MAKE_REF and SET and every
+     * condition of COND_BRANCH is known to have the right type.
+     */
+    VM_PROCEDURE_TYPES_VERIFIED = 2
+};
+
+static inline struct evil_object_t
+vm_make_procedure_header(int num_args, int num_locals)
+{
+    struct vm_procedure_header_t header;
+    struct evil_object_t object;
+
+    header.num_args = (unsigned short)num_args;
+    header.num_locals = (unsigned short)num_locals;
+    header.stack_depth = 0;
+    header.flags = 0;
+
+    object.tag_count.tag = TAG_FIXNUM;
+    object.tag_count.flag = 0;
+    object.tag_count.count = 1;
+    object.value.fixnum_value = 0;
+    memcpy(&object.value, &header, sizeof header);
+
+    return object;
+}
+
+static inline struct vm_procedure_header_t
+vm_procedure_header(struct evil_object_t *procedure)
+{
+    struct vm_procedure_header_t header;
+
+    memcpy(&header, &VECTOR_BASE(procedure)[FIELD_HEADER].value, sizeof header);
+
+    return header;
+}
+
+static inline void
+vm_set_procedure_header(struct evil_object_t *procedure, struct vm_procedure_header_t header)
+{
+    memcpy(&VECTOR_BASE(procedure)[FIELD_HEADER].value, &header, sizeof header);
+}
+
+/*
+ * Per call site cache for global lookups, stored unaligned in the bytecode
+ * directly after the symbol hash. A cache entry is valid only if it was
+ * filled in during the environment's current binding epoch and for the same
+ * lexical environment. The compiler emits it zeroed, which never matches as
+ * epochs start at 1.
+ */
+struct vm_inline_cache_t
+{
+    uint64_t binding_epoch;
+    struct evil_object_t *lexical_environment;
+    struct evil_object_t *location;
+};
+
+#define VM_INLINE_CACHE_SIZE (sizeof(struct vm_inline_cache_t))
+
+/*
+ * Every vm_run invocation publishes the procedure it is executing and its
+ * program area in the environment whenever they change, so that the
+ * sampling profiler's signal handler can walk the frame chain at any point.
+ * Frames are fully built before they are published. The activations of
+ * nested invocations, such as from builtins or loop traces calling back
+ * into the VM, are linked to the ones they were called from.
+ */
+struct vm_activation_t
+{
+    struct evil_object_t *volatile procedure;
+    struct evil_object_t *volatile program_area;
+    struct vm_activation_t *previous;
+};
+
+/*
+ * The evaluation stack is a chain of segments. The first one is the buffer
+ * given to evil_environment_create; when a call finds that its frame won't
+ * fit in what is left of the current segment, the arguments are copied to
+ * the top of a new segment and the frame is built there. Returning from
+ * that frame copies the result back to the return slot in the previous
+ * segment and drops back to it. Segments are kept around once allocated,
+ * so a call sequence that keeps crossing the same boundary doesn't pay for
+ * an allocation each time.
+ *
+ * Like the first segment, a segment's top slot is never used; the frame
+ * that opened it returns through top - 1.
+ */
+struct vm_stack_segment_t
+{
+    struct vm_stack_segment_t *previous;
+    struct vm_stack_segment_t *next;
+    struct evil_object_t *bottom;
+    struct evil_object_t *top;
+
+    /*
+     * Where the result of the frame that opened this segment goes. The live
+     * part of the previous segment starts right above it.
+     */
+    struct evil_object_t *return_slot;
+};
+
+/*
+ * The number of slots in a segment the VM allocates, unless a frame needs
+ * more than that.
+ */
+#ifndef VM_STACK_SEGMENT_SLOTS
+#   define VM_STACK_SEGMENT_SLOTS 16384
+#endif
+
+/*
+ * Slots a frame needs on top of its locals and evaluation stack for the
+ * procedure pushed by CALL_GLOBAL and the copies TAILCALL makes while
+ * moving the frame.
+ */
+#define VM_STACK_SCRATCH_SLOTS 2
+
+/*
+ * Makes the first segment of the environment's stack from the given
+ * buffer.
+ */
+void
+vm_stack_create(struct evil_environment_t *environment, void *stack, size_t stack_size);
+
+/*
+ * Frees the segments the VM allocated. The first segment's buffer belongs
+ * to the caller of evil_environment_create.
+ */
+void
+vm_stack_destroy(struct evil_environment_t *environment);
+
+/*
+ * Switches to a segment with at least num_slots free slots, whose frame
+ * returns to return_slot, and returns its stack pointer.
+ */
+struct evil_object_t *
+vm_stack_push_segment(struct evil_environment_t *environment, size_t num_slots, struct evil_object_t *return_slot);
+
+/*
+ * Drops back to the previous segment and returns the current segment's
+ * return slot.
+ */
+struct evil_object_t *
+vm_stack_pop_segment(struct evil_environment_t *environment);
+
+/*
+ * Fibers. (spawn thunk) creates a fiber that runs the procedure, which takes
+ * no arguments, on an evaluation stack of its own and returns the fiber's id.
+ * (yield) lets the other runnable fibers run and (join id) waits for a fiber
+ * to finish and returns its result. The code that was running before any
+ * fibers were spawned is the environment's main fiber, with id 0, and runs
+ * on the environment's stack.
+ *
+ * Fibers are cooperative and all run inside one environment, so only one
+ * runs at a time. vm_run switches between them by saving the running
+ * fiber's stack pointer, program area, procedure and pc, installing the
+ * stack of the next fiber in the run queue and carrying on with its
+ * registers; the lexical environment is the one of the procedure, like for
+ * returns. A fiber that doesn't yield is preempted once it has made
+ * VM_FIBER_TIME_SLICE calls and loop iterations while others are waiting.
+ *
+ * A fiber can only be switched out while none of its frames are below a
+ * builtin or native code that called back into the VM, as those hold C
+ * stack frames of their own. A yield in such a nested call is ignored and
+ * preemption is put off, and a join that would block there is an error.
+ */
+#ifndef VM_FIBER_TIME_SLICE
+#   define VM_FIBER_TIME_SLICE 1024
+#endif
+
+/*
+ * The number of slots in a fiber's first stack segment. Deeper recursion
+ * grows the stack in segments as usual.
+ */
+#ifndef VM_FIBER_STACK_SLOTS
+#   define VM_FIBER_STACK_SLOTS 256
+#endif
+
+enum vm_fiber_state_t
+{
+    VM_FIBER_RUNNABLE,
+    VM_FIBER_BLOCKED,
+    VM_FIBER_DONE
+};
+
+struct vm_fiber_t
+{
+    /*
+     * The next fiber in the run queue or, while blocked, in the list of
+     * fibers waiting on the same fiber.
+     */
+    struct vm_fiber_t *next;
+    struct vm_fiber_t *waiters;
+    enum vm_fiber_state_t state;
+    size_t id;
+
+    /*
+     * The number of vm_run invocations running this fiber's frames.
+     */
+    int depth;
+
+    /*
+     * Set once the fiber's result has been handed to a join, after which
+     * the fiber is freed.
+     */
+    int joined;
+
+    /*
+     * The registers of a suspended fiber. The procedure is kept as a
+     * reference so the garbage collector sees it.
+     */
+    struct vm_stack_segment_t *stack_segment;
+    struct evil_object_t *sp;
+    struct evil_object_t *program_area;
+    struct evil_object_t procedure;
+    ptrdiff_t pc_offset;
+
+    struct evil_object_t result;
+};
+
+struct vm_scheduler_t
+{
+    struct vm_fiber_t *current;
+    struct vm_fiber_t *run_queue_head;
+    struct vm_fiber_t *run_queue_tail;
+
+    /*
+     * Every fiber that hasn't been joined yet, indexed by id.
+     */
+    struct vm_fiber_t **fibers;
+    size_t num_fibers;
+    size_t capacity;
+
+    /*
+     * Counts down at every call and loop iteration; vm_run looks for
+     * another fiber to run when it reaches zero. Yielding and blocking set
+     * it to zero. The slice is what the budget was last set to, so the
+     * difference is what has been used of it since.
+     */
+    int budget;
+    int slice;
+
+    /*
+     * The calls and loop iterations left to a metered vm_run invocation,
+     * see vm_run_with_fuel, or VM_UNLIMITED_FUEL.
+     */
+    int64_t fuel;
+};
+
+struct vm_scheduler_t *
+vm_scheduler_create(struct evil_environment_t *environment);
+
+/*
+ * Frees the fibers and their stacks. Must be called while the main fiber
+ * is running.
+ */
+void
+vm_scheduler_destroy(struct vm_scheduler_t *scheduler);
+
+/*
+ * Fuel. vm_run_with_fuel runs a procedure like vm_run but gives up once it
+ * has used up its fuel, which is counted in the same calls and loop
+ * iterations that make up fibers' time slices, and returns EVIL_RUN_SUSPENDED.
+ * Its frames stay on the environment's stack and the rest of its registers
+ * are kept in a vm_suspension_t until vm_resume carries on with more fuel.
+ * Nothing else may run in the environment in the meantime, though the
+ * garbage collector may.
+ *
+ * Like switching fibers, suspending can only happen while none of the
+ * running fiber's frames are below a builtin or native code that called
+ * back into the VM. Fuel that runs out in such a nested call is overdrawn
+ * and the invocation is suspended as soon as control is back in its own
+ * frames. A metered invocation that is itself nested in another runs to
+ * completion.
+ */
+#define VM_UNLIMITED_FUEL (-1)
+
+struct vm_suspension_t
+{
+    /*
+     * The procedure is kept as a reference so the garbage collector sees
+     * it.
+     */
+    struct evil_object_t procedure;
+    struct evil_object_t *program_area;
+    ptrdiff_t pc_offset;
+
+    /*
+     * The stack pointer the invocation restores when it is done and the
+     * fiber it must finish on, which isn't necessarily the one it was
+     * suspended in.
+     */
+    struct evil_object_t *old_stack;
+    struct vm_fiber_t *entry_fiber;
+};
+
+/*
+ * Calls the procedure with at most the given amount of fuel, which must be
+ * positive, and stores its result if it finishes.
+ */
+enum evil_run_status_t
+vm_run_with_fuel(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, struct evil_object_t *fn, int num_args, struct evil_object_t *args, int64_t fuel, struct evil_object_t *result);
+
+/*
+ * Carries on with the environment's suspended invocation.
+ */
+enum evil_run_status_t
+vm_resume(struct evil_environment_t *environment, int64_t fuel, struct evil_object_t *result);
+
+/*
+ * Drops the environment's suspended invocation, if it has one, leaving the
+ * environment running its main fiber on its own stack again.
+ */
+void
+vm_discard_suspension(struct evil_environment_t *environment);
+
+/*
+ * Calls made on behalf of builtins. A builtin that calls a procedure, like
+ * apply and eval, returns the result of vm_request_call rather than
+ * starting a vm_run of its own, and the VM makes the call from the
+ * instruction that called the builtin as if it had been there all along.
+ * The call takes no C stack, its frames can switch fibers and be suspended,
+ * and a builtin called in tail position hands on a proper tail call. The
+ * procedure may be a builtin that requests a call in turn.
+ *
+ * The callee's frame is built over the builtin's arguments, so the
+ * arguments passed on must be a run of them and there can't be more of them
+ * than the builtin was given. Nothing may run in the environment between
+ * the request and the builtin returning.
+ */
+struct evil_object_t
+vm_request_call(struct evil_environment_t *environment, struct evil_object_t *fn, int num_args, struct evil_object_t *args);
+
+/*
+ * Makes the call the builtin that returned the result requested, if any,
+ * in a nested vm_run and returns its result instead. For code outside the
+ * interpreter loop that calls builtins, such as loop traces.
+ */
+struct evil_object_t
+vm_finish_call_request(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, struct evil_object_t result);
+
+/*
+ * Opcode profiling. When enabled the interpreter counts every instruction it
+ * dispatches, and every (previous, current) pair of instructions, and
+ * charges the time stamp counter cycles between two dispatches to the
+ * earlier instruction. Time spent in builtins, nested VM invocations and
+ * native code is charged to the instruction that entered them; instructions
+ * run as native code are not counted, so build with ENABLE_JIT=0 to count
+ * everything. The counters are per environment and can be printed and reset
+ * with (vm-profile) and (vm-profile 'reset) or the functions below.
+ */
+#ifndef ENABLE_VM_PROFILING
+#   define ENABLE_VM_PROFILING 0
+#endif
+
+struct vm_profile_t
+{
+    uint64_t counts[256];
+    uint64_t cycles[256];
+    uint64_t pair_counts[256][256];
+    uint64_t previous_timestamp;
+    unsigned char previous_opcode;
+    int depth;
+};
+
+/*
+ * Returns NULL if profiling is not enabled.
+ */
+struct vm_profile_t *
+vm_profile_create(void);
+
+void
+vm_profile_destroy(struct vm_profile_t *profile);
+
+void
+vm_profile_dump(struct evil_environment_t *environment);
+
+void
+vm_profile_reset(struct evil_environment_t *environment);
+
 struct evil_object_t
 vm_run(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, struct evil_object_t *fn, int num_args, struct evil_object_t *args);
 
@@ -259,6 +844,13 @@ vm_trace_stack(struct evil_environment_t *environment, struct evil_object_t *sp,
 int
 vm_slot_index(int slot_index);
 
+/*
+ * Returns the size of the instruction at pc including its opcode, or 0 if
+ * the opcode is not known.
+ */
+int
+vm_instruction_size(const unsigned char *pc);
+
 union convert_two_t
 {
     unsigned char bytes[2];
@@ -27,6 +27,7 @@
     #define snprintf _snprintf
 #else
     #include <dirent.h>
+    #include <pthread.h>
     #include <time.h>
 #endif
 
@@ -36,7 +37,9 @@
 #include "gc.h"
 #include "object.h"
 #include "runtime.h"
+#include "sampler.h"
 #include "test.h"
+#include "vm.h"
 
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -47,10 +50,59 @@
 #endif
 
 #define NUM_BENCHMARK_ITERATIONS 30
-
-char *print_buffer;
-size_t print_buffer_offset;
-size_t print_buffer_size;
+#define NUM_TEST_THREADS 8
+#define NUM_THREADED_TEST_ITERATIONS 4
+
+/*
+ * Tests marked #!fuel are evaluated this many calls and loop iterations at
+ * a time, with a garbage collection while each slice is suspended.
+ */
+#define TEST_FUEL 7
+
+/*
+ * Tests marked #!incremental are run with a garbage collection pause budget
+ * this small, in microseconds, so that incremental collections take many
+ * slices with the test running in between.
+ */
+#define TEST_PAUSE_BUDGET 10
+
+/*
+ * Tests marked #!parallel are run with this many mark threads, and with
+ * collections that happen all at once, as those are the ones marked in
+ * parallel.
+ */
+#define TEST_MARK_THREADS 3
+
+/*
+ * Tests run in a heap this large, except that tests marked #!large are run
+ * in an environment of their own with the larger heap, for objects that
+ * wouldn't fit in the shared one.
+ */
+#define TEST_HEAP_SIZE (1024 * 1024)
+#define TEST_LARGE_HEAP_SIZE (4 * 1024 * 1024)
+
+/*
+ * Tests marked #!sampled, followed by a procedure name, are run with the
+ * sampler going. Their folded stacks are then written to a temporary file,
+ * which has to hold samples and a stack with a frame for that procedure.
+ */
+#define TEST_SAMPLED_NAME_SIZE 64
+
+/*
+ * Tests marked #!profiling are only run when the VM counts instructions,
+ * which 'make VM_PROFILING=1' turns on, and are skipped otherwise. The
+ * counters (vm-profile) prints vary from run to run, so only the result of
+ * these tests is compared.
+ */
+
+/*
+ * Each thread records its own output, so tests marked #!threads can run in
+ * an environment per thread. Only the main thread echoes to stdout.
+ */
+static EVIL_THREAD_LOCAL char *print_buffer;
+static EVIL_THREAD_LOCAL size_t print_buffer_offset;
+static EVIL_THREAD_LOCAL size_t print_buffer_size;
+static EVIL_THREAD_LOCAL int print_buffer_quiet;
 
 struct test_t;
 
@@ -103,10 +155,14 @@ evil_printf(const char *format, ...)
     }
 
     print_buffer_offset += required_length;
-
     va_end(args);
+
+    if (print_buffer_quiet)
+        return;
+
     va_start(args, format);
     vprintf(format, args);
+    va_end(args);
 }
 
 static void
@@ -119,6 +175,9 @@ static void
 free_print_buffer(void)
 {
     free(print_buffer);
+    print_buffer = NULL;
+    print_buffer_offset = 0;
+    print_buffer_size = 0;
 }
 
 static char *
@@ -218,29 +277,30 @@ read_test_file(const char *filename)
     return buffer;
 }
 
-void *stack;
-void *heap;
+struct test_memory_t
+{
+    void *stack;
+    void *heap;
+};
 
 static struct evil_environment_t *
-create_test_environment(void)
+create_test_environment(struct test_memory_t *memory, size_t heap_size)
 {
     size_t stack_size;
-    size_t heap_size;
 
     stack_size = 1024 * sizeof(struct evil_object_t);
-    heap_size = 1024 * 1024;
-    stack = evil_aligned_alloc(sizeof(void *), stack_size);
-    heap = evil_aligned_alloc(4096, heap_size);
+    memory->stack = evil_aligned_alloc(sizeof(void *), stack_size);
+    memory->heap = evil_aligned_alloc(4096, heap_size);
 
-    return evil_environment_create(stack, stack_size, heap, heap_size);
+    return evil_environment_create(memory->stack, stack_size, memory->heap, heap_size);
 }
 
 static void
-destroy_test_environment(struct evil_environment_t *environment)
+destroy_test_environment(struct evil_environment_t *environment, struct test_memory_t *memory)
 {
     evil_environment_destroy(environment);
-    evil_aligned_free(stack);
-    evil_aligned_free(heap);
+    evil_aligned_free(memory->stack);
+    evil_aligned_free(memory->heap);
 }
 
 static struct evil_object_handle_t *
@@ -272,19 +332,41 @@ create_test_ast(struct evil_environment_t *environment, struct evil_object_handl
 }
 
 static struct evil_object_handle_t *
-evaluate_test_result(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, struct evil_object_handle_t *ast_handle)
+evaluate_test_result(struct evil_environment_t *environment, struct evil_object_handle_t *lexical_environment, struct evil_object_handle_t *ast_handle, int metered)
 {
     struct evil_object_t *ast_object;
     struct evil_object_t result;
+    enum evil_run_status_t status;
+    int num_suspensions;
 
     ast_object = evil_resolve_object_handle(ast_handle);
-    result = evil_eval(environment, lexical_environment, 1, ast_object);
+
+    if (!metered)
+    {
+        result = evil_eval(environment, lexical_environment, 1, ast_object);
+        return evil_create_object_handle_from_value(environment, result);
+    }
+
+    num_suspensions = 0;
+    status = evil_eval_with_fuel(environment, lexical_environment, ast_object, TEST_FUEL, &result);
+
+    while (status == EVIL_RUN_SUSPENDED)
+    {
+        ++num_suspensions;
+        gc_collect(environment->heap);
+        status = evil_resume(environment, TEST_FUEL, &result);
+    }
+
+    if (num_suspensions == 0)
+    {
+        evil_printf("[test] the evaluation was never suspended\n");
+    }
 
     return evil_create_object_handle_from_value(environment, result);
 }
 
 static int
-run_test(struct evil_environment_t *environment, const char *test, const char *expected)
+run_test(struct evil_environment_t *environment, const char *test, const char *expected, int metered, int result_only)
 {
     struct evil_object_handle_t *string_handle;
     struct evil_object_handle_t *ast_handle;
@@ -297,7 +379,12 @@ run_test(struct evil_environment_t *environment, const char *test, const char *e
 
     string_handle = create_string_object(environment, test);
     ast_handle = create_test_ast(environment, lexical_environment, string_handle);
-    result_handle = evaluate_test_result(environment, lexical_environment, ast_handle);
+    result_handle = evaluate_test_result(environment, lexical_environment, ast_handle, metered);
+
+    if (result_only)
+    {
+        reset_print_buffer();
+    }
 
     evil_print(environment, lexical_environment, 1, evil_resolve_object_handle(result_handle));
 
@@ -308,6 +395,231 @@ run_test(struct evil_environment_t *environment, const char *test, const char *e
     return strcmp(expected, print_buffer) == 0;
 }
 
+struct threaded_test_t
+{
+    const char *test;
+    const char *expected;
+    int num_passed;
+    char *failed_output;
+};
+
+static void
+run_threaded_test_iterations(struct threaded_test_t *threaded_test)
+{
+    int i;
+
+    /*
+     * Every iteration gets a fresh environment so that creating and
+     * destroying them races with the other threads' evaluation too.
+     */
+    print_buffer_quiet = 1;
+
+    for (i = 0; i < NUM_THREADED_TEST_ITERATIONS; ++i)
+    {
+        struct evil_environment_t *environment;
+        struct test_memory_t memory;
+
+        environment = create_test_environment(&memory, TEST_HEAP_SIZE);
+
+        if (run_test(environment, threaded_test->test, threaded_test->expected, 0, 0))
+        {
+            ++threaded_test->num_passed;
+        }
+        else if (threaded_test->failed_output == NULL)
+        {
+            threaded_test->failed_output = calloc(print_buffer_offset + 1, 1);
+            assert(threaded_test->failed_output != NULL);
+            memmove(threaded_test->failed_output, print_buffer, print_buffer_offset);
+        }
+
+        destroy_test_environment(environment, &memory);
+    }
+
+    free_print_buffer();
+}
+
+#ifdef _MSC_VER
+    typedef HANDLE test_thread_t;
+
+    static DWORD WINAPI
+    test_thread_main(LPVOID context)
+    {
+        run_threaded_test_iterations(context);
+
+        return 0;
+    }
+
+    static int
+    start_test_thread(test_thread_t *thread, struct threaded_test_t *threaded_test)
+    {
+        *thread = CreateThread(NULL, 0, test_thread_main, threaded_test, 0, NULL);
+
+        return *thread != NULL;
+    }
+
+    static void
+    join_test_thread(test_thread_t thread)
+    {
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+    }
+#else
+    typedef pthread_t test_thread_t;
+
+    static void *
+    test_thread_main(void *context)
+    {
+        run_threaded_test_iterations(context);
+
+        return NULL;
+    }
+
+    static int
+    start_test_thread(test_thread_t *thread, struct threaded_test_t *threaded_test)
+    {
+        return pthread_create(thread, NULL, test_thread_main, threaded_test) == 0;
+    }
+
+    static void
+    join_test_thread(test_thread_t thread)
+    {
+        pthread_join(thread, NULL);
+    }
+#endif
+
+static int
+folded_stacks_have_frame(const char *folded, const char *name)
+{
+    size_t name_length;
+    const char *frame;
+
+    name_length = strlen(name);
+
+    for (frame = strstr(folded, name); frame != NULL; frame = strstr(frame + 1, name))
+    {
+        int begins;
+        int ends;
+
+        begins = frame == folded || frame[-1] == '\n' || frame[-1] == ';';
+        ends = frame[name_length] == ';' || frame[name_length] == ' ';
+
+        if (begins && ends)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+run_sampled_test(struct evil_environment_t *environment, const char *test, const char *expected, const char *name)
+{
+    FILE *file;
+    char *folded;
+    size_t size;
+    size_t bytes_read;
+    int num_samples;
+    int result;
+
+    /*
+     * Without a sampler only the output is checked.
+     */
+    if (!sampler_start(environment, SAMPLER_DEFAULT_FREQUENCY))
+    {
+        return run_test(environment, test, expected, 0, 0);
+    }
+
+    result = run_test(environment, test, expected, 0, 0);
+    sampler_stop();
+
+    file = tmpfile();
+    assert(file != NULL);
+    num_samples = sampler_write_folded(environment, file);
+
+    size = (size_t)ftell(file);
+    folded = calloc(size + 1, 1);
+    assert(folded != NULL);
+    rewind(file);
+    bytes_read = fread(folded, 1, size, file);
+    assert(bytes_read == size);
+    fclose(file);
+
+    if (num_samples == 0 || !folded_stacks_have_frame(folded, name))
+    {
+        evil_printf("[test] %d samples, none in %s:\n%s", num_samples, name, folded);
+        result = 0;
+    }
+
+    free(folded);
+
+    return result;
+}
+
+static int
+run_large_test(const char *test, const char *expected)
+{
+    struct evil_environment_t *environment;
+    struct test_memory_t memory;
+    int result;
+
+    environment = create_test_environment(&memory, TEST_LARGE_HEAP_SIZE);
+    result = run_test(environment, test, expected, 0, 0);
+    destroy_test_environment(environment, &memory);
+
+    return result;
+}
+
+static int
+run_threaded_test(const char *test, const char *expected)
+{
+    test_thread_t threads[NUM_TEST_THREADS];
+    struct threaded_test_t threaded_tests[NUM_TEST_THREADS];
+    int num_threads;
+    int result;
+    int i;
+
+    for (num_threads = 0; num_threads < NUM_TEST_THREADS; ++num_threads)
+    {
+        threaded_tests[num_threads].test = test;
+        threaded_tests[num_threads].expected = expected;
+        threaded_tests[num_threads].num_passed = 0;
+        threaded_tests[num_threads].failed_output = NULL;
+
+        if (!start_test_thread(&threads[num_threads], &threaded_tests[num_threads]))
+            break;
+    }
+
+    result = num_threads == NUM_TEST_THREADS;
+    reset_print_buffer();
+
+    for (i = 0; i < num_threads; ++i)
+    {
+        join_test_thread(threads[i]);
+        result &= threaded_tests[i].num_passed == NUM_THREADED_TEST_ITERATIONS;
+    }
+
+    /*
+     * The output of the first iteration that failed, or the expected output
+     * if they all passed, stands in for the test's output in the report.
+     */
+    for (i = 0; i < num_threads; ++i)
+    {
+        if (threaded_tests[i].failed_output != NULL)
+        {
+            if (print_buffer_offset == 0)
+                evil_printf("%s", threaded_tests[i].failed_output);
+
+            free(threaded_tests[i].failed_output);
+        }
+    }
+
+    if (result)
+        evil_printf("%s", expected);
+
+    return result;
+}
+
 #ifdef _MSC_VER
     typedef HANDLE directory_t;
     static WIN32_FIND_DATA file_data;
@@ -520,6 +832,10 @@ dump_buffer_as_hex(const void *buffer, size_t length)
 static void
 report_test_result(const char *test_name, int result, const char *expected)
 {
+    const char *actual;
+
+    actual = (print_buffer != NULL) ? print_buffer : "";
+
     if (result == 0)
     {
         /*
@@ -535,8 +851,8 @@ report_test_result(const char *test_name, int result, const char *expected)
 
         printf("\nActual:\n");
         printf("----------------------------------------\n");
-        printf("%s\n", print_buffer);
-        dump_buffer_as_hex(print_buffer, strlen(print_buffer));
+        printf("%s\n", actual);
+        dump_buffer_as_hex(actual, strlen(actual));
     }
     else
     {
@@ -570,6 +886,7 @@ struct test_t
     uint64_t ticks;
     int success;
     int broken;
+    int skipped;
     char filename[260];
 };
 
@@ -659,6 +976,7 @@ initialize_tests(const char *directory_name, int argc, char *argv[], int *num_te
         tests[num_tests].ticks = 0;
         tests[num_tests].success = 0;
         tests[num_tests].broken = 0;
+        tests[num_tests].skipped = 0;
         memmove(tests[num_tests].filename, filename, sizeof filename);
 
         ++num_tests;
@@ -679,12 +997,14 @@ print_unit_test_summary(struct test_t *tests, int num_tests)
 {
     int num_passed;
     int num_broken;
+    int num_skipped;
     int i;
     size_t max_test_name_length;
     double ticks_to_ms;
 
     num_passed = 0;
     num_broken = 0;
+    num_skipped = 0;
     max_test_name_length = 0;
     ticks_to_ms = 1000.0 / (double)get_tick_frequency();
 
@@ -712,6 +1032,11 @@ print_unit_test_summary(struct test_t *tests, int num_tests)
             status = "BROKEN";
             ++num_broken;
         }
+        else if (tests[i].skipped)
+        {
+            status = "skipped";
+            ++num_skipped;
+        }
         else
         {
             if (tests[i].success)
@@ -735,7 +1060,8 @@ print_unit_test_summary(struct test_t *tests, int num_tests)
 
     printf("\npassed: %d\n", num_passed);
     printf("broken: %d\n", num_broken);
-    printf("failed: %d\n", num_tests - num_passed - num_broken);
+    printf("skipped: %d\n", num_skipped);
+    printf("failed: %d\n", num_tests - num_passed - num_broken - num_skipped);
 }
 
 static void
@@ -808,8 +1134,10 @@ int
 evil_run_tests(int argc, char *argv[])
 {
     struct evil_environment_t *environment;
+    struct test_memory_t memory;
     int num_tests;
     int num_passed;
+    int num_skipped;
     int i;
     struct test_t *tests;
 
@@ -817,9 +1145,10 @@ evil_run_tests(int argc, char *argv[])
 
     num_tests = 0;
     num_passed = 0;
+    num_skipped = 0;
 
     tests = initialize_tests(TEST_DIR, argc, argv, &num_tests);
-    environment = create_test_environment();
+    environment = create_test_environment(&memory, TEST_HEAP_SIZE);
 
     for (i = 0; i < num_tests; ++i)
     {
@@ -828,6 +1157,14 @@ evil_run_tests(int argc, char *argv[])
         char *test_end;
         char *test;
         char *expected;
+        int threaded;
+        int metered;
+        int incremental;
+        int parallel;
+        int large;
+        int profiling;
+        const char *sampled;
+        char sampled_name[TEST_SAMPLED_NAME_SIZE];
         int result;
         uint64_t begin;
         uint64_t end;
@@ -843,6 +1180,33 @@ evil_run_tests(int argc, char *argv[])
             goto next_test;
         }
 
+        profiling = strstr(test_file, "#!profiling") != NULL;
+
+        if (profiling && !ENABLE_VM_PROFILING)
+        {
+            tests[i].skipped = 1;
+            ++num_skipped;
+            goto next_test;
+        }
+
+        threaded = strstr(test_file, "#!threads") != NULL;
+        metered = strstr(test_file, "#!fuel") != NULL;
+        incremental = strstr(test_file, "#!incremental") != NULL;
+        parallel = strstr(test_file, "#!parallel") != NULL;
+        large = strstr(test_file, "#!large") != NULL;
+        sampled = strstr(test_file, "#!sampled ");
+
+        if (sampled != NULL)
+        {
+            size_t length;
+
+            sampled += strlen("#!sampled ");
+            length = strcspn(sampled, " :\r\n");
+            assert(length > 0 && length < TEST_SAMPLED_NAME_SIZE);
+            memcpy(sampled_name, sampled, length);
+            sampled_name[length] = 0;
+        }
+
         test_end = remove_character(test_file, test_end, '\r');
         test_end = remove_comments(test_file, test_end);
 
@@ -877,9 +1241,61 @@ evil_run_tests(int argc, char *argv[])
         *expected = 0;
         ++expected;
 
+        if (incremental)
+        {
+            evil_set_gc_pause_budget(environment, TEST_PAUSE_BUDGET);
+        }
+
+        /*
+         * Only collections that happen all at once are marked in parallel,
+         * and the test heap is too small to get mark threads otherwise.
+         */
+        if (parallel)
+        {
+            evil_set_gc_pause_budget(environment, 0);
+            evil_set_gc_mark_threads(environment, TEST_MARK_THREADS);
+        }
+
+        /*
+         * Tests marked #!threads are run by several threads at once, each in
+         * environments of its own, rather than in the shared environment.
+         */
         begin = get_ticks();
-        result = run_test(environment, test, expected);
+
+        if (threaded)
+        {
+            result = run_threaded_test(test, expected);
+        }
+        else if (large)
+        {
+            result = run_large_test(test, expected);
+        }
+        else if (sampled)
+        {
+            result = run_sampled_test(environment, test, expected, sampled_name);
+        }
+        else
+        {
+            result = run_test(environment, test, expected, metered, profiling);
+        }
+
         end = get_ticks();
+
+        if (incremental)
+        {
+            evil_set_gc_pause_budget(environment, EVIL_GC_PAUSE_BUDGET);
+        }
+
+        /*
+         * Later tests go back to the default incremental collector, marked
+         * on the collecting thread alone.
+         */
+        if (parallel)
+        {
+            evil_set_gc_pause_budget(environment, EVIL_GC_PAUSE_BUDGET);
+            evil_set_gc_mark_threads(environment, 0);
+        }
+
         report_test_result(filename, result, expected);
         tests[i].success = result;
         tests[i].ticks = end - begin;
@@ -895,9 +1311,9 @@ evil_run_tests(int argc, char *argv[])
 
     print_test_summary(tests, num_tests);
 
-    destroy_test_environment(environment);
+    destroy_test_environment(environment, &memory);
     free_print_buffer();
     free(tests);
 
-    return num_tests - num_passed;
+    return num_tests - num_passed - num_skipped;
 }